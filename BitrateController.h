@@ -0,0 +1,106 @@
+/*=========================================================================
+
+  Adapts the encoders' bitrates to what the network delivers.
+
+  The senders report, for the slowest client, how many bytes went out,
+  how long Send() blocked on them and how many messages are still queued.
+  A backlog of more than a frame means the link is slower than the
+  encoders: the target drops to below the rate the link sustained. An
+  empty queue lets it creep back up towards the configured budget. Every
+  stream gets its share of the target in proportion to its budget, so the
+  depth and color streams keep their balance as the link narrows.
+
+=========================================================================*/
+
+#pragma once
+
+// What the slowest client's sender saw since the last update
+typedef struct {
+  long long bytes;      // bytes written to the socket
+  double sendSeconds;   // time spent blocked in Send()
+  double seconds;       // wall time covered
+  int   queued;         // messages still waiting in its queue
+} LinkSample;
+
+class BitrateController
+{
+public:
+  /// budgetKbps is the most the streams may use together; frameMessages is
+  /// the number of messages one frame puts in a client's queue
+  BitrateController(int budgetKbps, int frameMessages) :
+    m_Budget(budgetKbps > 0 ? budgetKbps : 1),
+    m_Minimum(budgetKbps * MinimumPercent / 100 > 0 ? budgetKbps * MinimumPercent / 100 : 1),
+    m_FrameMessages(frameMessages > 0 ? frameMessages : 1),
+    m_Target(m_Budget),
+    m_Hold(0)
+  {
+  }
+
+  /// Fold in one sample and return the new target in kbit/s
+  int Update(const LinkSample& sample)
+  {
+    if (sample.seconds <= 0)
+    {
+      return m_Target;
+    }
+    // While the link is saturated the sender is always in Send(), so bytes
+    // over send time is what it can carry; otherwise it is only a bound
+    double delivered = sample.bytes * 8.0 / 1000.0 / sample.seconds;
+    double capacity = sample.sendSeconds > 0 ? sample.bytes * 8.0 / 1000.0 / sample.sendSeconds : 0;
+    if (capacity < delivered)
+    {
+      capacity = delivered;
+    }
+
+    if (sample.queued > m_FrameMessages)
+    {
+      // Backlog: back off below what got through so the queue can drain
+      double target = m_Target * 0.7;
+      if (capacity > 0 && target > capacity * 0.85)
+      {
+        target = capacity * 0.85;
+      }
+      m_Target = static_cast<int>(target);
+      m_Hold = HoldUpdates;
+    }
+    else if (m_Hold > 0)
+    {
+      // let the queue drain before probing again
+      m_Hold--;
+    }
+    else if (sample.queued == 0)
+    {
+      m_Target += m_Target * IncreasePercent / 100 + m_Budget / 100;
+    }
+    if (m_Target > m_Budget)
+    {
+      m_Target = m_Budget;
+    }
+    if (m_Target < m_Minimum)
+    {
+      m_Target = m_Minimum;
+    }
+    return m_Target;
+  }
+
+  int GetTarget() const { return m_Target; }
+
+  /// Share of the current target for a stream budgeted streamKbps
+  int GetShare(int streamKbps) const
+  {
+    long long share = static_cast<long long>(streamKbps) * m_Target / m_Budget;
+    return share > 0 ? static_cast<int>(share) : 1;
+  }
+
+private:
+  // Below this share of the budget the client queue flush takes over
+  static const int MinimumPercent = 10;
+  static const int IncreasePercent = 5;
+  static const int HoldUpdates = 2;
+
+  int   m_Budget;
+  int   m_Minimum;
+  int   m_FrameMessages;
+  int   m_Target;
+  int   m_Hold;
+};
@@ -0,0 +1,376 @@
+/*=========================================================================
+
+  Fans encoded frames out to every connected OpenIGTLink client.
+
+  Every frame is encoded and framed once; the message bytes are shared by
+  all clients. Each client has its own sender thread and a bounded queue,
+  so a slow client never stalls the encoder or the other clients. When a
+  client's queue is full it is flushed and the client skips each stream
+  until that stream's next keyframe, which the broadcaster asks the
+  encoders for. The senders also time their writes, so the encoders' rate
+  control can see how fast the slowest client really drains, and stamp
+  the end of each write into the latency trace.
+
+=========================================================================*/
+
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include "igtlConditionVariable.h"
+#include "igtlMultiThreader.h"
+#include "igtlSocket.h"
+#include "BitrateController.h"
+#include "LatencyTrace.h"
+
+// One framed message, shared by the queues of all clients
+typedef struct {
+  std::string stream;
+  bool  keyframe;
+  std::vector<unsigned char> bytes;
+  FrameTrace trace;
+} BroadcastPacket;
+typedef std::shared_ptr<const BroadcastPacket> BroadcastPacketPointer;
+
+// Per-stream frame accounting. Client drops and sends are summed over clients.
+typedef struct {
+  int   encoded;        // frames the stream's encoder produced
+  int   dropped;        // frames skipped before encoding, or dropped from a client queue
+  int   sent;           // messages written to client sockets
+  long long bytes;      // bitstream bytes the encoder produced
+  double encodeSeconds; // time spent encoding (back-projecting, for a point cloud)
+} StreamStatistics;
+
+class ClientBroadcaster
+{
+public:
+  // Send() and Receive() on a client socket give up after this long, so
+  // its threads come back to look at closing and hungUp: a POSIX close()
+  // does not wake a send() or recv() blocked on the same descriptor
+  enum { SocketTimeout = 1000 }; // ms
+
+  typedef struct {
+    igtl::Socket::Pointer socket;
+    std::deque<BroadcastPacketPointer> queue;
+    std::set<std::string> synced;   // streams that have had a keyframe since the last flush
+    igtl::ConditionVariable::Pointer ready;
+    ClientBroadcaster* owner;
+    int   threadID;
+    bool  subscribed;
+    bool  closing;
+    bool  hungUp;     // the client went away or is being dropped; its control thread finishes
+    int   sent;
+    int   dropped;
+    long long sentBytes;      // of the budgeted streams only, as is sendSeconds
+    double sendSeconds;       // time spent blocked in Send()
+    long long sampledBytes;   // sentBytes and sendSeconds at the last SampleLink()
+    double sampledSeconds;
+  } Client;
+
+  ClientBroadcaster(int maxQueue) : m_Latency(NULL), m_MaxQueue(maxQueue), m_KeyframeGeneration(0), m_Subscribers(0)
+  {
+    m_Threader = igtl::MultiThreader::New();
+  }
+
+  /// Where the senders record when a packet's last byte went out; NULL for nowhere
+  void SetLatencyRecorder(LatencyRecorder* latency) { m_Latency = latency; }
+
+  /// Start the sender thread for a newly accepted socket; frames flow after Subscribe()
+  Client* Connect(igtl::Socket::Pointer socket)
+  {
+    Client* client = new Client;
+    client->socket = socket;
+    client->socket->SetTimeout(SocketTimeout);
+    client->ready = igtl::ConditionVariable::New();
+    client->owner = this;
+    client->subscribed = false;
+    client->closing = false;
+    client->hungUp = false;
+    client->sent = 0;
+    client->dropped = 0;
+    client->sentBytes = 0;
+    client->sendSeconds = 0.0;
+    client->sampledBytes = 0;
+    client->sampledSeconds = 0.0;
+
+    m_Lock.Lock();
+    m_Clients.push_back(client);
+    m_Lock.Unlock();
+    client->threadID = m_Threader->SpawnThread((igtl::ThreadFunctionType) &ClientBroadcaster::SenderThread, client);
+    return client;
+  }
+
+  /// Start delivering frames; the client joins each stream at its next keyframe
+  void Subscribe(Client* client)
+  {
+    m_Lock.Lock();
+    if (!client->subscribed)
+    {
+      client->subscribed = true;
+      client->synced.clear();
+      m_Subscribers++;
+      m_KeyframeGeneration++;
+    }
+    m_Lock.Unlock();
+  }
+
+  void Unsubscribe(Client* client)
+  {
+    m_Lock.Lock();
+    if (client->subscribed)
+    {
+      client->subscribed = false;
+      client->queue.clear();
+      m_Subscribers--;
+    }
+    m_Lock.Unlock();
+  }
+
+  /// Called by the client's control thread when the client stopped or went away,
+  /// and by the server to make that thread finish
+  void HangUp(Client* client)
+  {
+    Unsubscribe(client);
+    m_Lock.Lock();
+    client->hungUp = true;
+    m_Lock.Unlock();
+  }
+
+  bool IsHungUp(Client* client)
+  {
+    m_Lock.Lock();
+    bool hungUp = client->hungUp;
+    m_Lock.Unlock();
+    return hungUp;
+  }
+
+  /// Stop the client's sender thread, close its socket and free it
+  void Disconnect(Client* client)
+  {
+    Unsubscribe(client);
+    m_Lock.Lock();
+    client->closing = true;
+    m_Clients.remove(client);
+    client->ready->Signal();
+    m_Lock.Unlock();
+
+    // a sender stuck in Send() sees closing within SocketTimeout
+    m_Threader->TerminateThread(client->threadID);
+    client->socket->CloseSocket();
+    std::cerr << "Client disconnected: " << client->sent << " messages sent, "
+              << client->dropped << " dropped." << std::endl;
+    delete client;
+  }
+
+  bool HasSubscribers()
+  {
+    m_Lock.Lock();
+    bool any = m_Subscribers > 0;
+    m_Lock.Unlock();
+    return any;
+  }
+
+  /// True once per keyframe request for an encoder that last saw generation seen
+  bool TakeKeyframeRequest(int& seen)
+  {
+    m_Lock.Lock();
+    bool request = seen != m_KeyframeGeneration;
+    seen = m_KeyframeGeneration;
+    m_Lock.Unlock();
+    return request;
+  }
+
+  void CountEncoded(const std::string& stream, int bytes, double encodeSeconds)
+  {
+    m_Lock.Lock();
+    StreamStatistics& statistics = Statistics(stream);
+    statistics.encoded++;
+    statistics.bytes += bytes;
+    statistics.encodeSeconds += encodeSeconds;
+    m_Lock.Unlock();
+  }
+
+  void CountDropped(const std::string& stream, int frames)
+  {
+    m_Lock.Lock();
+    Statistics(stream).dropped += frames;
+    m_Lock.Unlock();
+  }
+
+  StreamStatistics GetStatistics(const std::string& stream)
+  {
+    m_Lock.Lock();
+    StreamStatistics statistics = Statistics(stream);
+    m_Lock.Unlock();
+    return statistics;
+  }
+
+  /// Leave a stream the bitrate budget does not cover, e.g. the point
+  /// cloud, out of SampleLink()
+  void ExcludeFromLink(const std::string& stream)
+  {
+    m_Lock.Lock();
+    m_Unbudgeted.insert(stream);
+    m_Lock.Unlock();
+  }
+
+  /// What the slowest subscribed client sent of the budgeted streams since
+  /// the last call: the one with the longest queue, or the lowest
+  /// throughput among equals. The caller fills in the wall time. False when
+  /// nobody is subscribed.
+  bool SampleLink(LinkSample& sample)
+  {
+    bool any = false;
+    double slowest = 0;
+    m_Lock.Lock();
+    for (std::list<Client*>::iterator it = m_Clients.begin(); it != m_Clients.end(); ++it)
+    {
+      Client* client = *it;
+      long long bytes = client->sentBytes - client->sampledBytes;
+      double sendSeconds = client->sendSeconds - client->sampledSeconds;
+      client->sampledBytes = client->sentBytes;
+      client->sampledSeconds = client->sendSeconds;
+      if (!client->subscribed)
+      {
+        continue;
+      }
+      int queued = 0;
+      for (size_t i = 0; i < client->queue.size(); i++)
+      {
+        if (m_Unbudgeted.count(client->queue[i]->stream) == 0)
+          queued++;
+      }
+      double rate = sendSeconds > 0 ? bytes / sendSeconds : 0;
+      if (!any || queued > sample.queued || (queued == sample.queued && rate < slowest))
+      {
+        sample.bytes = bytes;
+        sample.sendSeconds = sendSeconds;
+        sample.queued = queued;
+        slowest = rate;
+        any = true;
+      }
+    }
+    m_Lock.Unlock();
+    return any;
+  }
+
+  /// Queue one framed message for every subscribed client
+  void Broadcast(const BroadcastPacketPointer& packet)
+  {
+    m_Lock.Lock();
+    for (std::list<Client*>::iterator it = m_Clients.begin(); it != m_Clients.end(); ++it)
+    {
+      Client* client = *it;
+      if (!client->subscribed)
+      {
+        continue;
+      }
+      if (static_cast<int>(client->queue.size()) >= m_MaxQueue)
+      {
+        // Too far behind: drop the backlog and resync every stream on keyframes
+        client->dropped += static_cast<int>(client->queue.size());
+        for (size_t i = 0; i < client->queue.size(); i++)
+          Statistics(client->queue[i]->stream).dropped++;
+        client->queue.clear();
+        client->synced.clear();
+        m_KeyframeGeneration++;
+      }
+      if (packet->keyframe)
+      {
+        client->synced.insert(packet->stream);
+      }
+      else if (client->synced.count(packet->stream) == 0)
+      {
+        client->dropped++;
+        Statistics(packet->stream).dropped++;
+        continue;
+      }
+      client->queue.push_back(packet);
+      client->ready->Signal();
+    }
+    m_Lock.Unlock();
+  }
+
+private:
+  // callers hold m_Lock
+  StreamStatistics& Statistics(const std::string& stream)
+  {
+    std::map<std::string, StreamStatistics>::iterator it = m_Statistics.find(stream);
+    if (it == m_Statistics.end())
+    {
+      StreamStatistics zero = { 0, 0, 0, 0, 0.0 };
+      it = m_Statistics.insert(std::make_pair(stream, zero)).first;
+    }
+    return it->second;
+  }
+
+  static void* SenderThread(void* ptr)
+  {
+    igtl::MultiThreader::ThreadInfo* info =
+    static_cast<igtl::MultiThreader::ThreadInfo*>(ptr);
+    Client* client = static_cast<Client*>(info->UserData);
+    ClientBroadcaster* self = client->owner;
+
+    self->m_Lock.Lock();
+    for (;;)
+    {
+      while (client->queue.empty() && !client->closing)
+        client->ready->Wait(&self->m_Lock);
+      if (client->closing)
+        break;
+      BroadcastPacketPointer packet = client->queue.front();
+      client->queue.pop_front();
+      self->m_Lock.Unlock();
+
+      std::chrono::steady_clock::time_point sendStart = std::chrono::steady_clock::now();
+      int r = client->socket->Send(&packet->bytes[0], packet->bytes.size());
+      std::chrono::steady_clock::time_point sendEnd = std::chrono::steady_clock::now();
+      double sendSeconds = std::chrono::duration<double>(sendEnd - sendStart).count();
+      if (r && self->m_Latency)
+      {
+        self->m_Latency->RecordStage(packet->stream, packet->trace, TraceSent, LatencyRecorder::ToStamp(sendEnd));
+      }
+
+      self->m_Lock.Lock();
+      if (!r)
+      {
+        // closed, or stalled for SocketTimeout: the control thread sees
+        // hungUp and the server disconnects the client
+        client->queue.clear();
+        if (client->subscribed)
+        {
+          client->subscribed = false;
+          self->m_Subscribers--;
+        }
+        client->hungUp = true;
+        break;
+      }
+      client->sent++;
+      if (self->m_Unbudgeted.count(packet->stream) == 0)
+      {
+        client->sentBytes += packet->bytes.size();
+        client->sendSeconds += sendSeconds;
+      }
+      self->Statistics(packet->stream).sent++;
+    }
+    self->m_Lock.Unlock();
+    return NULL;
+  }
+
+  igtl::SimpleMutexLock m_Lock;
+  igtl::MultiThreader::Pointer m_Threader;
+  std::list<Client*> m_Clients;
+  std::map<std::string, StreamStatistics> m_Statistics;
+  std::set<std::string> m_Unbudgeted;   // streams SampleLink() ignores
+  LatencyRecorder* m_Latency;
+  int   m_MaxQueue;
+  int   m_KeyframeGeneration;
+  int   m_Subscribers;
+};
@@ -0,0 +1,401 @@
+//------------------------------------------------------------------------------
+// ColorConversion.cpp
+//------------------------------------------------------------------------------
+
+#include "SimdSupport.h"
+#include "ColorConversion.h"
+
+static const int cShift = 14;
+
+static inline uint8_t Clamp8(int nValue)
+{
+    return static_cast<uint8_t>(nValue < 0 ? 0 : (nValue > 255 ? 255 : nValue));
+}
+
+static inline uint8_t Weigh(const int16_t* pWeights, int32_t nOffset, int r, int g, int b)
+{
+    return Clamp8((pWeights[0] * r + pWeights[1] * g + pWeights[2] * b + nOffset) >> cShift);
+}
+
+static inline int16_t ToQ14(double fValue)
+{
+    return static_cast<int16_t>(fValue * (1 << cShift) + (fValue < 0 ? -0.5 : 0.5));
+}
+
+// Two 16-bit weights in one 32-bit lane, for _mm_madd_epi16 on (lo, hi) pairs
+static inline int PairWeights(int16_t nLo, int16_t nHi)
+{
+    return static_cast<int>(static_cast<uint32_t>(static_cast<uint16_t>(nLo)) |
+                            (static_cast<uint32_t>(static_cast<uint16_t>(nHi)) << 16));
+}
+
+/// <summary>
+/// Constructor, BT.601 limited range
+/// </summary>
+ColorConverter::ColorConverter()
+{
+    SetFormat(ColorMatrixBT601, ColorRangeLimited);
+}
+
+/// <summary>
+/// Select the matrix and range
+/// </summary>
+void ColorConverter::SetFormat(ColorMatrix eMatrix, ColorRange eRange)
+{
+    m_eMatrix = eMatrix;
+    m_eRange = eRange;
+
+    double kr = eMatrix == ColorMatrixBT709 ? 0.2126 : 0.299;
+    double kb = eMatrix == ColorMatrixBT709 ? 0.0722 : 0.114;
+    double ys = eRange == ColorRangeFull ? 1.0 : 219.0 / 255.0;
+    double cs = eRange == ColorRangeFull ? 1.0 : 224.0 / 255.0;
+
+    // The green weights are derived so that each row sums exactly to the
+    // luma scale (Y) or to 0 (U, V): white is exactly 235 / 255, gray has
+    // exactly neutral chroma
+    m_nY[0] = ToQ14(kr * ys);
+    m_nY[2] = ToQ14(kb * ys);
+    m_nY[1] = static_cast<int16_t>(ToQ14(ys) - m_nY[0] - m_nY[2]);
+    m_nU[0] = ToQ14(-kr / (2.0 * (1.0 - kb)) * cs);
+    m_nU[2] = ToQ14(0.5 * cs);
+    m_nU[1] = static_cast<int16_t>(-m_nU[0] - m_nU[2]);
+    m_nV[0] = ToQ14(0.5 * cs);
+    m_nV[2] = ToQ14(-kb / (2.0 * (1.0 - kr)) * cs);
+    m_nV[1] = static_cast<int16_t>(-m_nV[0] - m_nV[2]);
+
+    m_nYOffset = ((eRange == ColorRangeFull ? 0 : 16) << cShift) + (1 << (cShift - 1));
+    m_nCOffset = (128 << cShift) + (1 << (cShift - 1));
+}
+
+/// <summary>
+/// Convert an image, picking the widest kernel this CPU supports
+/// </summary>
+void ColorConverter::Convert(const uint32_t* pBgrx, int nWidth, int nHeight, ChromaFormat eChroma,
+                             uint8_t* pY, uint8_t* pU, uint8_t* pV) const
+{
+#if DEPTH_SIMD_X86
+    if (SimdSupport::HasAVX2())
+    {
+        ConvertWith(&ColorConverter::RowsAVX2, pBgrx, nWidth, nHeight, eChroma, pY, pU, pV);
+        return;
+    }
+    if (SimdSupport::HasSSE2())
+    {
+        ConvertWith(&ColorConverter::RowsSSE2, pBgrx, nWidth, nHeight, eChroma, pY, pU, pV);
+        return;
+    }
+#endif
+    ConvertScalar(pBgrx, nWidth, nHeight, eChroma, pY, pU, pV);
+}
+
+/// <summary>
+/// Reference implementation, one pixel at a time
+/// </summary>
+void ColorConverter::ConvertScalar(const uint32_t* pBgrx, int nWidth, int nHeight, ChromaFormat eChroma,
+                                   uint8_t* pY, uint8_t* pU, uint8_t* pV) const
+{
+    ConvertWith(&ColorConverter::RowsScalar, pBgrx, nWidth, nHeight, eChroma, pY, pU, pV);
+}
+
+void ColorConverter::ConvertWith(RowKernel kernel, const uint32_t* pBgrx, int nWidth, int nHeight, ChromaFormat eChroma,
+                                 uint8_t* pY, uint8_t* pU, uint8_t* pV) const
+{
+    int nChromaWidth = eChroma == Chroma444 ? nWidth : nWidth / 2;
+    int nRows = eChroma == Chroma420 ? 2 : 1;
+
+    for (int y = 0; y + nRows <= nHeight; y += nRows)
+    {
+        const uint32_t* pRow0 = pBgrx + y * nWidth;
+        const uint32_t* pRow1 = nRows == 2 ? pRow0 + nWidth : NULL;
+        uint8_t* pY0 = pY + y * nWidth;
+        uint8_t* pY1 = nRows == 2 ? pY0 + nWidth : NULL;
+        int nChroma = y / nRows * nChromaWidth;
+
+        int nDone = (this->*kernel)(pRow0, pRow1, 0, nWidth, eChroma, pY0, pY1, pU + nChroma, pV + nChroma);
+        if (nDone < nWidth)
+        {
+            RowsScalar(pRow0, pRow1, nDone, nWidth, eChroma, pY0, pY1, pU + nChroma, pV + nChroma);
+        }
+    }
+}
+
+int ColorConverter::RowsScalar(const uint32_t* pRow0, const uint32_t* pRow1, int nBegin, int nWidth,
+                               ChromaFormat eChroma, uint8_t* pY0, uint8_t* pY1, uint8_t* pU, uint8_t* pV) const
+{
+    for (int x = nBegin; x < nWidth; ++x)
+    {
+        uint32_t c = pRow0[x];
+        pY0[x] = Weigh(m_nY, m_nYOffset, (c >> 16) & 0xFF, (c >> 8) & 0xFF, c & 0xFF);
+        if (pRow1)
+        {
+            c = pRow1[x];
+            pY1[x] = Weigh(m_nY, m_nYOffset, (c >> 16) & 0xFF, (c >> 8) & 0xFF, c & 0xFF);
+        }
+    }
+
+    if (eChroma == Chroma444)
+    {
+        for (int x = nBegin; x < nWidth; ++x)
+        {
+            uint32_t c = pRow0[x];
+            int r = (c >> 16) & 0xFF, g = (c >> 8) & 0xFF, b = c & 0xFF;
+            pU[x] = Weigh(m_nU, m_nCOffset, r, g, b);
+            pV[x] = Weigh(m_nV, m_nCOffset, r, g, b);
+        }
+        return nWidth;
+    }
+
+    // average the covered pixels, rounding, then convert
+    for (int x = nBegin; x + 1 < nWidth; x += 2)
+    {
+        uint32_t c0 = pRow0[x], c1 = pRow0[x + 1];
+        int r = ((c0 >> 16) & 0xFF) + ((c1 >> 16) & 0xFF);
+        int g = ((c0 >> 8) & 0xFF) + ((c1 >> 8) & 0xFF);
+        int b = (c0 & 0xFF) + (c1 & 0xFF);
+        if (eChroma == Chroma420)
+        {
+            c0 = pRow1[x];
+            c1 = pRow1[x + 1];
+            r += ((c0 >> 16) & 0xFF) + ((c1 >> 16) & 0xFF);
+            g += ((c0 >> 8) & 0xFF) + ((c1 >> 8) & 0xFF);
+            b += (c0 & 0xFF) + (c1 & 0xFF);
+            r = (r + 2) >> 2;
+            g = (g + 2) >> 2;
+            b = (b + 2) >> 2;
+        }
+        else
+        {
+            r = (r + 1) >> 1;
+            g = (g + 1) >> 1;
+            b = (b + 1) >> 1;
+        }
+        pU[x / 2] = Weigh(m_nU, m_nCOffset, r, g, b);
+        pV[x / 2] = Weigh(m_nV, m_nCOffset, r, g, b);
+    }
+    return nWidth;
+}
+
+#if DEPTH_SIMD_X86
+
+// Returns the number of samples interleaved; the caller finishes the rest
+DEPTH_TARGET_SSE2
+static int InterleaveSSE2(const uint8_t* pU, const uint8_t* pV, int nCount, uint8_t* pUV)
+{
+    int i = 0;
+    for (; i + 16 <= nCount; i += 16)
+    {
+        __m128i u = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pU + i));
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pV + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pUV + 2 * i), _mm_unpacklo_epi8(u, v));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pUV + 2 * i + 16), _mm_unpackhi_epi8(u, v));
+    }
+    return i;
+}
+
+// The SIMD kernels split pixels into 16-bit R, G and B lanes and weigh them
+// with madd on (R, G) and (B, 0) pairs, so every product and sum is the
+// scalar one. Saturating packs give the scalar clamp.
+
+DEPTH_TARGET_SSE2
+static inline void SplitSSE2(const uint32_t* pPixels, __m128i& r, __m128i& g, __m128i& b)
+{
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pPixels));
+    __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pPixels + 4));
+    b = _mm_packs_epi32(_mm_and_si128(lo, mask), _mm_and_si128(hi, mask));
+    g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 8), mask), _mm_and_si128(_mm_srli_epi32(hi, 8), mask));
+    r = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 16), mask), _mm_and_si128(_mm_srli_epi32(hi, 16), mask));
+}
+
+DEPTH_TARGET_SSE2
+static inline __m128i WeighSSE2(__m128i r, __m128i g, __m128i b, __m128i weightsRG, __m128i weightsB, __m128i offset)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r, g), weightsRG),
+                                             _mm_madd_epi16(_mm_unpacklo_epi16(b, zero), weightsB)), offset);
+    __m128i hi = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r, g), weightsRG),
+                                             _mm_madd_epi16(_mm_unpackhi_epi16(b, zero), weightsB)), offset);
+    return _mm_packs_epi32(_mm_srai_epi32(lo, cShift), _mm_srai_epi32(hi, cShift));
+}
+
+// Sum horizontal pairs of 2 x 8 lanes into 8 lanes
+DEPTH_TARGET_SSE2
+static inline __m128i PairSumSSE2(__m128i a, __m128i b)
+{
+    const __m128i ones = _mm_set1_epi16(1);
+    return _mm_packs_epi32(_mm_madd_epi16(a, ones), _mm_madd_epi16(b, ones));
+}
+
+DEPTH_TARGET_SSE2
+int ColorConverter::RowsSSE2(const uint32_t* pRow0, const uint32_t* pRow1, int nBegin, int nWidth,
+                             ChromaFormat eChroma, uint8_t* pY0, uint8_t* pY1, uint8_t* pU, uint8_t* pV) const
+{
+    const __m128i yRG = _mm_set1_epi32(PairWeights(m_nY[0], m_nY[1]));
+    const __m128i yB = _mm_set1_epi32(PairWeights(m_nY[2], 0));
+    const __m128i uRG = _mm_set1_epi32(PairWeights(m_nU[0], m_nU[1]));
+    const __m128i uB = _mm_set1_epi32(PairWeights(m_nU[2], 0));
+    const __m128i vRG = _mm_set1_epi32(PairWeights(m_nV[0], m_nV[1]));
+    const __m128i vB = _mm_set1_epi32(PairWeights(m_nV[2], 0));
+    const __m128i yOffset = _mm_set1_epi32(m_nYOffset);
+    const __m128i cOffset = _mm_set1_epi32(m_nCOffset);
+    const __m128i round = _mm_set1_epi16(eChroma == Chroma420 ? 2 : 1);
+    const int nAverageShift = eChroma == Chroma420 ? 2 : 1;
+
+    int x = nBegin;
+    for (; x + 16 <= nWidth; x += 16)
+    {
+        __m128i sumR = _mm_setzero_si128(), sumG = _mm_setzero_si128(), sumB = _mm_setzero_si128();
+        for (int row = 0; row < (pRow1 ? 2 : 1); ++row)
+        {
+            const uint32_t* pRow = row ? pRow1 : pRow0;
+            __m128i rA, gA, bA, rB, gB, bB;
+            SplitSSE2(pRow + x, rA, gA, bA);
+            SplitSSE2(pRow + x + 8, rB, gB, bB);
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>((row ? pY1 : pY0) + x),
+                _mm_packus_epi16(WeighSSE2(rA, gA, bA, yRG, yB, yOffset), WeighSSE2(rB, gB, bB, yRG, yB, yOffset)));
+
+            if (eChroma == Chroma444)
+            {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(pU + x),
+                    _mm_packus_epi16(WeighSSE2(rA, gA, bA, uRG, uB, cOffset), WeighSSE2(rB, gB, bB, uRG, uB, cOffset)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(pV + x),
+                    _mm_packus_epi16(WeighSSE2(rA, gA, bA, vRG, vB, cOffset), WeighSSE2(rB, gB, bB, vRG, vB, cOffset)));
+                continue;
+            }
+            sumR = _mm_add_epi16(sumR, PairSumSSE2(rA, rB));
+            sumG = _mm_add_epi16(sumG, PairSumSSE2(gA, gB));
+            sumB = _mm_add_epi16(sumB, PairSumSSE2(bA, bB));
+        }
+
+        if (eChroma != Chroma444)
+        {
+            __m128i r = _mm_srli_epi16(_mm_add_epi16(sumR, round), nAverageShift);
+            __m128i g = _mm_srli_epi16(_mm_add_epi16(sumG, round), nAverageShift);
+            __m128i b = _mm_srli_epi16(_mm_add_epi16(sumB, round), nAverageShift);
+            __m128i u = WeighSSE2(r, g, b, uRG, uB, cOffset);
+            __m128i v = WeighSSE2(r, g, b, vRG, vB, cOffset);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(pU + x / 2), _mm_packus_epi16(u, u));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(pV + x / 2), _mm_packus_epi16(v, v));
+        }
+    }
+    return x;
+}
+
+// AVX2 packs work within 128-bit lanes; a 64-bit permute after each pack
+// restores pixel order, so lanes hold pixels in order as in the SSE2 kernel.
+
+DEPTH_TARGET_AVX2
+static inline void SplitAVX2(const uint32_t* pPixels, __m256i& r, __m256i& g, __m256i& b)
+{
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pPixels));
+    __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pPixels + 8));
+    b = _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_and_si256(lo, mask), _mm256_and_si256(hi, mask)), 0xD8);
+    g = _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(lo, 8), mask),
+                                                    _mm256_and_si256(_mm256_srli_epi32(hi, 8), mask)), 0xD8);
+    r = _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(lo, 16), mask),
+                                                    _mm256_and_si256(_mm256_srli_epi32(hi, 16), mask)), 0xD8);
+}
+
+// Unpacking and packing within the same lanes keeps the pixel order
+DEPTH_TARGET_AVX2
+static inline __m256i WeighAVX2(__m256i r, __m256i g, __m256i b, __m256i weightsRG, __m256i weightsB, __m256i offset)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(r, g), weightsRG),
+                                                   _mm256_madd_epi16(_mm256_unpacklo_epi16(b, zero), weightsB)), offset);
+    __m256i hi = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(r, g), weightsRG),
+                                                   _mm256_madd_epi16(_mm256_unpackhi_epi16(b, zero), weightsB)), offset);
+    return _mm256_packs_epi32(_mm256_srai_epi32(lo, cShift), _mm256_srai_epi32(hi, cShift));
+}
+
+DEPTH_TARGET_AVX2
+static inline __m256i PackBytesAVX2(__m256i a, __m256i b)
+{
+    return _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+}
+
+DEPTH_TARGET_AVX2
+static inline __m256i PairSumAVX2(__m256i a, __m256i b)
+{
+    const __m256i ones = _mm256_set1_epi16(1);
+    return _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_madd_epi16(a, ones), _mm256_madd_epi16(b, ones)), 0xD8);
+}
+
+DEPTH_TARGET_AVX2
+int ColorConverter::RowsAVX2(const uint32_t* pRow0, const uint32_t* pRow1, int nBegin, int nWidth,
+                             ChromaFormat eChroma, uint8_t* pY0, uint8_t* pY1, uint8_t* pU, uint8_t* pV) const
+{
+    const __m256i yRG = _mm256_set1_epi32(PairWeights(m_nY[0], m_nY[1]));
+    const __m256i yB = _mm256_set1_epi32(PairWeights(m_nY[2], 0));
+    const __m256i uRG = _mm256_set1_epi32(PairWeights(m_nU[0], m_nU[1]));
+    const __m256i uB = _mm256_set1_epi32(PairWeights(m_nU[2], 0));
+    const __m256i vRG = _mm256_set1_epi32(PairWeights(m_nV[0], m_nV[1]));
+    const __m256i vB = _mm256_set1_epi32(PairWeights(m_nV[2], 0));
+    const __m256i yOffset = _mm256_set1_epi32(m_nYOffset);
+    const __m256i cOffset = _mm256_set1_epi32(m_nCOffset);
+    const __m256i round = _mm256_set1_epi16(eChroma == Chroma420 ? 2 : 1);
+    const int nAverageShift = eChroma == Chroma420 ? 2 : 1;
+
+    int x = nBegin;
+    for (; x + 32 <= nWidth; x += 32)
+    {
+        __m256i sumR = _mm256_setzero_si256(), sumG = _mm256_setzero_si256(), sumB = _mm256_setzero_si256();
+        for (int row = 0; row < (pRow1 ? 2 : 1); ++row)
+        {
+            const uint32_t* pRow = row ? pRow1 : pRow0;
+            __m256i rA, gA, bA, rB, gB, bB;
+            SplitAVX2(pRow + x, rA, gA, bA);
+            SplitAVX2(pRow + x + 16, rB, gB, bB);
+
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>((row ? pY1 : pY0) + x),
+                PackBytesAVX2(WeighAVX2(rA, gA, bA, yRG, yB, yOffset), WeighAVX2(rB, gB, bB, yRG, yB, yOffset)));
+
+            if (eChroma == Chroma444)
+            {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(pU + x),
+                    PackBytesAVX2(WeighAVX2(rA, gA, bA, uRG, uB, cOffset), WeighAVX2(rB, gB, bB, uRG, uB, cOffset)));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(pV + x),
+                    PackBytesAVX2(WeighAVX2(rA, gA, bA, vRG, vB, cOffset), WeighAVX2(rB, gB, bB, vRG, vB, cOffset)));
+                continue;
+            }
+            sumR = _mm256_add_epi16(sumR, PairSumAVX2(rA, rB));
+            sumG = _mm256_add_epi16(sumG, PairSumAVX2(gA, gB));
+            sumB = _mm256_add_epi16(sumB, PairSumAVX2(bA, bB));
+        }
+
+        if (eChroma != Chroma444)
+        {
+            __m256i r = _mm256_srli_epi16(_mm256_add_epi16(sumR, round), nAverageShift);
+            __m256i g = _mm256_srli_epi16(_mm256_add_epi16(sumG, round), nAverageShift);
+            __m256i b = _mm256_srli_epi16(_mm256_add_epi16(sumB, round), nAverageShift);
+            __m256i u = WeighAVX2(r, g, b, uRG, uB, cOffset);
+            __m256i v = WeighAVX2(r, g, b, vRG, vB, cOffset);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(pU + x / 2), _mm256_castsi256_si128(PackBytesAVX2(u, u)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(pV + x / 2), _mm256_castsi256_si128(PackBytesAVX2(v, v)));
+        }
+    }
+    return x;
+}
+
+#endif
+
+/// <summary>
+/// Interleave U and V planes into one UV plane
+/// </summary>
+void ColorConverter::InterleaveChroma(const uint8_t* pU, const uint8_t* pV, int nCount, uint8_t* pUV)
+{
+    int i = 0;
+#if DEPTH_SIMD_X86
+    if (SimdSupport::HasSSE2())
+    {
+        i = InterleaveSSE2(pU, pV, nCount, pUV);
+    }
+#endif
+    for (; i < nCount; ++i)
+    {
+        pUV[2 * i] = pU[i];
+        pUV[2 * i + 1] = pV[i];
+    }
+}
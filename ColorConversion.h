@@ -0,0 +1,105 @@
+//------------------------------------------------------------------------------
+// ColorConversion.h
+//------------------------------------------------------------------------------
+
+// Converts BGRX (RGBQUAD layout) images to planar YUV 4:4:4, 4:2:2 or 4:2:0
+// with the BT.601 or BT.709 matrix in limited or full range, and interleaves
+// planar chroma for NV12. The SSE2 and AVX2 kernels give exactly the scalar
+// reference's output.
+
+#pragma once
+
+#include <stdint.h>
+
+enum ColorMatrix
+{
+    ColorMatrixBT601 = 0,
+    ColorMatrixBT709 = 1
+};
+
+enum ColorRange
+{
+    ColorRangeLimited = 0,  // Y 16-235, U/V 16-240
+    ColorRangeFull = 1      // Y, U, V 0-255
+};
+
+enum ChromaFormat
+{
+    Chroma444 = 0,
+    Chroma422 = 1,          // chroma halved horizontally
+    Chroma420 = 2           // chroma halved in both directions
+};
+
+class ColorConverter
+{
+public:
+    /// <summary>
+    /// Constructor, BT.601 limited range
+    /// </summary>
+    ColorConverter();
+
+    /// <summary>
+    /// Select the matrix and range
+    /// </summary>
+    void SetFormat(ColorMatrix eMatrix, ColorRange eRange);
+
+    ColorMatrix GetMatrix() const { return m_eMatrix; }
+    ColorRange GetRange() const { return m_eRange; }
+
+    /// <summary>
+    /// Convert an image, picking the widest kernel this CPU supports. Chroma
+    /// samples are the rounded average of the 2 (4:2:2) or 2x2 (4:2:0) pixels
+    /// they cover. The width must be even, and the height too for 4:2:0.
+    /// </summary>
+    /// <param name="pBgrx">source pixels, nWidth per row</param>
+    /// <param name="nWidth">image width</param>
+    /// <param name="nHeight">image height</param>
+    /// <param name="eChroma">chroma subsampling of the output</param>
+    /// <param name="pY">luma plane, nWidth per row</param>
+    /// <param name="pU">U plane, nWidth or nWidth/2 per row</param>
+    /// <param name="pV">V plane, as pU</param>
+    void Convert(const uint32_t* pBgrx, int nWidth, int nHeight, ChromaFormat eChroma,
+                 uint8_t* pY, uint8_t* pU, uint8_t* pV) const;
+
+    /// <summary>
+    /// Reference implementation, one pixel at a time
+    /// </summary>
+    void ConvertScalar(const uint32_t* pBgrx, int nWidth, int nHeight, ChromaFormat eChroma,
+                       uint8_t* pY, uint8_t* pU, uint8_t* pV) const;
+
+    /// <summary>
+    /// Interleave U and V planes into one UV plane, as NV12 stores chroma
+    /// </summary>
+    /// <param name="pU">U samples</param>
+    /// <param name="pV">V samples</param>
+    /// <param name="nCount">samples in each of pU and pV</param>
+    /// <param name="pUV">2 * nCount bytes, U first</param>
+    static void InterleaveChroma(const uint8_t* pU, const uint8_t* pV, int nCount, uint8_t* pUV);
+
+private:
+    // Converts one row, or two for 4:2:0, from nBegin on; returns the
+    // number of pixels done, the scalar kernel finishing the rest
+    typedef int (ColorConverter::*RowKernel)(const uint32_t* pRow0, const uint32_t* pRow1, int nBegin, int nWidth,
+                                             ChromaFormat eChroma, uint8_t* pY0, uint8_t* pY1, uint8_t* pU, uint8_t* pV) const;
+
+    void ConvertWith(RowKernel kernel, const uint32_t* pBgrx, int nWidth, int nHeight, ChromaFormat eChroma,
+                     uint8_t* pY, uint8_t* pU, uint8_t* pV) const;
+
+    int RowsScalar(const uint32_t* pRow0, const uint32_t* pRow1, int nBegin, int nWidth,
+                   ChromaFormat eChroma, uint8_t* pY0, uint8_t* pY1, uint8_t* pU, uint8_t* pV) const;
+    int RowsSSE2(const uint32_t* pRow0, const uint32_t* pRow1, int nBegin, int nWidth,
+                 ChromaFormat eChroma, uint8_t* pY0, uint8_t* pY1, uint8_t* pU, uint8_t* pV) const;
+    int RowsAVX2(const uint32_t* pRow0, const uint32_t* pRow1, int nBegin, int nWidth,
+                 ChromaFormat eChroma, uint8_t* pY0, uint8_t* pY1, uint8_t* pU, uint8_t* pV) const;
+
+    ColorMatrix             m_eMatrix;
+    ColorRange              m_eRange;
+
+    // Q14 weights of R, G, B per output component, and the offset added
+    // before the shift (including rounding)
+    int16_t                 m_nY[3];
+    int16_t                 m_nU[3];
+    int16_t                 m_nV[3];
+    int32_t                 m_nYOffset;
+    int32_t                 m_nCOffset;
+};
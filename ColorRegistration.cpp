@@ -0,0 +1,279 @@
+//------------------------------------------------------------------------------
+// ColorRegistration.cpp
+//------------------------------------------------------------------------------
+
+#include "ColorRegistration.h"
+
+/// <summary>
+/// Gather registered color for a band of depth rows
+/// </summary>
+void ColorRegistration::GatherBilinear(const float* pColorPoints, int nDepthWidth, int nRowBegin, int nRowEnd,
+                                       const uint32_t* pColor, int nColorWidth, int nColorHeight,
+                                       uint32_t* pRegistered, uint32_t* pPreview)
+{
+    // Valid sample positions; the last column/row are handled by clamping the
+    // right/bottom neighbor, so positions up to width-1 / height-1 are accepted
+    const float fMaxX = static_cast<float>(nColorWidth - 1);
+    const float fMaxY = static_cast<float>(nColorHeight - 1);
+
+    for (int row = nRowBegin; row < nRowEnd; ++row)
+    {
+        for (int i = row * nDepthWidth, end = i + nDepthWidth; i < end; ++i)
+        {
+            float x = pColorPoints[2 * i];
+            float y = pColorPoints[2 * i + 1];
+
+            // also rejects -infinity and NaN
+            if (!(x >= 0.0f && x <= fMaxX && y >= 0.0f && y <= fMaxY))
+            {
+                pRegistered[i] = 0;
+                continue;
+            }
+
+            int x0 = static_cast<int>(x);
+            int y0 = static_cast<int>(y);
+            int x1 = x0 + 1 < nColorWidth ? x0 + 1 : x0;
+            int y1 = y0 + 1 < nColorHeight ? y0 + 1 : y0;
+
+            // 8-bit fixed point weights keep the result independent of float rounding modes
+            int wx = static_cast<int>((x - x0) * 256.0f);
+            int wy = static_cast<int>((y - y0) * 256.0f);
+
+            uint32_t c00 = pColor[y0 * nColorWidth + x0];
+            uint32_t c01 = pColor[y0 * nColorWidth + x1];
+            uint32_t c10 = pColor[y1 * nColorWidth + x0];
+            uint32_t c11 = pColor[y1 * nColorWidth + x1];
+
+            // blue and red share one 64-bit accumulator, green gets its own
+            const uint64_t maskRB = 0x000000FF000000FFull;
+            uint64_t rb00 = ((c00 & 0xFF0000ull) << 16) | (c00 & 0xFF);
+            uint64_t rb01 = ((c01 & 0xFF0000ull) << 16) | (c01 & 0xFF);
+            uint64_t rb10 = ((c10 & 0xFF0000ull) << 16) | (c10 & 0xFF);
+            uint64_t rb11 = ((c11 & 0xFF0000ull) << 16) | (c11 & 0xFF);
+            uint64_t rbTop = rb00 * (256 - wx) + rb01 * wx;
+            uint64_t rbBottom = rb10 * (256 - wx) + rb11 * wx;
+            uint64_t rb = ((rbTop * (256 - wy) + rbBottom * wy + 0x0000800000008000ull) >> 16) & maskRB;
+
+            uint32_t gTop = ((c00 >> 8) & 0xFF) * (256 - wx) + ((c01 >> 8) & 0xFF) * wx;
+            uint32_t gBottom = ((c10 >> 8) & 0xFF) * (256 - wx) + ((c11 >> 8) & 0xFF) * wx;
+
+            int b = static_cast<int>(rb & 0xFF);
+            int g = static_cast<int>((gTop * (256 - wy) + gBottom * wy + 32768) >> 16);
+            int r = static_cast<int>(rb >> 32);
+
+            uint32_t color = static_cast<uint32_t>(b | (g << 8) | (r << 16));
+            pRegistered[i] = color;
+            if (pPreview)
+            {
+                pPreview[i] = color;
+            }
+        }
+    }
+}
+
+// Depth samples within 20 mm or 1/32 of their depth are taken to lie on the
+// same surface
+static inline bool SameSurface(int nDepthA, int nDepthB)
+{
+    int nDiff = nDepthA > nDepthB ? nDepthA - nDepthB : nDepthB - nDepthA;
+    int nTolerance = nDepthA >> 5;
+    return nDiff <= (nTolerance > 20 ? nTolerance : 20);
+}
+
+// Of two hole-filling candidates, the one closer in depth to the hole; a
+// candidate is cNoSource when there is none on that side
+static inline uint32_t PickCandidate(int nDepth, uint32_t nFirst, int nFirstDepth, uint32_t nSecond, int nSecondDepth)
+{
+    if (nFirst == ColorRegistration::cNoSource)
+    {
+        return nSecond;
+    }
+    if (nSecond == ColorRegistration::cNoSource)
+    {
+        return nFirst;
+    }
+    int nFirstDiff = nFirstDepth > nDepth ? nFirstDepth - nDepth : nDepth - nFirstDepth;
+    int nSecondDiff = nSecondDepth > nDepth ? nSecondDepth - nDepth : nDepth - nSecondDepth;
+    return nSecondDiff < nFirstDiff ? nSecond : nFirst;
+}
+
+/// <summary>
+/// Splat every nStride-th color pixel of a band of color rows into the z-buffer
+/// </summary>
+void ColorRegistration::ScatterZBuffered(const float* pDepthPoints, int nColorWidth, int nStride, int nRowBegin, int nRowEnd,
+                                         const uint16_t* pDepth, int nDepthWidth, int nDepthHeight,
+                                         std::atomic<uint64_t>* pCells)
+{
+    int nFirstRow = (nRowBegin + nStride - 1) / nStride * nStride;
+    for (int row = nFirstRow; row < nRowEnd; row += nStride)
+    {
+        for (int colorIndex = row * nColorWidth, end = colorIndex + nColorWidth; colorIndex < end; colorIndex += nStride)
+        {
+            float x = pDepthPoints[2 * colorIndex];
+            float y = pDepthPoints[2 * colorIndex + 1];
+
+            // also rejects -infinity and NaN
+            if (!(x >= -0.5f && x < nDepthWidth - 0.5f && y >= -0.5f && y < nDepthHeight - 0.5f))
+            {
+                continue;
+            }
+
+            // the sample lies on the surface seen by its nearest depth pixel
+            int nearestX = static_cast<int>(x + 0.5f);
+            int nearestY = static_cast<int>(y + 0.5f);
+            int nSampleDepth = pDepth[nearestY * nDepthWidth + nearestX];
+            if (nSampleDepth == 0)
+            {
+                continue;
+            }
+
+            // full resolution samples land on their nearest pixel only; sparser
+            // ones cover the four pixels around them
+            int x0 = nearestX, x1 = nearestX;
+            int y0 = nearestY, y1 = nearestY;
+            if (nStride > 1)
+            {
+                x0 = x < 0.0f ? -1 : static_cast<int>(x);
+                y0 = y < 0.0f ? -1 : static_cast<int>(y);
+                x1 = x0 + 1;
+                y1 = y0 + 1;
+            }
+
+            for (int depthY = y0; depthY <= y1; ++depthY)
+            {
+                for (int depthX = x0; depthX <= x1; ++depthX)
+                {
+                    if (depthX < 0 || depthX >= nDepthWidth || depthY < 0 || depthY >= nDepthHeight)
+                    {
+                        continue;
+                    }
+                    int depthIndex = depthY * nDepthWidth + depthX;
+
+                    // depth test: a sample from another surface, in front of or
+                    // behind this pixel's, does not belong here
+                    if (!SameSurface(nSampleDepth, pDepth[depthIndex]))
+                    {
+                        continue;
+                    }
+
+                    // squared distance is below 2; 16 bits of it
+                    float dx = x - depthX;
+                    float dy = y - depthY;
+                    uint64_t distance = static_cast<uint64_t>((dx * dx + dy * dy) * 32767.0f);
+                    uint64_t bid = (static_cast<uint64_t>(nSampleDepth) << 48) | (distance << 32) | static_cast<uint32_t>(colorIndex);
+
+                    std::atomic<uint64_t>& cell = pCells[depthIndex];
+                    uint64_t current = cell.load(std::memory_order_relaxed);
+                    while (bid < current && !cell.compare_exchange_weak(current, bid, std::memory_order_relaxed))
+                    {
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Take the winning color pixels of a band of depth rows and fill holes along the rows
+/// </summary>
+void ColorRegistration::ResolveRows(std::atomic<uint64_t>* pCells, const uint16_t* pDepth, int nDepthWidth,
+                                    int nRowBegin, int nRowEnd, uint32_t* pSource, uint32_t* pFilled)
+{
+    for (int i = nRowBegin * nDepthWidth, end = nRowEnd * nDepthWidth; i < end; ++i)
+    {
+        uint64_t bid = pCells[i].load(std::memory_order_relaxed);
+        if (bid == cEmptyCell)
+        {
+            pSource[i] = cNoSource;
+            continue;
+        }
+        pCells[i].store(cEmptyCell, std::memory_order_relaxed);
+        pSource[i] = static_cast<uint32_t>(bid);
+    }
+
+    for (int row = nRowBegin; row < nRowEnd; ++row)
+    {
+        int rowStart = row * nDepthWidth;
+        for (int x = 0; x < nDepthWidth; ++x)
+        {
+            int i = rowStart + x;
+            int nDepth = pDepth[i];
+            pFilled[i] = pSource[i];
+            if (pSource[i] != cNoSource || nDepth == 0)
+            {
+                continue;
+            }
+            for (int k = 1; k <= cFillRadius; ++k)
+            {
+                uint32_t nLeft = cNoSource, nRight = cNoSource;
+                if (x - k >= 0 && pSource[i - k] != cNoSource && SameSurface(nDepth, pDepth[i - k]))
+                {
+                    nLeft = pSource[i - k];
+                }
+                if (x + k < nDepthWidth && pSource[i + k] != cNoSource && SameSurface(nDepth, pDepth[i + k]))
+                {
+                    nRight = pSource[i + k];
+                }
+                if (nLeft != cNoSource || nRight != cNoSource)
+                {
+                    pFilled[i] = PickCandidate(nDepth, nLeft, x - k >= 0 ? pDepth[i - k] : 0,
+                                               nRight, x + k < nDepthWidth ? pDepth[i + k] : 0);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Fill the remaining holes of a band of depth rows along the columns
+/// </summary>
+void ColorRegistration::FillColumns(const uint32_t* pFilled, const uint16_t* pDepth, int nDepthWidth, int nDepthHeight,
+                                    int nRowBegin, int nRowEnd, const uint32_t* pColor,
+                                    uint32_t* pRegistered, uint32_t* pPreview)
+{
+    for (int row = nRowBegin; row < nRowEnd; ++row)
+    {
+        int rowStart = row * nDepthWidth;
+        for (int i = rowStart, end = rowStart + nDepthWidth; i < end; ++i)
+        {
+            uint32_t nSource = pFilled[i];
+            int nDepth = pDepth[i];
+            if (nSource == cNoSource && nDepth != 0)
+            {
+                for (int k = 1; k <= cFillRadius; ++k)
+                {
+                    int up = i - k * nDepthWidth;
+                    int down = i + k * nDepthWidth;
+                    uint32_t nUp = cNoSource, nDown = cNoSource;
+                    if (row - k >= 0 && pFilled[up] != cNoSource && SameSurface(nDepth, pDepth[up]))
+                    {
+                        nUp = pFilled[up];
+                    }
+                    if (row + k < nDepthHeight && pFilled[down] != cNoSource && SameSurface(nDepth, pDepth[down]))
+                    {
+                        nDown = pFilled[down];
+                    }
+                    if (nUp != cNoSource || nDown != cNoSource)
+                    {
+                        nSource = PickCandidate(nDepth, nUp, row - k >= 0 ? pDepth[up] : 0,
+                                                nDown, row + k < nDepthHeight ? pDepth[down] : 0);
+                        break;
+                    }
+                }
+            }
+
+            if (nSource == cNoSource)
+            {
+                pRegistered[i] = 0;
+                continue;
+            }
+            uint32_t color = pColor[nSource] & 0xFFFFFF;
+            pRegistered[i] = color;
+            if (pPreview)
+            {
+                pPreview[i] = color;
+            }
+        }
+    }
+}
@@ -0,0 +1,92 @@
+//------------------------------------------------------------------------------
+// ColorRegistration.h
+//------------------------------------------------------------------------------
+
+// Registers the color frame onto the depth grid as a BGRX image, black where
+// no color maps; ColorConverter turns it into YUV. Every kernel works on a band of rows so callers can split a
+// frame across threads; results do not depend on how the rows are split.
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+namespace ColorRegistration
+{
+    /// <summary>
+    /// Value of an empty scatter cell
+    /// </summary>
+    const uint64_t cEmptyCell = ~0ull;
+
+    /// <summary>
+    /// Color index of a depth pixel no color pixel was registered to
+    /// </summary>
+    const uint32_t cNoSource = ~0u;
+
+    /// <summary>
+    /// Farthest a hole takes its color from, in depth pixels along a row or column
+    /// </summary>
+    const int cFillRadius = 2;
+
+    /// <summary>
+    /// Gather registered color for rows [nRowBegin, nRowEnd) of the depth grid:
+    /// every depth pixel samples the color frame bilinearly at its mapped position.
+    /// Pixels whose color position is invalid (negative infinity, as returned by
+    /// the coordinate mapper) or outside the color frame are black.
+    /// </summary>
+    /// <param name="pColorPoints">color space X,Y pair per depth pixel (ColorSpacePoint layout)</param>
+    /// <param name="nDepthWidth">width of the depth grid</param>
+    /// <param name="nRowBegin">first depth row</param>
+    /// <param name="nRowEnd">one past the last depth row</param>
+    /// <param name="pColor">BGRA color frame (RGBQUAD layout)</param>
+    /// <param name="nColorWidth">width of the color frame</param>
+    /// <param name="nColorHeight">height of the color frame</param>
+    /// <param name="pRegistered">BGRX output, depth grid sized</param>
+    /// <param name="pPreview">BGRX output for valid pixels only; may be NULL</param>
+    void GatherBilinear(const float* pColorPoints, int nDepthWidth, int nRowBegin, int nRowEnd,
+                        const uint32_t* pColor, int nColorWidth, int nColorHeight,
+                        uint32_t* pRegistered, uint32_t* pPreview);
+
+    /// <summary>
+    /// First scatter pass for color rows [nRowBegin, nRowEnd): every nStride-th
+    /// color pixel of every nStride-th row is splatted into a z-buffer of bids,
+    /// one cell per depth pixel. At stride 1 a sample covers the depth pixel it
+    /// maps to, at larger strides the four around it. A sample takes the depth
+    /// of its nearest depth pixel and is rejected where the covered pixel's depth
+    /// is on another surface; otherwise the nearer sample wins, then the one
+    /// nearer the pixel center, then the lower color index. Bids are applied with
+    /// an atomic min, so the result is the same for any order or thread count.
+    /// Cells must start out as cEmptyCell.
+    /// </summary>
+    /// <param name="pDepthPoints">depth space X,Y pair per color pixel (DepthSpacePoint layout)</param>
+    /// <param name="nColorWidth">width of the color frame</param>
+    /// <param name="nStride">distance between the color pixels used, in both directions</param>
+    /// <param name="nRowBegin">first color row</param>
+    /// <param name="nRowEnd">one past the last color row</param>
+    /// <param name="pDepth">depth frame in millimeters</param>
+    /// <param name="nDepthWidth">width of the depth grid</param>
+    /// <param name="nDepthHeight">height of the depth grid</param>
+    /// <param name="pCells">one bid cell per depth pixel</param>
+    void ScatterZBuffered(const float* pDepthPoints, int nColorWidth, int nStride, int nRowBegin, int nRowEnd,
+                          const uint16_t* pDepth, int nDepthWidth, int nDepthHeight,
+                          std::atomic<uint64_t>* pCells);
+
+    /// <summary>
+    /// Second scatter pass for depth rows [nRowBegin, nRowEnd): move the winning
+    /// color index of each cell to pSource and reset the cells for the next frame,
+    /// then fill holes along the rows into pFilled. A hole with a depth takes the
+    /// nearest source within cFillRadius on the same surface; when both sides have
+    /// one at the same distance, the one closer in depth.
+    /// </summary>
+    void ResolveRows(std::atomic<uint64_t>* pCells, const uint16_t* pDepth, int nDepthWidth,
+                     int nRowBegin, int nRowEnd, uint32_t* pSource, uint32_t* pFilled);
+
+    /// <summary>
+    /// Third scatter pass for depth rows [nRowBegin, nRowEnd): fill the holes left
+    /// by ResolveRows the same way along the columns, reading only pFilled, and
+    /// write the registered image. Pixels still without color are black.
+    /// </summary>
+    void FillColumns(const uint32_t* pFilled, const uint16_t* pDepth, int nDepthWidth, int nDepthHeight,
+                     int nRowBegin, int nRowEnd, const uint32_t* pColor,
+                     uint32_t* pRegistered, uint32_t* pPreview);
+}
@@ -0,0 +1,458 @@
+//------------------------------------------------------------------------------
+// DepthDecimator.cpp
+//------------------------------------------------------------------------------
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include "DepthDecimator.h"
+
+static const uint64_t cEmptyKey = ~0ULL;
+
+// Voxel coordinates are 21 bits per axis, offset to be unsigned; a key never
+// has its top bit set, so it can't be cEmptyKey
+static const int cCoordinateBits = 21;
+static const int64_t cCoordinateOffset = 1LL << (cCoordinateBits - 1);
+
+// Regions are picked by the top bits of the hash, slots by the low bits
+static const int cRegionBits = 4;
+
+// floor without the library call: clamp, truncate, then step down for
+// negative fractions
+static inline uint64_t VoxelCoordinate(float fValue)
+{
+    const float fLimit = static_cast<float>(cCoordinateOffset - 1);
+    fValue = fValue < -fLimit ? -fLimit : (fValue > fLimit ? fLimit : fValue);
+    int n = static_cast<int>(fValue);
+    n -= fValue < static_cast<float>(n);
+    return static_cast<uint64_t>(n + cCoordinateOffset);
+}
+
+// splitmix64 finalizer, so neighboring voxels spread over all regions
+static inline uint64_t MixKey(uint64_t nKey)
+{
+    nKey ^= nKey >> 30;
+    nKey *= 0xBF58476D1CE4E5B9ULL;
+    nKey ^= nKey >> 27;
+    nKey *= 0x94D049BB133111EBULL;
+    nKey ^= nKey >> 31;
+    return nKey;
+}
+
+static inline void LoadPosition(const void* pPositions, PointFormat eFormat, int i, float* pPosition)
+{
+    if (eFormat == PointFormatInt16)
+    {
+        const int16_t* p = static_cast<const int16_t*>(pPositions) + 3 * i;
+        pPosition[0] = p[0];
+        pPosition[1] = p[1];
+        pPosition[2] = p[2];
+    }
+    else
+    {
+        const float* p = static_cast<const float*>(pPositions) + 3 * i;
+        pPosition[0] = p[0];
+        pPosition[1] = p[1];
+        pPosition[2] = p[2];
+    }
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+DepthDecimator::DepthDecimator(FrameArena& arena, int nWidth, int nHeight) :
+    m_arena(arena),
+    m_nWidth(nWidth),
+    m_nHeight(nHeight),
+    m_nThreads(1),
+    m_ePass(PassReduce),
+    m_nTasks(0),
+    m_eMethod(DecimationNone),
+    m_nFactor(1),
+    m_pDepth(NULL),
+    m_pOut(NULL),
+    m_pPositions(NULL),
+    m_pColors(NULL),
+    m_nPoints(0),
+    m_eFormat(PointFormatFloat32),
+    m_fInverseLeaf(1.0f),
+    m_pKeys(NULL),
+    m_pHashes(NULL),
+    m_pTileCounts(NULL),
+    m_pRegionPoints(NULL),
+    m_pSlots(NULL),
+    m_pIsFirst(NULL),
+    m_pCentroids(NULL),
+    m_pAverageColors(NULL)
+{
+    m_threader = igtl::MultiThreader::New();
+    SetThreadCount(0);
+}
+
+/// <summary>
+/// Number of worker threads; 0 uses one per core
+/// </summary>
+void DepthDecimator::SetThreadCount(int nThreads)
+{
+    m_nThreads = nThreads > 0 ? nThreads : igtl::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    if (m_nThreads < 1)
+    {
+        m_nThreads = 1;
+    }
+}
+
+/// <summary>
+/// Size of a decimated plane side
+/// </summary>
+int DepthDecimator::GetDecimatedSize(int nSize, int nFactor)
+{
+    nFactor = nFactor > cMaxFactor ? cMaxFactor : nFactor;
+    return nFactor > 1 ? (nSize / nFactor) & ~1 : nSize;
+}
+
+/// <summary>
+/// Reduce a depth frame to a smaller plane
+/// </summary>
+void DepthDecimator::Decimate(DecimationMethod eMethod, int nFactor, const uint16_t* pDepth, uint16_t* pReduced)
+{
+    m_eMethod = eMethod;
+    m_nFactor = nFactor < 1 ? 1 : (nFactor > cMaxFactor ? cMaxFactor : nFactor);
+    m_pDepth = pDepth;
+    m_pOut = pReduced;
+    int nBlockRows = GetDecimatedSize(m_nHeight, m_nFactor);
+    int nTileBlocks = std::max(1, cTileRows / m_nFactor);
+    Execute(PassReduce, (nBlockRows + nTileBlocks - 1) / nTileBlocks);
+}
+
+/// <summary>
+/// Reduce a depth frame, keeping the result on the full grid
+/// </summary>
+void DepthDecimator::Thin(DecimationMethod eMethod, int nFactor, const uint16_t* pDepth, uint16_t* pThinned)
+{
+    m_eMethod = eMethod;
+    m_nFactor = nFactor < 1 ? 1 : (nFactor > cMaxFactor ? cMaxFactor : nFactor);
+    m_pDepth = pDepth;
+    m_pOut = pThinned;
+    int nBlockRows = GetDecimatedSize(m_nHeight, m_nFactor);
+    int nTileBlocks = std::max(1, cTileRows / m_nFactor);
+    Execute(PassThin, (nBlockRows + nTileBlocks - 1) / nTileBlocks);
+}
+
+/// <summary>
+/// Replace the points in each voxel by their centroid and average color
+/// </summary>
+int DepthDecimator::VoxelFilter(const void* pPositions, const uint8_t* pColors, int nPoints, PointFormat eFormat, float fLeafSize,
+                                void* pOutPositions, uint8_t* pOutColors)
+{
+    if (nPoints <= 0 || fLeafSize <= 0.0f)
+    {
+        return 0;
+    }
+
+    int nTiles = (nPoints + cTilePoints - 1) / cTilePoints;
+    m_pKeys = m_arena.Allocate<uint64_t>(nPoints);
+    m_pHashes = m_arena.Allocate<uint64_t>(nPoints);
+    m_pTileCounts = m_arena.Allocate<int>(nTiles * cVoxelRegions);
+    m_pRegionPoints = m_arena.Allocate<int>(nPoints);
+    m_pIsFirst = m_arena.Allocate<uint8_t>(nPoints);
+    m_pCentroids = m_arena.Allocate<float>(3 * nPoints);
+    m_pAverageColors = m_arena.Allocate<uint8_t>(3 * nPoints);
+    if (!m_pKeys || !m_pHashes || !m_pTileCounts || !m_pRegionPoints || !m_pIsFirst || !m_pCentroids || !m_pAverageColors)
+    {
+        return 0;
+    }
+
+    m_pPositions = pPositions;
+    m_pColors = pColors;
+    m_nPoints = nPoints;
+    m_eFormat = eFormat;
+    m_fInverseLeaf = 1.0f / fLeafSize;
+    Execute(PassVoxelKeys, nTiles);
+
+    // where each tile's points of each region go, and the table slots of each
+    // region: half as many again as its points keeps probing short even if
+    // every point is a voxel of its own
+    int nOffset = 0;
+    m_nSlotBegin[0] = 0;
+    for (int r = 0; r < cVoxelRegions; ++r)
+    {
+        m_nRegionBegin[r] = nOffset;
+        for (int t = 0; t < nTiles; ++t)
+        {
+            int nCount = m_pTileCounts[t * cVoxelRegions + r];
+            m_pTileCounts[t * cVoxelRegions + r] = nOffset;
+            nOffset += nCount;
+        }
+        int nRegionPoints = nOffset - m_nRegionBegin[r];
+        m_nSlotBegin[r + 1] = m_nSlotBegin[r] + nRegionPoints + nRegionPoints / 2 + 1;
+    }
+    m_nRegionBegin[cVoxelRegions] = nOffset;
+
+    m_pSlots = m_arena.Allocate<VoxelSlot>(m_nSlotBegin[cVoxelRegions]);
+    if (!m_pSlots)
+    {
+        return 0;
+    }
+    Execute(PassVoxelPartition, nTiles);
+    Execute(PassVoxelAccumulate, cVoxelRegions);
+
+    // each voxel was written at its first point; compact them in that order
+    int nVoxels = 0;
+    for (int i = 0; i < nPoints; ++i)
+    {
+        if (!m_pIsFirst[i])
+        {
+            continue;
+        }
+        const float* pCentroid = m_pCentroids + 3 * i;
+        if (eFormat == PointFormatInt16)
+        {
+            int16_t* pOut = static_cast<int16_t*>(pOutPositions) + 3 * nVoxels;
+            for (int c = 0; c < 3; ++c)
+            {
+                pOut[c] = static_cast<int16_t>(lrintf(pCentroid[c]));
+            }
+        }
+        else
+        {
+            memcpy(static_cast<float*>(pOutPositions) + 3 * nVoxels, pCentroid, 3 * sizeof(float));
+        }
+        memcpy(pOutColors + 3 * nVoxels, m_pAverageColors + 3 * i, 3);
+        ++nVoxels;
+    }
+    return nVoxels;
+}
+
+/// <summary>
+/// Run one pass on all threads and wait for it
+/// </summary>
+void DepthDecimator::Execute(Pass ePass, int nTasks)
+{
+    m_ePass = ePass;
+    m_nTasks = nTasks;
+    if (m_nThreads == 1 || nTasks == 1)
+    {
+        igtl::MultiThreader::ThreadInfo info;
+        info.ThreadID = 0;
+        info.NumberOfThreads = 1;
+        info.UserData = this;
+        Worker(&info);
+        return;
+    }
+    m_threader->SetNumberOfThreads(m_nThreads < nTasks ? m_nThreads : nTasks);
+    m_threader->SetSingleMethod((igtl::ThreadFunctionType) &DepthDecimator::Worker, this);
+    m_threader->SingleMethodExecute();
+}
+
+/// <summary>
+/// Worker entry point
+/// </summary>
+void* DepthDecimator::Worker(void* ptr)
+{
+    igtl::MultiThreader::ThreadInfo* info = static_cast<igtl::MultiThreader::ThreadInfo*>(ptr);
+    DepthDecimator* self = static_cast<DepthDecimator*>(info->UserData);
+
+    int nTileBlocks = std::max(1, cTileRows / self->m_nFactor);
+    int nBlockRows = GetDecimatedSize(self->m_nHeight, self->m_nFactor);
+    for (int task = info->ThreadID; task < self->m_nTasks; task += info->NumberOfThreads)
+    {
+        switch (self->m_ePass)
+        {
+        case PassReduce:
+        case PassThin:
+            self->ReduceBlocks(task * nTileBlocks, std::min((task + 1) * nTileBlocks, nBlockRows), self->m_ePass == PassThin);
+            break;
+        case PassVoxelKeys:
+            self->ComputeKeys(task);
+            break;
+        case PassVoxelPartition:
+            self->PartitionTile(task);
+            break;
+        case PassVoxelAccumulate:
+            self->AccumulateRegion(task);
+            break;
+        }
+    }
+    return NULL;
+}
+
+/// <summary>
+/// Reduce block rows [nBlockRowBegin, nBlockRowEnd); each reads factor
+/// consecutive depth rows and writes one output row
+/// </summary>
+void DepthDecimator::ReduceBlocks(int nBlockRowBegin, int nBlockRowEnd, bool bThin) const
+{
+    int f = m_nFactor;
+    int nCenter = f / 2;
+    int nBlockColumns = GetDecimatedSize(m_nWidth, f);
+    int nBlockRows = GetDecimatedSize(m_nHeight, f);
+
+    if (bThin)
+    {
+        // this tile owns its depth rows, and the last tile the rows no block covers
+        int nRowEnd = nBlockRowEnd == nBlockRows ? m_nHeight : nBlockRowEnd * f;
+        memset(m_pOut + nBlockRowBegin * f * m_nWidth, 0, (nRowEnd - nBlockRowBegin * f) * m_nWidth * sizeof(uint16_t));
+    }
+
+    uint16_t samples[cMaxFactor * cMaxFactor];
+    for (int by = nBlockRowBegin; by < nBlockRowEnd; ++by)
+    {
+        const uint16_t* pBlockRow = m_pDepth + by * f * m_nWidth;
+        for (int bx = 0; bx < nBlockColumns; ++bx)
+        {
+            const uint16_t* pBlock = pBlockRow + bx * f;
+            uint16_t nValue;
+            if (m_eMethod == DecimationMedian)
+            {
+                // 0 is no reading, not a sample. Blocks hold at most 64
+                // samples, few enough for an insertion sort to beat a selection.
+                int n = 0;
+                for (int y = 0; y < f; ++y)
+                {
+                    for (int x = 0; x < f; ++x)
+                    {
+                        uint16_t d = pBlock[y * m_nWidth + x];
+                        if (d == 0)
+                        {
+                            continue;
+                        }
+                        int k = n++;
+                        for (; k > 0 && samples[k - 1] > d; --k)
+                        {
+                            samples[k] = samples[k - 1];
+                        }
+                        samples[k] = d;
+                    }
+                }
+                nValue = n > 0 ? samples[(n - 1) / 2] : 0;
+            }
+            else
+            {
+                nValue = pBlock[nCenter * m_nWidth + nCenter];
+            }
+
+            if (bThin)
+            {
+                m_pOut[(by * f + nCenter) * m_nWidth + bx * f + nCenter] = nValue;
+            }
+            else
+            {
+                m_pOut[by * nBlockColumns + bx] = nValue;
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Voxel key and hash of a tile's points, counting them per region
+/// </summary>
+void DepthDecimator::ComputeKeys(int nTile) const
+{
+    int* pCounts = m_pTileCounts + nTile * cVoxelRegions;
+    for (int r = 0; r < cVoxelRegions; ++r)
+    {
+        pCounts[r] = 0;
+    }
+
+    int nEnd = std::min((nTile + 1) * cTilePoints, m_nPoints);
+    for (int i = nTile * cTilePoints; i < nEnd; ++i)
+    {
+        float position[3];
+        LoadPosition(m_pPositions, m_eFormat, i, position);
+        uint64_t nKey = VoxelCoordinate(position[0] * m_fInverseLeaf) << (2 * cCoordinateBits) |
+                        VoxelCoordinate(position[1] * m_fInverseLeaf) << cCoordinateBits |
+                        VoxelCoordinate(position[2] * m_fInverseLeaf);
+        uint64_t nHash = MixKey(nKey);
+        m_pKeys[i] = nKey;
+        m_pHashes[i] = nHash;
+        m_pIsFirst[i] = 0;
+        ++pCounts[nHash >> (64 - cRegionBits)];
+    }
+}
+
+/// <summary>
+/// Append a tile's point indices to their regions' lists, in point order
+/// </summary>
+void DepthDecimator::PartitionTile(int nTile) const
+{
+    int nOffsets[cVoxelRegions];
+    memcpy(nOffsets, m_pTileCounts + nTile * cVoxelRegions, sizeof(nOffsets));
+
+    int nEnd = std::min((nTile + 1) * cTilePoints, m_nPoints);
+    for (int i = nTile * cTilePoints; i < nEnd; ++i)
+    {
+        m_pRegionPoints[nOffsets[m_pHashes[i] >> (64 - cRegionBits)]++] = i;
+    }
+}
+
+/// <summary>
+/// Sum the region's points into its voxels, with linear probing inside the
+/// region, then write each voxel's average at its first point
+/// </summary>
+void DepthDecimator::AccumulateRegion(int nRegion) const
+{
+    int nSlotBase = m_nSlotBegin[nRegion];
+    uint64_t nSlots = static_cast<uint64_t>(m_nSlotBegin[nRegion + 1] - nSlotBase);
+    VoxelSlot* pSlots = m_pSlots + nSlotBase;
+    for (uint64_t j = 0; j < nSlots; ++j)
+    {
+        pSlots[j].key = cEmptyKey;
+    }
+
+    // neighboring pixels mostly share a voxel, so the last one is checked first
+    VoxelSlot* pLast = NULL;
+    for (int p = m_nRegionBegin[nRegion]; p < m_nRegionBegin[nRegion + 1]; ++p)
+    {
+        int i = m_pRegionPoints[p];
+        uint64_t nKey = m_pKeys[i];
+
+        VoxelSlot* pSlot = pLast;
+        if (!pSlot || pSlot->key != nKey)
+        {
+            // the low hash bits pick the first slot; the region has more slots
+            // than points, so a free one is always found
+            uint64_t j = ((m_pHashes[i] & 0xFFFFFFFFULL) * nSlots) >> 32;
+            while (pSlots[j].key != cEmptyKey && pSlots[j].key != nKey)
+            {
+                j = j + 1 < nSlots ? j + 1 : 0;
+            }
+            pSlot = &pSlots[j];
+            if (pSlot->key == cEmptyKey)
+            {
+                pSlot->key = nKey;
+                pSlot->first = i;
+                pSlot->count = 0;
+                pSlot->sum[0] = pSlot->sum[1] = pSlot->sum[2] = 0.0f;
+                pSlot->colorSum[0] = pSlot->colorSum[1] = pSlot->colorSum[2] = 0;
+            }
+            pLast = pSlot;
+        }
+
+        float position[3];
+        LoadPosition(m_pPositions, m_eFormat, i, position);
+        const uint8_t* pColor = m_pColors + 3 * i;
+        ++pSlot->count;
+        for (int c = 0; c < 3; ++c)
+        {
+            pSlot->sum[c] += position[c];
+            pSlot->colorSum[c] += pColor[c];
+        }
+    }
+
+    for (uint64_t j = 0; j < nSlots; ++j)
+    {
+        const VoxelSlot& slot = pSlots[j];
+        if (slot.key == cEmptyKey)
+        {
+            continue;
+        }
+        float* pCentroid = m_pCentroids + 3 * slot.first;
+        uint8_t* pColor = m_pAverageColors + 3 * slot.first;
+        for (int c = 0; c < 3; ++c)
+        {
+            pCentroid[c] = slot.sum[c] / slot.count;
+            pColor[c] = static_cast<uint8_t>((slot.colorSum[c] + slot.count / 2) / slot.count);
+        }
+        m_pIsFirst[slot.first] = 1;
+    }
+}
@@ -0,0 +1,150 @@
+//------------------------------------------------------------------------------
+// DepthDecimator.h
+//------------------------------------------------------------------------------
+
+// Reduces the depth pipeline's output for clients that can't take all of it.
+// A depth frame is cut into factor x factor blocks, each reduced to its
+// center sample (stride) or the median of its valid samples (block median),
+// either as a smaller depth plane or thinned in place for the point cloud.
+// A point cloud can instead be reduced to the centroid of the points in each
+// voxel of a hashed grid. All of it runs on all cores, and the output does not
+// depend on the number of threads.
+
+#pragma once
+
+#include <stdint.h>
+#include "igtlMultiThreader.h"
+#include "FrameArena.h"
+#include "PointCloudBuilder.h"
+
+enum DecimationMethod
+{
+    DecimationNone = 0,
+    DecimationStride = 1,       // center sample of each block
+    DecimationMedian = 2,       // median of the valid samples of each block
+    DecimationVoxel = 3         // centroid of the points in each voxel, point clouds only
+};
+
+class DepthDecimator
+{
+public:
+    static const int        cMaxFactor = 8;
+
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    /// <param name="arena">arena for the per-frame scratch, rewound by the caller between frames</param>
+    /// <param name="nWidth">width of the depth grid</param>
+    /// <param name="nHeight">height of the depth grid</param>
+    DepthDecimator(FrameArena& arena, int nWidth, int nHeight);
+
+    /// <summary>
+    /// Number of worker threads; 0 uses one per core
+    /// </summary>
+    void SetThreadCount(int nThreads);
+
+    /// <summary>
+    /// Size of a decimated plane side: whole blocks, rounded down to even for 4:2:0
+    /// </summary>
+    static int GetDecimatedSize(int nSize, int nFactor);
+
+    /// <summary>
+    /// Reduce a depth frame to GetDecimatedSize(width) x GetDecimatedSize(height)
+    /// </summary>
+    /// <param name="eMethod">DecimationStride or DecimationMedian</param>
+    /// <param name="nFactor">block size, 2 to cMaxFactor</param>
+    /// <param name="pDepth">full depth frame</param>
+    /// <param name="pReduced">decimated plane output</param>
+    void Decimate(DecimationMethod eMethod, int nFactor, const uint16_t* pDepth, uint16_t* pReduced);
+
+    /// <summary>
+    /// As Decimate, but the result stays on the full grid at each block's
+    /// center and every other pixel is 0, so back-projection skips it
+    /// </summary>
+    void Thin(DecimationMethod eMethod, int nFactor, const uint16_t* pDepth, uint16_t* pThinned);
+
+    /// <summary>
+    /// Replace the points in each voxel by their centroid and average color.
+    /// Voxels come out in the order of their first point; input and output may
+    /// not overlap.
+    /// </summary>
+    /// <param name="pPositions">input positions</param>
+    /// <param name="pColors">input colors, r, g, b per point</param>
+    /// <param name="nPoints">number of input points</param>
+    /// <param name="eFormat">format of the positions, in and out</param>
+    /// <param name="fLeafSize">voxel edge in the positions' unit</param>
+    /// <param name="pOutPositions">output positions, room for nPoints</param>
+    /// <param name="pOutColors">output colors, room for nPoints</param>
+    /// <returns>number of voxels written, 0 if the arena is out of memory</returns>
+    int VoxelFilter(const void* pPositions, const uint8_t* pColors, int nPoints, PointFormat eFormat, float fLeafSize,
+                    void* pOutPositions, uint8_t* pOutColors);
+
+private:
+    DepthDecimator(const DepthDecimator&);
+    DepthDecimator& operator=(const DepthDecimator&);
+
+    enum Pass { PassReduce, PassThin, PassVoxelKeys, PassVoxelPartition, PassVoxelAccumulate };
+
+    // Slot of the voxel table, with its sums so a point touches one slot
+    typedef struct
+    {
+        uint64_t            key;
+        int32_t             first;      // index of the voxel's first point
+        int32_t             count;
+        float               sum[3];
+        uint32_t            colorSum[3];
+    } VoxelSlot;
+
+    /// <summary>
+    /// Run one pass on all threads and wait for it
+    /// </summary>
+    void                    Execute(Pass ePass, int nTasks);
+
+    /// <summary>
+    /// Worker entry point; processes tasks ThreadID, ThreadID + NumberOfThreads, ...
+    /// </summary>
+    static void*            Worker(void* ptr);
+
+    void                    ReduceBlocks(int nBlockRowBegin, int nBlockRowEnd, bool bThin) const;
+    void                    ComputeKeys(int nTile) const;
+    void                    PartitionTile(int nTile) const;
+    void                    AccumulateRegion(int nRegion) const;
+
+    static const int        cTileRows = 16;
+    static const int        cTilePoints = 8192;
+
+    // the voxel table is split into regions by hash. Points are partitioned
+    // by region, keeping their order, and one thread fills a region at a time.
+    static const int        cVoxelRegions = 16;
+
+    FrameArena&             m_arena;
+    int                     m_nWidth;
+    int                     m_nHeight;
+    int                     m_nThreads;
+    igtl::MultiThreader::Pointer m_threader;
+
+    // arguments of the pass being executed
+    Pass                    m_ePass;
+    int                     m_nTasks;
+    DecimationMethod        m_eMethod;
+    int                     m_nFactor;
+    const uint16_t*         m_pDepth;
+    uint16_t*               m_pOut;
+    const void*             m_pPositions;
+    const uint8_t*          m_pColors;
+    int                     m_nPoints;
+    PointFormat             m_eFormat;
+    float                   m_fInverseLeaf;
+
+    // voxel scratch, per frame
+    uint64_t*               m_pKeys;
+    uint64_t*               m_pHashes;
+    int*                    m_pTileCounts;      // points per tile and region, then where they go
+    int*                    m_pRegionPoints;    // point indices grouped by region
+    int                     m_nRegionBegin[cVoxelRegions + 1];
+    int                     m_nSlotBegin[cVoxelRegions + 1];
+    VoxelSlot*              m_pSlots;
+    uint8_t*                m_pIsFirst;
+    float*                  m_pCentroids;
+    uint8_t*                m_pAverageColors;
+};
@@ -14,6 +14,7 @@
 
 =========================================================================*/
 
+#include <chrono>
 #include <fstream>
 #include "svc/codec_api.h"
 #include "svc/codec_def.h"
@@ -32,6 +33,8 @@
 #include "igtlServerSocket.h"
 #include "igtlMultiThreader.h"
 #include "igtlConditionVariable.h"
+#include "VideoFrameSender.h"
+#include "BitrateController.h"
 #include <math.h>
 
 #define IGTL_IMAGE_HEADER_SIZE          72
@@ -313,6 +316,26 @@ namespace DepthImageServer {
       EncFileParamToParamExt(&kFileParamArray, &pEncParamExtColor);
       encoderColor_->InitializeExt(&pEncParamExtColor);
       encoderColor_->SetOption(ENCODER_OPTION_DATAFORMAT, &videoFormat);
+
+      // One reusable message per stream, packed once
+      std::string frameNames[2] = { "DepthFrame", "DepthIndex"};
+      VideoFrameSender depthSenders[2];
+      for (int iMessage = 0; iMessage < 2; iMessage++)
+      {
+        depthSenders[iMessage].Initialize(frameNames[iMessage], td->td_Server->pic.iPicWidth, td->td_Server->pic.iPicHeight);
+      }
+      VideoFrameSender colorSender;
+      colorSender.Initialize("ColorFrame", td->td_Server->pic_Color.iPicWidth, td->td_Server->pic_Color.iPicHeight);
+      VideoPayload layers[128];
+
+      // Depth goes out raw; only the color bitrate can follow the link. The
+      // sends are synchronous, so there is no queue to watch: the link is
+      // behind when the sender spends most of the time blocked in Send().
+      BitrateController rateController(pEncParamExtColor.iTargetBitrate / 1000, 3);
+      std::chrono::steady_clock::time_point rateSampleStart = std::chrono::steady_clock::now();
+      long long depthBytes = 0, colorBytes = 0;
+      double sendSeconds = 0.0;
+      int rateFrames = 0;
       while (!td->stop)
       {
         int iFrameIdx = 0;
@@ -320,69 +343,70 @@ namespace DepthImageServer {
         {
           td->td_Server->pic.uiTimeStamp = (long long)(iFrameIdx * (1000 / pEncParamExt.fMaxFrameRate));
           iFrameIdx++;
-          std::string frameNames[2] = { "DepthFrame", "DepthIndex"};
           for (int iMessage = 0; iMessage < 2; iMessage++)
           {
-            igtl::VideoMessage::Pointer videoMsg;
-            videoMsg = igtl::VideoMessage::New();
-            videoMsg->SetDefaultBodyType("ColoredDepth");
-            videoMsg->SetDeviceName(frameNames[iMessage]);
-            videoMsg->SetBitStreamSize(pEncParamExt.iPicWidth*pEncParamExt.iPicHeight);
-            videoMsg->AllocateScalars();
-            videoMsg->SetScalarType(videoMsg->TYPE_UINT32);
-            videoMsg->SetEndian(igtl_is_little_endian() == 1 ? 2 : 1); //little endian is 2 big endian is 1
-            videoMsg->SetWidth(td->td_Server->pic.iPicWidth);
-            videoMsg->SetHeight(td->td_Server->pic.iPicHeight);
-            memcpy(videoMsg->GetPackFragmentPointer(2), td->td_Server->pic.pData[0]+ iMessage*pEncParamExt.iPicWidth*pEncParamExt.iPicHeight, pEncParamExt.iPicWidth*pEncParamExt.iPicHeight);
-            videoMsg->Pack();
+            // sent straight from the plane, no copy into the message
+            VideoPayload plane = { td->td_Server->pic.pData[0] + iMessage*pEncParamExt.iPicWidth*pEncParamExt.iPicHeight,
+                                   pEncParamExt.iPicWidth*pEncParamExt.iPicHeight };
+            std::chrono::steady_clock::time_point sendStart = std::chrono::steady_clock::now();
             glock->Lock();
-            for (int i = 0; i < videoMsg->GetNumberOfPackFragments(); i++)
-            {
-              socket->Send(videoMsg->GetPackFragmentPointer(i), videoMsg->GetPackFragmentSize(i));
-            }
+            depthSenders[iMessage].Send(socket, &plane, 1);
             glock->Unlock();
+            sendSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - sendStart).count();
+            depthBytes += plane.size;
           }
           rv = encoderColor_->EncodeFrame(&td->td_Server->pic_Color, &td->td_Server->info_Color);
           if (rv == cmResultSuccess)
           {
             //---------------
-            igtl::VideoMessage::Pointer videoMsg;
-            videoMsg = igtl::VideoMessage::New();
-            videoMsg->SetDefaultBodyType("ColoredDepth");
-            videoMsg->SetDeviceName("ColorFrame");
-            videoMsg->SetBitStreamSize(td->td_Server->info_Color.iFrameSizeInBytes);
-            videoMsg->AllocateScalars();
-            videoMsg->SetScalarType(videoMsg->TYPE_UINT32);
-            videoMsg->SetEndian(igtl_is_little_endian() == 1 ? 2 : 1); //little endian is 2 big endian is 1
-            videoMsg->SetWidth(td->td_Server->pic_Color.iPicWidth);
-            videoMsg->SetHeight(td->td_Server->pic_Color.iPicHeight);
-            int frameSize = 0;
-            int layerSize = 0;
-            for (int i = 0; i < td->td_Server->info_Color.iLayerNum; ++i) {
+            // Each layer's NALs are contiguous in its pBsBuf; the layers go
+            // out as one message body without being gathered into a copy
+            int nLayers = td->td_Server->info_Color.iLayerNum;
+            for (int i = 0; i < nLayers; ++i) {
               const SLayerBSInfo& layerInfo = td->td_Server->info_Color.sLayerInfo[i];
-              layerSize = 0;
+              int layerSize = 0;
               for (int j = 0; j < layerInfo.iNalCount; ++j)
               {
-                frameSize += layerInfo.pNalLengthInByte[j];
                 layerSize += layerInfo.pNalLengthInByte[j];
               }
-              //TestDebugCharArrayCmp(layerInfo.pBsBuf, layerInfo.pBsBuf, layerSize<200? layerSize:200);
-              for (int i = 0; i < layerSize; i++)
-              {
-                videoMsg->GetPackFragmentPointer(2)[frameSize - layerSize + i] = layerInfo.pBsBuf[i];
-              }
+              layers[i].data = layerInfo.pBsBuf;
+              layers[i].size = layerSize;
               //fwrite(layerInfo.pBsBuf, 1, layerSize, pFpBs); // write pure bit stream into file
             }
-            //std::cerr<<"line break"<<std::endl;
-            //TestDebugCharArrayCmp(videoMsg->GetPackFragmentPointer(2), videoMsg->GetPackFragmentPointer(1) + IGTL_VIDEO_HEADER_SIZE, 200);
-            videoMsg->Pack();
+            std::chrono::steady_clock::time_point sendStart = std::chrono::steady_clock::now();
             glock->Lock();
-
-            for (int i = 0; i < videoMsg->GetNumberOfPackFragments(); i++)
+            colorSender.Send(socket, layers, nLayers);
+            glock->Unlock();
+            sendSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - sendStart).count();
+            for (int i = 0; i < nLayers; ++i)
+              colorBytes += layers[i].size;
+          }
+          if (++rateFrames == 10)
+          {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            // The controller only budgets color: give it the color bytes and
+            // the send time the link needs for them once the raw depth, which
+            // takes most of the link, has had its share
+            LinkSample sample;
+            sample.seconds = std::chrono::duration<double>(now - rateSampleStart).count();
+            sample.queued = sendSeconds > 0.8 * sample.seconds ? 4 : 0;
+            sample.bytes = colorBytes;
+            double linkRate = sendSeconds > 0 ? (depthBytes + colorBytes) / sendSeconds : 0;
+            double colorRoom = linkRate - (sample.seconds > 0 ? depthBytes / sample.seconds : 0);
+            sample.sendSeconds = colorRoom > 0 ? colorBytes / colorRoom : sendSeconds;
+            int previous = rateController.GetTarget();
+            if (rateController.Update(sample) != previous)
             {
-              socket->Send(videoMsg->GetPackFragmentPointer(i), videoMsg->GetPackFragmentSize(i));
+              SBitrateInfo bitrate;
+              bitrate.iLayer = SPATIAL_LAYER_ALL;
+              bitrate.iBitrate = rateController.GetTarget() * 1000;
+              encoderColor_->SetOption(ENCODER_OPTION_BITRATE, &bitrate);
             }
-            glock->Unlock();
+            depthBytes = 0;
+            colorBytes = 0;
+            sendSeconds = 0.0;
+            rateSampleStart = now;
+            rateFrames = 0;
           }
           td->td_Server->transmissionFinished = true;
           td->td_Server->conditionVar->Signal();
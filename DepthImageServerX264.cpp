@@ -1,15 +1,30 @@
 #include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <fstream>
+#include <list>
+#include <map>
+#include <vector>
+#include <chrono>
 
 #include "igtl_header.h"
 #include "igtl_video.h"
-#include "utils/BufferedData.h"
-#include "utils/FileInputStream.h"
 #include "igtlOSUtil.h"
 #include "igtlMessageHeader.h"
 #include "igtlVideoMessage.h"
 #include "igtlServerSocket.h"
 #include "igtlMultiThreader.h"
 #include "igtlConditionVariable.h"
+#include "DepthPacking.h"
+#include "VideoFrameSender.h"
+#include "ClientBroadcaster.h"
+#include "FrameExchange.h"
+#include "ColorConversion.h"
+#include "PointCloudSender.h"
+#include "DepthDecimator.h"
+#include "DepthTemporalFilter.h"
+#include "DepthSpatialFilter.h"
+#include "LatencyTrace.h"
 
 extern "C" {
   #include "stdint.h"
@@ -19,12 +34,137 @@ extern "C" {
 }
 #define FAIL_IF_ERROR( cond, ... ) FAIL_IF_ERR( cond, "x264", __VA_ARGS__ )
 
-bool Synchonize = true;
 bool useDemux = true;
 int DemuxMethod = 2;
 bool useCompressForRGB = false;
 
+// How depth leaves the server: the 8-bit DepthFrame/DepthIndex pair, one
+// 8 or 10 bit "Depth16" stream carrying 1 + (depth - DepthMin) / DepthStep
+// (0 = invalid, see DepthQuantizer::QuantizeFitted), or one 8-bit YUV444
+// "DepthPacked" stream using DepthStreamPacking. x264 encodes 8 or 10 bit
+// only, so the sensor's full range is lossless only through DepthPacked.
+enum { DepthStreamSplit = 0, DepthStreamHighBitDepth = 1, DepthStreamPacked = 2 };
+int DepthStreamMode = DepthStreamSplit;
+int DepthStreamBitDepth = 10;
+int DepthStreamQP = 0; // 0 is lossless
+int DepthStreamPacking = DepthPackingTriangle;
+
+// How color is registered onto the depth grid: every color pixel scattered to
+// its depth position, or every depth pixel gathering its color bilinearly
+enum { RegistrationColorScatter = 0, RegistrationDepthGather = 1 };
+int RegistrationMode = RegistrationDepthGather;
+
+// Threads sharing the registration and decimation of a frame, 0 for one per core
+int RegistrationThreads = 0;
+
+// Color pixels used by the scatter, every n-th of every n-th row; the holes
+// left in the depth grid are filled from neighbors on the same surface
+int RegistrationColorStride = 1;
+
+// Back the capture side's frame buffers with huge pages when the system allows
+// it (on Windows the account needs the "Lock pages in memory" right)
+int FrameArenaHugePages = 0;
+
+// YUV conversion of the color stream; the encoder signals the same matrix and
+// range in the VUI so decoders convert back correctly
+int ColorStreamMatrix = ColorMatrixBT601;
+int ColorStreamRange = ColorRangeLimited;
+
+// Picture format of the color stream. 4:2:0 halves the samples to encode;
+// NV12 is x264's internal 4:2:0 layout, so it skips the encoder's own copy
+enum { ColorFormatI420 = 0, ColorFormatNV12 = 1, ColorFormatI444 = 2 };
+int ColorStreamFormat = ColorFormatI444;
+
+// Colored point cloud sent with every frame as a POINTCLOUD message, with
+// float meters or int16 millimeters (half the bytes) for positions
+enum { PointCloudOff = 0, PointCloudFloat32 = 1, PointCloudInt16 = 2 };
+int PointCloudMode = PointCloudOff;
+
+// Reduction for clients that can't take every depth sample (DecimationMethod).
+// The depth streams shrink by DecimationFactor on each side with stride or
+// median; the point cloud can also be thinned that way, or reduced to one
+// point per VoxelSize millimeter voxel
+int DepthDecimation = DecimationNone;
+int PointCloudDecimation = DecimationNone;
+int DecimationFactor = 2;
+int VoxelSize = 10;
+
+// Temporal denoising of depth before it is quantized (TemporalFilterMode): a
+// running average taking TemporalFilterWeight percent of each new reading, or
+// the median of the last TemporalFilterHistory readings. A pixel that changes
+// by more than TemporalFilterThreshold mm at 1 m (scaled with depth) is moving
+// and passes through unfiltered
+int TemporalFilter = TemporalFilterOff;
+int TemporalFilterWeight = 25;
+int TemporalFilterHistory = 3;
+int TemporalFilterThreshold = 20;
+
+// Spatial cleanup of depth ahead of the temporal filter (SpatialFilterMode):
+// speckle and flying pixel removal with small hole filling, optionally
+// followed by the edge-preserving bilateral filter. Neighbors within
+// SpatialFilterThreshold mm at 1 m (scaled with depth) are on the same
+// surface. A frame over SpatialFilterBudget ms (0 for none) drops the
+// bilateral filter for a while
+int SpatialFilter = SpatialFilterOff;
+int SpatialFilterThreshold = 20;
+int SpatialFilterBudget = 0;
+
+// Region of interest: only the RoiWidth x RoiHeight pixels at RoiX, RoiY of
+// the depth grid are encoded (0 size for the whole frame), and only depth
+// between DepthGateNear and DepthGateFar mm (0 for the sensor's reliable
+// range) is kept; color outside the gate is blanked. Streams carry the
+// offsets as RoiX/RoiY metadata
+int RoiX = 0;
+int RoiY = 0;
+int RoiWidth = 0;
+int RoiHeight = 0;
+int DepthGateNear = 0;
+int DepthGateFar = 0;
+
+// Messages a client may fall behind by before its backlog is dropped and it
+// resyncs on the next keyframes
+int ClientQueueDepth = 8;
+
+// Complete frames waiting for the encoder; 1 is latest-wins, more trades
+// latency for fewer dropped frames (up to FrameExchange::MaxQueueDepth)
+int FrameQueueDepth = 1;
+
+// Frames between per-stream encoded/dropped/sent reports, 0 for none
+int StatisticsInterval = 300;
+
+// Bitrate budgets in kbit/s for the depth streams together and for the
+// color stream, 0 for constant quality. A budgeted stream is capped CRF
+// (VBV), and every RateControlInterval frames the caps are scaled to what
+// the slowest client's link delivers. Lossless Depth16 (CQP) is never capped.
+int DepthBitrate = 0;
+int ColorBitrate = 0;
+int RateControlInterval = 10;
+
+// File the raw depth and color frames are recorded to, empty for none
+std::string RecordFile;
+
+// Where frames come from: the Kinect, a synthetic scene, or PlaybackFile as
+// written by --record. Without a sensor the nominal intrinsics stand in for
+// its coordinate mapper. SourceRealTime paces frames at their timestamps,
+// otherwise they come as fast as the pipeline takes them; SourceFrames
+// stops after that many frames (0 for a single pass or, synthetic, forever)
+enum { SourceKinect = 0, SourceSynthetic = 1, SourcePlayback = 2 };
+int SourceMode = SourceKinect;
+std::string PlaybackFile;
+int SourceRealTime = 1;
+int SourceFrames = 0;
+
+// Per-frame latency tracing: off, or p50/p99/p99.9 of every stage since the
+// acquire in the statistics reports, or that plus the capture time in each
+// message's igtl header timestamp and, with v2 headers, the stage times in
+// its metadata. The metadata changes every frame, so embedding repacks
+// the video message framing per frame.
+enum { LatencyTraceOff = 0, LatencyTraceReport = 1, LatencyTraceEmbed = 2 };
+int LatencyTraceMode = LatencyTraceOff;
+
 void* ThreadFunction(void* ptr);
+void* StreamEncoderThread(void* ptr);
+void* ClientControlThread(void* ptr);
 int   SendVideoData(igtl::Socket::Pointer& socket, igtl::VideoMessage::Pointer& videoMsg);
 namespace DepthImageServerX264 {
   
@@ -104,15 +244,31 @@ namespace DepthImageServerX264 {
     int       iPicHeight;            ///< luma picture height in y coordinate
     long long uiTimeStamp;           ///< timestamp of the source picture, unit: millisecond
   } SSourcePicture;
+  // Pictures of one captured frame, plus the depth range they were quantized with
+  enum { FrameDepthFrame = 0, FrameDepthIndex, FrameColor, FrameDepth16, FrameDepthPacked, FramePictureCount };
+  typedef struct {
+    x264_picture_t pictures[FramePictureCount];
+    const char* depthPacking;
+    int depthMin;
+    int depthMax;
+    double depthStep;       // millimeters per Depth16 code
+    // back-projected cloud, pointCount 0 while it is off or the rays are unknown
+    int pointCount;
+    void* pointPositions;
+    unsigned char* pointColors;
+    double pointSeconds;    // time spent back-projecting
+    double filterSeconds;   // time spent in the temporal depth filter
+    double spatialSeconds;  // time spent in the spatial depth filter
+    int spatialLevel;       // SpatialFilterMode the frame got within the budget
+    FrameTrace trace;       // capture side stamps, the encoders add theirs to a copy
+  } FrameSlot;
+
   typedef struct {
     igtl::MutexLock::Pointer glock;
     int   stop;
     int   portNum;
-    x264_picture_t pic_DepthFrame;
-    x264_picture_t pic_DepthIndex;
-    x264_picture_t pic_Color;
-    bool transmissionFinished;
-    igtl::ConditionVariable::Pointer conditionVar;
+    FrameSlot slots[FrameExchange::SlotCount];
+    FrameExchange exchange;
   } ThreadDataServer;
   typedef struct {
     int   nloop;
@@ -122,7 +278,42 @@ namespace DepthImageServerX264 {
     int   stop;
     bool  useCompression;
     ThreadDataServer* td_Server;
+    ClientBroadcaster* broadcaster;
+    LatencyRecorder* latency;   // NULL while LatencyTraceMode is off
   } ThreadData;
+
+  // Frame hand-off between ThreadFunction and the per-stream encoder workers
+  typedef struct {
+    igtl::SimpleMutexLock* lock;
+    igtl::ConditionVariable::Pointer frameReady;
+    igtl::ConditionVariable::Pointer streamsDone;
+    int   frame;
+    int   slot;
+    int   pending;
+    bool  stop;
+  } EncoderStage;
+
+  // pictures an encoder may hold before its output goes untraced
+  enum { TraceHistory = 64 };
+  typedef struct {
+    x264_t* encoder;
+    int   pictureIndex;   // into FrameSlot::pictures
+    std::string name;
+    int   width;
+    int   height;
+    int   lastFrame;
+    int   keyframeGeneration;
+    VideoFrameSender sender;
+    std::string metaData;   // metadata the sender's message currently carries
+    EncoderStage* stage;
+    ThreadData* td;
+    int   budget;           // VBV max rate in kbit/s the stream opened with, 0 if uncapped
+    int   bitrate;          // rate control's current share of it
+    int   appliedBitrate;   // what the encoder runs at
+    // traces of the pictures inside the encoder, by frame number; x264
+    // hands the frame number back in pic_out.opaque with the delayed output
+    FrameTrace traces[TraceHistory];
+  } StreamEncoder;
 }
 typedef struct {
   int b_progress;
@@ -131,6 +322,7 @@ typedef struct {
   FILE *tcfile_out;
   double timebase_convert_multiplier;
   int i_pulldown;
+  const char *profile;
 } cli_opt_t;
 
 typedef struct
@@ -303,56 +495,431 @@ static int parse_enum_value( const char *arg, const char * const *names, int *ds
 }
 static int parse( int argc, char **argv, x264_param_t *param, cli_opt_t *opt )
 {
-  const char *demuxer = demuxer_names[0];
-  char *output_filename = NULL;
-  const char *muxer = muxer_names[0];
-  x264_param_t defaults;
-  char *profile = NULL;
-  char *vid_filters = NULL;
-  int b_thread_input = 0;
   int b_turbo = 1;
-  int b_user_ref = 0;
-  int b_user_fps = 0;
-  int b_user_interlaced = 0;
   char *preset = NULL;
   char *tune = NULL;
-  
-  x264_param_default( &defaults );
-  int output_csp = defaults.i_csp;
+
+  memset( opt, 0, sizeof(cli_opt_t) );
   opt->b_progress = 1;
-  
+
+  /* Presets are applied before all other options. */
+  for( int i = 1; i < argc; i++ )
+  {
+    if( !strcmp( argv[i], "--preset" ) && i + 1 < argc )
+      preset = argv[++i];
+    else if( !strcmp( argv[i], "--tune" ) && i + 1 < argc )
+      tune = argv[++i];
+  }
+
   if( preset && !strcmp( preset, "placebo" ) )
     b_turbo = 0;
-  
+
   if( x264_param_default_preset( param, preset, tune ) < 0 )
+  {
+    x264_cli_log( "x264", X264_LOG_ERROR, "invalid preset '%s' or tune '%s'\n", preset ? preset : "", tune ? tune : "" );
     return -1;
-  
+  }
+
+  /* Everything else goes through x264's own option parser; a value-less
+   * option ("--sliced-threads", "--no-cabac") is a flag. */
+  for( int i = 1; i < argc; i++ )
+  {
+    if( strncmp( argv[i], "--", 2 ) )
+    {
+      x264_cli_log( "x264", X264_LOG_ERROR, "unexpected argument '%s'\n", argv[i] );
+      return -1;
+    }
+    const char *name = argv[i] + 2;
+    const char *value = ( i + 1 < argc && strncmp( argv[i+1], "--", 2 ) ) ? argv[++i] : NULL;
+    if( !strcmp( name, "preset" ) || !strcmp( name, "tune" ) )
+      continue;
+    if( !strcmp( name, "profile" ) )
+    {
+      opt->profile = value;
+      continue;
+    }
+    int ret = x264_param_parse( param, name, value );
+    if( ret == X264_PARAM_BAD_NAME )
+    {
+      x264_cli_log( "x264", X264_LOG_ERROR, "invalid option '%s'\n", name );
+      return -1;
+    }
+    if( ret == X264_PARAM_BAD_VALUE )
+    {
+      x264_cli_log( "x264", X264_LOG_ERROR, "invalid argument: %s = %s\n", name, value ? value : "(null)" );
+      return -1;
+    }
+  }
+
   /* If first pass mode is used, apply faster settings. */
   if( b_turbo )
     x264_param_apply_fastfirstpass( param );
-  
-  /* Apply profile restrictions. */
-  if( x264_param_apply_profile( param, profile ) < 0 )
+
+  /* Profile restrictions depend on the stream's colorspace and bit depth, which
+   * the caller sets after parsing; it applies opt->profile itself. */
+  return 0;
+}
+
+//------------------------------------------------------------
+// Encoder configuration
+//
+// Options are x264 CLI long options without the leading "--". Options under
+// "default" apply to every stream; options under a stream name (DepthFrame,
+// DepthIndex, Depth16, DepthPacked, ColorFrame) are applied after them.
+// Sources, later ones win:
+//   - the built-in defaults below
+//   - --encoder-profile <name>          a named profile, see EncoderProfiles
+//   - --encoder-config <file>           "[Stream]" sections of "option = value"
+//   - --<option> [value]                all streams
+//   - --<Stream>.<option> [value]       one stream
+//
+// Server options, not passed to x264:
+//   - --depth-stream split|depth16|packed  DepthStreamMode
+//   - --depth-packing split|gray|triangle  DepthStreamPacking
+//   - --depth-bitdepth 8|10             DepthStreamBitDepth
+//   - --depth-qp <n>                    DepthStreamQP
+//   - --registration scatter|gather     RegistrationMode
+//   - --registration-threads <n>        RegistrationThreads
+//   - --color-stride <n>                RegistrationColorStride
+//   - --huge-pages [0|1]                FrameArenaHugePages
+//   - --color-matrix bt601|bt709        ColorStreamMatrix
+//   - --color-range limited|full        ColorStreamRange
+//   - --color-format i420|nv12|i444     ColorStreamFormat
+//   - --point-cloud off|float|int16     PointCloudMode
+//   - --depth-decimation none|stride|median          DepthDecimation
+//   - --point-cloud-decimation none|stride|median|voxel  PointCloudDecimation
+//   - --decimation-factor <n>           DecimationFactor
+//   - --voxel-size <mm>                 VoxelSize
+//   - --temporal-filter off|average|median  TemporalFilter
+//   - --temporal-weight <percent>       TemporalFilterWeight
+//   - --temporal-history <n>            TemporalFilterHistory
+//   - --temporal-threshold <mm>         TemporalFilterThreshold
+//   - --spatial-filter off|speckle|bilateral  SpatialFilter
+//   - --spatial-threshold <mm>          SpatialFilterThreshold
+//   - --spatial-budget <ms>             SpatialFilterBudget
+//   - --roi <x>,<y>,<width>,<height>    RoiX, RoiY, RoiWidth, RoiHeight
+//   - --depth-gate <near>,<far>         DepthGateNear, DepthGateFar
+//   - --frame-queue <n>                 FrameQueueDepth
+//   - --client-queue <n>                ClientQueueDepth
+//   - --stats-interval <frames>         StatisticsInterval
+//   - --depth-bitrate <kbps>            DepthBitrate
+//   - --color-bitrate <kbps>            ColorBitrate
+//   - --rate-interval <frames>          RateControlInterval
+//   - --record <file>                   RecordFile
+//   - --source kinect|synthetic|playback  SourceMode
+//   - --playback-file <file>            PlaybackFile
+//   - --source-pace recorded|fast       SourceRealTime
+//   - --source-frames <n>               SourceFrames
+//   - --latency-trace off|report|embed  LatencyTraceMode
+//
+// "ultra-low-latency": ultrafast preset with zerolatency tune, sliced threads
+// so a frame is split across cores instead of pipelined, no B-frames and no
+// lookahead (no frames buffered inside the encoder), and periodic intra
+// refresh every 30 frames instead of IDR frames so no single frame spikes
+// the bitrate. Expect roughly twice the bitrate of "medium" at equal quality.
+typedef std::vector<std::pair<std::string, std::string> > EncoderOptionList;
+std::map<std::string, EncoderOptionList> EncoderOptions;
+
+static const char * const EncoderProfiles[][2] =
+{
+  { "ultra-low-latency", "preset=ultrafast tune=zerolatency sliced-threads rc-lookahead=0 sync-lookahead=0 bframes=0 keyint=30 intra-refresh threads=0" },
+  { "balanced", "preset=veryfast tune=zerolatency rc-lookahead=0 bframes=0 keyint=60" },
+  { 0, 0 }
+};
+
+static void AddEncoderOption( const std::string& stream, const std::string& name, const std::string& value )
+{
+  EncoderOptions[stream].push_back( std::make_pair( name, value ) );
+}
+
+int LoadEncoderProfile( const std::string& name )
+{
+  for( int i = 0; EncoderProfiles[i][0]; i++ )
+  {
+    if( name != EncoderProfiles[i][0] )
+      continue;
+    std::istringstream options( EncoderProfiles[i][1] );
+    std::string option;
+    while( options >> option )
+    {
+      size_t eq = option.find( '=' );
+      AddEncoderOption( "default", option.substr( 0, eq ), eq == std::string::npos ? "" : option.substr( eq + 1 ) );
+    }
+    return 0;
+  }
+  x264_cli_log( "x264", X264_LOG_ERROR, "unknown encoder profile '%s'\n", name.c_str() );
+  return -1;
+}
+
+static std::string TrimOption( const std::string& text )
+{
+  size_t first = text.find_first_not_of( " \t\r" );
+  if( first == std::string::npos )
+    return "";
+  size_t last = text.find_last_not_of( " \t\r" );
+  return text.substr( first, last - first + 1 );
+}
+
+int LoadEncoderConfigFile( const char* filename )
+{
+  std::ifstream file( filename );
+  if( !file )
+  {
+    x264_cli_log( "x264", X264_LOG_ERROR, "cannot open encoder config '%s'\n", filename );
     return -1;
-  /* if the user never specified the output range and the input is now rgb, default it to pc */
+  }
+  std::string section = "default";
+  std::string line;
+  while( std::getline( file, line ) )
+  {
+    line = TrimOption( line.substr( 0, line.find( '#' ) ) );
+    if( line.empty() )
+      continue;
+    if( line[0] == '[' && line[line.size() - 1] == ']' )
+    {
+      section = TrimOption( line.substr( 1, line.size() - 2 ) );
+      continue;
+    }
+    size_t eq = line.find( '=' );
+    if( eq == std::string::npos )
+      AddEncoderOption( section, line, "" );
+    else
+      AddEncoderOption( section, TrimOption( line.substr( 0, eq ) ), TrimOption( line.substr( eq + 1 ) ) );
+  }
+  return 0;
+}
+
+int ParseEncoderArguments( int argc, char **argv )
+{
+  for( int i = 1; i < argc; i++ )
+  {
+    if( strncmp( argv[i], "--", 2 ) )
+      continue;
+    std::string name = argv[i] + 2;
+    std::string value = ( i + 1 < argc && strncmp( argv[i+1], "--", 2 ) ) ? argv[++i] : "";
+    if( name == "encoder-profile" )
+    {
+      if( LoadEncoderProfile( value ) < 0 )
+        return -1;
+    }
+    else if( name == "encoder-config" )
+    {
+      if( LoadEncoderConfigFile( value.c_str() ) < 0 )
+        return -1;
+    }
+    else if( name == "depth-stream" )
+      DepthStreamMode = value == "depth16" ? DepthStreamHighBitDepth : value == "packed" ? DepthStreamPacked : DepthStreamSplit;
+    else if( name == "depth-packing" )
+      DepthStreamPacking = value == "split" ? DepthPackingSplit : value == "gray" ? DepthPackingGray : DepthPackingTriangle;
+    else if( name == "depth-bitdepth" )
+    {
+      DepthStreamBitDepth = atoi( value.c_str() );
+      if( DepthStreamBitDepth != 8 && DepthStreamBitDepth != 10 )
+      {
+        x264_cli_log( "x264", X264_LOG_ERROR, "depth-bitdepth must be 8 or 10, not '%s'\n", value.c_str() );
+        return -1;
+      }
+    }
+    else if( name == "depth-qp" )
+    {
+      DepthStreamQP = atoi( value.c_str() );
+      DepthStreamQP = DepthStreamQP < 0 ? 0 : DepthStreamQP;
+    }
+    else if( name == "registration" )
+      RegistrationMode = value == "scatter" ? RegistrationColorScatter : RegistrationDepthGather;
+    else if( name == "registration-threads" )
+      RegistrationThreads = atoi( value.c_str() );
+    else if( name == "color-stride" )
+      RegistrationColorStride = atoi( value.c_str() );
+    else if( name == "huge-pages" )
+      FrameArenaHugePages = value.empty() ? 1 : atoi( value.c_str() );
+    else if( name == "color-matrix" )
+      ColorStreamMatrix = value == "bt709" ? ColorMatrixBT709 : ColorMatrixBT601;
+    else if( name == "color-range" )
+      ColorStreamRange = value == "full" ? ColorRangeFull : ColorRangeLimited;
+    else if( name == "color-format" )
+      ColorStreamFormat = value == "i420" ? ColorFormatI420 : value == "nv12" ? ColorFormatNV12 : ColorFormatI444;
+    else if( name == "point-cloud" )
+      PointCloudMode = value == "float" ? PointCloudFloat32 : value == "int16" ? PointCloudInt16 : PointCloudOff;
+    else if( name == "depth-decimation" )
+      DepthDecimation = value == "stride" ? DecimationStride : value == "median" ? DecimationMedian : DecimationNone;
+    else if( name == "point-cloud-decimation" )
+      PointCloudDecimation = value == "stride" ? DecimationStride : value == "median" ? DecimationMedian :
+                             value == "voxel" ? DecimationVoxel : DecimationNone;
+    else if( name == "decimation-factor" )
+      DecimationFactor = atoi( value.c_str() );
+    else if( name == "voxel-size" )
+      VoxelSize = atoi( value.c_str() );
+    else if( name == "temporal-filter" )
+      TemporalFilter = value == "average" ? TemporalFilterAverage : value == "median" ? TemporalFilterMedian : TemporalFilterOff;
+    else if( name == "temporal-weight" )
+      TemporalFilterWeight = atoi( value.c_str() );
+    else if( name == "temporal-history" )
+      TemporalFilterHistory = atoi( value.c_str() );
+    else if( name == "temporal-threshold" )
+      TemporalFilterThreshold = atoi( value.c_str() );
+    else if( name == "spatial-filter" )
+      SpatialFilter = value == "speckle" ? SpatialFilterSpeckle : value == "bilateral" ? SpatialFilterBilateral : SpatialFilterOff;
+    else if( name == "spatial-threshold" )
+      SpatialFilterThreshold = atoi( value.c_str() );
+    else if( name == "spatial-budget" )
+      SpatialFilterBudget = atoi( value.c_str() );
+    else if( name == "roi" )
+    {
+      if( sscanf( value.c_str(), "%d,%d,%d,%d", &RoiX, &RoiY, &RoiWidth, &RoiHeight ) != 4 )
+        RoiX = RoiY = RoiWidth = RoiHeight = 0;
+    }
+    else if( name == "depth-gate" )
+    {
+      if( sscanf( value.c_str(), "%d,%d", &DepthGateNear, &DepthGateFar ) != 2 )
+        DepthGateNear = DepthGateFar = 0;
+    }
+    else if( name == "frame-queue" )
+      FrameQueueDepth = atoi( value.c_str() );
+    else if( name == "client-queue" )
+      ClientQueueDepth = atoi( value.c_str() );
+    else if( name == "stats-interval" )
+      StatisticsInterval = atoi( value.c_str() );
+    else if( name == "depth-bitrate" )
+      DepthBitrate = atoi( value.c_str() );
+    else if( name == "color-bitrate" )
+      ColorBitrate = atoi( value.c_str() );
+    else if( name == "rate-interval" )
+      RateControlInterval = atoi( value.c_str() );
+    else if( name == "record" )
+      RecordFile = value;
+    else if( name == "source" )
+      SourceMode = value == "synthetic" ? SourceSynthetic : value == "playback" ? SourcePlayback : SourceKinect;
+    else if( name == "playback-file" )
+    {
+      PlaybackFile = value;
+      SourceMode = SourcePlayback;
+    }
+    else if( name == "source-pace" )
+      SourceRealTime = value == "fast" ? 0 : 1;
+    else if( name == "source-frames" )
+      SourceFrames = atoi( value.c_str() );
+    else if( name == "latency-trace" )
+      LatencyTraceMode = value == "embed" ? LatencyTraceEmbed : value == "report" ? LatencyTraceReport : LatencyTraceOff;
+    else
+    {
+      size_t dot = name.find( '.' );
+      if( dot == std::string::npos )
+        AddEncoderOption( "default", name, value );
+      else
+        AddEncoderOption( name.substr( 0, dot ), name.substr( dot + 1 ), value );
+    }
+  }
+  return 0;
+}
+
+/* The region of interest within a frameWidth x frameHeight frame: clamped to
+ * it, with even offsets and sizes so 4:2:0 chroma stays aligned, or the whole
+ * frame when no region is set. */
+static void GetRegionOfInterest( int frameWidth, int frameHeight, int& x, int& y, int& width, int& height )
+{
+  if( RoiWidth <= 0 || RoiHeight <= 0 )
+  {
+    x = y = 0;
+    width = frameWidth;
+    height = frameHeight;
+    return;
+  }
+  x = X264_MAX( 0, X264_MIN( RoiX, frameWidth - 2 ) ) & ~1;
+  y = X264_MAX( 0, X264_MIN( RoiY, frameHeight - 2 ) ) & ~1;
+  width = X264_MAX( 2, X264_MIN( RoiWidth, frameWidth - x ) & ~1 );
+  height = X264_MAX( 2, X264_MIN( RoiHeight, frameHeight - y ) & ~1 );
+}
+
+/* A quarter second of VBV buffer: enough for a keyframe or intra refresh
+ * column, small enough that a stalled link backs the encoder off quickly. */
+static int GetVbvBufferSize( int kbps )
+{
+  return X264_MAX( kbps / 4, 1 );
+}
+
+/* Cap a stream at kbps; the options come before "default" and the stream's
+ * own section, so the configuration can still override them. */
+static void AddRateOptions( EncoderOptionList& options, int kbps )
+{
+  std::ostringstream maxRate, bufferSize;
+  maxRate << kbps;
+  bufferSize << GetVbvBufferSize( kbps );
+  options.push_back( std::make_pair( std::string("vbv-maxrate"), maxRate.str() ) );
+  options.push_back( std::make_pair( std::string("vbv-bufsize"), bufferSize.str() ) );
+}
+
+/* Build the x264 argument list for one stream: built-in base options, then
+ * "default", then the stream's own section. */
+static void BuildEncoderArguments( const std::string& stream, const EncoderOptionList& base, std::vector<std::string>& args )
+{
+  args.clear();
+  args.push_back( "" );
+  const EncoderOptionList* lists[3] = { &base, &EncoderOptions["default"], &EncoderOptions[stream] };
+  for( int l = 0; l < 3; l++ )
+  {
+    for( size_t i = 0; i < lists[l]->size(); i++ )
+    {
+      args.push_back( "--" + (*lists[l])[i].first );
+      if( !(*lists[l])[i].second.empty() )
+        args.push_back( (*lists[l])[i].second );
+    }
+  }
+}
+
+/* Open the encoder for one stream. Geometry, colorspace and bit depth come from
+ * the picture the stream encodes; everything else from the configuration. */
+static x264_t* OpenStreamEncoder( const std::string& stream, const EncoderOptionList& base, x264_picture_t* pic,
+                                  int width, int height, int bitDepth, x264_param_t *param, cli_opt_t *opt )
+{
+  std::vector<std::string> args;
+  BuildEncoderArguments( stream, base, args );
+  std::vector<char*> argv;
+  for( size_t i = 0; i < args.size(); i++ )
+    argv.push_back( &args[i][0] );
+
+  if( parse( (int)argv.size(), &argv[0], param, opt ) < 0 )
+  {
+    x264_cli_log( "x264", X264_LOG_ERROR, "bad encoder configuration for %s\n", stream.c_str() );
+    return NULL;
+  }
+  param->i_width  = width;
+  param->i_height = height;
+  param->b_vfr_input = 0;
+  param->b_repeat_headers = 1;
+  param->b_annexb = 1;
+  param->i_csp = pic->img.i_csp & X264_CSP_MASK;
+#if X264_BUILD >= 153
+  param->i_bitdepth = bitDepth;
+#endif
+  /* Apply profile restrictions. 8 bit 4:2:0 defaults to high, which hardware
+   * decoders support, unless it is lossless; everything else needs high444. */
   int csp = param->i_csp & X264_CSP_MASK;
+  bool lossless = param->rc.i_rc_method == X264_RC_CQP && param->rc.i_qp_constant <= 0;
+  const char *defaultProfile = ( csp == X264_CSP_I420 || csp == X264_CSP_NV12 ) && bitDepth == 8 && !lossless ? "high" : "high444";
+  if( x264_param_apply_profile( param, opt->profile ? opt->profile : defaultProfile ) < 0 )
+    return NULL;
+  /* if the user never specified the output range and the input is now rgb, default it to pc */
   if( csp >= X264_CSP_BGR && csp <= X264_CSP_RGB )
   {
       param->vui.b_fullrange = RANGE_PC;
   }
- 
-  return 0;
+  /* the color stream is converted by ColorConverter; signal what it produced */
+  if( stream == "ColorFrame" )
+  {
+    param->vui.i_colmatrix = ColorStreamMatrix == ColorMatrixBT709 ? 1 : 6; /* bt709 : smpte170m */
+    param->vui.b_fullrange = ColorStreamRange == ColorRangeFull ? RANGE_PC : RANGE_TV;
+  }
+  return x264_encoder_open( param );
 }
+
 std::string     videoFile = "";
 
 void ServerControl(void * ptr)
 {
   //------------------------------------------------------------
-  // Parse Arguments
- 
-  int    port     = 18944;
-  
-  igtl::MutexLock::Pointer glock = igtl::MutexLock::New();
+  // One encoder pipeline for all clients; each accepted client gets a
+  // control thread here and a sender thread in the broadcaster
   igtl::MultiThreader::Pointer threader = igtl::MultiThreader::New();
   igtl::MultiThreader::ThreadInfo* info =
   static_cast<igtl::MultiThreader::ThreadInfo*>(ptr);
@@ -360,113 +927,283 @@ void ServerControl(void * ptr)
   //int id      = info->ThreadID;
   //int nThread = info->NumberOfThreads;
   DepthImageServerX264::ThreadData* td = static_cast<DepthImageServerX264::ThreadData*>(info->UserData);
+  int    port     = td->td_Server->portNum;
+
+  ClientBroadcaster broadcaster(ClientQueueDepth);
+  LatencyRecorder latency;
+  td->broadcaster = &broadcaster;
+  td->latency     = LatencyTraceMode != LatencyTraceOff ? &latency : NULL;
+  broadcaster.SetLatencyRecorder(td->latency);
+  td->glock       = igtl::MutexLock::New();
+  td->socket      = NULL;
+  int encoderThreadID = threader->SpawnThread((igtl::ThreadFunctionType) &ThreadFunction, td);
 
-  threader->SpawnThread((igtl::ThreadFunctionType) &ThreadFunction, td);
-  while(1);
-  {
-    igtl::Sleep(10000);
-  }
-  
   igtl::ServerSocket::Pointer serverSocket;
   serverSocket = igtl::ServerSocket::New();
   int r = serverSocket->CreateServer(port);
-  
+
   if (r < 0)
   {
     std::cerr << "Cannot create a server socket." << std::endl;
     exit(0);
   }
-  while(1){
+  std::list<std::pair<ClientBroadcaster::Client*, int> > clients;
+  while (!td->stop)
+  {
     //------------------------------------------------------------
     // Waiting for Connection
-    int threadID = -1;
     igtl::Socket::Pointer socket;
     socket = serverSocket->WaitForConnection(1000);
-    
+
     if (socket.IsNotNull()) // if client connected
     {
       std::cerr << "A client is connected." << std::endl;
-      
-      // Create a message buffer to receive header
-      igtl::MessageHeader::Pointer headerMsg;
-      headerMsg = igtl::MessageHeader::New();
-      //------------------------------------------------------------
-      // loop
-      for (;;)
+      ClientBroadcaster::Client* client = broadcaster.Connect(socket);
+      int threadID = threader->SpawnThread((igtl::ThreadFunctionType) &ClientControlThread, client);
+      clients.push_back(std::make_pair(client, threadID));
+    }
+
+    // Reap clients whose control thread has finished
+    for (std::list<std::pair<ClientBroadcaster::Client*, int> >::iterator it = clients.begin(); it != clients.end();)
+    {
+      if (broadcaster.IsHungUp(it->first))
       {
-        // Initialize receive buffer
-        headerMsg->InitPack();
-        
-        // Receive generic header from the socket
-        int rs = socket->Receive(headerMsg->GetPackPointer(), headerMsg->GetPackSize());
-        if (rs == 0)
-        {
-          if (threadID >= 0)
-          {
-            td->stop = 1;
-            threader->TerminateThread(threadID);
-            threadID = -1;
-          }
-          std::cerr << "Disconnecting the client." << std::endl;
-          td->socket = NULL;  // VERY IMPORTANT. Completely remove the instance.
-          socket->CloseSocket();
-          break;
-        }
-        if (rs != headerMsg->GetPackSize())
-        {
-          continue;
-        }
-        
-        // Deserialize the header
-        headerMsg->Unpack();
-        
-        // Check data type and receive data body
-        if (strcmp(headerMsg->GetDeviceType(), "STT_VIDEO") == 0)
+        threader->TerminateThread(it->second);
+        broadcaster.Disconnect(it->first);
+        it = clients.erase(it);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+  }
+
+  // Shutting down: the encoder thread has been woken through the frame
+  // exchange and joins its stream workers before it returns; then hang up
+  // each client, whose control thread sees it at its next Receive() timeout
+  threader->TerminateThread(encoderThreadID);
+  for (std::list<std::pair<ClientBroadcaster::Client*, int> >::iterator it = clients.begin(); it != clients.end(); ++it)
+  {
+    broadcaster.HangUp(it->first);
+    threader->TerminateThread(it->second);
+    broadcaster.Disconnect(it->first);
+  }
+  serverSocket->CloseSocket();
+  td->broadcaster = NULL;
+  td->latency = NULL;
+}
+
+void* ClientControlThread(void* ptr)
+{
+  //------------------------------------------------------------
+  // Start/stop requests of one client; frames reach it through its sender thread
+  igtl::MultiThreader::ThreadInfo* info =
+  static_cast<igtl::MultiThreader::ThreadInfo*>(ptr);
+  ClientBroadcaster::Client* client = static_cast<ClientBroadcaster::Client*>(info->UserData);
+  ClientBroadcaster* broadcaster = client->owner;
+  igtl::Socket::Pointer socket = client->socket;
+
+  // Create a message buffer to receive header
+  igtl::MessageHeader::Pointer headerMsg;
+  headerMsg = igtl::MessageHeader::New();
+  //------------------------------------------------------------
+  // loop
+  while (!broadcaster->IsHungUp(client))
+  {
+    // Initialize receive buffer
+    headerMsg->InitPack();
+
+    // Receive generic header from the socket; -1 is a timeout, see ClientBroadcaster::SocketTimeout
+    int rs = socket->Receive(headerMsg->GetPackPointer(), headerMsg->GetPackSize());
+    if (rs == 0)
+    {
+      std::cerr << "Disconnecting the client." << std::endl;
+      break;
+    }
+    if (rs != headerMsg->GetPackSize())
+    {
+      continue;
+    }
+
+    // Deserialize the header
+    headerMsg->Unpack();
+
+    // Check data type and receive data body
+    if (strcmp(headerMsg->GetDeviceType(), "STT_VIDEO") == 0)
+    {
+      std::cerr << "Received a STT_VIDEO message." << std::endl;
+
+      igtl::StartVideoDataMessage::Pointer startVideoMsg;
+      startVideoMsg = igtl::StartVideoDataMessage::New();
+      startVideoMsg->SetMessageHeader(headerMsg);
+      startVideoMsg->AllocatePack();
+
+      socket->Receive(startVideoMsg->GetPackBodyPointer(), startVideoMsg->GetPackBodySize());
+      int c = startVideoMsg->Unpack(1);
+      if (c & igtl::MessageHeader::UNPACK_BODY) // if CRC check is OK
+      {
+        // every client shares the same encoders, so resolution and
+        // compression requests are not per client
+        broadcaster->Subscribe(client);
+      }
+    }
+    else if (strcmp(headerMsg->GetDeviceType(), "STP_VIDEO") == 0)
+    {
+      socket->Skip(headerMsg->GetBodySizeToRead(), 0);
+      std::cerr << "Received a STP_VIDEO message." << std::endl;
+      std::cerr << "Disconnecting the client." << std::endl;
+      break;
+    }
+    else
+    {
+      std::cerr << "Receiving : " << headerMsg->GetDeviceType() << std::endl;
+      socket->Skip(headerMsg->GetBodySizeToRead(), 0);
+    }
+  }
+  broadcaster->HangUp(client);
+  return NULL;
+}
+
+void* StreamEncoderThread(void* ptr)
+{
+  //------------------------------------------------------------
+  // One encoder per stream; sends as soon as its own NALs are ready
+  igtl::MultiThreader::ThreadInfo* info =
+  static_cast<igtl::MultiThreader::ThreadInfo*>(ptr);
+  DepthImageServerX264::StreamEncoder* stream = static_cast<DepthImageServerX264::StreamEncoder*>(info->UserData);
+  DepthImageServerX264::EncoderStage* stage = stream->stage;
+  DepthImageServerX264::ThreadData* td = stream->td;
+  x264_picture_t pic_out;
+  x264_nal_t *nal;
+  int i_nal;
+
+  for (;;)
+  {
+    stage->lock->Lock();
+    while (stage->frame == stream->lastFrame && !stage->stop)
+      stage->frameReady->Wait(stage->lock);
+    if (stage->stop)
+    {
+      stage->lock->Unlock();
+      break;
+    }
+    stream->lastFrame = stage->frame;
+    DepthImageServerX264::FrameSlot* slot = &td->td_Server->slots[stage->slot];
+    stage->lock->Unlock();
+
+    // new or resyncing clients can only join a stream at a keyframe
+    x264_picture_t* picture = &slot->pictures[stream->pictureIndex];
+    if (stream->bitrate != stream->appliedBitrate)
+    {
+      // x264 only changes the VBV rates in place when it was opened with VBV
+      x264_param_t param;
+      x264_encoder_parameters(stream->encoder, &param);
+      param.rc.i_vbv_max_bitrate = stream->bitrate;
+      param.rc.i_vbv_buffer_size = GetVbvBufferSize(stream->bitrate);
+      if (x264_encoder_reconfig(stream->encoder, &param) < 0)
+        stream->bitrate = stream->appliedBitrate;
+      stream->appliedBitrate = stream->bitrate;
+    }
+    if (td->broadcaster->TakeKeyframeRequest(stream->keyframeGeneration))
+      picture->i_type = X264_TYPE_IDR;
+    else
+      picture->i_type = X264_TYPE_AUTO;
+    FrameTrace& inputTrace = stream->traces[stream->lastFrame % DepthImageServerX264::TraceHistory];
+    inputTrace = slot->trace;
+    inputTrace.frame = stream->lastFrame;
+    picture->opaque = reinterpret_cast<void*>(static_cast<intptr_t>(stream->lastFrame));
+    std::chrono::steady_clock::time_point encodeStart = std::chrono::steady_clock::now();
+    int i_frame_size = x264_encoder_encode(stream->encoder, &nal, &i_nal, picture, &pic_out);
+    std::chrono::steady_clock::time_point encodeEnd = std::chrono::steady_clock::now();
+    double encodeSeconds = std::chrono::duration<double>(encodeEnd - encodeStart).count();
+    inputTrace.stamps[TraceEncodeStart] = LatencyRecorder::ToStamp(encodeStart);
+    if (i_frame_size > 0)
+    {
+      // the output may be an earlier picture; one that fell out of the
+      // history goes untraced
+      int outputFrame = static_cast<int>(reinterpret_cast<intptr_t>(pic_out.opaque));
+      FrameTrace trace = stream->traces[outputFrame % DepthImageServerX264::TraceHistory];
+      if (trace.frame != outputFrame)
+        trace.stamps[TraceAcquire] = 0;
+      trace.stamps[TraceEncodeEnd] = LatencyRecorder::ToStamp(encodeEnd);
+      // The stream's message is reused; it only has to be repacked when its metadata changes
+      igtl::VideoMessage* videoMsg = stream->sender.GetMessage();
+#if OpenIGTLink_HEADER_VERSION >= 2
+      if (stream->pictureIndex == DepthImageServerX264::FrameDepth16)
+      {
+        // Receivers turn codes back into millimeters as DepthMin + (code - 1) * DepthStep
+        std::ostringstream depthMin, depthStep, depthBitDepth;
+        depthMin << slot->depthMin;
+        depthStep << std::setprecision(10) << slot->depthStep;
+        depthBitDepth << DepthStreamBitDepth;
+        std::string metaData = depthMin.str() + "/" + depthStep.str() + "/" + depthBitDepth.str();
+        if (stream->metaData != metaData)
         {
-          std::cerr << "Received a STT_VIDEO message." << std::endl;
-          
-          igtl::StartVideoDataMessage::Pointer startVideoMsg;
-          startVideoMsg = igtl::StartVideoDataMessage::New();
-          startVideoMsg->SetMessageHeader(headerMsg);
-          startVideoMsg->AllocatePack();
-          
-          socket->Receive(startVideoMsg->GetPackBodyPointer(), startVideoMsg->GetPackBodySize());
-          int c = startVideoMsg->Unpack(1);
-          if (c & igtl::MessageHeader::UNPACK_BODY) // if CRC check is OK
-          {
-            td->interval = startVideoMsg->GetResolution();
-            td->glock    = glock;
-            td->socket   = socket;
-            td->stop     = 0;
-            td->useCompression = startVideoMsg->GetUseCompress();
-            threadID    = threader->SpawnThread((igtl::ThreadFunctionType) &ThreadFunction, &td);
-          }
+          stream->metaData = metaData;
+          videoMsg->SetHeaderVersion(IGTL_HEADER_VERSION_2);
+          videoMsg->SetMetaDataElement("DepthMin", IANA_TYPE_US_ASCII, depthMin.str());
+          videoMsg->SetMetaDataElement("DepthStep", IANA_TYPE_US_ASCII, depthStep.str());
+          videoMsg->SetMetaDataElement("DepthBitDepth", IANA_TYPE_US_ASCII, depthBitDepth.str());
+          stream->sender.Invalidate();
         }
-        else if (strcmp(headerMsg->GetDeviceType(), "STP_VIDEO") == 0)
+      }
+      else if (stream->pictureIndex == DepthImageServerX264::FrameDepthPacked)
+      {
+        // The decoder needs the scheme and max code (DepthMax - DepthMin + 1)
+        std::ostringstream depthMin, depthMax;
+        depthMin << slot->depthMin;
+        depthMax << slot->depthMax;
+        std::string packing(slot->depthPacking);
+        std::string metaData = depthMin.str() + "/" + depthMax.str() + "/" + packing;
+        if (stream->metaData != metaData)
         {
-          socket->Skip(headerMsg->GetBodySizeToRead(), 0);
-          std::cerr << "Received a STP_VIDEO message." << std::endl;
-          if (threadID >= 0)
-          {
-            td->stop  = 1;
-            threader->TerminateThread(threadID);
-            threadID = -1;
-            std::cerr << "Disconnecting the client." << std::endl;
-            td->socket = NULL;  // VERY IMPORTANT. Completely remove the instance.
-            socket->CloseSocket();
-          }
-          break;
+          stream->metaData = metaData;
+          videoMsg->SetHeaderVersion(IGTL_HEADER_VERSION_2);
+          videoMsg->SetMetaDataElement("DepthMin", IANA_TYPE_US_ASCII, depthMin.str());
+          videoMsg->SetMetaDataElement("DepthMax", IANA_TYPE_US_ASCII, depthMax.str());
+          videoMsg->SetMetaDataElement("DepthPacking", IANA_TYPE_US_ASCII, packing);
+          stream->sender.Invalidate();
         }
-        else
+      }
+      if (LatencyTraceMode == LatencyTraceEmbed && trace.stamps[TraceAcquire] != 0)
+      {
+        // microseconds since the acquire, whose wall clock time is the header timestamp
+        const int stages[] = { TraceDepth, TraceColor, TraceEncodeStart, TraceEncodeEnd };
+        const char* const names[] = { "LatencyDepth", "LatencyColor", "LatencyEncodeStart", "LatencyEncodeEnd" };
+        videoMsg->SetHeaderVersion(IGTL_HEADER_VERSION_2);
+        for (int i = 0; i < 4; i++)
         {
-          std::cerr << "Receiving : " << headerMsg->GetDeviceType() << std::endl;
-          socket->Skip(headerMsg->GetBodySizeToRead(), 0);
+          std::ostringstream us;
+          us << trace.stamps[stages[i]] - trace.stamps[TraceAcquire];
+          videoMsg->SetMetaDataElement(names[i], IANA_TYPE_US_ASCII, us.str());
         }
+        stream->sender.Invalidate();
       }
+#endif
+      // x264 keeps the payloads of all NALs of a frame contiguous. The
+      // message is framed once and shared by every client's queue.
+      VideoPayload payload = { nal[0].p_payload, i_frame_size };
+      std::shared_ptr<BroadcastPacket> packet(new BroadcastPacket);
+      packet->stream = stream->name;
+      packet->keyframe = pic_out.b_keyframe != 0;
+      td->broadcaster->CountEncoded(stream->name, i_frame_size, encodeSeconds);
+      stream->sender.Serialize(&payload, 1, packet->bytes);
+      if (LatencyTraceMode == LatencyTraceEmbed)
+        LatencyRecorder::PutTimeStamp(trace, packet->bytes);
+      trace.stamps[TracePack] = LatencyRecorder::Now();
+      packet->trace = trace;
+      if (td->latency)
+        td->latency->Record(stream->name, trace, TracePack);
+      td->broadcaster->Broadcast(packet);
     }
-      //memcpy(pYUVBuf, yuvImg.data, bufLen*sizeof(unsigned char));
-      //fwrite(pYUVBuf, bufLen*sizeof(unsigned char), 1, pFileOut);
+
+    stage->lock->Lock();
+    if (--stage->pending == 0)
+      stage->streamsDone->Signal();
+    stage->lock->Unlock();
   }
+  return NULL;
 }
 
 void* ThreadFunction(void* ptr)
@@ -482,39 +1219,31 @@ void* ThreadFunction(void* ptr)
   
   //------------------------------------------------------------
   // Get user data
-  igtl::MutexLock::Pointer glock = td->glock;
   long interval = td->interval;
   std::cerr << "Interval = " << interval << " (ms)" << std::endl;
   //long interval = 1000;
   //long interval = (id + 1) * 100; // (ms)
   
-  igtl::Socket::Pointer& socket = td->socket;
-  
   //------------------------------------------------------------
   // Allocate TrackingData Message Class
   //
   // NOTE: TrackingDataElement class instances are allocated
   //       before the loop starts to avoid reallocation
   //       in each image transfer.
-  int picWidth = 512, picHeight = 424;
+  // the streams cover the region of interest; the depth streams carry its decimated planes
+  int roiX, roiY, picWidth, picHeight;
+  GetRegionOfInterest(512, 424, roiX, roiY, picWidth, picHeight);
+  int depthWidth = picWidth, depthHeight = picHeight;
+  if (DepthDecimation != DecimationNone)
+  {
+    depthWidth = DepthDecimator::GetDecimatedSize(picWidth, DecimationFactor);
+    depthHeight = DepthDecimator::GetDecimatedSize(picHeight, DecimationFactor);
+  }
   x264_param_t param;
-  x264_picture_t pic_out;
-  x264_nal_t *nal;
-  int i_nal;
-  x264_param_default_preset( &param, "medium", NULL );
   cli_opt_t opt;
   x264_t *h_DepthFrame = NULL;
   x264_t *h_DepthIndex= NULL;
   x264_t *h_ColorFrame = NULL;
-  
-  param.i_width  = picWidth;
-  param.i_height = picHeight;
-  param.b_vfr_input = 0;
-  param.b_repeat_headers = 1;
-  param.b_annexb = 1;
-  x264_param_apply_profile( &param, "high444" );
-  int argc = 7;
-  char *argv[7] = {"","--qp","0","--crf","24", "--tune", "zerolatency"};
   const cli_pulldown_t *pulldown = NULL; // shut up gcc
   
   int     i_frame = 0;
@@ -524,32 +1253,198 @@ void* ThreadFunction(void* ptr)
   int64_t second_largest_pts = -1;
   int64_t ticks_per_frame;
   double  pulldown_pts = 0;
-  
+
+  // Built-in base options, overridden by EncoderOptions
+  EncoderOptionList baseOptions;
+  baseOptions.push_back( std::make_pair( std::string("tune"), std::string("zerolatency") ) );
+  baseOptions.push_back( std::make_pair( std::string("crf"), std::string("24") ) );
+
+  x264_t* h[3];
+  int pictureIndex[3];
+  std::string frameNames[3];
+  int nStreams = 0;
+  // all slots share colorspace and strides, so the first one configures the encoders
+  DepthImageServerX264::FrameSlot* firstSlot = &td->td_Server->slots[0];
+  if (DepthStreamMode == DepthStreamHighBitDepth)
+  {
+#if X264_BUILD >= 153
+    // Single 4:0:0 stream at 8/10 bit; CQP 0 with high444 is lossless in codes
+    std::ostringstream qp;
+    qp << DepthStreamQP;
+    EncoderOptionList depth16Options = baseOptions;
+    depth16Options.push_back( std::make_pair( std::string("qp"), qp.str() ) );
+    h_DepthFrame = OpenStreamEncoder("Depth16", depth16Options, &firstSlot->pictures[DepthImageServerX264::FrameDepth16], depthWidth, depthHeight, DepthStreamBitDepth, &param, &opt);
+    h[nStreams] = h_DepthFrame;
+    pictureIndex[nStreams] = DepthImageServerX264::FrameDepth16;
+    frameNames[nStreams++] = "Depth16";
+#else
+    std::cerr << "x264 build " << X264_BUILD << " has no runtime bit depth, using split depth streams." << std::endl;
+    DepthStreamMode = DepthStreamSplit;
+#endif
+  }
+  // a split depth budget goes half to each plane
+  EncoderOptionList depthOptions = baseOptions;
+  if (DepthBitrate > 0)
+    AddRateOptions( depthOptions, DepthStreamMode == DepthStreamSplit ? X264_MAX( DepthBitrate / 2, 1 ) : DepthBitrate );
+  EncoderOptionList colorOptions = baseOptions;
+  if (ColorBitrate > 0)
+    AddRateOptions( colorOptions, ColorBitrate );
+  if (DepthStreamMode == DepthStreamPacked)
+  {
+    h_DepthFrame = OpenStreamEncoder("DepthPacked", depthOptions, &firstSlot->pictures[DepthImageServerX264::FrameDepthPacked], depthWidth, depthHeight, 8, &param, &opt);
+    h[nStreams] = h_DepthFrame;
+    pictureIndex[nStreams] = DepthImageServerX264::FrameDepthPacked;
+    frameNames[nStreams++] = "DepthPacked";
+  }
+  if (DepthStreamMode == DepthStreamSplit)
+  {
+    h_DepthFrame = OpenStreamEncoder("DepthFrame", depthOptions, &firstSlot->pictures[DepthImageServerX264::FrameDepthFrame], depthWidth, depthHeight, 8, &param, &opt);
+    h_DepthIndex = OpenStreamEncoder("DepthIndex", depthOptions, &firstSlot->pictures[DepthImageServerX264::FrameDepthIndex], depthWidth, depthHeight, 8, &param, &opt);
+    h[nStreams] = h_DepthFrame;
+    pictureIndex[nStreams] = DepthImageServerX264::FrameDepthFrame;
+    frameNames[nStreams++] = "DepthFrame";
+    h[nStreams] = h_DepthIndex;
+    pictureIndex[nStreams] = DepthImageServerX264::FrameDepthIndex;
+    frameNames[nStreams++] = "DepthIndex";
+  }
+  // the color stream is opened last, so param/opt below describe it
+  h_ColorFrame = OpenStreamEncoder("ColorFrame", colorOptions, &firstSlot->pictures[DepthImageServerX264::FrameColor], picWidth, picHeight, 8, &param, &opt);
+  h[nStreams] = h_ColorFrame;
+  pictureIndex[nStreams] = DepthImageServerX264::FrameColor;
+  frameNames[nStreams++] = "ColorFrame";
   opt.b_progress &= param.i_log_level < X264_LOG_DEBUG;
 
-  parse( argc, argv, &param, &opt ) ;
-  param.rc.i_rc_method = 0;
-  param.i_csp = X264_CSP_BGR;
-  h_DepthFrame = x264_encoder_open(&param);
-  h_DepthIndex = x264_encoder_open(&param);
-  h_ColorFrame = x264_encoder_open(&param);
-  x264_t* h[3] = {h_DepthFrame,h_DepthIndex, h_ColorFrame};
-  x264_picture_t* pictureGroup[3] = {&td->td_Server->pic_DepthFrame,&td->td_Server->pic_DepthIndex, &td->td_Server->pic_Color};
+  bool encodersOpen = true;
+  for (int i = 0; i < nStreams; i++)
+  {
+    if (!h[i])
+    {
+      std::cerr << "Cannot open the " << frameNames[i] << " encoder." << std::endl;
+      encodersOpen = false;
+    }
+  }
+  if (!encodersOpen)
+  {
+    for (int i = 0; i < nStreams; i++)
+    {
+      if (h[i])
+        x264_encoder_close(h[i]);
+    }
+    return NULL;
+  }
   //x264_encoder_parameters(h_DepthFrame, &param);
   //x264_encoder_parameters(h_DepthIndex, &param);
   //x264_encoder_parameters(h_ColorFrame, &param);
   ticks_per_frame = (int64_t)param.i_timebase_den * param.i_fps_den / param.i_timebase_num / param.i_fps_num;
   ticks_per_frame = X264_MAX( ticks_per_frame, 1 );
+
+  DepthImageServerX264::EncoderStage stage;
+  stage.lock = new igtl::SimpleMutexLock;
+  stage.frameReady = igtl::ConditionVariable::New();
+  stage.streamsDone = igtl::ConditionVariable::New();
+  stage.frame = -1;
+  stage.slot = 0;
+  stage.pending = 0;
+  stage.stop = false;
+  igtl::MultiThreader::Pointer encoderThreader = igtl::MultiThreader::New();
+  DepthImageServerX264::StreamEncoder streams[3];
+  int streamThreadID[3];
+  for (int i = 0; i < nStreams; i++)
+  {
+    streams[i].encoder = h[i];
+    streams[i].pictureIndex = pictureIndex[i];
+    streams[i].name = frameNames[i];
+    bool isColor = pictureIndex[i] == DepthImageServerX264::FrameColor;
+    streams[i].width = isColor ? picWidth : depthWidth;
+    streams[i].height = isColor ? picHeight : depthHeight;
+    streams[i].lastFrame = -1;
+    streams[i].keyframeGeneration = 0;
+    // whatever VBV rate the stream ended up with is its budget
+    x264_param_t streamParam;
+    x264_encoder_parameters(h[i], &streamParam);
+    streams[i].budget = streamParam.rc.i_rc_method != X264_RC_CQP ? streamParam.rc.i_vbv_max_bitrate : 0;
+    streams[i].bitrate = streams[i].budget;
+    streams[i].appliedBitrate = streams[i].budget;
+    for (int j = 0; j < DepthImageServerX264::TraceHistory; j++)
+    {
+      memset(&streams[i].traces[j], 0, sizeof(FrameTrace));
+      streams[i].traces[j].frame = -1;
+    }
+    streams[i].sender.Initialize(frameNames[i], streams[i].width, streams[i].height);
+#if OpenIGTLink_HEADER_VERSION >= 2
+    if (picWidth != 512 || picHeight != 424)
+    {
+      // where the cropped pictures sit in the sensor's 512x424 depth grid
+      std::ostringstream offsetX, offsetY;
+      offsetX << roiX;
+      offsetY << roiY;
+      igtl::VideoMessage* videoMsg = streams[i].sender.GetMessage();
+      videoMsg->SetHeaderVersion(IGTL_HEADER_VERSION_2);
+      videoMsg->SetMetaDataElement("RoiX", IANA_TYPE_US_ASCII, offsetX.str());
+      videoMsg->SetMetaDataElement("RoiY", IANA_TYPE_US_ASCII, offsetY.str());
+    }
+#endif
+    streams[i].stage = &stage;
+    streams[i].td = td;
+    streamThreadID[i] = encoderThreader->SpawnThread((igtl::ThreadFunctionType) &StreamEncoderThread, &streams[i]);
+  }
+
+  // One target for all capped streams, shared out by their budgets. The
+  // uncapped streams and the point cloud stay out of the link samples: a
+  // link they saturate must not push the capped streams to their minimum
+  // while they keep going at full rate
+  int totalBudget = 0;
+  int cappedStreams = 0;
+  for (int i = 0; i < nStreams; i++)
+  {
+    totalBudget += streams[i].budget;
+    if (streams[i].budget > 0)
+      cappedStreams++;
+    else
+      td->broadcaster->ExcludeFromLink(frameNames[i]);
+  }
+  td->broadcaster->ExcludeFromLink("PointCloud");
+  BitrateController rateController(totalBudget, cappedStreams);
+  std::chrono::steady_clock::time_point rateSampleStart = std::chrono::steady_clock::now();
+
+  int exchangeDropped = 0;
+  long long cloudPoints = 0;
+  double filterSeconds = 0;
+  double spatialSeconds = 0;
+  int spatialReduced = 0;
   while (!td->stop)
   {
+    // Next queued frame (the newest one at depth 1); capture keeps writing into another slot
+    int slot = td->td_Server->exchange.Acquire();
+    if (slot < 0)
+      break;
+    int published = 0, dropped = 0;
+    td->td_Server->exchange.GetCounts(published, dropped);
+    for (int i = 0; i < nStreams; i++)
+      td->broadcaster->CountDropped(frameNames[i], dropped - exchangeDropped);
+    if (PointCloudMode != PointCloudOff)
+      td->broadcaster->CountDropped("PointCloud", dropped - exchangeDropped);
+    exchangeDropped = dropped;
+    if (!td->broadcaster->HasSubscribers())
+    {
+      // nobody is watching; don't encode
+      continue;
+    }
+    filterSeconds += td->td_Server->slots[slot].filterSeconds;
+    spatialSeconds += td->td_Server->slots[slot].spatialSeconds;
+    if (td->td_Server->slots[slot].spatialLevel < SpatialFilter)
+      spatialReduced++;
+    x264_picture_t* pictureGroup[3];
+    for (int i = 0; i < nStreams; i++)
+      pictureGroup[i] = &td->td_Server->slots[slot].pictures[pictureIndex[i]];
     if (!param.b_vfr_input)
     {
-      for(int i = 0; i<3 ;i++)
+      for(int i = 0; i<nStreams ;i++)
         pictureGroup[i]->i_pts = i_frame;
     }
     if( opt.i_pulldown && !param.b_vfr_input )
     {
-      for (int i = 0; i < 3; i++)
+      for (int i = 0; i < nStreams; i++)
       {
         pictureGroup[i]->i_pic_struct = pulldown->pattern[i_frame % pulldown->mod];
         pictureGroup[i]->i_pts = (int64_t)(pulldown_pts + 0.5);
@@ -559,42 +1454,128 @@ void* ThreadFunction(void* ptr)
     }
     else if (opt.timebase_convert_multiplier)
     {
-      for (int i = 0; i < 3; i++)
+      for (int i = 0; i < nStreams; i++)
       {
         pictureGroup[i]->i_pts = (int64_t)(pictureGroup[i]->i_pts * opt.timebase_convert_multiplier + 0.5);
       }
     }
-    std::string frameNames[3] = { "DepthFrame", "DepthIndex","ColorFrame"};
-    for (int iMessage = 0; iMessage < 3; iMessage++)
+    // Publish the frame once, let every stream encode and send on its own
+    // worker, and wait for all of them before acquiring the next slot
+    stage.lock->Lock();
+    stage.frame = i_frame;
+    stage.slot = slot;
+    stage.pending = nStreams;
+    stage.frameReady->Broadcast();
+    stage.lock->Unlock();
+
+    // the point cloud needs no encoder; frame it while the streams encode
+    DepthImageServerX264::FrameSlot* cloudSlot = &td->td_Server->slots[slot];
+    if (PointCloudMode != PointCloudOff && cloudSlot->pointCount > 0)
+    {
+      PointFormat format = PointCloudMode == PointCloudInt16 ? PointFormatInt16 : PointFormatFloat32;
+      std::shared_ptr<BroadcastPacket> packet(new BroadcastPacket);
+      packet->stream = "PointCloud";
+      packet->keyframe = true;
+      PointCloudSender::Serialize("PointCloud", format, cloudSlot->pointCount,
+                                  cloudSlot->pointPositions, cloudSlot->pointColors, packet->bytes);
+      if (LatencyTraceMode == LatencyTraceEmbed)
+        LatencyRecorder::PutTimeStamp(cloudSlot->trace, packet->bytes);
+      packet->trace = cloudSlot->trace;
+      packet->trace.stamps[TracePack] = LatencyRecorder::Now();
+      if (td->latency)
+        td->latency->Record(packet->stream, packet->trace, TracePack);
+      td->broadcaster->CountEncoded(packet->stream, static_cast<int>(packet->bytes.size()), cloudSlot->pointSeconds);
+      td->broadcaster->Broadcast(packet);
+      cloudPoints += cloudSlot->pointCount;
+    }
+
+    stage.lock->Lock();
+    while (stage.pending > 0)
+      stage.streamsDone->Wait(stage.lock);
+    stage.lock->Unlock();
+    i_frame++;
+    if (totalBudget > 0 && RateControlInterval > 0 && i_frame % RateControlInterval == 0)
     {
-      int i_frame_size = x264_encoder_encode(h[iMessage], &nal, &i_nal, pictureGroup[iMessage], &pic_out);
-      if (i_frame_size > 0)
+      // the workers are idle until the next frame is published
+      LinkSample sample;
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      if (td->broadcaster->SampleLink(sample))
       {
-        igtl::VideoMessage::Pointer videoMsg;
-        videoMsg = igtl::VideoMessage::New();
-        videoMsg->SetDefaultBodyType("ColoredDepth");
-        videoMsg->SetDeviceName(frameNames[iMessage]);
-        videoMsg->SetBitStreamSize(picWidth*picHeight);
-        videoMsg->AllocateScalars();
-        videoMsg->SetScalarType(videoMsg->TYPE_UINT32);
-        videoMsg->SetEndian(igtl_is_little_endian() == 1 ? 2 : 1); //little endian is 2 big endian is 1
-        videoMsg->SetWidth(picWidth);
-        videoMsg->SetHeight(picHeight);
-        memcpy(videoMsg->GetPackFragmentPointer(2), nal[0].p_payload, i_frame_size);
-        videoMsg->Pack();
-        glock->Lock();
-        for (int i = 0; i < videoMsg->GetNumberOfPackFragments(); i++)
+        sample.seconds = std::chrono::duration<double>(now - rateSampleStart).count();
+        rateController.Update(sample);
+        for (int i = 0; i < nStreams; i++)
         {
-          socket->Send(videoMsg->GetPackFragmentPointer(i), videoMsg->GetPackFragmentSize(i));
+          if (streams[i].budget > 0)
+            streams[i].bitrate = rateController.GetShare(streams[i].budget);
         }
-        glock->Unlock();
       }
+      rateSampleStart = now;
+    }
+    if (StatisticsInterval > 0 && i_frame % StatisticsInterval == 0)
+    {
+      for (int i = 0; i < nStreams; i++)
+      {
+        StreamStatistics statistics = td->broadcaster->GetStatistics(frameNames[i]);
+        int encoded = statistics.encoded > 0 ? statistics.encoded : 1;
+        std::cerr << frameNames[i] << ": " << statistics.encoded << " encoded, "
+                  << statistics.dropped << " dropped, " << statistics.sent << " sent, "
+                  << 1000.0 * statistics.encodeSeconds / encoded << " ms and "
+                  << statistics.bytes / 1024.0 / encoded << " KiB per frame." << std::endl;
+      }
+      if (PointCloudMode != PointCloudOff)
+      {
+        StreamStatistics statistics = td->broadcaster->GetStatistics("PointCloud");
+        int encoded = statistics.encoded > 0 ? statistics.encoded : 1;
+        double seconds = statistics.encodeSeconds > 0 ? statistics.encodeSeconds : 1;
+        std::cerr << "PointCloud: " << statistics.encoded << " built, "
+                  << statistics.dropped << " dropped, " << statistics.sent << " sent, "
+                  << cloudPoints / encoded << " points and "
+                  << statistics.bytes / 1024.0 / encoded << " KiB per frame, "
+                  << cloudPoints / seconds / 1e6 << " Mpoints/s back-projected." << std::endl;
+      }
+      if (td->latency)
+      {
+        // since the last report; ms since the acquire, p50/p99/p99.9
+        std::vector<std::string> traced(frameNames, frameNames + nStreams);
+        if (PointCloudMode != PointCloudOff)
+          traced.push_back("PointCloud");
+        for (size_t i = 0; i < traced.size(); i++)
+        {
+          std::cerr << traced[i] << " latency (ms p50/p99/p99.9):";
+          for (int stage = TraceDepth; stage < TraceStageCount; stage++)
+          {
+            LatencySummary summary = td->latency->GetSummary(traced[i], stage);
+            if (summary.count > 0)
+              std::cerr << " " << LatencyRecorder::GetStageName(stage) << " " << summary.p50 / 1000.0 << "/"
+                        << summary.p99 / 1000.0 << "/" << summary.p999 / 1000.0;
+          }
+          std::cerr << std::endl;
+        }
+        td->latency->Clear();
+      }
+      if (totalBudget > 0)
+        std::cerr << "Rate control: " << rateController.GetTarget() << " of "
+                  << totalBudget << " kbit/s." << std::endl;
+      if (TemporalFilter != TemporalFilterOff)
+        std::cerr << "Temporal filter: " << 1000.0 * filterSeconds / i_frame << " ms per frame." << std::endl;
+      if (SpatialFilter != SpatialFilterOff)
+        std::cerr << "Spatial filter: " << 1000.0 * spatialSeconds / i_frame << " ms per frame, "
+                  << spatialReduced << " frames without the bilateral filter." << std::endl;
     }
-    i_frame++;
-    td->td_Server->transmissionFinished = true;
-    td->td_Server->conditionVar->Signal();
   }
-  x264_encoder_close(h_DepthIndex);
+
+  stage.lock->Lock();
+  stage.stop = true;
+  stage.frameReady->Broadcast();
+  stage.lock->Unlock();
+  for (int i = 0; i < nStreams; i++)
+  {
+    encoderThreader->TerminateThread(streamThreadID[i]);
+  }
+  delete stage.lock;
+
+  if (h_DepthIndex)
+    x264_encoder_close(h_DepthIndex);
   x264_encoder_close(h_DepthFrame);
   x264_encoder_close(h_ColorFrame);
   return NULL;
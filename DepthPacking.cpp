@@ -0,0 +1,324 @@
+//------------------------------------------------------------------------------
+// DepthPacking.cpp
+//------------------------------------------------------------------------------
+
+#include <string.h>
+#include "SimdSupport.h"
+#include "DepthPacking.h"
+
+namespace
+{
+    const uint8_t cNeutralChroma = 128;
+
+    // largest code Split holds: U = 0 marks invalid, so the high byte + 1 stops at 255
+    const uint16_t cSplitMaxCode = 255 * 256;
+
+    inline uint16_t ClampCode(int code, uint16_t nMaxCode)
+    {
+        return static_cast<uint16_t>(code < 0 ? 0 : (code > nMaxCode ? nMaxCode : code));
+    }
+
+#if DEPTH_SIMD_X86
+    /// <summary>
+    /// Narrow two vectors of 16 words (each <= 255) to 32 bytes in order
+    /// </summary>
+    DEPTH_TARGET_AVX2
+    inline void StorePacked(uint8_t* pOut, __m256i a, __m256i b)
+    {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(pOut),
+            _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8));
+    }
+#endif
+
+    //--------------------------------------------------------------------------
+    // Split: the legacy intensity/index pair in Y and U. Cheap, but the wrapped
+    // low byte in Y has a hard edge every 256 codes. Codes above cSplitMaxCode
+    // are packed as cSplitMaxCode.
+    //--------------------------------------------------------------------------
+    class SplitDepthPacker : public DepthPacker
+    {
+    public:
+        DepthPackingScheme GetScheme() const { return DepthPackingSplit; }
+        const char* GetName() const { return "Split"; }
+
+        void Pack(const uint16_t* pCode, int nPixels, uint16_t /* nMaxCode */, uint8_t* pY, uint8_t* pU, uint8_t* pV) const
+        {
+            int i = 0;
+#if DEPTH_SIMD_X86
+            if (SimdSupport::HasAVX2())
+            {
+                i = PackAVX2(pCode, nPixels, pY, pU);
+            }
+#endif
+            for (; i < nPixels; ++i)
+            {
+                uint16_t code = pCode[i];
+                int offset = (code > cSplitMaxCode ? cSplitMaxCode : code) - 1;
+                pY[i] = static_cast<uint8_t>(code ? (offset & 0xFF) : 0);
+                pU[i] = static_cast<uint8_t>(code ? (((offset >> 8) + 1) & 0xFF) : 0);
+            }
+            memset(pV, cNeutralChroma, nPixels);
+        }
+
+        void Unpack(const uint8_t* pY, const uint8_t* pU, const uint8_t* /* pV */, int nPixels, uint16_t nMaxCode, uint16_t* pCode) const
+        {
+            for (int i = 0; i < nPixels; ++i)
+            {
+                pCode[i] = pU[i] ? ClampCode((pU[i] - 1) * 256 + pY[i] + 1, nMaxCode) : 0;
+            }
+        }
+
+    private:
+#if DEPTH_SIMD_X86
+        DEPTH_TARGET_AVX2
+        static int PackAVX2(const uint16_t* pCode, int nPixels, uint8_t* pY, uint8_t* pU)
+        {
+            const __m256i lowByte = _mm256_set1_epi16(0x00FF);
+            const __m256i one = _mm256_set1_epi16(1);
+            const __m256i zero = _mm256_setzero_si256();
+            const __m256i maxCode = _mm256_set1_epi16(static_cast<short>(cSplitMaxCode));
+
+            int i = 0;
+            for (; i + 32 <= nPixels; i += 32)
+            {
+                __m256i y[2];
+                __m256i u[2];
+                for (int half = 0; half < 2; ++half)
+                {
+                    __m256i code = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pCode + i + 16 * half));
+                    __m256i invalid = _mm256_cmpeq_epi16(code, zero);
+                    __m256i offset = _mm256_sub_epi16(_mm256_min_epu16(code, maxCode), one);
+                    y[half] = _mm256_andnot_si256(invalid, _mm256_and_si256(offset, lowByte));
+                    u[half] = _mm256_andnot_si256(invalid, _mm256_and_si256(_mm256_add_epi16(_mm256_srli_epi16(offset, 8), one), lowByte));
+                }
+                StorePacked(pY + i, y[0], y[1]);
+                StorePacked(pU + i, u[0], u[1]);
+            }
+            return i;
+        }
+#endif
+    };
+
+    //--------------------------------------------------------------------------
+    // Gray: base-256 reflected Gray code. The low byte runs backwards on odd
+    // high bytes, so U is continuous; Y is the high byte stretched over 0-255
+    // so codec noise must exceed half a step before it flips a digit.
+    //--------------------------------------------------------------------------
+    class GrayDepthPacker : public DepthPacker
+    {
+    public:
+        DepthPackingScheme GetScheme() const { return DepthPackingGray; }
+        const char* GetName() const { return "Gray"; }
+
+        void Pack(const uint16_t* pCode, int nPixels, uint16_t nMaxCode, uint8_t* pY, uint8_t* pU, uint8_t* pV) const
+        {
+            int nStep = Step(nMaxCode);
+            int i = 0;
+#if DEPTH_SIMD_X86
+            if (SimdSupport::HasAVX2())
+            {
+                i = PackAVX2(pCode, nPixels, nStep, pY, pU);
+            }
+#endif
+            for (; i < nPixels; ++i)
+            {
+                int high = pCode[i] >> 8;
+                int low = pCode[i] & 0xFF;
+                pY[i] = static_cast<uint8_t>(high * nStep);
+                pU[i] = static_cast<uint8_t>((high & 1) ? (low ^ 0xFF) : low);
+            }
+            memset(pV, cNeutralChroma, nPixels);
+        }
+
+        void Unpack(const uint8_t* pY, const uint8_t* pU, const uint8_t* /* pV */, int nPixels, uint16_t nMaxCode, uint16_t* pCode) const
+        {
+            int nStep = Step(nMaxCode);
+            for (int i = 0; i < nPixels; ++i)
+            {
+                int high = (pY[i] + nStep / 2) / nStep;
+                int low = (high & 1) ? (pU[i] ^ 0xFF) : pU[i];
+                pCode[i] = ClampCode(high * 256 + low, nMaxCode);
+            }
+        }
+
+    private:
+        static int Step(uint16_t nMaxCode)
+        {
+            int nHighMax = nMaxCode >> 8;
+            return nHighMax ? 255 / nHighMax : 255;
+        }
+
+#if DEPTH_SIMD_X86
+        DEPTH_TARGET_AVX2
+        static int PackAVX2(const uint16_t* pCode, int nPixels, int nStep, uint8_t* pY, uint8_t* pU)
+        {
+            const __m256i lowByte = _mm256_set1_epi16(0x00FF);
+            const __m256i one = _mm256_set1_epi16(1);
+            const __m256i step = _mm256_set1_epi16(static_cast<short>(nStep));
+            const __m256i zero = _mm256_setzero_si256();
+
+            int i = 0;
+            for (; i + 32 <= nPixels; i += 32)
+            {
+                __m256i y[2];
+                __m256i u[2];
+                for (int half = 0; half < 2; ++half)
+                {
+                    __m256i code = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pCode + i + 16 * half));
+                    __m256i high = _mm256_srli_epi16(code, 8);
+                    __m256i reflect = _mm256_and_si256(_mm256_sub_epi16(zero, _mm256_and_si256(high, one)), lowByte);
+                    y[half] = _mm256_mullo_epi16(high, step);
+                    u[half] = _mm256_xor_si256(_mm256_and_si256(code, lowByte), reflect);
+                }
+                StorePacked(pY + i, y[0], y[1]);
+                StorePacked(pU + i, u[0], u[1]);
+            }
+            return i;
+        }
+#endif
+    };
+
+    //--------------------------------------------------------------------------
+    // Triangle: Y is a coarse ramp over the whole range; U and V are triangle
+    // waves of period p a quarter period apart. Y picks the quarter period,
+    // and within it whichever of U/V is away from its fold gives the fine
+    // position. All three planes are smooth, so H.264 errors stay small.
+    // p is 512 codes (lossless for ranges below 4096) and doubles as needed,
+    // dropping a low bit of U/V each time; valid codes below one such step
+    // are packed as one step so they do not decode as invalid 0.
+    //--------------------------------------------------------------------------
+    class TriangleDepthPacker : public DepthPacker
+    {
+    public:
+        DepthPackingScheme GetScheme() const { return DepthPackingTriangle; }
+        const char* GetName() const { return "Triangle"; }
+
+        void Pack(const uint16_t* pCode, int nPixels, uint16_t nMaxCode, uint8_t* pY, uint8_t* pU, uint8_t* pV) const
+        {
+            int nShift = Shift(nMaxCode);
+            int nPeriod = 512 << nShift;
+            uint16_t nRamp = Ramp(nMaxCode);
+            int i = 0;
+#if DEPTH_SIMD_X86
+            if (SimdSupport::HasAVX2())
+            {
+                i = PackAVX2(pCode, nPixels, nShift, nRamp, pY, pU, pV);
+            }
+#endif
+            for (; i < nPixels; ++i)
+            {
+                int code = pCode[i];
+                code = code && code < (1 << nShift) ? 1 << nShift : code;
+                pY[i] = static_cast<uint8_t>((code * nRamp) >> 16);
+                pU[i] = static_cast<uint8_t>(Triangle(code & (nPeriod - 1), nPeriod) >> nShift);
+                pV[i] = static_cast<uint8_t>(Triangle((code - nPeriod / 4) & (nPeriod - 1), nPeriod) >> nShift);
+            }
+        }
+
+        void Unpack(const uint8_t* pY, const uint8_t* pU, const uint8_t* pV, int nPixels, uint16_t nMaxCode, uint16_t* pCode) const
+        {
+            int nShift = Shift(nMaxCode);
+            int nPeriod = 512 << nShift;
+            int nQuarter = nPeriod / 4;
+            int nInvalid = ((1 << nShift) + 1) / 2;
+            uint16_t nRamp = Ramp(nMaxCode);
+            for (int i = 0; i < nPixels; ++i)
+            {
+                // centre of the Y bin, then the nearest quarter-period point
+                int coarse = static_cast<int>(((2 * pY[i] + 1) * 65536LL) / (2 * nRamp));
+                int quarter = (coarse + nQuarter / 2) / nQuarter;
+                int centre = quarter * nQuarter;
+
+                // U folds on even quarters and V on odd ones; use the other one
+                bool bUseV = (quarter & 1) == 0;
+                int phase = bUseV ? ((centre - nQuarter) & (nPeriod - 1)) : (centre & (nPeriod - 1));
+                int centreValue = Triangle(phase, nPeriod) >> nShift;
+                int value = bUseV ? pV[i] : pU[i];
+                int delta = (value - centreValue) * (1 << nShift);
+                int code = phase < nPeriod / 2 ? centre + delta : centre - delta;
+
+                // valid codes were packed as at least one step, so anything
+                // below half a step (below 1 when lossless) was invalid
+                pCode[i] = code < nInvalid ? 0 : ClampCode(code, nMaxCode);
+            }
+        }
+
+    private:
+        static int Triangle(int t, int nPeriod)
+        {
+            return t < nPeriod / 2 ? t : nPeriod - 1 - t;
+        }
+
+        static int Shift(uint16_t nMaxCode)
+        {
+            int nShift = 0;
+            while (nMaxCode >= (4096 << nShift))
+            {
+                ++nShift;
+            }
+            return nShift;
+        }
+
+        // 16.16 multiplier taking [0, nMaxCode] onto [0, 255]
+        static uint16_t Ramp(uint16_t nMaxCode)
+        {
+            int nRange = nMaxCode < 256 ? 256 : nMaxCode;
+            return static_cast<uint16_t>((255 * 65536) / nRange);
+        }
+
+#if DEPTH_SIMD_X86
+        DEPTH_TARGET_AVX2
+        static int PackAVX2(const uint16_t* pCode, int nPixels, int nShift, uint16_t nRamp, uint8_t* pY, uint8_t* pU, uint8_t* pV)
+        {
+            int nPeriod = 512 << nShift;
+            const __m256i ramp = _mm256_set1_epi16(static_cast<short>(nRamp));
+            const __m256i periodMask = _mm256_set1_epi16(static_cast<short>(nPeriod - 1));
+            const __m256i quarter = _mm256_set1_epi16(static_cast<short>(nPeriod / 4));
+            const __m128i shift = _mm_cvtsi32_si128(nShift);
+            const __m256i step = _mm256_set1_epi16(static_cast<short>(1 << nShift));
+            const __m256i zero = _mm256_setzero_si256();
+
+            int i = 0;
+            for (; i + 32 <= nPixels; i += 32)
+            {
+                __m256i y[2];
+                __m256i u[2];
+                __m256i v[2];
+                for (int half = 0; half < 2; ++half)
+                {
+                    __m256i code = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pCode + i + 16 * half));
+                    code = _mm256_max_epu16(code, _mm256_andnot_si256(_mm256_cmpeq_epi16(code, zero), step));
+                    __m256i phaseU = _mm256_and_si256(code, periodMask);
+                    __m256i phaseV = _mm256_and_si256(_mm256_sub_epi16(code, quarter), periodMask);
+
+                    // triangle(t) = min(t, p - 1 - t)
+                    y[half] = _mm256_mulhi_epu16(code, ramp);
+                    u[half] = _mm256_srl_epi16(_mm256_min_epu16(phaseU, _mm256_sub_epi16(periodMask, phaseU)), shift);
+                    v[half] = _mm256_srl_epi16(_mm256_min_epu16(phaseV, _mm256_sub_epi16(periodMask, phaseV)), shift);
+                }
+                StorePacked(pY + i, y[0], y[1]);
+                StorePacked(pU + i, u[0], u[1]);
+                StorePacked(pV + i, v[0], v[1]);
+            }
+            return i;
+        }
+#endif
+    };
+}
+
+/// <summary>
+/// Create the packer for a scheme; the caller owns the result
+/// </summary>
+DepthPacker* DepthPacker::Create(DepthPackingScheme eScheme)
+{
+    switch (eScheme)
+    {
+        case DepthPackingGray:
+            return new GrayDepthPacker();
+        case DepthPackingTriangle:
+            return new TriangleDepthPacker();
+        case DepthPackingSplit:
+        default:
+            return new SplitDepthPacker();
+    }
+}
@@ -0,0 +1,64 @@
+//------------------------------------------------------------------------------
+// DepthPacking.h
+//------------------------------------------------------------------------------
+
+// Packs depth codes (depth - min + 1, 0 = invalid) into three 8-bit planes
+// of a YUV444 picture and back, with schemes that differ in how well they
+// survive lossy H.264 coding
+
+#pragma once
+
+#include <stdint.h>
+
+enum DepthPackingScheme
+{
+    DepthPackingSplit = 0,      // Y = (code-1)%256, U = (code-1)/256+1, as the DepthFrame/DepthIndex pair; codes above 65280 saturate
+    DepthPackingGray = 1,       // Y = scaled high byte, U = low byte reflected on odd high bytes
+    DepthPackingTriangle = 2    // Y = coarse linear ramp, U/V = two phase-shifted triangle waves
+};
+
+class DepthPacker
+{
+public:
+    /// <summary>
+    /// Destructor
+    /// </summary>
+    virtual ~DepthPacker() {}
+
+    /// <summary>
+    /// Scheme implemented by this packer
+    /// </summary>
+    virtual DepthPackingScheme GetScheme() const = 0;
+
+    /// <summary>
+    /// Name sent to receivers so they can pick the matching decoder
+    /// </summary>
+    virtual const char* GetName() const = 0;
+
+    /// <summary>
+    /// Pack depth codes into Y, U and V planes
+    /// </summary>
+    /// <param name="pCode">depth codes, 0 is invalid</param>
+    /// <param name="nPixels">number of samples</param>
+    /// <param name="nMaxCode">largest code that can occur (max - min + 1)</param>
+    /// <param name="pY">Y plane output</param>
+    /// <param name="pU">U plane output</param>
+    /// <param name="pV">V plane output</param>
+    virtual void Pack(const uint16_t* pCode, int nPixels, uint16_t nMaxCode, uint8_t* pY, uint8_t* pU, uint8_t* pV) const = 0;
+
+    /// <summary>
+    /// Recover depth codes from (possibly lossy) Y, U and V planes
+    /// </summary>
+    /// <param name="pY">Y plane</param>
+    /// <param name="pU">U plane</param>
+    /// <param name="pV">V plane</param>
+    /// <param name="nPixels">number of samples</param>
+    /// <param name="nMaxCode">largest code used when packing</param>
+    /// <param name="pCode">depth code output</param>
+    virtual void Unpack(const uint8_t* pY, const uint8_t* pU, const uint8_t* pV, int nPixels, uint16_t nMaxCode, uint16_t* pCode) const = 0;
+
+    /// <summary>
+    /// Create the packer for a scheme; the caller owns the result
+    /// </summary>
+    static DepthPacker* Create(DepthPackingScheme eScheme);
+};
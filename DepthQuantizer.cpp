@@ -0,0 +1,339 @@
+//------------------------------------------------------------------------------
+// DepthQuantizer.cpp
+//------------------------------------------------------------------------------
+
+#include <string.h>
+#include "SimdSupport.h"
+#include "DepthQuantizer.h"
+
+static const int cTableSize = 65536;
+
+/// <summary>
+/// Constructor
+/// </summary>
+DepthQuantizer::DepthQuantizer() :
+    m_nMinDepth(1),
+    m_nMaxDepth(0),
+    m_pTable(NULL)
+{
+    // An empty range (min > max) until SetRange is called: every sample is invalid
+    m_pTable = new uint16_t[cTableSize];
+    memset(m_pTable, 0, cTableSize * sizeof(uint16_t));
+}
+
+/// <summary>
+/// Destructor
+/// </summary>
+DepthQuantizer::~DepthQuantizer()
+{
+    delete[] m_pTable;
+    m_pTable = NULL;
+}
+
+/// <summary>
+/// Set the reliable depth range, rebuilding the lookup table only if it changed
+/// </summary>
+/// <param name="nMinDepth">minimum reliable depth</param>
+/// <param name="nMaxDepth">maximum reliable depth</param>
+void DepthQuantizer::SetRange(uint16_t nMinDepth, uint16_t nMaxDepth)
+{
+    if (nMinDepth == m_nMinDepth && nMaxDepth == m_nMaxDepth)
+    {
+        return;
+    }
+
+    m_nMinDepth = nMinDepth;
+    m_nMaxDepth = nMaxDepth;
+
+    for (int depth = 0; depth < cTableSize; ++depth)
+    {
+        uint16_t entry = 0;
+        if (depth >= nMinDepth && depth <= nMaxDepth)
+        {
+            int offset = depth - nMinDepth;
+            uint8_t intensity = static_cast<uint8_t>(offset % 256);
+            uint8_t index = static_cast<uint8_t>(offset / 256 + 1);
+            entry = static_cast<uint16_t>(intensity | (index << 8));
+        }
+        m_pTable[depth] = entry;
+    }
+}
+
+/// <summary>
+/// Quantize a depth buffer, picking the widest kernel this CPU supports
+/// </summary>
+void DepthQuantizer::Quantize(const uint16_t* pDepth, int nPixels, uint32_t* pPreview, uint8_t* pIntensity, uint8_t* pIndex) const
+{
+#if DEPTH_SIMD_X86
+    if (SimdSupport::HasAVX2())
+    {
+        QuantizeAVX2(pDepth, nPixels, pPreview, pIntensity, pIndex);
+        return;
+    }
+    if (SimdSupport::HasSSE41())
+    {
+        QuantizeSSE41(pDepth, nPixels, pPreview, pIntensity, pIndex);
+        return;
+    }
+#endif
+    QuantizeScalar(pDepth, nPixels, pPreview, pIntensity, pIndex);
+}
+
+/// <summary>
+/// Reference implementation using only the lookup table
+/// </summary>
+void DepthQuantizer::QuantizeScalar(const uint16_t* pDepth, int nPixels, uint32_t* pPreview, uint8_t* pIntensity, uint8_t* pIndex) const
+{
+    for (int i = 0; i < nPixels; ++i)
+    {
+        uint16_t entry = m_pTable[pDepth[i]];
+        uint8_t intensity = static_cast<uint8_t>(entry & 0xFF);
+        pIntensity[i] = intensity;
+        pIndex[i] = static_cast<uint8_t>(entry >> 8);
+        if (pPreview)
+        {
+            pPreview[i] = static_cast<uint32_t>(intensity) << 16;
+        }
+    }
+}
+
+/// <summary>
+/// Step of the fitted codes as a 16.16 multiplier on d-min: 65536 when the
+/// range fits the codes (always at 16 bit, where only 0-65535 saturates its
+/// top depth), else the largest one keeping max-min within 2^nBitDepth-2
+/// </summary>
+uint32_t DepthQuantizer::GetFittedScale(int nBitDepth) const
+{
+    uint32_t nRange = m_nMaxDepth > m_nMinDepth ? m_nMaxDepth - m_nMinDepth : 0;
+    uint32_t nMaxCode = (1u << nBitDepth) - 1;
+    if (nBitDepth >= 16 || nRange < nMaxCode)
+    {
+        return 65536;
+    }
+    return static_cast<uint32_t>((static_cast<uint64_t>(nMaxCode - 1) << 16) / nRange);
+}
+
+/// <summary>
+/// Millimeters per fitted code at nBitDepth for the current range
+/// </summary>
+double DepthQuantizer::GetFittedStep(int nBitDepth) const
+{
+    return 65536.0 / GetFittedScale(nBitDepth);
+}
+
+template <typename Code>
+void DepthQuantizer::QuantizeFittedScalar(const uint16_t* pDepth, int nPixels, uint32_t* pPreview, Code* pFitted, uint16_t nMaxCode, uint32_t nScale) const
+{
+    for (int i = 0; i < nPixels; ++i)
+    {
+        uint16_t depth = pDepth[i];
+        uint32_t code = 0;
+        if (depth >= m_nMinDepth && depth <= m_nMaxDepth)
+        {
+            uint32_t offset = depth - m_nMinDepth;
+            code = nScale >= 65536 ? offset + 1 : ((offset * nScale + 0x8000) >> 16) + 1;
+            code = code < nMaxCode ? code : nMaxCode;
+        }
+        pFitted[i] = static_cast<Code>(code);
+        if (pPreview)
+        {
+            pPreview[i] = static_cast<uint32_t>(m_pTable[depth] & 0xFF) << 16;
+        }
+    }
+}
+
+#if DEPTH_SIMD_X86
+
+// The SIMD kernels evaluate the table formula directly on 16-bit lanes;
+// unsigned min/max (SSE4.1) give the branch-free range test.
+
+DEPTH_TARGET_SSE41
+void DepthQuantizer::QuantizeSSE41(const uint16_t* pDepth, int nPixels, uint32_t* pPreview, uint8_t* pIntensity, uint8_t* pIndex) const
+{
+    const __m128i minDepth = _mm_set1_epi16(static_cast<short>(m_nMinDepth));
+    const __m128i maxDepth = _mm_set1_epi16(static_cast<short>(m_nMaxDepth));
+    const __m128i lowByte = _mm_set1_epi16(0x00FF);
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i zero = _mm_setzero_si128();
+
+    int i = 0;
+    for (; i + 16 <= nPixels; i += 16)
+    {
+        __m128i intensity[2];
+        __m128i index[2];
+        for (int half = 0; half < 2; ++half)
+        {
+            __m128i depth = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pDepth + i + 8 * half));
+            __m128i valid = _mm_and_si128(
+                _mm_cmpeq_epi16(_mm_max_epu16(depth, minDepth), depth),
+                _mm_cmpeq_epi16(_mm_min_epu16(depth, maxDepth), depth));
+            __m128i offset = _mm_sub_epi16(depth, minDepth);
+            intensity[half] = _mm_and_si128(_mm_and_si128(offset, lowByte), valid);
+            index[half] = _mm_and_si128(_mm_and_si128(_mm_add_epi16(_mm_srli_epi16(offset, 8), one), lowByte), valid);
+        }
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pIntensity + i), _mm_packus_epi16(intensity[0], intensity[1]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pIndex + i), _mm_packus_epi16(index[0], index[1]));
+
+        if (pPreview)
+        {
+            for (int half = 0; half < 2; ++half)
+            {
+                __m128i* pOut = reinterpret_cast<__m128i*>(pPreview + i + 8 * half);
+                _mm_storeu_si128(pOut, _mm_unpacklo_epi16(zero, intensity[half]));
+                _mm_storeu_si128(pOut + 1, _mm_unpackhi_epi16(zero, intensity[half]));
+            }
+        }
+    }
+
+    QuantizeScalar(pDepth + i, nPixels - i, pPreview ? pPreview + i : NULL, pIntensity + i, pIndex + i);
+}
+
+DEPTH_TARGET_AVX2
+void DepthQuantizer::QuantizeAVX2(const uint16_t* pDepth, int nPixels, uint32_t* pPreview, uint8_t* pIntensity, uint8_t* pIndex) const
+{
+    const __m256i minDepth = _mm256_set1_epi16(static_cast<short>(m_nMinDepth));
+    const __m256i maxDepth = _mm256_set1_epi16(static_cast<short>(m_nMaxDepth));
+    const __m256i lowByte = _mm256_set1_epi16(0x00FF);
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i zero = _mm256_setzero_si256();
+
+    int i = 0;
+    for (; i + 32 <= nPixels; i += 32)
+    {
+        __m256i intensity[2];
+        __m256i index[2];
+        for (int half = 0; half < 2; ++half)
+        {
+            __m256i depth = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pDepth + i + 16 * half));
+            __m256i valid = _mm256_and_si256(
+                _mm256_cmpeq_epi16(_mm256_max_epu16(depth, minDepth), depth),
+                _mm256_cmpeq_epi16(_mm256_min_epu16(depth, maxDepth), depth));
+            __m256i offset = _mm256_sub_epi16(depth, minDepth);
+            intensity[half] = _mm256_and_si256(_mm256_and_si256(offset, lowByte), valid);
+            index[half] = _mm256_and_si256(_mm256_and_si256(_mm256_add_epi16(_mm256_srli_epi16(offset, 8), one), lowByte), valid);
+        }
+
+        // packus works per 128-bit lane; restore pixel order across lanes
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(pIntensity + i),
+            _mm256_permute4x64_epi64(_mm256_packus_epi16(intensity[0], intensity[1]), 0xD8));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(pIndex + i),
+            _mm256_permute4x64_epi64(_mm256_packus_epi16(index[0], index[1]), 0xD8));
+
+        if (pPreview)
+        {
+            for (int half = 0; half < 2; ++half)
+            {
+                __m256i lo = _mm256_unpacklo_epi16(zero, intensity[half]);
+                __m256i hi = _mm256_unpackhi_epi16(zero, intensity[half]);
+                __m256i* pOut = reinterpret_cast<__m256i*>(pPreview + i + 16 * half);
+                _mm256_storeu_si256(pOut, _mm256_permute2x128_si256(lo, hi, 0x20));
+                _mm256_storeu_si256(pOut + 1, _mm256_permute2x128_si256(lo, hi, 0x31));
+            }
+        }
+    }
+
+    QuantizeScalar(pDepth + i, nPixels - i, pPreview ? pPreview + i : NULL, pIntensity + i, pIndex + i);
+}
+
+// 16 fitted codes to 16 bit samples, or narrowed to 8 bit ones (the codes fit)
+DEPTH_TARGET_AVX2
+static inline void StoreFitted(uint16_t* pFitted, __m256i code)
+{
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(pFitted), code);
+}
+
+DEPTH_TARGET_AVX2
+static inline void StoreFitted(uint8_t* pFitted, __m256i code)
+{
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(code, code), 0x08);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pFitted), _mm256_castsi256_si128(packed));
+}
+
+template <typename Code>
+DEPTH_TARGET_AVX2
+void DepthQuantizer::QuantizeFittedAVX2(const uint16_t* pDepth, int nPixels, uint32_t* pPreview, Code* pFitted, uint16_t nMaxCode, uint32_t nScale) const
+{
+    const __m256i minDepth = _mm256_set1_epi16(static_cast<short>(m_nMinDepth));
+    const __m256i maxDepth = _mm256_set1_epi16(static_cast<short>(m_nMaxDepth));
+    const __m256i maxCode = _mm256_set1_epi16(static_cast<short>(nMaxCode));
+    const __m256i scale = _mm256_set1_epi16(static_cast<short>(nScale));
+    const __m256i lowByte = _mm256_set1_epi16(0x00FF);
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i zero = _mm256_setzero_si256();
+    const bool bScaled = nScale < 65536;
+
+    int i = 0;
+    for (; i + 16 <= nPixels; i += 16)
+    {
+        __m256i depth = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pDepth + i));
+        __m256i valid = _mm256_and_si256(
+            _mm256_cmpeq_epi16(_mm256_max_epu16(depth, minDepth), depth),
+            _mm256_cmpeq_epi16(_mm256_min_epu16(depth, maxDepth), depth));
+        __m256i offset = _mm256_sub_epi16(depth, minDepth);
+
+        __m256i code;
+        if (bScaled)
+        {
+            // (offset * scale + 0x8000) >> 16: the high half, plus one where the low half rounds up
+            __m256i high = _mm256_mulhi_epu16(offset, scale);
+            __m256i round = _mm256_srli_epi16(_mm256_mullo_epi16(offset, scale), 15);
+            code = _mm256_add_epi16(_mm256_add_epi16(high, round), one);
+        }
+        else
+        {
+            // saturating add so min == 0, depth == 65535 clamps instead of wrapping to 0
+            code = _mm256_adds_epu16(offset, one);
+        }
+        code = _mm256_min_epu16(code, maxCode);
+        StoreFitted(pFitted + i, _mm256_and_si256(code, valid));
+
+        if (pPreview)
+        {
+            __m256i intensity = _mm256_and_si256(_mm256_and_si256(offset, lowByte), valid);
+            __m256i lo = _mm256_unpacklo_epi16(zero, intensity);
+            __m256i hi = _mm256_unpackhi_epi16(zero, intensity);
+            __m256i* pOut = reinterpret_cast<__m256i*>(pPreview + i);
+            _mm256_storeu_si256(pOut, _mm256_permute2x128_si256(lo, hi, 0x20));
+            _mm256_storeu_si256(pOut + 1, _mm256_permute2x128_si256(lo, hi, 0x31));
+        }
+    }
+
+    QuantizeFittedScalar(pDepth + i, nPixels - i, pPreview ? pPreview + i : NULL, pFitted + i, nMaxCode, nScale);
+}
+
+#endif
+
+/// <summary>
+/// Fit depth into a single plane, picking the AVX2 kernel when available
+/// </summary>
+template <typename Code>
+void DepthQuantizer::QuantizeFittedDispatch(const uint16_t* pDepth, int nPixels, uint32_t* pPreview, Code* pFitted, int nBitDepth) const
+{
+    uint16_t nMaxCode = static_cast<uint16_t>((1 << nBitDepth) - 1);
+    uint32_t nScale = GetFittedScale(nBitDepth);
+#if DEPTH_SIMD_X86
+    if (SimdSupport::HasAVX2())
+    {
+        QuantizeFittedAVX2(pDepth, nPixels, pPreview, pFitted, nMaxCode, nScale);
+        return;
+    }
+#endif
+    QuantizeFittedScalar(pDepth, nPixels, pPreview, pFitted, nMaxCode, nScale);
+}
+
+/// <summary>
+/// Fit depth into a plane of 16 bit samples at nBitDepth
+/// </summary>
+void DepthQuantizer::QuantizeFitted(const uint16_t* pDepth, int nPixels, uint32_t* pPreview, uint16_t* pFitted, int nBitDepth) const
+{
+    QuantizeFittedDispatch(pDepth, nPixels, pPreview, pFitted, nBitDepth);
+}
+
+/// <summary>
+/// Fit depth into a plane of 8 bit samples
+/// </summary>
+void DepthQuantizer::QuantizeFitted(const uint16_t* pDepth, int nPixels, uint32_t* pPreview, uint8_t* pFitted) const
+{
+    QuantizeFittedDispatch(pDepth, nPixels, pPreview, pFitted, 8);
+}
@@ -0,0 +1,93 @@
+//------------------------------------------------------------------------------
+// DepthQuantizer.h
+//------------------------------------------------------------------------------
+
+// Converts raw 16-bit depth into the RGBX preview and the 8-bit
+// DepthFrame (intensity) / DepthIndex planes in a single pass
+
+#pragma once
+
+#include <stdint.h>
+
+class DepthQuantizer
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    DepthQuantizer();
+
+    /// <summary>
+    /// Destructor
+    /// </summary>
+    ~DepthQuantizer();
+
+    /// <summary>
+    /// Set the reliable depth range, rebuilding the lookup table only if it changed.
+    /// Depth d inside [nMinDepth, nMaxDepth] maps to intensity (d-min)%256 and
+    /// index (d-min)/256+1; everything else maps to intensity 0 and index 0.
+    /// </summary>
+    /// <param name="nMinDepth">minimum reliable depth</param>
+    /// <param name="nMaxDepth">maximum reliable depth</param>
+    void SetRange(uint16_t nMinDepth, uint16_t nMaxDepth);
+
+    /// <summary>
+    /// Quantize a depth buffer. Picks the AVX2, SSE4.1 or lookup table kernel at runtime.
+    /// </summary>
+    /// <param name="pDepth">raw depth samples</param>
+    /// <param name="nPixels">number of samples</param>
+    /// <param name="pPreview">BGRX output (RGBQUAD layout), intensity in the red channel; may be NULL</param>
+    /// <param name="pIntensity">DepthFrame plane output</param>
+    /// <param name="pIndex">DepthIndex plane output</param>
+    void Quantize(const uint16_t* pDepth, int nPixels, uint32_t* pPreview, uint8_t* pIntensity, uint8_t* pIndex) const;
+
+    /// <summary>
+    /// Reference implementation using only the lookup table
+    /// </summary>
+    void QuantizeScalar(const uint16_t* pDepth, int nPixels, uint32_t* pPreview, uint8_t* pIntensity, uint8_t* pIndex) const;
+
+    /// <summary>
+    /// Fit depth into a single plane without splitting it. Depth d inside
+    /// [nMinDepth, nMaxDepth] maps to code 1 + round((d-min) / step) and
+    /// everything else to 0; d comes back as min + (code-1) * step, within
+    /// step/2. Step is GetFittedStep: 1 (lossless) when the range fits the
+    /// 2^nBitDepth-1 codes, else the range spread over all of them.
+    /// </summary>
+    /// <param name="pDepth">raw depth samples</param>
+    /// <param name="nPixels">number of samples</param>
+    /// <param name="pPreview">BGRX output as in Quantize; may be NULL</param>
+    /// <param name="pFitted">plane output, 16 bit samples</param>
+    /// <param name="nBitDepth">bit depth of the codes (8 to 16)</param>
+    void QuantizeFitted(const uint16_t* pDepth, int nPixels, uint32_t* pPreview, uint16_t* pFitted, int nBitDepth) const;
+
+    /// <summary>
+    /// QuantizeFitted at 8 bit, for planes of 8 bit samples
+    /// </summary>
+    void QuantizeFitted(const uint16_t* pDepth, int nPixels, uint32_t* pPreview, uint8_t* pFitted) const;
+
+    /// <summary>
+    /// Millimeters per QuantizeFitted code at nBitDepth for the current range
+    /// </summary>
+    /// <returns>1 when the range fits, else the step receivers decode with</returns>
+    double GetFittedStep(int nBitDepth) const;
+
+private:
+    DepthQuantizer(const DepthQuantizer&);
+    DepthQuantizer& operator=(const DepthQuantizer&);
+
+    void QuantizeSSE41(const uint16_t* pDepth, int nPixels, uint32_t* pPreview, uint8_t* pIntensity, uint8_t* pIndex) const;
+    void QuantizeAVX2(const uint16_t* pDepth, int nPixels, uint32_t* pPreview, uint8_t* pIntensity, uint8_t* pIndex) const;
+    uint32_t GetFittedScale(int nBitDepth) const;
+    template <typename Code>
+    void QuantizeFittedDispatch(const uint16_t* pDepth, int nPixels, uint32_t* pPreview, Code* pFitted, int nBitDepth) const;
+    template <typename Code>
+    void QuantizeFittedScalar(const uint16_t* pDepth, int nPixels, uint32_t* pPreview, Code* pFitted, uint16_t nMaxCode, uint32_t nScale) const;
+    template <typename Code>
+    void QuantizeFittedAVX2(const uint16_t* pDepth, int nPixels, uint32_t* pPreview, Code* pFitted, uint16_t nMaxCode, uint32_t nScale) const;
+
+    uint16_t                m_nMinDepth;
+    uint16_t                m_nMaxDepth;
+
+    // 65536 entries, intensity in the low byte and index in the high byte
+    uint16_t*               m_pTable;
+};
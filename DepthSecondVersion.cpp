@@ -8,6 +8,7 @@
 
 #include "stdafx.h"
 #include <strsafe.h>
+#include <shellapi.h>
 #include "resource.h"
 #include "DepthSecondVersion.h"
 
@@ -29,33 +30,35 @@ int APIENTRY wWinMain(
     UNREFERENCED_PARAMETER(hPrevInstance);
     UNREFERENCED_PARAMETER(lpCmdLine);
 
-    CDepthSecondVersion application;
-    application.Run(hInstance, nShowCmd);
-}
-
-
-void Bitmap2Yuv444p_calc2(uint8_t *destination, uint8_t *rgb, size_t width, size_t height)
-{
-  size_t image_size = width * height;
-  size_t upos = image_size;
-  size_t vpos = image_size*2;
-  size_t i = 0;
-
-  for (size_t line = 0; line < height; ++line)
-  {
-    for (size_t x = 0; x < width; x ++)
+    // Encoder options (--encoder-profile, --encoder-config, --<option>, --<Stream>.<option>)
+    // and server options (--depth-stream, --depth-packing, --depth-bitdepth, --depth-qp, --registration,
+    // --registration-threads, --color-stride, --huge-pages, --color-matrix, --color-range, --color-format, --point-cloud, --depth-decimation, --point-cloud-decimation,
+    // --decimation-factor, --voxel-size, --temporal-filter, --temporal-weight, --temporal-history,
+    // --temporal-threshold, --spatial-filter, --spatial-threshold, --spatial-budget, --roi, --depth-gate,
+    // --frame-queue, --client-queue, --stats-interval, --depth-bitrate, --color-bitrate, --rate-interval,
+    // --record, --source, --playback-file, --source-pace, --source-frames, --latency-trace)
+    int nArgs = 0;
+    LPWSTR* pArgsW = CommandLineToArgvW(GetCommandLineW(), &nArgs);
+    if (pArgsW)
     {
-      uint8_t r = rgb[3 * i];
-      uint8_t g = rgb[3 * i + 1];
-      uint8_t b = rgb[3 * i + 2];
-
-      destination[i] = ((66 * r + 129 * g + 25 * b) >> 8) + 16;
-
-      destination[upos+i] = ((-38 * r + -74 * g + 112 * b) >> 8) + 128;
-      destination[vpos+i] = ((112 * r + -94 * g + -18 * b) >> 8) + 128;
-      i++;
+        std::vector<std::string> args(nArgs);
+        std::vector<char*> argv(nArgs);
+        for (int i = 0; i < nArgs; ++i)
+        {
+            int nBytes = WideCharToMultiByte(CP_UTF8, 0, pArgsW[i], -1, NULL, 0, NULL, NULL);
+            args[i].resize(nBytes > 0 ? nBytes : 1);
+            WideCharToMultiByte(CP_UTF8, 0, pArgsW[i], -1, &args[i][0], nBytes, NULL, NULL);
+            argv[i] = &args[i][0];
+        }
+        if (nArgs > 0)
+        {
+            ParseEncoderArguments(nArgs, &argv[0]);
+        }
+        LocalFree(pArgsW);
     }
-  }
+
+    CDepthSecondVersion application;
+    application.Run(hInstance, nShowCmd);
 }
 
 /// <summary>
@@ -69,61 +72,30 @@ CDepthSecondVersion::CDepthSecondVersion() :
     m_fFreq(0),
     m_nNextStatusTime(0LL),
     m_bSaveScreenshot(false),
-    m_pKinectSensor(NULL),
-    m_pDepthFrameReader(NULL),
+    m_pFrameSource(NULL),
+    m_pCoordinateMapper(NULL),
     m_pD2DFactory(NULL),
     m_pDrawDepth(NULL),
     m_pDrawColor(NULL),
-    m_pDepthRGBX(NULL),
-    m_pColorRGBX(NULL),
-    m_pMultiSourceReader(NULL)
+    m_pRecorder(NULL),
+    m_pipeline(true, SourceMode != SourceKinect)
 {
     LARGE_INTEGER qpf = {0};
     if (QueryPerformanceFrequency(&qpf))
     {
         m_fFreq = double(qpf.QuadPart);
     }
-    this->localMutex = new igtl::SimpleMutexLock;
-    // create heap storage for depth pixel data in RGBX format
-    m_pDepthRGBX = new RGBQUAD[cDepthWidth * cDepthHeight];
-    m_pColorRGBX = new RGBQUAD[cColorWidth * cColorHeight];
-    // create heap storage for the coorinate mapping from color to depth
-    m_pDepthCoordinates = new DepthSpacePoint[cColorWidth * cColorHeight];
-    x264_picture_alloc(&picDepthFrame, X264_CSP_I420, cDepthWidth, cDepthHeight);
-    x264_picture_alloc(&picDepthIndex, X264_CSP_I420, cDepthWidth, cDepthHeight);
-    x264_picture_alloc(&picColor, X264_CSP_RGB, cColorWidth, cColorHeight);
-    int frameSize = cDepthWidth*cDepthHeight;
-    m_pDepthFrameYUV420.SetLength(frameSize);
-    picDepthFrame.img.i_plane = 1;
-    picDepthFrame.img.plane[0] = m_pDepthFrameYUV420.data();
-    picDepthFrame.img.i_stride[0] = cDepthWidth;
-    m_pDepthIndexYUV420.SetLength(frameSize);
-    picDepthIndex.img.i_plane = 1;
-    picDepthIndex.img.plane[0] = m_pDepthIndexYUV420.data();
-    picDepthIndex.img.i_stride[0] = cDepthWidth;
-    m_pColorYUV444.SetLength(cDepthWidth* cDepthHeight * 3 );
-    picColor.img.i_plane = 3;
-    picColor.img.i_stride[0] = picColor.img.i_stride[1] = picColor.img.i_stride[2] = cColorWidth;
-    picColor.img.plane[0] = m_pColorYUV444.data();
-    picColor.img.plane[1] = picColor.img.plane[0] + cDepthWidth * cDepthHeight;
-    picColor.img.plane[2] = picColor.img.plane[1] + cDepthWidth * cDepthHeight;
-    
-    // Initial the openigtlink server
-    threaderServer = igtl::MultiThreader::New();
-    glockServer = igtl::MutexLock::New();
-    DepthImageServerX264::ThreadDataServer td_Server;
-    td_Server.portNum = 18944;
-    td_Server.stop = 1;
-    td_Server.pic_DepthFrame = picDepthFrame;
-    td_Server.pic_DepthIndex = picDepthIndex;
-    td_Server.pic_Color = picColor;
-    td_Server.transmissionFinished = true;
-    td_Server.conditionVar = igtl::ConditionVariable::New();
-    td.td_Server = &td_Server;
-    threaderServer->SpawnThread((igtl::ThreadFunctionType) &ServerControl, &td);
-    
+    if (!RecordFile.empty())
+    {
+        m_pRecorder = new FrameRecorder(cDepthWidth, cDepthHeight, cColorWidth, cColorHeight);
+        if (!m_pRecorder->Open(RecordFile))
+        {
+            std::cerr << "Cannot create the recording " << RecordFile << "." << std::endl;
+            delete m_pRecorder;
+            m_pRecorder = NULL;
+        }
+    }
 }
-  
 
 /// <summary>
 /// Destructor
@@ -144,28 +116,25 @@ CDepthSecondVersion::~CDepthSecondVersion()
     }
 
 
-    if (m_pDepthRGBX)
+    if (m_pRecorder)
     {
-      delete[] m_pDepthRGBX;
-      m_pDepthRGBX = NULL;
+      m_pRecorder->Close();
+      std::cerr << "Recording: " << m_pRecorder->GetRecordedCount() << " frames written, "
+                << m_pRecorder->GetDroppedCount() << " dropped." << std::endl;
+      delete m_pRecorder;
+      m_pRecorder = NULL;
     }
 
     // clean up Direct2D
     SafeRelease(m_pD2DFactory);
 
-    // done with depth frame reader
-    SafeRelease(m_pDepthFrameReader);
-
-    // done with depth frame reader
-    SafeRelease(m_pColorFrameReader);
-
-    // close the Kinect Sensor
-    if (m_pKinectSensor)
+    // done with the frames, closes the Kinect sensor
+    if (m_pFrameSource)
     {
-        m_pKinectSensor->Close();
+        delete m_pFrameSource;
+        m_pFrameSource = NULL;
+        m_pCoordinateMapper = NULL;
     }
-
-    SafeRelease(m_pKinectSensor);
 }
 
 /// <summary>
@@ -230,130 +199,38 @@ int CDepthSecondVersion::Run(HINSTANCE hInstance, int nCmdShow)
 /// </summary>
 void CDepthSecondVersion::Update()
 {
-    if (!m_pDepthFrameReader)
+    if (!m_pFrameSource)
     {
         return;
     }
 
-    IDepthFrame* pDepthFrame = NULL;
-    IColorFrame* pColorFrame = NULL;
-    HRESULT hr = m_pDepthFrameReader->AcquireLatestFrame(&pDepthFrame);
-    if (SUCCEEDED(hr))
+    SourceFrame frame;
+    if (m_pFrameSource->Acquire(frame))
     {
-        INT64 nTime = 0;
-        IFrameDescription* pFrameDescription = NULL;
-        int nWidth = 0;
-        int nHeight = 0;
-        USHORT nDepthMinReliableDistance = 0;
-        USHORT nDepthMaxDistance = 0;
-        UINT nBufferSize = 0;
-        UINT16 *pBuffer = NULL;
-
-        IFrameDescription* pFrameDescriptionColor = NULL;
-        int nWidthColor = 0;
-        int nHeightColor = 0;
-        UINT nBufferSizeColor = 0;
-        RGBQUAD *pBufferColor = NULL;
-
-        hr = pDepthFrame->get_RelativeTime(&nTime);
-
-        if (SUCCEEDED(hr))
-        {
-            hr = pDepthFrame->get_FrameDescription(&pFrameDescription);
-        }
-
-        if (SUCCEEDED(hr))
-        {
-            hr = pFrameDescription->get_Width(&nWidth);
-        }
+        ShowFrameRate(frame.depthTime);
+        m_pipeline.ProcessFrame(frame);
 
-        if (SUCCEEDED(hr))
+        if (m_pRecorder && (frame.depthWidth == cDepthWidth) && (frame.depthHeight == cDepthHeight))
         {
-            hr = pFrameDescription->get_Height(&nHeight);
+          // the raw frames as the source delivered them; the recorder only
+          // copies them here, its own thread writes them out
+          bool bColor = frame.pColor && (frame.colorWidth == cColorWidth) && (frame.colorHeight == cColorHeight);
+          m_pRecorder->Record(frame.depthTime, frame.pDepth, frame.colorTime, bColor ? frame.pColor : NULL);
         }
 
-        if (SUCCEEDED(hr))
+        // Draw the data with Direct2D
+        if (frame.pColor && (frame.colorWidth == cColorWidth) && (frame.colorHeight == cColorHeight))
         {
-            hr = pDepthFrame->get_DepthMinReliableDistance(&nDepthMinReliableDistance);
+          m_pDrawColor->Draw(reinterpret_cast<BYTE*>(const_cast<uint32_t*>(frame.pColor)), cColorWidth * cColorHeight * sizeof(RGBQUAD));
         }
+        m_pDrawDepth->Draw(reinterpret_cast<BYTE*>(m_pipeline.GetPreview()), cDepthWidth * cDepthHeight * sizeof(RGBQUAD));
+        m_pFrameSource->Release();
 
-        if (SUCCEEDED(hr))
+        if (m_pFrameSource->IsFinished())
         {
-			    // In order to see the full range of depth (including the less reliable far field depth)
-			    // we are setting nDepthMaxDistance to the extreme potential depth threshold
-			    //nDepthMaxDistance = USHRT_MAX;
-
-			    // Note:  If you wish to filter by reliable depth distance, uncomment the following line.
-          hr = pDepthFrame->get_DepthMaxReliableDistance(&nDepthMaxDistance);
-        }
-
-        if (SUCCEEDED(hr))
-        {
-            hr = pDepthFrame->AccessUnderlyingBuffer(&nBufferSize, &pBuffer);            
+          SetStatusMessage(L"Frame source finished.", 10000, true);
         }
-
-        if (SUCCEEDED(hr))
-        {
-          //nDepthMaxDistance = nDepthMinReliableDistance + 255;
-          ProcessDepth(nTime, pBuffer, nWidth, nHeight, nDepthMinReliableDistance, nDepthMaxDistance);
-        }
-        SafeRelease(pFrameDescription);
-
-        hr = m_pColorFrameReader->AcquireLatestFrame(&pColorFrame);
-        if (SUCCEEDED(hr))
-        {
-          hr = pColorFrame->get_FrameDescription(&pFrameDescriptionColor);
-        }
-
-        if (SUCCEEDED(hr))
-        {
-          hr = pFrameDescriptionColor->get_Width(&nWidthColor);
-        }
-
-        if (SUCCEEDED(hr))
-        {
-          hr = pFrameDescriptionColor->get_Height(&nHeightColor);
-        }
-
-        ColorImageFormat imageFormat = ColorImageFormat_None;
-        if (SUCCEEDED(hr))
-        {
-          hr = pColorFrame->get_RawColorImageFormat(&imageFormat);
-        }
-
-        if (SUCCEEDED(hr))
-        {
-          if (imageFormat == ColorImageFormat_Bgra)
-          {
-            hr = pColorFrame->AccessRawUnderlyingBuffer(&nBufferSizeColor, reinterpret_cast<BYTE**>(&pBufferColor));
-          }
-          else if (m_pColorRGBX)
-          {
-            pBufferColor = m_pColorRGBX;
-            nBufferSizeColor = cColorWidth * cColorHeight * sizeof(RGBQUAD);
-            hr = pColorFrame->CopyConvertedFrameDataToArray(nBufferSizeColor, reinterpret_cast<BYTE*>(pBufferColor), ColorImageFormat_Bgra);
-          }
-          else
-          {
-            hr = E_FAIL;
-          }
-        }
-        if (SUCCEEDED(hr))
-        {
-          ProcessColor(nTime, pBuffer, pBufferColor,nWidth,nHeight, nWidthColor, nHeightColor);
-        }
-        if (Synchonize)
-        {
-          this->localMutex->Lock();
-          this->td.td_Server->transmissionFinished = false;
-          while (!this->td.td_Server->transmissionFinished)
-            this->td.td_Server->conditionVar->Wait(this->localMutex);
-          this->localMutex->Unlock();
-        }
-        SafeRelease(pFrameDescriptionColor);
     }
-    SafeRelease(pDepthFrame);
-    SafeRelease(pColorFrame);
 }
 
 /// <summary>
@@ -421,8 +298,8 @@ LRESULT CALLBACK CDepthSecondVersion::DlgProc(HWND hWnd, UINT message, WPARAM wP
                 SetStatusMessage(L"Failed to initialize the Direct2D draw device.", 10000, true);
             }
 
-            // Get and initialize the default Kinect sensor
-            InitializeDefaultSensor();
+            // Open the Kinect, the recording or the synthetic scene
+            InitializeFrameSource();
             LPTSTR lpString = L"18944";
             SetDlgItemText(m_hWnd, IDC_EDIT1, lpString);
         }
@@ -450,8 +327,8 @@ LRESULT CALLBACK CDepthSecondVersion::DlgProc(HWND hWnd, UINT message, WPARAM wP
 			      {
               LPTSTR lpString= new TCHAR[5];
               GetDlgItemText(m_hWnd, IDC_EDIT1, lpString, 5);
-              td.td_Server->portNum = atoi((const char*)lpString);
-              td.td_Server->stop = (bool) HIWORD(wParam);
+              m_pipeline.GetServer().portNum = atoi((const char*)lpString);
+              m_pipeline.GetServer().stop = (bool) HIWORD(wParam);
 			      }
             break;
     }
@@ -460,76 +337,50 @@ LRESULT CALLBACK CDepthSecondVersion::DlgProc(HWND hWnd, UINT message, WPARAM wP
 }
 
 /// <summary>
-/// Initializes the default Kinect sensor
+/// Creates the frame source selected by SourceMode
 /// </summary>
 /// <returns>indicates success or failure</returns>
-HRESULT CDepthSecondVersion::InitializeDefaultSensor()
+HRESULT CDepthSecondVersion::InitializeFrameSource()
 {
-    HRESULT hr;
-
-    hr = GetDefaultKinectSensor(&m_pKinectSensor);
-    if (FAILED(hr))
+    if (SourceMode == SourceSynthetic)
     {
-        return hr;
+        m_pFrameSource = new SyntheticFrameSource(cDepthWidth, cDepthHeight, cColorWidth, cColorHeight,
+            SourceRealTime != 0, SourceFrames);
+        return S_OK;
     }
 
-    if (m_pKinectSensor)
+    if (SourceMode == SourcePlayback)
     {
-        // Initialize the Kinect and get the depth reader
-        IDepthFrameSource* pDepthFrameSource = NULL;
-        IColorFrameSource* pColorFrameSource = NULL;
-        //m_pKinectSensor->OpenMultiSourceFrameReader(FrameSourceTypes_Color | FrameSourceTypes_Depth, &m_pMultiSourceReader);
-        hr = m_pKinectSensor->Open();
-
-        if (SUCCEEDED(hr))
-        {
-            hr = m_pKinectSensor->get_DepthFrameSource(&pDepthFrameSource);
-        }
-
-        if (SUCCEEDED(hr))
+        PlaybackFrameSource* pPlayback = new PlaybackFrameSource(SourceRealTime != 0, SourceFrames);
+        if (!pPlayback->Open(PlaybackFile))
         {
-            hr = m_pKinectSensor->get_ColorFrameSource(&pColorFrameSource);
+            delete pPlayback;
+            SetStatusMessage(L"Cannot play back the recording!", 10000, true);
+            return E_FAIL;
         }
-
-        if (SUCCEEDED(hr))
-        {
-          m_pKinectSensor->get_CoordinateMapper(&m_pCoordinateMapper);
-        }
-
-        if (SUCCEEDED(hr))
-        {
-            hr = pDepthFrameSource->OpenReader(&m_pDepthFrameReader);
-        }
-
-        if (SUCCEEDED(hr))
-        {
-            hr = pColorFrameSource->OpenReader(&m_pColorFrameReader);
-        }
-
-
-        SafeRelease(pDepthFrameSource);
-        SafeRelease(pColorFrameSource);
+        m_pFrameSource = pPlayback;
+        return S_OK;
     }
 
-    if (!m_pKinectSensor || FAILED(hr))
+    KinectFrameSource* pKinect = new KinectFrameSource(cColorWidth, cColorHeight);
+    HRESULT hr = pKinect->Initialize();
+    if (FAILED(hr))
     {
+        delete pKinect;
         SetStatusMessage(L"No ready Kinect found!", 10000, true);
-        return E_FAIL;
+        return hr;
     }
-
+    m_pCoordinateMapper = pKinect->GetCoordinateMapper();
+    m_pipeline.SetMapper(this);
+    m_pFrameSource = pKinect;
     return hr;
 }
 
 /// <summary>
-/// Handle new depth data
+/// Show the frame rate and the time of the latest depth frame
 /// <param name="nTime">timestamp of frame</param>
-/// <param name="pBuffer">pointer to frame data</param>
-/// <param name="nWidth">width (in pixels) of input image data</param>
-/// <param name="nHeight">height (in pixels) of input image data</param>
-/// <param name="nMinDepth">minimum reliable depth</param>
-/// <param name="nMaxDepth">maximum reliable depth</param>
 /// </summary>
-void CDepthSecondVersion::ProcessDepth(INT64 nTime, const UINT16* pBuffer, int nWidth, int nHeight, USHORT nMinDepth, USHORT nMaxDepth)
+void CDepthSecondVersion::ShowFrameRate(INT64 nTime)
 {
     if (m_hWnd)
     {
@@ -562,110 +413,45 @@ void CDepthSecondVersion::ProcessDepth(INT64 nTime, const UINT16* pBuffer, int n
             m_nFramesSinceUpdate = 0;
         }
     }
+}
 
-    // Make sure we've received valid data
-    if (m_pDepthRGBX && pBuffer && (nWidth == cDepthWidth) && (nHeight == cDepthHeight))
-    {
-        RGBQUAD* pRGBX = m_pDepthRGBX;
-
-        // end pixel is start + width*height - 1
-        const UINT16* pBufferEnd = pBuffer + (nWidth * nHeight);
-        uint8_t* pDepthFrame = m_pDepthFrameYUV420.data();
-        uint8_t* pDepthIndex = m_pDepthIndexYUV420.data();
-        for(int j = 0; j < nHeight; ++j)
-        { 
-          for (int i = 0; i<nWidth; ++i)
-          {
-            USHORT depth = *pBuffer;
-
-            // To convert to a byte, we're discarding the most-significant
-            // rather than least-significant bits.
-            // We're preserving detail, although the intensity will "wrap."
-            // Values outside the reliable depth range are mapped to 0 (black).
-
-            // Note: Using conditionals in this loop could degrade performance.
-            // Consider using a lookup table instead when writing production code.
-            BYTE intensity = static_cast<BYTE>((depth >= nMinDepth) && (depth <= nMaxDepth) ? ((depth- nMinDepth) % 256) : 0);
-
-            pRGBX->rgbRed = intensity;
-            pRGBX->rgbGreen = 0;
-            pRGBX->rgbBlue = 0;
-            if ((depth >= nMinDepth) && (depth <= nMaxDepth))
-            {
-              *(pDepthFrame + j*cDepthWidth + i) = intensity;
-              *(pDepthIndex + j*cDepthWidth + i) = (depth - nMinDepth) / 256 + 1;
-            }
-            ++pRGBX;
-            ++pBuffer;
-          }
-        }
-    }
+/// <summary>
+/// Map every depth pixel to color space with the Kinect's mapper
+/// </summary>
+const float* CDepthSecondVersion::MapDepthToColor(const uint16_t* pDepth, FrameArena& arena)
+{
+    ColorSpacePoint* pMapped = arena.Allocate<ColorSpacePoint>(cDepthWidth * cDepthHeight);
+    HRESULT hr = pMapped ? m_pCoordinateMapper->MapDepthFrameToColorSpace(cDepthWidth * cDepthHeight, (UINT16*)pDepth, cDepthWidth * cDepthHeight, pMapped) : E_OUTOFMEMORY;
+    return SUCCEEDED(hr) ? reinterpret_cast<const float*>(pMapped) : NULL;
 }
 
 /// <summary>
-/// Handle new depth data
-/// <param name="nTime">timestamp of frame</param>
-/// <param name="pBuffer">pointer to frame data</param>
-/// <param name="nWidth">width (in pixels) of input image data</param>
-/// <param name="nHeight">height (in pixels) of input image data</param>
+/// Map every color pixel to depth space with the Kinect's mapper
+/// </summary>
+const float* CDepthSecondVersion::MapColorToDepth(const uint16_t* pDepth, FrameArena& arena)
+{
+    DepthSpacePoint* pMapped = arena.Allocate<DepthSpacePoint>(cColorWidth * cColorHeight);
+    HRESULT hr = pMapped ? m_pCoordinateMapper->MapColorFrameToDepthSpace(cDepthWidth * cDepthHeight, (UINT16*)pDepth, cColorWidth * cColorHeight, pMapped) : E_OUTOFMEMORY;
+    return SUCCEEDED(hr) ? reinterpret_cast<const float*>(pMapped) : NULL;
+}
+
+/// <summary>
+/// Give the point cloud builder the Kinect's depth to camera space rays
 /// </summary>
-void CDepthSecondVersion::ProcessColor(INT64 nTime, UINT16*pBuffer, RGBQUAD* pBufferColor, int nWidth, int nHeight, int nWidthColor, int nHeightColor)
+void CDepthSecondVersion::SetRays(PointCloudBuilder& builder, int nRoiX, int nRoiY)
 {
-  // Make sure we've received valid data
-  if (m_pCoordinateMapper &&
-    pBuffer && (nWidth == cDepthWidth) && (nHeight == cDepthHeight) &&
-    pBufferColor && (nWidthColor == cColorWidth) && (nHeightColor == cColorHeight))
-  {
-    HRESULT hr = m_pCoordinateMapper->MapColorFrameToDepthSpace(cDepthWidth * cDepthHeight, (UINT16*)pBuffer, nWidthColor * nHeightColor, m_pDepthCoordinates);
-    uint8_t RGBFrame[3 * cDepthWidth * cDepthHeight] = { 0 };
-    //std::vector<std::vector<uint8_t> >testTemp(cDepthWidth * cDepthHeight, std::vector<uint8_t>(3,0));
-    if (SUCCEEDED(hr))
+    // the table is all zero until the sensor has reported its intrinsics
+    UINT32 nEntries = 0;
+    PointF* pTable = NULL;
+    if (SUCCEEDED(m_pCoordinateMapper->GetDepthFrameToCameraSpaceTable(&nEntries, &pTable)))
     {
-      // loop over output pixels
-      RGBQUAD* pSrc = new RGBQUAD();
-      int validPoint = 0;
-      for (int colorIndex = 0; colorIndex < (nWidthColor*nHeightColor); ++colorIndex)
-      {
-        // default setting source to copy from the background pixel
-
-        DepthSpacePoint p = m_pDepthCoordinates[colorIndex];
-
-        // Values that are negative infinity means it is an invalid color to depth mapping so we
-        // skip processing for this pixel
-        if (p.X != -std::numeric_limits<float>::infinity() && p.Y != -std::numeric_limits<float>::infinity())
+        if (nEntries == cDepthWidth * cDepthHeight)
         {
-          int depthX = static_cast<int>(p.X + 0.5f);
-          int depthY = static_cast<int>(p.Y + 0.5f);
-
-         
-          if ((depthX >= 0 && depthX < nWidth) && (depthY >= 0 && depthY < nHeight))
-          {
-            validPoint++;
-            int fillIndex = CheckNeighbors(RGBFrame, depthY*nWidth + depthX, nWidth,nHeight);
-            // set source for copy to the color pixel
-            //pSrc = m_pColorRGBX + colorIndex;
-            RGBFrame[3 *fillIndex] = (pBufferColor + colorIndex)->rgbRed;
-            RGBFrame[3 *fillIndex + 1] = (pBufferColor + colorIndex)->rgbGreen;
-            RGBFrame[3 *fillIndex + 2] = (pBufferColor + colorIndex)->rgbBlue;
-            m_pDepthRGBX[fillIndex] = *(pBufferColor + colorIndex);
-            pSrc->rgbBlue = 0;
-            pSrc->rgbGreen = 0;
-            pSrc->rgbRed = 0;
-            pBufferColor[colorIndex] = *pSrc;
-            
-          }
+            // the builder covers the region of interest only
+            builder.SetRayTable(reinterpret_cast<const float*>(pTable) + 2 * (nRoiY * cDepthWidth + nRoiX), cDepthWidth);
         }
-      }
-      pSrc = NULL;
-      Bitmap2Yuv444p_calc2(m_pColorYUV444.data(), RGBFrame, nWidth, nHeight);
+        CoTaskMemFree(pTable);
     }
-  }
-  if (pBufferColor && (nWidthColor == cColorWidth) && (nHeightColor == cColorHeight))
-  {
-    // Draw the data with Direct2D
-    m_pDrawColor->Draw(reinterpret_cast<BYTE*>(pBufferColor), cColorWidth * cColorHeight * sizeof(RGBQUAD));
-  }
-  m_pDrawDepth->Draw(reinterpret_cast<BYTE*>(m_pDepthRGBX), cDepthWidth * cDepthHeight * sizeof(RGBQUAD));
 }
 
 /// <summary>
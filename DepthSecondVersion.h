@@ -8,39 +8,20 @@
 
 #include "resource.h"
 #include "ImageRenderer.h"
+#include "FrameRecorder.h"
+#include "KinectFrameSource.h"
+#include "PlaybackFrameSource.h"
+#include "SyntheticFrameSource.h"
 //#include "DepthImageServer.cxx"
-#include "DepthImageServerX264.cpp"
+#include "FramePipeline.h"
 using namespace DepthImageServerX264;
-int CheckNeighbors(uint8_t *RGBFrame, int checkIndex, int nWidth, int nHeight)
-{
-  if (RGBFrame[3* checkIndex]==0 && RGBFrame[3 * checkIndex+1]==0 && RGBFrame[3 * checkIndex+2]==0)
-  { 
-    return checkIndex;
-  }
-  else if (RGBFrame[3 * (checkIndex + 1)] == 0 && RGBFrame[3 * (checkIndex + 1) + 1] == 0 && RGBFrame[3 * (checkIndex + 1) + 2] == 0)
-  {
-    return (checkIndex+1)>=(nHeight*nWidth)?(nHeight*nWidth-1):(checkIndex + 1);
-  }
-  else if (RGBFrame[3 * (checkIndex - 1)] == 0 && RGBFrame[3 * (checkIndex - 1) + 1] == 0 && RGBFrame[3 * (checkIndex - 1) + 2] == 0)
-  {
-    return (checkIndex - 1) < 0 ? 0 : (checkIndex - 1);
-  }
-  else if (RGBFrame[3 * (checkIndex + nWidth)] == 0 && RGBFrame[3 * (checkIndex + nWidth) + 1] == 0 && RGBFrame[3 * (checkIndex + nWidth) + 2] == 0)
-  {
-    return (checkIndex + nWidth) >= (nHeight*nWidth) ? (nHeight*nWidth - 1) : (checkIndex + nWidth);
-  }
-  else if (RGBFrame[3 * (checkIndex - nWidth)] == 0 && RGBFrame[3 * (checkIndex - nWidth) + 1] == 0 && RGBFrame[3 * (checkIndex - nWidth) + 2] == 0)
-  {
-    return (checkIndex - nWidth) < 0 ? 0 : (checkIndex - nWidth);
-  }
-}
-
-class CDepthSecondVersion
+
+class CDepthSecondVersion : private FramePipelineMapper
 {
-    static const int        cDepthWidth  = 512;
-    static const int        cDepthHeight = 424;
-    static const int        cColorWidth = 1920;
-    static const int        cColorHeight = 1080;
+    static const int        cDepthWidth  = FramePipeline::cDepthWidth;
+    static const int        cDepthHeight = FramePipeline::cDepthHeight;
+    static const int        cColorWidth = FramePipeline::cColorWidth;
+    static const int        cColorHeight = FramePipeline::cColorHeight;
 
 public:
     /// <summary>
@@ -89,41 +70,23 @@ private:
     DWORD                   m_nFramesSinceUpdate;
     bool                    m_bSaveScreenshot;
 
-    // Current Kinect
-    IKinectSensor*          m_pKinectSensor;
+    // Depth and color frames: the Kinect, a recording or a synthetic scene
+    FrameSource*            m_pFrameSource;
 
-    // Coordinate Mapper
+    // The Kinect's coordinate mapper, NULL for the other sources
     ICoordinateMapper*      m_pCoordinateMapper;
 
-    // Depth reader
-    IDepthFrameReader*      m_pDepthFrameReader;
-
-    // Color reader
-    IColorFrameReader*      m_pColorFrameReader;
-
-    IMultiSourceFrameReader* m_pMultiSourceReader;
-
     // Direct2D
     ImageRenderer*          m_pDrawDepth;
     ImageRenderer*          m_pDrawColor;
     ID2D1Factory*           m_pD2DFactory;
-    RGBQUAD*                m_pDepthRGBX;
-    RGBQUAD*                m_pColorRGBX;
-
-    DepthSpacePoint *m_pDepthCoordinates;
-    BufferedData m_pDepthFrameYUV420;
-    BufferedData m_pDepthIndexYUV420;
-    SFrameBSInfo info;
-    x264_picture_t picDepthFrame;
-    x264_picture_t picDepthIndex;
-    BufferedData m_pColorYUV444;
-    SFrameBSInfo infoColor;
-    x264_picture_t picColor;
-
-    igtl::MultiThreader::Pointer threaderServer;
-    igtl::MutexLock::Pointer glockServer;
-    DepthImageServerX264::ThreadData td;
-    igtl::SimpleMutexLock *localMutex;
+
+    // Writes the raw frames to RecordFile for offline replay; NULL when off
+    FrameRecorder*          m_pRecorder;
+
+    // Slots, depth and color processing and the server; maps through
+    // m_pCoordinateMapper once the Kinect is open, and keeps the preview
+    FramePipeline           m_pipeline;
 
     /// <summary>
     /// Main processing function
@@ -131,31 +94,21 @@ private:
     void                    Update();
 
     /// <summary>
-    /// Initializes the default Kinect sensor
+    /// Creates the frame source selected by SourceMode
     /// </summary>
     /// <returns>S_OK on success, otherwise failure code</returns>
-    HRESULT                 InitializeDefaultSensor();
-
-    /// <summary>
-    /// Handle new depth data
-    /// <param name="nTime">timestamp of frame</param>
-    /// <param name="pBuffer">pointer to frame data</param>
-    /// <param name="nWidth">width (in pixels) of input image data</param>
-    /// <param name="nHeight">height (in pixels) of input image data</param>
-    /// <param name="nMinDepth">minimum reliable depth</param>
-    /// <param name="nMaxDepth">maximum reliable depth</param>
-    /// </summary>
-    void                    ProcessDepth(INT64 nTime, const UINT16* pBuffer, int nHeight, int nWidth, USHORT nMinDepth, USHORT nMaxDepth);
+    HRESULT                 InitializeFrameSource();
 
     /// <summary>
-    /// Handle new depth data
+    /// Show the frame rate and the time of the latest depth frame
     /// <param name="nTime">timestamp of frame</param>
-    /// <param name="pBuffer">pointer to frame data</param>
-    /// <param name="nWidth">width (in pixels) of input image data</param>
-    /// <param name="nHeight">height (in pixels) of input image data</param>
     /// </summary>
-    void                    ProcessColor(INT64 nTime, UINT16*pBuffer, RGBQUAD* pBufferColor, int nWidth, int nHeight, int nWidthColor, int nHeightColor);
+    void                    ShowFrameRate(INT64 nTime);
 
+    // FramePipelineMapper, through the Kinect's coordinate mapper
+    const float*            MapDepthToColor(const uint16_t* pDepth, FrameArena& arena);
+    const float*            MapColorToDepth(const uint16_t* pDepth, FrameArena& arena);
+    void                    SetRays(PointCloudBuilder& builder, int nRoiX, int nRoiY);
 
     /// <summary>
     /// Set the status bar message
@@ -0,0 +1,421 @@
+//------------------------------------------------------------------------------
+// DepthSpatialFilter.cpp
+//------------------------------------------------------------------------------
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include "SimdSupport.h"
+#include "DepthSpatialFilter.h"
+
+// a kept pixel needs this many of its 8 neighbors on its surface; a hole is
+// filled when this many neighbors are valid and agree
+static const int cMinSupport = 3;
+static const int cMinFill = 6;
+
+// bilateral taps at distance 0, 1, 2, and the full range weight
+static const int cRadius = 2;
+static const int cSpatialWeights[cRadius + 1] = { 4, 3, 1 };
+static const int cRangeWeight = 256;
+
+static const int cMaxThresholdScale = 65535;
+
+static inline uint16_t Threshold(uint16_t nDepth, uint16_t nScale)
+{
+    return static_cast<uint16_t>((static_cast<uint32_t>(nDepth) * nScale) >> 16);
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+DepthSpatialFilter::DepthSpatialFilter(FrameArena& arena, int nWidth, int nHeight) :
+    m_arena(arena),
+    m_nWidth(nWidth),
+    m_nHeight(nHeight),
+    m_nThreads(1),
+    m_nThresholdScale(0),
+    m_fBudget(0.0),
+    m_eBudgetLevel(SpatialFilterBilateral),
+    m_eLastLevel(SpatialFilterOff),
+    m_nReducedFrames(0),
+    m_ePass(PassSpeckle),
+    m_bSimd(false),
+    m_pIn(NULL),
+    m_pOut(NULL)
+{
+    m_threader = igtl::MultiThreader::New();
+    SetThreadCount(0);
+    SetThreshold(20);
+}
+
+/// <summary>
+/// Number of worker threads; 0 uses one per core
+/// </summary>
+void DepthSpatialFilter::SetThreadCount(int nThreads)
+{
+    m_nThreads = nThreads > 0 ? nThreads : igtl::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    if (m_nThreads < 1)
+    {
+        m_nThreads = 1;
+    }
+}
+
+/// <summary>
+/// Same-surface depth difference in millimeters at 1 m
+/// </summary>
+void DepthSpatialFilter::SetThreshold(int nThreshold)
+{
+    int nScale = nThreshold > 0 ? (nThreshold * 65536 + 500) / 1000 : 0;
+    m_nThresholdScale = static_cast<uint16_t>(nScale > cMaxThresholdScale ? cMaxThresholdScale : nScale);
+}
+
+/// <summary>
+/// Time a frame may take, 0 for no limit
+/// </summary>
+void DepthSpatialFilter::SetTimeBudget(double fSeconds)
+{
+    m_fBudget = fSeconds;
+    m_eBudgetLevel = SpatialFilterBilateral;
+    m_nReducedFrames = 0;
+}
+
+/// <summary>
+/// Filter a frame at the level the time budget allows
+/// </summary>
+void DepthSpatialFilter::Filter(SpatialFilterMode eMode, const uint16_t* pDepth, uint16_t* pFiltered)
+{
+    SpatialFilterMode eLevel = eMode < m_eBudgetLevel ? eMode : m_eBudgetLevel;
+    m_bSimd = SimdSupport::HasAVX2();
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    Run(eLevel, pDepth, pFiltered);
+    double fSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    m_eLastLevel = eLevel;
+
+    if (m_fBudget <= 0.0)
+    {
+        return;
+    }
+    if (fSeconds > m_fBudget && eLevel == SpatialFilterBilateral)
+    {
+        m_eBudgetLevel = SpatialFilterSpeckle;
+        m_nReducedFrames = 0;
+    }
+    else if (m_eBudgetLevel != SpatialFilterBilateral && ++m_nReducedFrames >= cRetryFrames)
+    {
+        m_eBudgetLevel = SpatialFilterBilateral;
+    }
+}
+
+/// <summary>
+/// Reference implementation, one pixel at a time on one thread
+/// </summary>
+void DepthSpatialFilter::FilterScalar(SpatialFilterMode eMode, const uint16_t* pDepth, uint16_t* pFiltered)
+{
+    int nThreads = m_nThreads;
+    m_nThreads = 1;
+    m_bSimd = false;
+    Run(eMode, pDepth, pFiltered);
+    m_nThreads = nThreads;
+    m_eLastLevel = eMode;
+}
+
+void DepthSpatialFilter::Run(SpatialFilterMode eMode, const uint16_t* pDepth, uint16_t* pFiltered)
+{
+    if (eMode == SpatialFilterOff)
+    {
+        memcpy(pFiltered, pDepth, m_nWidth * m_nHeight * sizeof(uint16_t));
+        return;
+    }
+
+    // speckle into the output, then through the scratch and back
+    Execute(PassSpeckle, pDepth, pFiltered);
+    if (eMode == SpatialFilterBilateral)
+    {
+        uint16_t* pScratch = m_arena.Allocate<uint16_t>(m_nWidth * m_nHeight);
+        if (pScratch)
+        {
+            Execute(PassHorizontal, pFiltered, pScratch);
+            Execute(PassVertical, pScratch, pFiltered);
+        }
+    }
+}
+
+/// <summary>
+/// Run one pass on all threads and wait for it
+/// </summary>
+void DepthSpatialFilter::Execute(Pass ePass, const uint16_t* pIn, uint16_t* pOut)
+{
+    m_ePass = ePass;
+    m_pIn = pIn;
+    m_pOut = pOut;
+    int nTasks = (m_nHeight + cTileRows - 1) / cTileRows;
+    if (m_nThreads == 1)
+    {
+        igtl::MultiThreader::ThreadInfo info;
+        info.ThreadID = 0;
+        info.NumberOfThreads = 1;
+        info.UserData = this;
+        Worker(&info);
+        return;
+    }
+    m_threader->SetNumberOfThreads(m_nThreads < nTasks ? m_nThreads : nTasks);
+    m_threader->SetSingleMethod((igtl::ThreadFunctionType) &DepthSpatialFilter::Worker, this);
+    m_threader->SingleMethodExecute();
+}
+
+/// <summary>
+/// Worker entry point
+/// </summary>
+void* DepthSpatialFilter::Worker(void* ptr)
+{
+    igtl::MultiThreader::ThreadInfo* info = static_cast<igtl::MultiThreader::ThreadInfo*>(ptr);
+    DepthSpatialFilter* self = static_cast<DepthSpatialFilter*>(info->UserData);
+
+    int nTasks = (self->m_nHeight + cTileRows - 1) / cTileRows;
+    for (int task = info->ThreadID; task < nTasks; task += info->NumberOfThreads)
+    {
+        int nRowEnd = std::min((task + 1) * cTileRows, self->m_nHeight);
+        for (int y = task * cTileRows; y < nRowEnd; ++y)
+        {
+            if (self->m_ePass == PassSpeckle)
+            {
+                self->SpeckleRow(y);
+            }
+            else
+            {
+                self->BilateralRow(y, self->m_ePass == PassVertical);
+            }
+        }
+    }
+    return NULL;
+}
+
+/// <summary>
+/// Speckle removal and hole filling of one row; the kernel covers the
+/// interior, the pixel function the image border
+/// </summary>
+void DepthSpatialFilter::SpeckleRow(int y) const
+{
+    int x = 0;
+#if DEPTH_SIMD_X86
+    if (m_bSimd && y > 0 && y < m_nHeight - 1)
+    {
+        m_pOut[y * m_nWidth] = SpecklePixel(0, y);
+        for (x = 1; x + 16 <= m_nWidth - 1; x += 16)
+        {
+            SpeckleAVX2(y * m_nWidth + x);
+        }
+    }
+#endif
+    for (; x < m_nWidth; ++x)
+    {
+        m_pOut[y * m_nWidth + x] = SpecklePixel(x, y);
+    }
+}
+
+/// <summary>
+/// One direction of the bilateral filter for one row
+/// </summary>
+void DepthSpatialFilter::BilateralRow(int y, bool bVertical) const
+{
+    int x = 0;
+#if DEPTH_SIMD_X86
+    if (m_bSimd)
+    {
+        if (bVertical)
+        {
+            // rows past the border are skipped for every pixel of the row alike
+            int nTapBegin = std::max(-cRadius, -y);
+            int nTapEnd = std::min(cRadius, m_nHeight - 1 - y);
+            for (; x + 8 <= m_nWidth; x += 8)
+            {
+                BilateralAVX2(y * m_nWidth + x, m_nWidth, nTapBegin, nTapEnd);
+            }
+        }
+        else
+        {
+            for (; x < cRadius; ++x)
+            {
+                m_pOut[y * m_nWidth + x] = BilateralPixel(x, y, false);
+            }
+            for (; x + 8 <= m_nWidth - cRadius; x += 8)
+            {
+                BilateralAVX2(y * m_nWidth + x, 1, -cRadius, cRadius);
+            }
+        }
+    }
+#endif
+    for (; x < m_nWidth; ++x)
+    {
+        m_pOut[y * m_nWidth + x] = BilateralPixel(x, y, bVertical);
+    }
+}
+
+// A valid pixel stays if enough neighbors are within its threshold; a hole
+// takes the middle of its valid neighbors if enough of them agree within the
+// threshold of the nearest. Neighbors outside the image count as invalid.
+uint16_t DepthSpatialFilter::SpecklePixel(int x, int y) const
+{
+    uint16_t c = m_pIn[y * m_nWidth + x];
+    uint16_t nThreshold = Threshold(c, m_nThresholdScale);
+    int nSupport = 0;
+    int nValid = 0;
+    uint16_t nMin = 0xFFFF;
+    uint16_t nMax = 0;
+    for (int dy = -1; dy <= 1; ++dy)
+    {
+        for (int dx = -1; dx <= 1; ++dx)
+        {
+            int nx = x + dx;
+            int ny = y + dy;
+            if ((dx == 0 && dy == 0) || nx < 0 || nx >= m_nWidth || ny < 0 || ny >= m_nHeight)
+            {
+                continue;
+            }
+            uint16_t n = m_pIn[ny * m_nWidth + nx];
+            if (n == 0)
+            {
+                continue;
+            }
+            ++nValid;
+            nMin = std::min(nMin, n);
+            nMax = std::max(nMax, n);
+            nSupport += (n > c ? n - c : c - n) <= nThreshold;
+        }
+    }
+
+    if (c != 0)
+    {
+        return nSupport >= cMinSupport ? c : 0;
+    }
+    if (nValid >= cMinFill && nMax - nMin <= Threshold(nMin, m_nThresholdScale))
+    {
+        return static_cast<uint16_t>((nMin + nMax + 1) >> 1);
+    }
+    return 0;
+}
+
+// Taps weigh spatial x range weight, the range weight falling linearly from
+// cRangeWeight to 0 at the threshold (at least 1 mm); invalid taps and taps
+// outside the image weigh nothing. The result is the center plus the weighted
+// mean difference, so the sums stay small.
+uint16_t DepthSpatialFilter::BilateralPixel(int x, int y, bool bVertical) const
+{
+    uint16_t c = m_pIn[y * m_nWidth + x];
+    if (c == 0)
+    {
+        return 0;
+    }
+
+    int nSigma = std::max<int>(1, Threshold(c, m_nThresholdScale));
+    float fInverse = static_cast<float>(cRangeWeight) / static_cast<float>(nSigma);
+    int nSumWeight = 0;
+    int nSumWeighted = 0;
+    for (int k = -cRadius; k <= cRadius; ++k)
+    {
+        int nx = bVertical ? x : x + k;
+        int ny = bVertical ? y + k : y;
+        if (nx < 0 || nx >= m_nWidth || ny < 0 || ny >= m_nHeight)
+        {
+            continue;
+        }
+        uint16_t n = m_pIn[ny * m_nWidth + nx];
+        if (n == 0)
+        {
+            continue;
+        }
+        int nDifference = static_cast<int>(n) - static_cast<int>(c);
+        int nRange = cRangeWeight - static_cast<int>(static_cast<float>(abs(nDifference)) * fInverse);
+        if (nRange <= 0)
+        {
+            continue;
+        }
+        int nWeight = nRange * cSpatialWeights[abs(k)];
+        nSumWeight += nWeight;
+        nSumWeighted += nWeight * nDifference;
+    }
+
+    long nValue = static_cast<long>(c) + lrintf(static_cast<float>(nSumWeighted) / static_cast<float>(nSumWeight));
+    return static_cast<uint16_t>(nValue < 0 ? 0 : (nValue > 65535 ? 65535 : nValue));
+}
+
+#if DEPTH_SIMD_X86
+
+// Sixteen interior pixels; unsigned differences are max - min, "within the
+// threshold" is a zero saturating difference, and counters are decremented
+// by the all-ones compare results.
+DEPTH_TARGET_AVX2
+void DepthSpatialFilter::SpeckleAVX2(int i) const
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i scale = _mm256_set1_epi16(static_cast<short>(m_nThresholdScale));
+    static const int offsets[8] = { -1, 1, 0, 0, -1, 1, -1, 1 };
+    static const int rows[8] = { 0, 0, -1, 1, -1, -1, 1, 1 };
+
+    __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(m_pIn + i));
+    __m256i threshold = _mm256_mulhi_epu16(c, scale);
+    __m256i support = zero;
+    __m256i valid = zero;
+    __m256i lowest = _mm256_cmpeq_epi16(zero, zero);
+    __m256i highest = zero;
+    for (int k = 0; k < 8; ++k)
+    {
+        __m256i n = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(m_pIn + i + rows[k] * m_nWidth + offsets[k]));
+        __m256i missing = _mm256_cmpeq_epi16(n, zero);
+        __m256i difference = _mm256_sub_epi16(_mm256_max_epu16(n, c), _mm256_min_epu16(n, c));
+        __m256i close = _mm256_andnot_si256(missing, _mm256_cmpeq_epi16(_mm256_subs_epu16(difference, threshold), zero));
+        support = _mm256_sub_epi16(support, close);
+        valid = _mm256_sub_epi16(valid, _mm256_andnot_si256(missing, _mm256_cmpeq_epi16(zero, zero)));
+        lowest = _mm256_min_epu16(lowest, _mm256_or_si256(n, missing));
+        highest = _mm256_max_epu16(highest, n);
+    }
+
+    __m256i keep = _mm256_cmpgt_epi16(support, _mm256_set1_epi16(cMinSupport - 1));
+    __m256i agree = _mm256_cmpeq_epi16(_mm256_subs_epu16(_mm256_sub_epi16(highest, lowest),
+                                                         _mm256_mulhi_epu16(lowest, scale)), zero);
+    __m256i fill = _mm256_and_si256(_mm256_cmpgt_epi16(valid, _mm256_set1_epi16(cMinFill - 1)), agree);
+    __m256i kept = _mm256_and_si256(c, keep);
+    __m256i filled = _mm256_and_si256(_mm256_avg_epu16(lowest, highest), fill);
+    __m256i result = _mm256_blendv_epi8(filled, kept, _mm256_xor_si256(_mm256_cmpeq_epi16(c, zero), _mm256_cmpeq_epi16(zero, zero)));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(m_pOut + i), result);
+}
+
+// Eight pixels in 32-bit lanes, taps nTapBegin..nTapEnd at nStep apart; the
+// same float operations as BilateralPixel, so the results match bit for bit.
+DEPTH_TARGET_AVX2
+void DepthSpatialFilter::BilateralAVX2(int i, int nStep, int nTapBegin, int nTapEnd) const
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i range = _mm256_set1_epi32(cRangeWeight);
+
+    __m256i c = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(m_pIn + i)));
+    __m256i sigma = _mm256_max_epi32(_mm256_set1_epi32(1),
+                                     _mm256_srli_epi32(_mm256_mullo_epi32(c, _mm256_set1_epi32(m_nThresholdScale)), 16));
+    __m256 inverse = _mm256_div_ps(_mm256_set1_ps(static_cast<float>(cRangeWeight)), _mm256_cvtepi32_ps(sigma));
+    __m256i sumWeight = zero;
+    __m256i sumWeighted = zero;
+    for (int k = nTapBegin; k <= nTapEnd; ++k)
+    {
+        __m256i n = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(m_pIn + i + k * nStep)));
+        __m256i difference = _mm256_sub_epi32(n, c);
+        __m256i rangeWeight = _mm256_sub_epi32(range,
+            _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_abs_epi32(difference)), inverse)));
+        rangeWeight = _mm256_andnot_si256(_mm256_cmpeq_epi32(n, zero), _mm256_max_epi32(rangeWeight, zero));
+        __m256i weight = _mm256_mullo_epi32(rangeWeight, _mm256_set1_epi32(cSpatialWeights[k < 0 ? -k : k]));
+        sumWeight = _mm256_add_epi32(sumWeight, weight);
+        sumWeighted = _mm256_add_epi32(sumWeighted, _mm256_mullo_epi32(weight, difference));
+    }
+
+    // a zero center has no weight at all; it stays zero
+    __m256i missing = _mm256_cmpeq_epi32(c, zero);
+    __m256 sum = _mm256_cvtepi32_ps(_mm256_or_si256(sumWeight, _mm256_and_si256(missing, _mm256_set1_epi32(1))));
+    __m256i mean = _mm256_cvtps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(sumWeighted), sum));
+    __m256i value = _mm256_andnot_si256(missing, _mm256_add_epi32(c, mean));
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(value, value), 0xD8);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(m_pOut + i), _mm256_castsi256_si128(packed));
+}
+
+#endif
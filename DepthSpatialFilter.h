@@ -0,0 +1,124 @@
+//------------------------------------------------------------------------------
+// DepthSpatialFilter.h
+//------------------------------------------------------------------------------
+
+// Spatial cleanup of a depth frame. Speckle removal drops pixels with too few
+// neighbors on their surface (speckle and the flying pixels along depth edges)
+// and fills one- and two-pixel holes whose neighbors agree. The bilateral
+// filter then smooths each surface with a separable 5-tap kernel whose range
+// weight falls to zero at the noise threshold, so depth edges stay sharp.
+// Rows are split into tiles across threads; every pass reads one buffer and
+// writes another, so the output never depends on the thread count or timing.
+
+#pragma once
+
+#include <stdint.h>
+#include "igtlMultiThreader.h"
+#include "FrameArena.h"
+
+enum SpatialFilterMode
+{
+    SpatialFilterOff = 0,
+    SpatialFilterSpeckle = 1,   // speckle and flying pixel removal, small hole filling
+    SpatialFilterBilateral = 2  // the above, then the edge-preserving bilateral filter
+};
+
+class DepthSpatialFilter
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    /// <param name="arena">arena for the per-frame scratch, rewound by the caller between frames</param>
+    /// <param name="nWidth">width of the depth frame</param>
+    /// <param name="nHeight">height of the depth frame</param>
+    DepthSpatialFilter(FrameArena& arena, int nWidth, int nHeight);
+
+    /// <summary>
+    /// Number of worker threads; 0 uses one per core
+    /// </summary>
+    void SetThreadCount(int nThreads);
+
+    /// <summary>
+    /// Depth difference, in millimeters at 1 m, within which neighbors are on
+    /// the same surface; it scales with depth as the sensor noise does
+    /// </summary>
+    void SetThreshold(int nThreshold);
+
+    /// <summary>
+    /// Time a frame may take, 0 for no limit. A frame over budget drops the
+    /// bilateral filter for the next frames, and it is retried every
+    /// cRetryFrames frames; the output of a frame depends only on its level.
+    /// </summary>
+    void SetTimeBudget(double fSeconds);
+
+    /// <summary>
+    /// Mode the last frame was filtered with, after the time budget
+    /// </summary>
+    SpatialFilterMode GetLevel() const { return m_eLastLevel; }
+
+    /// <summary>
+    /// Filter a frame, picking the AVX2 kernels when available
+    /// </summary>
+    /// <param name="eMode">SpatialFilterSpeckle or SpatialFilterBilateral</param>
+    /// <param name="pDepth">raw depth in millimeters</param>
+    /// <param name="pFiltered">filtered depth output, not overlapping pDepth</param>
+    void Filter(SpatialFilterMode eMode, const uint16_t* pDepth, uint16_t* pFiltered);
+
+    /// <summary>
+    /// Reference implementation, one pixel at a time on one thread, without
+    /// the time budget
+    /// </summary>
+    void FilterScalar(SpatialFilterMode eMode, const uint16_t* pDepth, uint16_t* pFiltered);
+
+private:
+    DepthSpatialFilter(const DepthSpatialFilter&);
+    DepthSpatialFilter& operator=(const DepthSpatialFilter&);
+
+    enum Pass { PassSpeckle, PassHorizontal, PassVertical };
+
+    /// <summary>
+    /// Run the passes of eMode on all threads
+    /// </summary>
+    void                    Run(SpatialFilterMode eMode, const uint16_t* pDepth, uint16_t* pFiltered);
+
+    /// <summary>
+    /// Run one pass on all threads and wait for it
+    /// </summary>
+    void                    Execute(Pass ePass, const uint16_t* pIn, uint16_t* pOut);
+
+    /// <summary>
+    /// Worker entry point; processes row tiles ThreadID, ThreadID + NumberOfThreads, ...
+    /// </summary>
+    static void*            Worker(void* ptr);
+
+    void                    SpeckleRow(int y) const;
+    void                    BilateralRow(int y, bool bVertical) const;
+    uint16_t                SpecklePixel(int x, int y) const;
+    uint16_t                BilateralPixel(int x, int y, bool bVertical) const;
+
+    // As the pixel functions, for 16 (speckle) or 8 (bilateral) pixels from i
+    void                    SpeckleAVX2(int i) const;
+    void                    BilateralAVX2(int i, int nStep, int nTapBegin, int nTapEnd) const;
+
+    static const int        cTileRows = 16;
+    static const int        cRetryFrames = 300;
+
+    FrameArena&             m_arena;
+    int                     m_nWidth;
+    int                     m_nHeight;
+    int                     m_nThreads;
+    igtl::MultiThreader::Pointer m_threader;
+    uint16_t                m_nThresholdScale;  // threshold at depth d is (d * scale) >> 16
+
+    double                  m_fBudget;
+    SpatialFilterMode       m_eBudgetLevel;
+    SpatialFilterMode       m_eLastLevel;
+    int                     m_nReducedFrames;
+
+    // arguments of the pass being executed
+    Pass                    m_ePass;
+    bool                    m_bSimd;
+    const uint16_t*         m_pIn;
+    uint16_t*               m_pOut;
+};
@@ -0,0 +1,277 @@
+//------------------------------------------------------------------------------
+// DepthTemporalFilter.cpp
+//------------------------------------------------------------------------------
+
+#include <string.h>
+#include "SimdSupport.h"
+#include "DepthTemporalFilter.h"
+
+// keeps the threshold below 16384 for any depth, so the AVX2 kernel's signed
+// rounding multiply never sees a step it would overflow on
+static const int cMaxThresholdScale = 16383;
+
+static inline uint16_t AbsoluteDifference(uint16_t a, uint16_t b)
+{
+    return static_cast<uint16_t>(a > b ? a - b : b - a);
+}
+
+/// <summary>
+/// Constructor; the history comes from arena and lives as long as it
+/// </summary>
+DepthTemporalFilter::DepthTemporalFilter(FrameArena& arena, int nWidth, int nHeight, TemporalFilterMode eMode, int nHistory) :
+    m_nPixels(nWidth * nHeight),
+    m_eMode(eMode),
+    m_nHistory(1),
+    m_nWeight(0),
+    m_nThresholdScale(0),
+    m_pAverage(NULL),
+    m_nNext(0)
+{
+    memset(m_pHistory, 0, sizeof(m_pHistory));
+    SetWeight(0.25f);
+    SetThreshold(20);
+
+    if (m_eMode == TemporalFilterAverage)
+    {
+        m_pAverage = arena.Allocate<uint16_t>(m_nPixels);
+    }
+    else if (m_eMode == TemporalFilterMedian)
+    {
+        nHistory = nHistory < 3 ? 3 : (nHistory > cMaxHistory ? cMaxHistory : nHistory);
+        m_nHistory = nHistory | 1;
+        for (int i = 0; i < m_nHistory - 1; ++i)
+        {
+            m_pHistory[i] = arena.Allocate<uint16_t>(m_nPixels);
+        }
+    }
+    Reset();
+}
+
+/// <summary>
+/// Weight of a new reading in the running average, 0 to 1
+/// </summary>
+void DepthTemporalFilter::SetWeight(float fWeight)
+{
+    int nWeight = static_cast<int>(fWeight * 32768.0f + 0.5f);
+    m_nWeight = static_cast<uint16_t>(nWeight < 1 ? 1 : (nWeight > 32767 ? 32767 : nWeight));
+}
+
+/// <summary>
+/// Change, in millimeters at 1 m, above which a pixel counts as moving
+/// </summary>
+void DepthTemporalFilter::SetThreshold(int nThreshold)
+{
+    int nScale = nThreshold > 0 ? (nThreshold * 65536 + 500) / 1000 : 0;
+    m_nThresholdScale = static_cast<uint16_t>(nScale > cMaxThresholdScale ? cMaxThresholdScale : nScale);
+}
+
+/// <summary>
+/// Forget the history
+/// </summary>
+void DepthTemporalFilter::Reset()
+{
+    if (m_pAverage)
+    {
+        memset(m_pAverage, 0, m_nPixels * sizeof(uint16_t));
+    }
+    for (int i = 0; i < m_nHistory - 1; ++i)
+    {
+        if (m_pHistory[i])
+        {
+            memset(m_pHistory[i], 0, m_nPixels * sizeof(uint16_t));
+        }
+    }
+    m_nNext = 0;
+}
+
+/// <summary>
+/// Filter a frame, picking the AVX2 kernel when available
+/// </summary>
+void DepthTemporalFilter::Filter(const uint16_t* pDepth, uint16_t* pFiltered)
+{
+    int nDone = 0;
+    if (m_eMode == TemporalFilterAverage && m_pAverage)
+    {
+#if DEPTH_SIMD_X86
+        if (SimdSupport::HasAVX2())
+        {
+            nDone = m_nPixels & ~15;
+            AverageAVX2(pDepth, pFiltered, nDone);
+        }
+#endif
+        AverageRangeScalar(pDepth, pFiltered, nDone, m_nPixels);
+    }
+    else if (m_eMode == TemporalFilterMedian && m_pHistory[m_nHistory - 2])
+    {
+#if DEPTH_SIMD_X86
+        if (SimdSupport::HasAVX2())
+        {
+            nDone = m_nPixels & ~15;
+            MedianAVX2(pDepth, pFiltered, nDone);
+        }
+#endif
+        MedianRangeScalar(pDepth, pFiltered, nDone, m_nPixels);
+        PushHistory(pDepth);
+    }
+    else
+    {
+        memcpy(pFiltered, pDepth, m_nPixels * sizeof(uint16_t));
+    }
+}
+
+/// <summary>
+/// Reference implementation, one pixel at a time
+/// </summary>
+void DepthTemporalFilter::FilterScalar(const uint16_t* pDepth, uint16_t* pFiltered)
+{
+    if (m_eMode == TemporalFilterAverage && m_pAverage)
+    {
+        AverageRangeScalar(pDepth, pFiltered, 0, m_nPixels);
+    }
+    else if (m_eMode == TemporalFilterMedian && m_pHistory[m_nHistory - 2])
+    {
+        MedianRangeScalar(pDepth, pFiltered, 0, m_nPixels);
+        PushHistory(pDepth);
+    }
+    else
+    {
+        memcpy(pFiltered, pDepth, m_nPixels * sizeof(uint16_t));
+    }
+}
+
+// A reading within the threshold moves the average by weight x difference,
+// rounded; a larger one, or the first, replaces it. No reading (0) leaves the
+// average for when the pixel comes back.
+void DepthTemporalFilter::AverageRangeScalar(const uint16_t* pDepth, uint16_t* pFiltered, int nBegin, int nEnd)
+{
+    for (int i = nBegin; i < nEnd; ++i)
+    {
+        uint16_t d = pDepth[i];
+        if (d == 0)
+        {
+            pFiltered[i] = 0;
+            continue;
+        }
+
+        uint16_t s = m_pAverage[i];
+        uint16_t nDifference = AbsoluteDifference(d, s);
+        uint16_t nThreshold = static_cast<uint16_t>((static_cast<uint32_t>(d) * m_nThresholdScale) >> 16);
+        if (s == 0 || nDifference > nThreshold)
+        {
+            s = d;
+        }
+        else
+        {
+            uint16_t nStep = static_cast<uint16_t>((static_cast<uint32_t>(nDifference) * m_nWeight + 16384) >> 15);
+            s = static_cast<uint16_t>(d > s ? s + nStep : s - nStep);
+        }
+        m_pAverage[i] = s;
+        pFiltered[i] = s;
+    }
+}
+
+// The median of the previous frames and this one; a reading further than the
+// threshold from it is passed through, a missing one takes the median.
+void DepthTemporalFilter::MedianRangeScalar(const uint16_t* pDepth, uint16_t* pFiltered, int nBegin, int nEnd) const
+{
+    uint16_t samples[cMaxHistory];
+    for (int i = nBegin; i < nEnd; ++i)
+    {
+        uint16_t d = pDepth[i];
+        samples[0] = d;
+        for (int k = 1; k < m_nHistory; ++k)
+        {
+            uint16_t v = m_pHistory[k - 1][i];
+            int j = k;
+            for (; j > 0 && samples[j - 1] > v; --j)
+            {
+                samples[j] = samples[j - 1];
+            }
+            samples[j] = v;
+        }
+        uint16_t nMedian = samples[m_nHistory / 2];
+
+        uint16_t nThreshold = static_cast<uint16_t>((static_cast<uint32_t>(d) * m_nThresholdScale) >> 16);
+        pFiltered[i] = d != 0 && AbsoluteDifference(d, nMedian) > nThreshold ? d : nMedian;
+    }
+}
+
+void DepthTemporalFilter::PushHistory(const uint16_t* pDepth)
+{
+    memcpy(m_pHistory[m_nNext], pDepth, m_nPixels * sizeof(uint16_t));
+    m_nNext = m_nNext + 1 < m_nHistory - 1 ? m_nNext + 1 : 0;
+}
+
+#if DEPTH_SIMD_X86
+
+// Sixteen pixels at a time, all unsigned 16-bit: the difference is max - min,
+// "above the threshold" is a nonzero saturating difference, and the rounded
+// step is a rounding multiply by the Q15 weight, which is exact because steps
+// are only taken below the threshold (< 16384).
+DEPTH_TARGET_AVX2
+void DepthTemporalFilter::AverageAVX2(const uint16_t* pDepth, uint16_t* pFiltered, int nPixels)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i weight = _mm256_set1_epi16(static_cast<short>(m_nWeight));
+    const __m256i scale = _mm256_set1_epi16(static_cast<short>(m_nThresholdScale));
+
+    for (int i = 0; i < nPixels; i += 16)
+    {
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pDepth + i));
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(m_pAverage + i));
+
+        __m256i upper = _mm256_max_epu16(d, s);
+        __m256i difference = _mm256_sub_epi16(upper, _mm256_min_epu16(d, s));
+        __m256i threshold = _mm256_mulhi_epu16(d, scale);
+        __m256i still = _mm256_cmpeq_epi16(_mm256_subs_epu16(difference, threshold), zero);
+        __m256i step = _mm256_andnot_si256(_mm256_cmpeq_epi16(s, zero), still);
+
+        __m256i delta = _mm256_mulhrs_epi16(difference, weight);
+        __m256i rising = _mm256_cmpeq_epi16(upper, d);
+        __m256i stepped = _mm256_blendv_epi8(_mm256_sub_epi16(s, delta), _mm256_add_epi16(s, delta), rising);
+        __m256i average = _mm256_blendv_epi8(d, stepped, step);
+
+        __m256i missing = _mm256_cmpeq_epi16(d, zero);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(m_pAverage + i), _mm256_blendv_epi8(average, s, missing));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(pFiltered + i), _mm256_andnot_si256(missing, average));
+    }
+}
+
+// The median comes from an odd-even transposition sort of the history
+// registers, which is min/max only and sorts any n in n rounds.
+DEPTH_TARGET_AVX2
+void DepthTemporalFilter::MedianAVX2(const uint16_t* pDepth, uint16_t* pFiltered, int nPixels) const
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i scale = _mm256_set1_epi16(static_cast<short>(m_nThresholdScale));
+    const int n = m_nHistory;
+
+    for (int i = 0; i < nPixels; i += 16)
+    {
+        __m256i v[cMaxHistory];
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pDepth + i));
+        v[0] = d;
+        for (int k = 1; k < n; ++k)
+        {
+            v[k] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(m_pHistory[k - 1] + i));
+        }
+        for (int round = 0; round < n; ++round)
+        {
+            for (int k = round & 1; k + 1 < n; k += 2)
+            {
+                __m256i low = _mm256_min_epu16(v[k], v[k + 1]);
+                v[k + 1] = _mm256_max_epu16(v[k], v[k + 1]);
+                v[k] = low;
+            }
+        }
+        __m256i median = v[n / 2];
+
+        __m256i difference = _mm256_sub_epi16(_mm256_max_epu16(d, median), _mm256_min_epu16(d, median));
+        __m256i threshold = _mm256_mulhi_epu16(d, scale);
+        __m256i moved = _mm256_andnot_si256(_mm256_cmpeq_epi16(_mm256_subs_epu16(difference, threshold), zero),
+                                            _mm256_xor_si256(_mm256_cmpeq_epi16(d, zero), _mm256_cmpeq_epi16(zero, zero)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(pFiltered + i), _mm256_blendv_epi8(median, d, moved));
+    }
+}
+
+#endif
@@ -0,0 +1,96 @@
+//------------------------------------------------------------------------------
+// DepthTemporalFilter.h
+//------------------------------------------------------------------------------
+
+// Smooths depth over time before it is quantized and encoded. Raw depth
+// flickers by a few millimeters from frame to frame, more at edges and far
+// away, and the encoder spends most of the depth bitrate on that noise. Each
+// pixel is either a running average or the median of its last few readings,
+// and a pixel that moves by more than the noise threshold takes its new
+// reading at once so moving objects don't smear. The history is allocated
+// once; filtering a frame needs no memory.
+
+#pragma once
+
+#include <stdint.h>
+#include "FrameArena.h"
+
+enum TemporalFilterMode
+{
+    TemporalFilterOff = 0,
+    TemporalFilterAverage = 1,  // exponential running average
+    TemporalFilterMedian = 2    // median of the last n readings
+};
+
+class DepthTemporalFilter
+{
+public:
+    static const int        cMaxHistory = 7;
+
+    /// <summary>
+    /// Constructor; the history comes from arena and lives as long as it
+    /// </summary>
+    /// <param name="arena">arena for the history</param>
+    /// <param name="nWidth">width of the depth frame</param>
+    /// <param name="nHeight">height of the depth frame</param>
+    /// <param name="eMode">TemporalFilterAverage or TemporalFilterMedian</param>
+    /// <param name="nHistory">readings the median is taken over, odd, 3 to cMaxHistory</param>
+    DepthTemporalFilter(FrameArena& arena, int nWidth, int nHeight, TemporalFilterMode eMode, int nHistory);
+
+    /// <summary>
+    /// Weight of a new reading in the running average, 0 to 1
+    /// </summary>
+    void SetWeight(float fWeight);
+
+    /// <summary>
+    /// Change, in millimeters at 1 m, above which a pixel counts as moving.
+    /// Sensor noise grows with distance, so the threshold scales with depth.
+    /// </summary>
+    void SetThreshold(int nThreshold);
+
+    /// <summary>
+    /// Forget the history, e.g. after the sensor restarts
+    /// </summary>
+    void Reset();
+
+    /// <summary>
+    /// Filter a frame, picking the AVX2 kernel when available. Depth 0 stays
+    /// 0 for the running average; the median fills it from the history.
+    /// </summary>
+    /// <param name="pDepth">raw depth in millimeters</param>
+    /// <param name="pFiltered">filtered depth output</param>
+    void Filter(const uint16_t* pDepth, uint16_t* pFiltered);
+
+    /// <summary>
+    /// Reference implementation, one pixel at a time
+    /// </summary>
+    void FilterScalar(const uint16_t* pDepth, uint16_t* pFiltered);
+
+private:
+    DepthTemporalFilter(const DepthTemporalFilter&);
+    DepthTemporalFilter& operator=(const DepthTemporalFilter&);
+
+    // Filter pixels [nBegin, nEnd)
+    void AverageRangeScalar(const uint16_t* pDepth, uint16_t* pFiltered, int nBegin, int nEnd);
+    void MedianRangeScalar(const uint16_t* pDepth, uint16_t* pFiltered, int nBegin, int nEnd) const;
+
+    // As the scalar versions from pixel 0, for a multiple of 16 pixels
+    void AverageAVX2(const uint16_t* pDepth, uint16_t* pFiltered, int nPixels);
+    void MedianAVX2(const uint16_t* pDepth, uint16_t* pFiltered, int nPixels) const;
+
+    // Keep the frame as the newest reading of the median's history
+    void PushHistory(const uint16_t* pDepth);
+
+    int                     m_nPixels;
+    TemporalFilterMode      m_eMode;
+    int                     m_nHistory;
+    uint16_t                m_nWeight;          // Q15
+    uint16_t                m_nThresholdScale;  // threshold at depth d is (d * scale) >> 16
+
+    // running average, 0 where there is none yet
+    uint16_t*               m_pAverage;
+
+    // the median's previous m_nHistory - 1 frames; m_nNext is overwritten next
+    uint16_t*               m_pHistory[cMaxHistory];
+    int                     m_nNext;
+};
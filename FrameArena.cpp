@@ -0,0 +1,228 @@
+//------------------------------------------------------------------------------
+// FrameArena.cpp
+//------------------------------------------------------------------------------
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#include "FrameArena.h"
+
+static const size_t cNormalPage = 4096;
+#ifndef _WIN32
+static const size_t cHugePage = 2 * 1024 * 1024;
+#endif
+
+static inline size_t RoundUp(size_t nBytes, size_t nMultiple)
+{
+    return (nBytes + nMultiple - 1) / nMultiple * nMultiple;
+}
+
+#ifdef _WIN32
+/// <summary>
+/// Large pages need SeLockMemoryPrivilege enabled in the process token
+/// </summary>
+static bool EnableLockMemoryPrivilege()
+{
+    HANDLE hToken = NULL;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken))
+    {
+        return false;
+    }
+
+    TOKEN_PRIVILEGES privileges = {0};
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    bool bEnabled = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+                    AdjustTokenPrivileges(hToken, FALSE, &privileges, 0, NULL, NULL) &&
+                    GetLastError() == ERROR_SUCCESS;
+    CloseHandle(hToken);
+    return bEnabled;
+}
+#endif
+
+/// <summary>
+/// Constructor
+/// </summary>
+FrameArena::FrameArena(size_t nBlockSize, bool bHugePages) :
+    m_nBlockSize(nBlockSize),
+    m_bHugePages(bHugePages),
+    m_nBlock(0),
+    m_nOffset(0),
+    m_nPeak(0)
+{
+}
+
+/// <summary>
+/// Destructor
+/// </summary>
+FrameArena::~FrameArena()
+{
+    for (size_t i = 0; i < m_blocks.size(); ++i)
+    {
+        SystemFree(m_blocks[i].pBase, m_blocks[i].nSize);
+    }
+}
+
+/// <summary>
+/// Allocate nBytes, 64-byte aligned
+/// </summary>
+void* FrameArena::Allocate(size_t nBytes)
+{
+    size_t nAligned = RoundUp(nBytes > 0 ? nBytes : 1, cAlignment);
+
+    if (m_blocks.empty() || m_nOffset + nAligned > m_blocks[m_nBlock].nSize)
+    {
+        // move on to the next block, reserving one if it is missing or too small
+        size_t nUsage = GetUsage();
+        size_t nNext = m_blocks.empty() ? 0 : m_nBlock + 1;
+        if (nNext >= m_blocks.size() || m_blocks[nNext].nSize < nAligned)
+        {
+            if (!AddBlock(nAligned > m_nBlockSize ? nAligned : m_nBlockSize, nNext))
+            {
+                return NULL;
+            }
+        }
+        m_nBlock = nNext;
+        m_nOffset = 0;
+        m_blocks[m_nBlock].nUsedBefore = nUsage;
+    }
+
+    void* p = m_blocks[m_nBlock].pBase + m_nOffset;
+    m_nOffset += nAligned;
+
+    size_t nUsage = GetUsage();
+    if (nUsage > m_nPeak)
+    {
+        m_nPeak = nUsage;
+    }
+    return p;
+}
+
+/// <summary>
+/// Current position, to rewind to later
+/// </summary>
+FrameArena::Mark FrameArena::GetMark() const
+{
+    Mark mark = { m_nBlock, m_nOffset };
+    return mark;
+}
+
+/// <summary>
+/// Release everything allocated since the mark was taken
+/// </summary>
+void FrameArena::Rewind(const Mark& mark)
+{
+    m_nBlock = mark.block;
+    m_nOffset = mark.offset;
+}
+
+/// <summary>
+/// Bytes allocated now, including alignment padding
+/// </summary>
+size_t FrameArena::GetUsage() const
+{
+    return m_blocks.empty() ? 0 : m_blocks[m_nBlock].nUsedBefore + m_nOffset;
+}
+
+/// <summary>
+/// Bytes reserved from the system
+/// </summary>
+size_t FrameArena::GetCapacity() const
+{
+    size_t nCapacity = 0;
+    for (size_t i = 0; i < m_blocks.size(); ++i)
+    {
+        nCapacity += m_blocks[i].nSize;
+    }
+    return nCapacity;
+}
+
+/// <summary>
+/// Whether any block is backed by huge pages
+/// </summary>
+bool FrameArena::IsHugePageBacked() const
+{
+    for (size_t i = 0; i < m_blocks.size(); ++i)
+    {
+        if (m_blocks[i].bHugePages)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// <summary>
+/// Reserve a block of at least nBytes from the system and insert it at nPosition
+/// </summary>
+bool FrameArena::AddBlock(size_t nBytes, size_t nPosition)
+{
+    Block block;
+    block.nSize = nBytes;
+    block.nUsedBefore = 0;
+    block.bHugePages = false;
+    block.pBase = static_cast<char*>(SystemAllocate(block.nSize, m_bHugePages, block.bHugePages));
+    if (!block.pBase)
+    {
+        return false;
+    }
+    m_blocks.insert(m_blocks.begin() + nPosition, block);
+    return true;
+}
+
+/// <summary>
+/// Page-aligned memory from the system; nBytes is rounded up to whole pages
+/// </summary>
+void* FrameArena::SystemAllocate(size_t& nBytes, bool bHugePages, bool& bGotHugePages)
+{
+    bGotHugePages = false;
+#ifdef _WIN32
+    static const bool bLargePagesAllowed = EnableLockMemoryPrivilege();
+    size_t nLargePage = GetLargePageMinimum();
+    if (bHugePages && bLargePagesAllowed && nLargePage)
+    {
+        size_t nLarge = RoundUp(nBytes, nLargePage);
+        void* p = VirtualAlloc(NULL, nLarge, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (p)
+        {
+            nBytes = nLarge;
+            bGotHugePages = true;
+            return p;
+        }
+    }
+    nBytes = RoundUp(nBytes, cNormalPage);
+    return VirtualAlloc(NULL, nBytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    nBytes = RoundUp(nBytes, bHugePages ? cHugePage : cNormalPage);
+    void* p = mmap(NULL, nBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (bHugePages)
+    {
+        bGotHugePages = madvise(p, nBytes, MADV_HUGEPAGE) == 0;
+    }
+#endif
+    return p;
+#endif
+}
+
+/// <summary>
+/// Return a block to the system
+/// </summary>
+void FrameArena::SystemFree(void* pBase, size_t nBytes)
+{
+#ifdef _WIN32
+    (void)nBytes;
+    VirtualFree(pBase, 0, MEM_RELEASE);
+#else
+    munmap(pBase, nBytes);
+#endif
+}
@@ -0,0 +1,120 @@
+//------------------------------------------------------------------------------
+// FrameArena.h
+//------------------------------------------------------------------------------
+
+// Bump allocator for frame buffers. Memory comes from a few large blocks,
+// optionally backed by huge pages, and every allocation is 64-byte aligned.
+// Buffers that live as long as the pipeline are allocated first; a mark is
+// taken after them, and rewinding to it at the start of each frame releases
+// all per-frame scratch in O(1). Blocks are kept and reused, so once the
+// first frames have run no memory is allocated. Not thread-safe: allocate
+// from one thread, workers may use the memory.
+
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+class FrameArena
+{
+public:
+    static const size_t     cAlignment = 64;
+
+    /// <summary>
+    /// A position in the arena to rewind to
+    /// </summary>
+    typedef struct
+    {
+        size_t              block;
+        size_t              offset;
+    } Mark;
+
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    /// <param name="nBlockSize">size of each block; larger allocations get a block of their own</param>
+    /// <param name="bHugePages">try to back blocks with huge pages, falling back to normal pages</param>
+    FrameArena(size_t nBlockSize, bool bHugePages);
+
+    /// <summary>
+    /// Destructor
+    /// </summary>
+    ~FrameArena();
+
+    /// <summary>
+    /// Allocate nBytes, 64-byte aligned
+    /// </summary>
+    /// <returns>the memory, or NULL if the system is out of memory</returns>
+    void*                   Allocate(size_t nBytes);
+
+    /// <summary>
+    /// Allocate nCount elements of T, 64-byte aligned; T is not constructed
+    /// </summary>
+    template <typename T>
+    T*                      Allocate(size_t nCount)
+    {
+        return static_cast<T*>(Allocate(nCount * sizeof(T)));
+    }
+
+    /// <summary>
+    /// Current position, to rewind to later
+    /// </summary>
+    Mark                    GetMark() const;
+
+    /// <summary>
+    /// Release everything allocated since the mark was taken
+    /// </summary>
+    void                    Rewind(const Mark& mark);
+
+    /// <summary>
+    /// Bytes allocated now, including alignment padding
+    /// </summary>
+    size_t                  GetUsage() const;
+
+    /// <summary>
+    /// Most bytes ever allocated at once
+    /// </summary>
+    size_t                  GetPeakUsage() const { return m_nPeak; }
+
+    /// <summary>
+    /// Bytes reserved from the system
+    /// </summary>
+    size_t                  GetCapacity() const;
+
+    /// <summary>
+    /// Number of blocks reserved from the system
+    /// </summary>
+    size_t                  GetBlockCount() const { return m_blocks.size(); }
+
+    /// <summary>
+    /// Whether any block is backed by huge pages
+    /// </summary>
+    bool                    IsHugePageBacked() const;
+
+private:
+    FrameArena(const FrameArena&);
+    FrameArena& operator=(const FrameArena&);
+
+    typedef struct
+    {
+        char*               pBase;
+        size_t              nSize;
+        size_t              nUsedBefore;    // bytes in use in all earlier blocks when this one was entered
+        bool                bHugePages;
+    } Block;
+
+    /// <summary>
+    /// Reserve a block of at least nBytes from the system
+    /// </summary>
+    bool                    AddBlock(size_t nBytes, size_t nPosition);
+
+    static void*            SystemAllocate(size_t& nBytes, bool bHugePages, bool& bGotHugePages);
+    static void             SystemFree(void* pBase, size_t nBytes);
+
+    std::vector<Block>      m_blocks;
+    size_t                  m_nBlockSize;
+    bool                    m_bHugePages;
+    size_t                  m_nBlock;       // block being allocated from
+    size_t                  m_nOffset;      // next free byte in it
+    size_t                  m_nPeak;
+};
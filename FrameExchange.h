@@ -0,0 +1,120 @@
+/*=========================================================================
+
+  Latest-wins hand-off of captured frames to the encoder.
+
+  Frame slots rotate between the capture side, which always owns one slot
+  to write into, a queue of complete frames, and the encoder, which owns
+  the slot it is encoding. With a queue depth of 1 this is a triple
+  buffer: publishing replaces the waiting frame and the encoder always
+  gets the newest one, so latency stays flat when the encoder or network
+  hiccups. A deeper queue keeps up to that many frames for receivers that
+  prefer completeness over latency; only when it is full is the oldest
+  frame dropped. Neither side ever waits for the other to finish with a
+  buffer, and the encoder never sees a frame that is still being written.
+
+=========================================================================*/
+
+#pragma once
+
+#include <deque>
+#include <vector>
+#include "igtlConditionVariable.h"
+
+class FrameExchange
+{
+public:
+  enum { MaxQueueDepth = 4, SlotCount = MaxQueueDepth + 2 };
+
+  FrameExchange() : m_Depth(1), m_Write(0), m_Read(-1), m_Stop(false), m_Published(0), m_Dropped(0)
+  {
+    m_FrameReady = igtl::ConditionVariable::New();
+    SetQueueDepth(1);
+  }
+
+  /// Number of complete frames kept for the encoder; call before the first Publish()
+  void SetQueueDepth(int depth)
+  {
+    m_Depth = depth < 1 ? 1 : (depth > MaxQueueDepth ? MaxQueueDepth : depth);
+    m_Free.clear();
+    for (int slot = GetSlotCount() - 1; slot > 0; slot--)
+      m_Free.push_back(slot);
+    m_Write = 0;
+  }
+
+  /// Slots in use for the configured depth: one being written, the queue, one being encoded
+  int GetSlotCount() const { return m_Depth + 2; }
+
+  /// The slot the capture side may write into; only it changes this index
+  int GetWriteSlot() const { return m_Write; }
+
+  /// Queue the written slot for the encoder and take a free one, dropping
+  /// the oldest queued frame if the queue is full
+  void Publish()
+  {
+    m_Lock.Lock();
+    if (static_cast<int>(m_Queue.size()) >= m_Depth)
+    {
+      m_Free.push_back(m_Queue.front());
+      m_Queue.pop_front();
+      m_Dropped++;
+    }
+    m_Queue.push_back(m_Write);
+    m_Write = m_Free.back();
+    m_Free.pop_back();
+    m_Published++;
+    m_FrameReady->Signal();
+    m_Lock.Unlock();
+  }
+
+  /// Wait for the next queued frame and return its slot, which stays the
+  /// encoder's until the next call; -1 once stopped
+  int Acquire()
+  {
+    m_Lock.Lock();
+    while (m_Queue.empty() && !m_Stop)
+      m_FrameReady->Wait(&m_Lock);
+    if (m_Read >= 0)
+    {
+      m_Free.push_back(m_Read);
+      m_Read = -1;
+    }
+    if (!m_Stop)
+    {
+      m_Read = m_Queue.front();
+      m_Queue.pop_front();
+    }
+    int slot = m_Read;
+    m_Lock.Unlock();
+    return slot;
+  }
+
+  /// Wake the encoder for good
+  void Stop()
+  {
+    m_Lock.Lock();
+    m_Stop = true;
+    m_FrameReady->Broadcast();
+    m_Lock.Unlock();
+  }
+
+  /// Frames published and frames dropped before the encoder took them
+  void GetCounts(int& published, int& dropped)
+  {
+    m_Lock.Lock();
+    published = m_Published;
+    dropped = m_Dropped;
+    m_Lock.Unlock();
+  }
+
+private:
+  igtl::SimpleMutexLock m_Lock;
+  igtl::ConditionVariable::Pointer m_FrameReady;
+  int   m_Depth;
+  int   m_Write;
+  int   m_Read;
+  std::deque<int> m_Queue;
+  std::vector<int> m_Free;
+  bool  m_Stop;
+  int   m_Published;
+  int   m_Dropped;
+};
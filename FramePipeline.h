@@ -0,0 +1,770 @@
+//------------------------------------------------------------------------------
+// FramePipeline.h
+//------------------------------------------------------------------------------
+
+// Everything between a source frame and the encoder that does not depend
+// on the platform: the frame slots and the x264 pictures describing them,
+// depth filtering, decimation and quantization, color registration and
+// conversion, and the point cloud, published to the server ServerControl
+// runs. CDepthSecondVersion adds the Kinect's coordinate mapper and the
+// preview it draws; CHeadlessServer uses the pipeline as it is.
+//
+// The pipeline shares DepthImageServerX264.cpp's options and types with the
+// one translation unit that includes them, so it is defined here.
+
+#pragma once
+
+#include <string.h>
+#include <chrono>
+#include "DepthQuantizer.h"
+#include "DepthPacking.h"
+#include "FrameArena.h"
+#include "FrameSource.h"
+#include "RegistrationEngine.h"
+#include "ColorConversion.h"
+#include "PointCloudBuilder.h"
+#include "DepthDecimator.h"
+#include "DepthTemporalFilter.h"
+#include "DepthSpatialFilter.h"
+#include "DepthImageServerX264.cpp"
+
+/// <summary>
+/// Coordinate mapping of a sensor that knows its own calibration; without
+/// one the pipeline uses the nominal intrinsics
+/// </summary>
+class FramePipelineMapper
+{
+public:
+    /// <summary>
+    /// Destructor
+    /// </summary>
+    virtual ~FramePipelineMapper() {}
+
+    /// <summary>
+    /// Map every depth pixel to color space
+    /// </summary>
+    /// <param name="pDepth">depth frame</param>
+    /// <param name="arena">arena for the result, rewound at the next frame</param>
+    /// <returns>x, y color coordinates per depth pixel; NULL on failure</returns>
+    virtual const float* MapDepthToColor(const uint16_t* pDepth, FrameArena& arena) = 0;
+
+    /// <summary>
+    /// Map every color pixel to depth space
+    /// </summary>
+    /// <param name="pDepth">depth frame</param>
+    /// <param name="arena">arena for the result, rewound at the next frame</param>
+    /// <returns>x, y depth coordinates per color pixel; NULL on failure</returns>
+    virtual const float* MapColorToDepth(const uint16_t* pDepth, FrameArena& arena) = 0;
+
+    /// <summary>
+    /// Give the point cloud builder the sensor's rays for the region at nRoiX, nRoiY
+    /// </summary>
+    /// <param name="builder">builder covering the region of interest</param>
+    /// <param name="nRoiX">left edge of the region</param>
+    /// <param name="nRoiY">top edge of the region</param>
+    virtual void SetRays(PointCloudBuilder& builder, int nRoiX, int nRoiY) = 0;
+};
+
+class FramePipeline
+{
+public:
+    static const int        cDepthWidth  = 512;
+    static const int        cDepthHeight = 424;
+    static const int        cColorWidth = 1920;
+    static const int        cColorHeight = 1080;
+    static const size_t     cArenaBlockSize = 32 * 1024 * 1024;
+
+    /// <summary>
+    /// Constructor, sets up the frame slots and starts the server
+    /// </summary>
+    /// <param name="bPreview">keep a BGRX preview of the depth frame, see GetPreview()</param>
+    /// <param name="bNominalMaps">build the coordinate maps of the nominal intrinsics, for sources without a mapper</param>
+    FramePipeline(bool bPreview, bool bNominalMaps);
+
+    /// <summary>
+    /// Destructor, stops the server
+    /// </summary>
+    ~FramePipeline();
+
+    /// <summary>
+    /// Use the sensor's coordinate mapping instead of the nominal one; NULL for the nominal one
+    /// </summary>
+    void                    SetMapper(FramePipelineMapper* pMapper) { m_pMapper = pMapper; }
+
+    /// <summary>
+    /// Depth preview, cDepthWidth x cDepthHeight BGRX with intensity in red,
+    /// overlaid with the registered color; NULL without bPreview
+    /// </summary>
+    uint32_t*               GetPreview() const { return m_pPreview; }
+
+    /// <summary>
+    /// Port and listening switch of the server
+    /// </summary>
+    DepthImageServerX264::ThreadDataServer& GetServer() { return td_Server; }
+
+    /// <summary>
+    /// Process a source frame into the write slot and publish it to the encoder
+    /// once both its depth and color are in
+    /// </summary>
+    /// <param name="frame">frame the source acquired</param>
+    /// <returns>false if the frame was incomplete, of the wrong size or the arena ran out</returns>
+    bool                    ProcessFrame(const SourceFrame& frame);
+
+private:
+    FramePipeline(const FramePipeline&);
+    FramePipeline& operator=(const FramePipeline&);
+
+    // Sensor coordinate mapping, NULL for the nominal maps
+    FramePipelineMapper*    m_pMapper;
+
+    // The nominal depth to color and color to depth maps, x, y per pixel
+    float*                  m_pNominalColorPoints;
+    float*                  m_pNominalDepthPoints;
+
+    uint32_t*               m_pPreview;
+
+    // All frame buffers. Those that live as long as the pipeline come first;
+    // everything allocated after m_frameMark is released at the next frame.
+    FrameArena              m_arena;
+    FrameArena::Mark        m_frameMark;
+    size_t                  m_nReportedArenaPeak;
+
+    // Part of the depth grid that is filtered, encoded and back-projected;
+    // the whole grid unless a region of interest is set
+    int                     m_nRoiX;
+    int                     m_nRoiY;
+    int                     m_nRoiWidth;
+    int                     m_nRoiHeight;
+
+    // Color onto depth registration, shared across cores
+    RegistrationEngine*     m_pRegistration;
+
+    // Registered color to the ColorFrame stream's YUV planes
+    ColorConverter          m_colorConverter;
+
+    // Depth and registered color to the optional point cloud
+    PointCloudBuilder*      m_pPointCloud;
+
+    // Reduces the depth planes and the point cloud for low-bandwidth clients
+    DepthDecimator*         m_pDecimator;
+
+    // Denoises depth over time before it is quantized; NULL when off
+    DepthTemporalFilter*    m_pTemporalFilter;
+
+    // Removes speckle and smooths depth within each frame; NULL when off
+    DepthSpatialFilter*     m_pSpatialFilter;
+
+    // Depth to preview / DepthFrame / DepthIndex conversion
+    DepthQuantizer          m_depthQuantizer;
+
+    // Depth to YUV444 packing for the DepthPacked stream
+    DepthPacker*            m_pDepthPacker;
+
+    // Plane storage of each frame slot; the x264 pictures describing them
+    // live in td_Server.slots and are handed over through td_Server.exchange
+    uint8_t*                m_pDepthFrameYUV420[FrameExchange::SlotCount];
+    uint8_t*                m_pDepthIndexYUV420[FrameExchange::SlotCount];
+    uint8_t*                m_pColorYUV[FrameExchange::SlotCount];
+    uint8_t*                m_pDepth16[FrameExchange::SlotCount];
+    uint8_t*                m_pDepthPackedYUV444[FrameExchange::SlotCount];
+
+    igtl::MultiThreader::Pointer threaderServer;
+    int                     serverThreadID;
+    DepthImageServerX264::ThreadData td;
+    DepthImageServerX264::ThreadDataServer td_Server;
+
+    /// <summary>
+    /// Allocate the planes of one frame slot and describe them to x264
+    /// </summary>
+    /// <param name="iSlot">slot index</param>
+    void                    InitializeFrameSlot(int iSlot);
+
+    /// <summary>
+    /// Depth into the write slot's depth planes, and into the preview
+    /// </summary>
+    /// <param name="pBuffer">depth frame, cDepthWidth x cDepthHeight</param>
+    /// <param name="nMinDepth">minimum reliable depth</param>
+    /// <param name="nMaxDepth">maximum reliable depth</param>
+    /// <returns>false if the arena ran out</returns>
+    bool                    ProcessDepth(const uint16_t* pBuffer, uint16_t nMinDepth, uint16_t nMaxDepth);
+
+    /// <summary>
+    /// Color registered onto the depth grid into the write slot's color planes
+    /// </summary>
+    /// <param name="pBuffer">depth frame, cDepthWidth x cDepthHeight</param>
+    /// <param name="pBufferColor">BGRA color frame, cColorWidth x cColorHeight</param>
+    /// <returns>false if the mapping failed or the arena ran out</returns>
+    bool                    ProcessColor(const uint16_t* pBuffer, const uint32_t* pBufferColor);
+
+    /// <summary>
+    /// Back-project the frame into the write slot's point cloud
+    /// </summary>
+    /// <param name="pDepth">depth of the region of interest</param>
+    /// <param name="pColor">color registered onto it</param>
+    void                    BuildPointCloud(const uint16_t* pDepth, const uint32_t* pColor);
+
+    /// <summary>
+    /// Copy a nWidth x nHeight rectangle at nX, nY out of a frame into a contiguous buffer
+    /// </summary>
+    template <typename T>
+    static void             CopyRegion(const T* pFrame, int nFrameWidth, int nX, int nY, int nWidth, int nHeight, T* pRegion)
+    {
+        for (int y = 0; y < nHeight; ++y)
+        {
+            memcpy(pRegion + y * nWidth, pFrame + (nY + y) * nFrameWidth + nX, nWidth * sizeof(T));
+        }
+    }
+
+    /// <summary>
+    /// Seconds since start on the steady clock
+    /// </summary>
+    static double           SecondsSince(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+/// <summary>
+/// Constructor
+/// </summary>
+inline FramePipeline::FramePipeline(bool bPreview, bool bNominalMaps) :
+    m_pMapper(NULL),
+    m_pNominalColorPoints(NULL),
+    m_pNominalDepthPoints(NULL),
+    m_pPreview(NULL),
+    m_arena(cArenaBlockSize, FrameArenaHugePages != 0),
+    m_nReportedArenaPeak(0),
+    m_nRoiX(0),
+    m_nRoiY(0),
+    m_nRoiWidth(cDepthWidth),
+    m_nRoiHeight(cDepthHeight),
+    m_pRegistration(NULL),
+    m_pPointCloud(NULL),
+    m_pDecimator(NULL),
+    m_pTemporalFilter(NULL),
+    m_pSpatialFilter(NULL),
+    m_pDepthPacker(NULL)
+{
+    if (bPreview)
+    {
+        m_pPreview = m_arena.Allocate<uint32_t>(cDepthWidth * cDepthHeight);
+    }
+    if (bNominalMaps)
+    {
+        // without a sensor the coordinate maps never change
+        m_pNominalColorPoints = m_arena.Allocate<float>(2 * cDepthWidth * cDepthHeight);
+        m_pNominalDepthPoints = m_arena.Allocate<float>(2 * cColorWidth * cColorHeight);
+        if (m_pNominalColorPoints && m_pNominalDepthPoints)
+        {
+            GetNominalMaps(cDepthWidth, cDepthHeight, cColorWidth, cColorHeight, m_pNominalColorPoints, m_pNominalDepthPoints);
+        }
+    }
+    m_pRegistration = new RegistrationEngine(m_arena, cDepthWidth, cDepthHeight, cColorWidth, cColorHeight);
+    m_pRegistration->SetThreadCount(RegistrationThreads);
+    m_pRegistration->SetColorStride(RegistrationColorStride);
+    GetRegionOfInterest(cDepthWidth, cDepthHeight, m_nRoiX, m_nRoiY, m_nRoiWidth, m_nRoiHeight);
+    m_pPointCloud = new PointCloudBuilder(m_arena, m_nRoiWidth, m_nRoiHeight);
+    m_pDecimator = new DepthDecimator(m_arena, m_nRoiWidth, m_nRoiHeight);
+    m_pDecimator->SetThreadCount(RegistrationThreads);
+    if (TemporalFilter != TemporalFilterOff)
+    {
+        m_pTemporalFilter = new DepthTemporalFilter(m_arena, m_nRoiWidth, m_nRoiHeight,
+            static_cast<TemporalFilterMode>(TemporalFilter), TemporalFilterHistory);
+        m_pTemporalFilter->SetWeight(TemporalFilterWeight / 100.0f);
+        m_pTemporalFilter->SetThreshold(TemporalFilterThreshold);
+    }
+    if (SpatialFilter != SpatialFilterOff)
+    {
+        m_pSpatialFilter = new DepthSpatialFilter(m_arena, m_nRoiWidth, m_nRoiHeight);
+        m_pSpatialFilter->SetThreadCount(RegistrationThreads);
+        m_pSpatialFilter->SetThreshold(SpatialFilterThreshold);
+        m_pSpatialFilter->SetTimeBudget(SpatialFilterBudget / 1000.0);
+    }
+    m_colorConverter.SetFormat(static_cast<ColorMatrix>(ColorStreamMatrix), static_cast<ColorRange>(ColorStreamRange));
+    m_pDepthPacker = DepthPacker::Create(static_cast<DepthPackingScheme>(DepthStreamPacking));
+    td_Server.exchange.SetQueueDepth(FrameQueueDepth);
+    for (int iSlot = 0; iSlot < td_Server.exchange.GetSlotCount(); ++iSlot)
+    {
+        InitializeFrameSlot(iSlot);
+    }
+    // the coordinate maps and registration scratch are taken per frame
+    m_frameMark = m_arena.GetMark();
+
+    // Start the OpenIGTLink server
+    threaderServer = igtl::MultiThreader::New();
+    td_Server.portNum = 18944;
+    td_Server.stop = 1;
+    td.td_Server = &td_Server;
+    td.stop = 0;
+    serverThreadID = threaderServer->SpawnThread((igtl::ThreadFunctionType) &ServerControl, &td);
+}
+
+/// <summary>
+/// Destructor
+/// </summary>
+inline FramePipeline::~FramePipeline()
+{
+    // let the encoder thread leave its wait for the next frame, and wait
+    // for the server to join it and its stream workers: they use the slot
+    // planes in m_arena and td_Server until then
+    td.stop = 1;
+    td_Server.exchange.Stop();
+    threaderServer->TerminateThread(serverThreadID);
+
+    delete m_pDepthPacker;
+    delete m_pRegistration;
+    delete m_pPointCloud;
+    delete m_pDecimator;
+    delete m_pTemporalFilter;
+    delete m_pSpatialFilter;
+}
+
+/// <summary>
+/// Allocate the planes of one frame slot and describe them to x264
+/// </summary>
+/// <param name="iSlot">slot index</param>
+inline void FramePipeline::InitializeFrameSlot(int iSlot)
+{
+    // everything covers the region of interest; the depth streams its decimated planes
+    int frameSize = m_nRoiWidth * m_nRoiHeight;
+    DepthImageServerX264::FrameSlot& slot = td_Server.slots[iSlot];
+
+    int depthWidth = m_nRoiWidth;
+    int depthHeight = m_nRoiHeight;
+    if (DepthDecimation != DecimationNone)
+    {
+        depthWidth = DepthDecimator::GetDecimatedSize(m_nRoiWidth, DecimationFactor);
+        depthHeight = DepthDecimator::GetDecimatedSize(m_nRoiHeight, DecimationFactor);
+    }
+    int depthSize = depthWidth * depthHeight;
+
+    // DepthFrame / DepthIndex are I420 with only luma used; keep chroma neutral
+    uint8_t** pSplit[2] = { &m_pDepthFrameYUV420[iSlot], &m_pDepthIndexYUV420[iSlot] };
+    int iSplit[2] = { DepthImageServerX264::FrameDepthFrame, DepthImageServerX264::FrameDepthIndex };
+    for (int i = 0; i < 2; ++i)
+    {
+        x264_picture_t& pic = slot.pictures[iSplit[i]];
+        x264_picture_init(&pic);
+        *pSplit[i] = m_arena.Allocate<uint8_t>(depthSize * 3 / 2);
+        memset(*pSplit[i] + depthSize, 128, depthSize / 2);
+        pic.img.i_csp = X264_CSP_I420;
+        pic.img.i_plane = 3;
+        pic.img.i_stride[0] = depthWidth;
+        pic.img.i_stride[1] = pic.img.i_stride[2] = depthWidth / 2;
+        pic.img.plane[0] = *pSplit[i];
+        pic.img.plane[1] = pic.img.plane[0] + depthSize;
+        pic.img.plane[2] = pic.img.plane[1] + depthSize / 4;
+    }
+
+    // registered color at depth resolution in ColorStreamFormat; the encoder takes
+    // its colorspace from the picture, so the picture has to describe the buffer
+    x264_picture_t& picColor = slot.pictures[DepthImageServerX264::FrameColor];
+    x264_picture_init(&picColor);
+    picColor.img.i_stride[0] = m_nRoiWidth;
+    if (ColorStreamFormat == ColorFormatI444)
+    {
+        m_pColorYUV[iSlot] = m_arena.Allocate<uint8_t>(frameSize * 3);
+        picColor.img.i_csp = X264_CSP_I444;
+        picColor.img.i_plane = 3;
+        picColor.img.i_stride[1] = picColor.img.i_stride[2] = m_nRoiWidth;
+        picColor.img.plane[0] = m_pColorYUV[iSlot];
+        picColor.img.plane[1] = picColor.img.plane[0] + frameSize;
+        picColor.img.plane[2] = picColor.img.plane[1] + frameSize;
+    }
+    else if (ColorStreamFormat == ColorFormatNV12)
+    {
+        m_pColorYUV[iSlot] = m_arena.Allocate<uint8_t>(frameSize * 3 / 2);
+        picColor.img.i_csp = X264_CSP_NV12;
+        picColor.img.i_plane = 2;
+        picColor.img.i_stride[1] = m_nRoiWidth;
+        picColor.img.plane[0] = m_pColorYUV[iSlot];
+        picColor.img.plane[1] = picColor.img.plane[0] + frameSize;
+    }
+    else
+    {
+        m_pColorYUV[iSlot] = m_arena.Allocate<uint8_t>(frameSize * 3 / 2);
+        picColor.img.i_csp = X264_CSP_I420;
+        picColor.img.i_plane = 3;
+        picColor.img.i_stride[1] = picColor.img.i_stride[2] = m_nRoiWidth / 2;
+        picColor.img.plane[0] = m_pColorYUV[iSlot];
+        picColor.img.plane[1] = picColor.img.plane[0] + frameSize;
+        picColor.img.plane[2] = picColor.img.plane[1] + frameSize / 4;
+    }
+
+    // single depth plane; 8 bit streams take 8 bit samples, 10 bit ones 16 bit
+    // samples with the stride in bytes. The packed stream reuses the buffer
+    // for its 16 bit codes, so it always has room for those.
+    x264_picture_t& picDepth16 = slot.pictures[DepthImageServerX264::FrameDepth16];
+    x264_picture_init(&picDepth16);
+    m_pDepth16[iSlot] = m_arena.Allocate<uint8_t>(depthSize * sizeof(uint16_t));
+    bool bHighDepth = DepthStreamBitDepth > 8;
+#if X264_BUILD >= 153
+    picDepth16.img.i_csp = bHighDepth ? X264_CSP_I400 | X264_CSP_HIGH_DEPTH : X264_CSP_I400;
+#endif
+    picDepth16.img.i_plane = 1;
+    picDepth16.img.plane[0] = m_pDepth16[iSlot];
+    picDepth16.img.i_stride[0] = depthWidth * (bHighDepth ? sizeof(uint16_t) : sizeof(uint8_t));
+
+    // packed depth, 8 bit YUV444
+    x264_picture_t& picDepthPacked = slot.pictures[DepthImageServerX264::FrameDepthPacked];
+    x264_picture_init(&picDepthPacked);
+    m_pDepthPackedYUV444[iSlot] = m_arena.Allocate<uint8_t>(depthSize * 3);
+    picDepthPacked.img.i_csp = X264_CSP_I444;
+    picDepthPacked.img.i_plane = 3;
+    picDepthPacked.img.i_stride[0] = picDepthPacked.img.i_stride[1] = picDepthPacked.img.i_stride[2] = depthWidth;
+    picDepthPacked.img.plane[0] = m_pDepthPackedYUV444[iSlot];
+    picDepthPacked.img.plane[1] = picDepthPacked.img.plane[0] + depthSize;
+    picDepthPacked.img.plane[2] = picDepthPacked.img.plane[1] + depthSize;
+
+    slot.depthPacking = m_pDepthPacker->GetName();
+    slot.depthMin = 0;
+    slot.depthMax = 0;
+    slot.depthStep = 1;
+
+    // the cloud has room for a point per depth pixel
+    slot.pointCount = 0;
+    slot.pointPositions = NULL;
+    slot.pointColors = NULL;
+    slot.pointSeconds = 0.0;
+    slot.filterSeconds = 0.0;
+    slot.spatialSeconds = 0.0;
+    slot.spatialLevel = SpatialFilterOff;
+    memset(&slot.trace, 0, sizeof(slot.trace));
+    if (PointCloudMode != PointCloudOff)
+    {
+        PointFormat eFormat = PointCloudMode == PointCloudInt16 ? PointFormatInt16 : PointFormatFloat32;
+        slot.pointPositions = m_arena.Allocate(frameSize * PointCloudBuilder::GetPositionSize(eFormat));
+        slot.pointColors = m_arena.Allocate<uint8_t>(frameSize * 3);
+    }
+}
+
+/// <summary>
+/// Process a source frame into the write slot and publish it to the encoder
+/// </summary>
+inline bool FramePipeline::ProcessFrame(const SourceFrame& frame)
+{
+    // release the previous frame's scratch
+    m_arena.Rewind(m_frameMark);
+
+    bool bPublished = false;
+    if (frame.pDepth && frame.depthWidth == cDepthWidth && frame.depthHeight == cDepthHeight)
+    {
+        // the write slot carries the capture side of the frame's latency trace
+        FrameTrace& trace = td_Server.slots[td_Server.exchange.GetWriteSlot()].trace;
+        LatencyRecorder::Start(trace);
+        bool bDepth = ProcessDepth(frame.pDepth, frame.minReliableDepth, frame.maxReliableDepth);
+        trace.stamps[TraceDepth] = LatencyRecorder::Now();
+        if (bDepth && frame.pColor && frame.colorWidth == cColorWidth && frame.colorHeight == cColorHeight &&
+            ProcessColor(frame.pDepth, frame.pColor))
+        {
+            trace.stamps[TraceColor] = LatencyRecorder::Now();
+            // Only complete depth + color frames reach the encoder; it picks up
+            // the newest one whenever it is ready, capture never waits for it
+            td_Server.exchange.Publish();
+            bPublished = true;
+        }
+    }
+
+    // the peak only grows while the first frames of each mode run
+    if (m_arena.GetPeakUsage() > m_nReportedArenaPeak)
+    {
+        m_nReportedArenaPeak = m_arena.GetPeakUsage();
+        std::cerr << "Frame arena: peak " << m_nReportedArenaPeak / (1024 * 1024) << " MB of "
+                  << m_arena.GetCapacity() / (1024 * 1024) << " MB in " << m_arena.GetBlockCount() << " blocks"
+                  << (m_arena.IsHugePageBacked() ? ", huge pages" : "") << std::endl;
+    }
+    return bPublished;
+}
+
+/// <summary>
+/// Depth into the write slot's depth planes, and into the preview
+/// </summary>
+inline bool FramePipeline::ProcessDepth(const uint16_t* pBuffer, uint16_t nMinDepth, uint16_t nMaxDepth)
+{
+    // To convert to a byte, we're discarding the most-significant
+    // rather than least-significant bits.
+    // We're preserving detail, although the intensity will "wrap."
+    // The DepthIndex plane carries the discarded bits as (depth - min) / 256 + 1.
+    // Values outside the reliable depth range are mapped to 0 (black) in all outputs.
+    // The quantizer only rebuilds its lookup table when the range changes.
+    // The depth gate narrows the range, so everything outside it is invalid too.
+    if (DepthGateNear > 0 && DepthGateNear > nMinDepth)
+    {
+        nMinDepth = static_cast<uint16_t>(DepthGateNear);
+    }
+    if (DepthGateFar > 0 && DepthGateFar < nMaxDepth)
+    {
+        nMaxDepth = static_cast<uint16_t>(DepthGateFar);
+    }
+    m_depthQuantizer.SetRange(nMinDepth, nMaxDepth);
+    // Capture owns the write slot until ProcessFrame publishes it
+    int iSlot = td_Server.exchange.GetWriteSlot();
+    DepthImageServerX264::FrameSlot& slot = td_Server.slots[iSlot];
+    const uint16_t* pDepth = pBuffer;
+    int frameSize = cDepthWidth * cDepthHeight;
+    uint32_t* pPreview = m_pPreview;
+    if (m_nRoiWidth != cDepthWidth || m_nRoiHeight != cDepthHeight)
+    {
+        // The preview shows the whole frame, so the region can be placed;
+        // everything after it sees only the region
+        uint16_t* pRegion = m_arena.Allocate<uint16_t>(m_nRoiWidth * m_nRoiHeight);
+        if (!pRegion)
+        {
+            return false;
+        }
+        if (pPreview)
+        {
+            uint8_t* pDiscard = m_arena.Allocate<uint8_t>(frameSize * 2);
+            if (!pDiscard)
+            {
+                return false;
+            }
+            m_depthQuantizer.Quantize(pBuffer, frameSize, pPreview, pDiscard, pDiscard + frameSize);
+        }
+        CopyRegion<uint16_t>(pBuffer, cDepthWidth, m_nRoiX, m_nRoiY, m_nRoiWidth, m_nRoiHeight, pRegion);
+        pDepth = pRegion;
+        frameSize = m_nRoiWidth * m_nRoiHeight;
+        pPreview = NULL;
+    }
+    slot.filterSeconds = 0.0;
+    slot.spatialSeconds = 0.0;
+    slot.spatialLevel = SpatialFilterOff;
+    if (m_pSpatialFilter)
+    {
+        // Speckle and flying pixels go before the temporal filter sees them
+        uint16_t* pCleaned = m_arena.Allocate<uint16_t>(frameSize);
+        if (!pCleaned)
+        {
+            return false;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        m_pSpatialFilter->Filter(static_cast<SpatialFilterMode>(SpatialFilter), pDepth, pCleaned);
+        slot.spatialSeconds = SecondsSince(start);
+        slot.spatialLevel = m_pSpatialFilter->GetLevel();
+        pDepth = pCleaned;
+    }
+    if (m_pTemporalFilter)
+    {
+        // Everything below, preview included, sees the denoised frame
+        uint16_t* pFiltered = m_arena.Allocate<uint16_t>(frameSize);
+        if (!pFiltered)
+        {
+            return false;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        m_pTemporalFilter->Filter(pDepth, pFiltered);
+        slot.filterSeconds = SecondsSince(start);
+        pDepth = pFiltered;
+    }
+    if (DepthDecimation != DecimationNone)
+    {
+        // The streams take the reduced plane; the preview stays full size
+        uint16_t* pReduced = m_arena.Allocate<uint16_t>(frameSize);
+        if (!pReduced)
+        {
+            return false;
+        }
+        m_pDecimator->Decimate(static_cast<DecimationMethod>(DepthDecimation), DecimationFactor, pDepth, pReduced);
+        if (pPreview)
+        {
+            uint8_t* pDiscard = m_arena.Allocate<uint8_t>(frameSize * 2);
+            if (!pDiscard)
+            {
+                return false;
+            }
+            m_depthQuantizer.Quantize(pDepth, frameSize, pPreview, pDiscard, pDiscard + frameSize);
+        }
+        pDepth = pReduced;
+        frameSize = DepthDecimator::GetDecimatedSize(m_nRoiWidth, DecimationFactor) * DepthDecimator::GetDecimatedSize(m_nRoiHeight, DecimationFactor);
+        pPreview = NULL;
+    }
+    if (DepthStreamMode == DepthStreamHighBitDepth)
+    {
+        // One plane of codes, the range spread over them when it does not fit the bit depth
+        if (DepthStreamBitDepth > 8)
+        {
+            m_depthQuantizer.QuantizeFitted(pDepth, frameSize, pPreview,
+                reinterpret_cast<uint16_t*>(m_pDepth16[iSlot]), DepthStreamBitDepth);
+        }
+        else
+        {
+            m_depthQuantizer.QuantizeFitted(pDepth, frameSize, pPreview, m_pDepth16[iSlot]);
+        }
+    }
+    else if (DepthStreamMode == DepthStreamPacked)
+    {
+        // Full 16 bit codes, then spread over Y/U/V by the scheme chosen at startup
+        uint16_t nMaxCode = static_cast<uint16_t>(nMaxDepth >= nMinDepth ? nMaxDepth - nMinDepth + 1 : 1);
+        uint16_t* pCode = reinterpret_cast<uint16_t*>(m_pDepth16[iSlot]);
+        uint8_t* pPacked = m_pDepthPackedYUV444[iSlot];
+        m_depthQuantizer.QuantizeFitted(pDepth, frameSize, pPreview, pCode, 16);
+        m_pDepthPacker->Pack(pCode, frameSize, nMaxCode,
+            pPacked, pPacked + frameSize, pPacked + 2 * frameSize);
+    }
+    else
+    {
+        m_depthQuantizer.Quantize(pDepth, frameSize, pPreview,
+            m_pDepthFrameYUV420[iSlot], m_pDepthIndexYUV420[iSlot]);
+    }
+    slot.depthPacking = m_pDepthPacker->GetName();
+    slot.depthMin = nMinDepth;
+    slot.depthMax = nMaxDepth;
+    slot.depthStep = m_depthQuantizer.GetFittedStep(DepthStreamBitDepth);
+    return true;
+}
+
+/// <summary>
+/// Color registered onto the depth grid into the write slot's color planes
+/// </summary>
+inline bool FramePipeline::ProcessColor(const uint16_t* pBuffer, const uint32_t* pBufferColor)
+{
+    uint32_t* pRegistered = m_arena.Allocate<uint32_t>(cDepthWidth * cDepthHeight);
+    if (!pRegistered)
+    {
+        return false;
+    }
+    if (RegistrationMode == RegistrationDepthGather)
+    {
+        // Map the 217k depth pixels to color space and gather their color,
+        // instead of scattering all 2M color pixels onto the depth grid
+        const float* pColorPoints = m_pMapper ? m_pMapper->MapDepthToColor(pBuffer, m_arena) : m_pNominalColorPoints;
+        if (!pColorPoints)
+        {
+            return false;
+        }
+        m_pRegistration->Gather(pColorPoints, pBufferColor, pRegistered, m_pPreview);
+    }
+    else
+    {
+        // Splat the color pixels into a z-buffer on the depth grid and fill
+        // the holes; the same result whatever order the threads run in
+        const float* pDepthPoints = m_pMapper ? m_pMapper->MapColorToDepth(pBuffer, m_arena) : m_pNominalDepthPoints;
+        if (!pDepthPoints)
+        {
+            return false;
+        }
+        m_pRegistration->Scatter(pDepthPoints, pBuffer, pBufferColor, pRegistered, m_pPreview);
+    }
+    int nWidth = cDepthWidth;
+    int nHeight = cDepthHeight;
+    if (m_nRoiWidth != nWidth || m_nRoiHeight != nHeight)
+    {
+        // registration needs the whole frame; what follows only the region
+        uint32_t* pColorRegion = m_arena.Allocate<uint32_t>(m_nRoiWidth * m_nRoiHeight);
+        uint16_t* pDepthRegion = m_arena.Allocate<uint16_t>(m_nRoiWidth * m_nRoiHeight);
+        if (!pColorRegion || !pDepthRegion)
+        {
+            return false;
+        }
+        CopyRegion<uint32_t>(pRegistered, nWidth, m_nRoiX, m_nRoiY, m_nRoiWidth, m_nRoiHeight, pColorRegion);
+        CopyRegion<uint16_t>(pBuffer, nWidth, m_nRoiX, m_nRoiY, m_nRoiWidth, m_nRoiHeight, pDepthRegion);
+        pRegistered = pColorRegion;
+        pBuffer = pDepthRegion;
+        nWidth = m_nRoiWidth;
+        nHeight = m_nRoiHeight;
+    }
+    if (DepthGateNear > 0 || DepthGateFar > 0)
+    {
+        // blank the color behind and in front of the gate, as the depth is
+        const DepthImageServerX264::FrameSlot& slot = td_Server.slots[td_Server.exchange.GetWriteSlot()];
+        for (int i = 0; i < nWidth * nHeight; ++i)
+        {
+            if (pBuffer[i] < slot.depthMin || pBuffer[i] > slot.depthMax)
+            {
+                pRegistered[i] = 0;
+            }
+        }
+    }
+
+    // the planes follow each other as InitializeFrameSlot laid them out
+    int frameSize = nWidth * nHeight;
+    uint8_t* pY = m_pColorYUV[td_Server.exchange.GetWriteSlot()];
+    if (ColorStreamFormat == ColorFormatI444)
+    {
+        m_colorConverter.Convert(pRegistered, nWidth, nHeight, Chroma444, pY, pY + frameSize, pY + 2 * frameSize);
+    }
+    else if (ColorStreamFormat == ColorFormatNV12)
+    {
+        uint8_t* pU = m_arena.Allocate<uint8_t>(frameSize / 2);
+        if (!pU)
+        {
+            return false;
+        }
+        m_colorConverter.Convert(pRegistered, nWidth, nHeight, Chroma420, pY, pU, pU + frameSize / 4);
+        ColorConverter::InterleaveChroma(pU, pU + frameSize / 4, frameSize / 4, pY + frameSize);
+    }
+    else
+    {
+        m_colorConverter.Convert(pRegistered, nWidth, nHeight, Chroma420, pY, pY + frameSize, pY + frameSize + frameSize / 4);
+    }
+    if (PointCloudMode != PointCloudOff)
+    {
+        BuildPointCloud(pBuffer, pRegistered);
+    }
+    return true;
+}
+
+/// <summary>
+/// Back-project the frame into the write slot's point cloud
+/// </summary>
+inline void FramePipeline::BuildPointCloud(const uint16_t* pDepth, const uint32_t* pColor)
+{
+    DepthImageServerX264::FrameSlot& slot = td_Server.slots[td_Server.exchange.GetWriteSlot()];
+    slot.pointCount = 0;
+    if (!slot.pointPositions || !slot.pointColors)
+    {
+        return;
+    }
+
+    if (!m_pPointCloud->HasRays())
+    {
+        if (m_pMapper)
+        {
+            // the sensor may not have reported its intrinsics yet
+            m_pMapper->SetRays(*m_pPointCloud, m_nRoiX, m_nRoiY);
+        }
+        else
+        {
+            // no sensor to ask; the pinhole model of the nominal intrinsics
+            m_pPointCloud->SetIntrinsics(cNominalDepthFocal, cNominalDepthFocal,
+                cNominalDepthCenterX - m_nRoiX, cNominalDepthCenterY - m_nRoiY);
+        }
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    PointFormat eFormat = PointCloudMode == PointCloudInt16 ? PointFormatInt16 : PointFormatFloat32;
+    uint16_t nMinDepth = static_cast<uint16_t>(slot.depthMin);
+    uint16_t nMaxDepth = static_cast<uint16_t>(slot.depthMax);
+    int frameSize = m_nRoiWidth * m_nRoiHeight;
+    if (PointCloudDecimation == DecimationStride || PointCloudDecimation == DecimationMedian)
+    {
+        // zero depth everywhere but at the block centers, which back-projection skips
+        uint16_t* pThinned = m_arena.Allocate<uint16_t>(frameSize);
+        if (!pThinned)
+        {
+            return;
+        }
+        m_pDecimator->Thin(static_cast<DecimationMethod>(PointCloudDecimation), DecimationFactor, pDepth, pThinned);
+        pDepth = pThinned;
+    }
+    if (PointCloudDecimation == DecimationVoxel)
+    {
+        // the full cloud goes to scratch, its voxel centroids to the slot
+        void* pPositions = m_arena.Allocate(frameSize * PointCloudBuilder::GetPositionSize(eFormat));
+        uint8_t* pColors = m_arena.Allocate<uint8_t>(frameSize * 3);
+        if (!pPositions || !pColors)
+        {
+            return;
+        }
+        int nPoints = m_pPointCloud->Build(pDepth, pColor, nMinDepth, nMaxDepth, eFormat, pPositions, pColors);
+        float fLeafSize = eFormat == PointFormatInt16 ? static_cast<float>(VoxelSize) : VoxelSize * 0.001f;
+        slot.pointCount = m_pDecimator->VoxelFilter(pPositions, pColors, nPoints, eFormat, fLeafSize,
+            slot.pointPositions, slot.pointColors);
+    }
+    else
+    {
+        slot.pointCount = m_pPointCloud->Build(pDepth, pColor, nMinDepth, nMaxDepth,
+            eFormat, slot.pointPositions, slot.pointColors);
+    }
+    slot.pointSeconds = SecondsSince(start);
+}
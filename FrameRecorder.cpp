@@ -0,0 +1,445 @@
+//------------------------------------------------------------------------------
+// FrameRecorder.cpp
+//------------------------------------------------------------------------------
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include <string.h>
+#include "FrameRecorder.h"
+
+// room for a FrameRecordHeader; the frames start cache-line aligned after it
+static const uint32_t cHeaderSize = 64;
+
+// frames an hour at 30 fps, so the writer's index rarely has to grow
+static const size_t cIndexReserve = 30 * 60 * 60;
+
+static inline uint32_t RoundUp(uint32_t nBytes, uint32_t nMultiple)
+{
+    return (nBytes + nMultiple - 1) / nMultiple * nMultiple;
+}
+
+/// <summary>
+/// Constructor; the slots are allocated here, the file by Open
+/// </summary>
+FrameRecorder::FrameRecorder(int nDepthWidth, int nDepthHeight, int nColorWidth, int nColorHeight) :
+    m_nDepthWidth(nDepthWidth),
+    m_nDepthHeight(nDepthHeight),
+    m_nColorWidth(nColorWidth),
+    m_nColorHeight(nColorHeight),
+    m_nThreadID(-1),
+    m_bOpen(false),
+    m_bStop(false),
+    m_nFrameNumber(0),
+    m_nRecorded(0),
+    m_nDropped(0),
+#ifdef _WIN32
+    m_hFile(INVALID_HANDLE_VALUE),
+#else
+    m_nFile(-1),
+#endif
+    m_pCurrent(NULL),
+    m_pNext(NULL),
+    m_nCurrentOffset(0),
+    m_nUsed(0),
+    m_bFailed(false)
+{
+    m_queued = igtl::ConditionVariable::New();
+    m_threader = igtl::MultiThreader::New();
+
+    uint32_t nDepthSize = static_cast<uint32_t>(nDepthWidth * nDepthHeight * sizeof(uint16_t));
+    uint32_t nColorSize = static_cast<uint32_t>(nColorWidth * nColorHeight * sizeof(uint32_t));
+    uint32_t nRecordSize = RoundUp(cHeaderSize + RoundUp(nDepthSize, cHeaderSize) + nColorSize, cRecordAlignment);
+    for (int i = 0; i < cSlotCount; ++i)
+    {
+        // zeroed once; the padding between the parts is never written
+        m_slots[i].record.assign(nRecordSize, 0);
+        m_slots[i].nSize = 0;
+    }
+}
+
+/// <summary>
+/// Destructor; closes the recording
+/// </summary>
+FrameRecorder::~FrameRecorder()
+{
+    Close();
+}
+
+/// <summary>
+/// Create the file, replacing any old one, and start the writer thread
+/// </summary>
+bool FrameRecorder::Open(const std::string& filename)
+{
+    if (m_bOpen || !CreateRecordingFile(filename))
+    {
+        return false;
+    }
+
+    m_nCurrentOffset = 0;
+    m_pCurrent = MapExtent(0);
+    m_pNext = MapExtent(cExtentSize);
+    if (!m_pCurrent)
+    {
+        UnmapExtent(m_pNext);
+        m_pNext = NULL;
+        CloseRecordingFile();
+        return false;
+    }
+
+    // indexOffset stays 0 until Close, marking a recording that was cut short
+    RecordingHeader header = {0};
+    header.magic = cMagic;
+    header.version = cVersion;
+    header.depthWidth = m_nDepthWidth;
+    header.depthHeight = m_nDepthHeight;
+    header.colorWidth = m_nColorWidth;
+    header.colorHeight = m_nColorHeight;
+    header.extentSize = cExtentSize;
+    memcpy(m_pCurrent, &header, sizeof(header));
+    m_nUsed = cRecordAlignment;
+    m_bFailed = false;
+    m_index.clear();
+    m_index.reserve(cIndexReserve);
+
+    m_free.clear();
+    for (int i = cSlotCount - 1; i >= 0; --i)
+    {
+        m_free.push_back(i);
+    }
+    m_queue.clear();
+    m_bStop = false;
+    m_nFrameNumber = 0;
+    m_nRecorded = 0;
+    m_nDropped = 0;
+    m_nThreadID = m_threader->SpawnThread((igtl::ThreadFunctionType)&FrameRecorder::Writer, this);
+    m_bOpen = true;
+    return true;
+}
+
+/// <summary>
+/// Write what is queued, append the index and close the file
+/// </summary>
+void FrameRecorder::Close()
+{
+    if (!m_bOpen)
+    {
+        return;
+    }
+
+    m_lock.Lock();
+    m_bStop = true;
+    m_queued->Broadcast();
+    m_lock.Unlock();
+    m_threader->TerminateThread(m_nThreadID);
+
+    // the file can only shrink to its used size once nothing maps it
+    uint64_t nEnd = m_nCurrentOffset + m_nUsed;
+    UnmapExtent(m_pCurrent);
+    UnmapExtent(m_pNext);
+    m_pCurrent = NULL;
+    m_pNext = NULL;
+
+    RecordingHeader header = {0};
+    header.magic = cMagic;
+    header.version = cVersion;
+    header.depthWidth = m_nDepthWidth;
+    header.depthHeight = m_nDepthHeight;
+    header.colorWidth = m_nColorWidth;
+    header.colorHeight = m_nColorHeight;
+    header.extentSize = cExtentSize;
+    header.indexOffset = nEnd;
+    header.frameCount = m_index.size();
+    bool bDone = ResizeFile(nEnd) &&
+                 (m_index.empty() || WriteAt(nEnd, &m_index[0], m_index.size() * sizeof(IndexEntry))) &&
+                 WriteAt(0, &header, sizeof(header));
+    if (!bDone)
+    {
+        m_bFailed = true;
+    }
+    CloseRecordingFile();
+    m_bOpen = false;
+}
+
+/// <summary>
+/// Queue a frame; returns at once. Either frame may be NULL.
+/// </summary>
+bool FrameRecorder::Record(int64_t nDepthTime, const uint16_t* pDepth, int64_t nColorTime, const uint32_t* pColor)
+{
+    if (!m_bOpen)
+    {
+        return false;
+    }
+
+    m_lock.Lock();
+    uint64_t nFrameNumber = m_nFrameNumber++;
+    if (m_free.empty())
+    {
+        m_nDropped++;
+        m_lock.Unlock();
+        return false;
+    }
+    int iSlot = m_free.back();
+    m_free.pop_back();
+    m_lock.Unlock();
+
+    // the slot is ours until it is queued
+    Slot& slot = m_slots[iSlot];
+    FrameRecordHeader header = {0};
+    header.magic = cRecordMagic;
+    header.frameNumber = nFrameNumber;
+    header.depthTime = nDepthTime;
+    header.colorTime = nColorTime;
+    header.depthOffset = cHeaderSize;
+    header.depthSize = pDepth ? static_cast<uint32_t>(m_nDepthWidth * m_nDepthHeight * sizeof(uint16_t)) : 0;
+    header.colorOffset = cHeaderSize + RoundUp(static_cast<uint32_t>(m_nDepthWidth * m_nDepthHeight * sizeof(uint16_t)), cHeaderSize);
+    header.colorSize = pColor ? static_cast<uint32_t>(m_nColorWidth * m_nColorHeight * sizeof(uint32_t)) : 0;
+    header.flags = (pDepth ? RecordDepth : 0) | (pColor ? RecordColor : 0);
+
+    uint8_t* pRecord = &slot.record[0];
+    memcpy(pRecord, &header, sizeof(header));
+    uint32_t nEnd = header.depthOffset + header.depthSize;
+    if (pDepth)
+    {
+        memcpy(pRecord + header.depthOffset, pDepth, header.depthSize);
+    }
+    if (pColor)
+    {
+        memcpy(pRecord + header.colorOffset, pColor, header.colorSize);
+        nEnd = header.colorOffset + header.colorSize;
+    }
+    slot.nSize = RoundUp(nEnd, cRecordAlignment);
+    // clear what an earlier, larger record left in the padding
+    memset(pRecord + nEnd, 0, slot.nSize - nEnd);
+
+    m_lock.Lock();
+    m_queue.push_back(iSlot);
+    m_queued->Signal();
+    m_lock.Unlock();
+    return true;
+}
+
+int FrameRecorder::GetRecordedCount()
+{
+    m_lock.Lock();
+    int nRecorded = m_nRecorded;
+    m_lock.Unlock();
+    return nRecorded;
+}
+
+int FrameRecorder::GetDroppedCount()
+{
+    m_lock.Lock();
+    int nDropped = m_nDropped;
+    m_lock.Unlock();
+    return nDropped;
+}
+
+/// <summary>
+/// Writer thread; copies queued slots into the mapping until stopped
+/// </summary>
+void* FrameRecorder::Writer(void* ptr)
+{
+    igtl::MultiThreader::ThreadInfo* info = static_cast<igtl::MultiThreader::ThreadInfo*>(ptr);
+    FrameRecorder* self = static_cast<FrameRecorder*>(info->UserData);
+
+    self->m_lock.Lock();
+    for (;;)
+    {
+        while (self->m_queue.empty() && !self->m_bStop)
+        {
+            self->m_queued->Wait(&self->m_lock);
+        }
+        // a stop still writes everything that was queued before it
+        if (self->m_queue.empty())
+        {
+            break;
+        }
+        int iSlot = self->m_queue.front();
+        self->m_queue.pop_front();
+        self->m_lock.Unlock();
+
+        bool bWritten = self->Write(self->m_slots[iSlot]);
+
+        self->m_lock.Lock();
+        self->m_free.push_back(iSlot);
+        if (bWritten)
+        {
+            self->m_nRecorded++;
+        }
+        else
+        {
+            self->m_nDropped++;
+        }
+    }
+    self->m_lock.Unlock();
+    return NULL;
+}
+
+/// <summary>
+/// Copy one record into the mapping, moving to the next extent if it doesn't fit
+/// </summary>
+bool FrameRecorder::Write(const Slot& slot)
+{
+    if (m_bFailed)
+    {
+        return false;
+    }
+    if (m_nUsed + slot.nSize > cExtentSize && !Advance())
+    {
+        // out of disk or address space; the frames so far stay readable
+        m_bFailed = true;
+        return false;
+    }
+
+    const FrameRecordHeader* pHeader = reinterpret_cast<const FrameRecordHeader*>(&slot.record[0]);
+    IndexEntry entry = { m_nCurrentOffset + m_nUsed, pHeader->depthTime };
+    memcpy(m_pCurrent + m_nUsed, &slot.record[0], slot.nSize);
+    m_index.push_back(entry);
+    m_nUsed += slot.nSize;
+    return true;
+}
+
+/// <summary>
+/// Make the next extent the current one and map the one after it
+/// </summary>
+bool FrameRecorder::Advance()
+{
+    UnmapExtent(m_pCurrent);
+    m_pCurrent = m_pNext;
+    m_nCurrentOffset += cExtentSize;
+    m_nUsed = 0;
+    m_pNext = m_pCurrent ? MapExtent(m_nCurrentOffset + cExtentSize) : NULL;
+    return m_pCurrent != NULL;
+}
+
+#ifdef _WIN32
+
+bool FrameRecorder::CreateRecordingFile(const std::string& filename)
+{
+    m_hFile = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                          CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    return m_hFile != INVALID_HANDLE_VALUE;
+}
+
+/// <summary>
+/// Map cExtentSize bytes at nOffset; mapping past the end grows the file
+/// </summary>
+uint8_t* FrameRecorder::MapExtent(uint64_t nOffset)
+{
+    uint64_t nEnd = nOffset + cExtentSize;
+    HANDLE hMapping = CreateFileMappingW(m_hFile, NULL, PAGE_READWRITE,
+                                         static_cast<DWORD>(nEnd >> 32), static_cast<DWORD>(nEnd), NULL);
+    if (!hMapping)
+    {
+        return NULL;
+    }
+    void* pView = MapViewOfFile(hMapping, FILE_MAP_WRITE, static_cast<DWORD>(nOffset >> 32),
+                                static_cast<DWORD>(nOffset), static_cast<SIZE_T>(cExtentSize));
+    // the view keeps the mapping alive
+    CloseHandle(hMapping);
+    return static_cast<uint8_t*>(pView);
+}
+
+void FrameRecorder::UnmapExtent(uint8_t* pView)
+{
+    if (pView)
+    {
+        UnmapViewOfFile(pView);
+    }
+}
+
+bool FrameRecorder::ResizeFile(uint64_t nSize)
+{
+    LARGE_INTEGER position;
+    position.QuadPart = static_cast<LONGLONG>(nSize);
+    return SetFilePointerEx(m_hFile, position, NULL, FILE_BEGIN) && SetEndOfFile(m_hFile);
+}
+
+bool FrameRecorder::WriteAt(uint64_t nOffset, const void* pData, size_t nBytes)
+{
+    LARGE_INTEGER position;
+    position.QuadPart = static_cast<LONGLONG>(nOffset);
+    DWORD nWritten = 0;
+    return SetFilePointerEx(m_hFile, position, NULL, FILE_BEGIN) &&
+           WriteFile(m_hFile, pData, static_cast<DWORD>(nBytes), &nWritten, NULL) &&
+           nWritten == nBytes;
+}
+
+void FrameRecorder::CloseRecordingFile()
+{
+    if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+}
+
+#else
+
+bool FrameRecorder::CreateRecordingFile(const std::string& filename)
+{
+    m_nFile = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    return m_nFile >= 0;
+}
+
+/// <summary>
+/// Map cExtentSize bytes at nOffset, growing the file to cover them
+/// </summary>
+uint8_t* FrameRecorder::MapExtent(uint64_t nOffset)
+{
+    if (ftruncate(m_nFile, static_cast<off_t>(nOffset + cExtentSize)) != 0)
+    {
+        return NULL;
+    }
+    void* pView = mmap(NULL, cExtentSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_nFile, static_cast<off_t>(nOffset));
+    return pView != MAP_FAILED ? static_cast<uint8_t*>(pView) : NULL;
+}
+
+void FrameRecorder::UnmapExtent(uint8_t* pView)
+{
+    if (pView)
+    {
+        munmap(pView, cExtentSize);
+    }
+}
+
+bool FrameRecorder::ResizeFile(uint64_t nSize)
+{
+    return ftruncate(m_nFile, static_cast<off_t>(nSize)) == 0;
+}
+
+bool FrameRecorder::WriteAt(uint64_t nOffset, const void* pData, size_t nBytes)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(pData);
+    while (nBytes > 0)
+    {
+        ssize_t nWritten = pwrite(m_nFile, p, nBytes, static_cast<off_t>(nOffset));
+        if (nWritten <= 0)
+        {
+            return false;
+        }
+        p += nWritten;
+        nOffset += nWritten;
+        nBytes -= nWritten;
+    }
+    return true;
+}
+
+void FrameRecorder::CloseRecordingFile()
+{
+    if (m_nFile >= 0)
+    {
+        close(m_nFile);
+        m_nFile = -1;
+    }
+}
+
+#endif
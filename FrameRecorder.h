@@ -0,0 +1,174 @@
+//------------------------------------------------------------------------------
+// FrameRecorder.h
+//------------------------------------------------------------------------------
+
+// Records raw sensor frames to disk so a capture session can be replayed
+// offline. The file is memory-mapped and grows in large preallocated
+// extents; each frame is one page-aligned record holding the depth and the
+// BGRA color frame with their RelativeTime stamps, and an index of the
+// records is appended when the recording is closed. Capture only copies
+// the frame into one of a few preallocated slots; a writer thread moves it
+// into the mapping. When every slot is still waiting to be written the
+// frame is dropped rather than holding up capture.
+//
+// File layout:
+//   RecordingHeader, padded to cRecordAlignment
+//   records, each a FrameRecordHeader, the depth frame and the color frame
+//     at its depthOffset and colorOffset, padded to cRecordAlignment; a
+//     record never crosses an extent, the rest of an extent is zero
+//   IndexEntry[frameCount] at indexOffset
+// A recording that was never closed has indexOffset 0; its records can
+// still be found by walking the extents.
+
+#pragma once
+
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "igtlConditionVariable.h"
+#include "igtlMultiThreader.h"
+
+class FrameRecorder
+{
+public:
+    static const uint32_t   cMagic = 0x4345524B;        // "KREC"
+    static const uint32_t   cRecordMagic = 0x454D5246;  // "FRME"
+    static const uint32_t   cVersion = 1;
+    static const uint32_t   cRecordAlignment = 4096;
+    static const uint64_t   cExtentSize = 64 * 1024 * 1024;
+
+    enum { RecordDepth = 1, RecordColor = 2 };
+
+    typedef struct
+    {
+        uint32_t            magic;
+        uint32_t            version;
+        uint32_t            depthWidth;
+        uint32_t            depthHeight;
+        uint32_t            colorWidth;
+        uint32_t            colorHeight;
+        uint64_t            extentSize;
+        uint64_t            indexOffset;    // 0 until the recording is closed
+        uint64_t            frameCount;
+    } RecordingHeader;
+
+    typedef struct
+    {
+        uint32_t            magic;
+        uint32_t            flags;          // RecordDepth | RecordColor
+        uint64_t            frameNumber;    // counts dropped frames too, so gaps show
+        int64_t             depthTime;      // RelativeTime, 100 ns units
+        int64_t             colorTime;
+        uint32_t            depthOffset;    // from the start of the record
+        uint32_t            depthSize;
+        uint32_t            colorOffset;
+        uint32_t            colorSize;
+    } FrameRecordHeader;
+
+    typedef struct
+    {
+        uint64_t            offset;         // of the FrameRecordHeader
+        int64_t             depthTime;
+    } IndexEntry;
+
+    /// <summary>
+    /// Constructor; the slots are allocated here, the file by Open
+    /// </summary>
+    /// <param name="nDepthWidth">width of the depth frames</param>
+    /// <param name="nDepthHeight">height of the depth frames</param>
+    /// <param name="nColorWidth">width of the BGRA color frames</param>
+    /// <param name="nColorHeight">height of the BGRA color frames</param>
+    FrameRecorder(int nDepthWidth, int nDepthHeight, int nColorWidth, int nColorHeight);
+
+    /// <summary>
+    /// Destructor; closes the recording
+    /// </summary>
+    ~FrameRecorder();
+
+    /// <summary>
+    /// Create the file, replacing any old one, and start the writer thread
+    /// </summary>
+    bool Open(const std::string& filename);
+
+    /// <summary>
+    /// Write what is queued, append the index and close the file
+    /// </summary>
+    void Close();
+
+    /// <summary>
+    /// Queue a frame; returns at once. Either frame may be NULL.
+    /// </summary>
+    /// <returns>false if the frame was dropped</returns>
+    bool Record(int64_t nDepthTime, const uint16_t* pDepth, int64_t nColorTime, const uint32_t* pColor);
+
+    int GetRecordedCount();
+    int GetDroppedCount();
+
+private:
+    FrameRecorder(const FrameRecorder&);
+    FrameRecorder& operator=(const FrameRecorder&);
+
+    static const int        cSlotCount = 4;
+
+    // a record as it will be in the file, header first
+    typedef struct
+    {
+        std::vector<uint8_t> record;
+        uint32_t            nSize;
+    } Slot;
+
+    /// <summary>
+    /// Writer thread; copies queued slots into the mapping until stopped
+    /// </summary>
+    static void*            Writer(void* ptr);
+
+    /// <summary>
+    /// Copy one record into the mapping, moving to the next extent if it doesn't fit
+    /// </summary>
+    bool                    Write(const Slot& slot);
+
+    /// <summary>
+    /// Make the next extent the current one and map the one after it
+    /// </summary>
+    bool                    Advance();
+
+    // platform layer
+    bool                    CreateRecordingFile(const std::string& filename);
+    uint8_t*                MapExtent(uint64_t nOffset);
+    void                    UnmapExtent(uint8_t* pView);
+    bool                    ResizeFile(uint64_t nSize);
+    bool                    WriteAt(uint64_t nOffset, const void* pData, size_t nBytes);
+    void                    CloseRecordingFile();
+
+    int                     m_nDepthWidth;
+    int                     m_nDepthHeight;
+    int                     m_nColorWidth;
+    int                     m_nColorHeight;
+
+    Slot                    m_slots[cSlotCount];
+    std::vector<int>        m_free;
+    std::deque<int>         m_queue;            // filled slots, oldest first
+    igtl::SimpleMutexLock   m_lock;
+    igtl::ConditionVariable::Pointer m_queued;
+    igtl::MultiThreader::Pointer m_threader;
+    int                     m_nThreadID;
+    bool                    m_bOpen;
+    bool                    m_bStop;
+    uint64_t                m_nFrameNumber;
+    int                     m_nRecorded;
+    int                     m_nDropped;
+
+    // writer thread only
+#ifdef _WIN32
+    void*                   m_hFile;
+#else
+    int                     m_nFile;
+#endif
+    uint8_t*                m_pCurrent;         // mapped extent being written
+    uint8_t*                m_pNext;            // the following one, mapped ahead
+    uint64_t                m_nCurrentOffset;   // file offset of m_pCurrent
+    uint64_t                m_nUsed;            // bytes used within m_pCurrent
+    bool                    m_bFailed;
+    std::vector<IndexEntry> m_index;
+};
@@ -0,0 +1,146 @@
+//------------------------------------------------------------------------------
+// FrameSource.h
+//------------------------------------------------------------------------------
+
+// Where the pipeline's depth and color frames come from: the Kinect, a
+// recording made by FrameRecorder, or a synthetic scene. A source never
+// blocks; Acquire returns false until its next frame is due, so the
+// caller's loop keeps servicing its window and the encoder as it does
+// when the sensor has nothing new.
+
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+
+// Nominal Kinect v2 intrinsics, for sources without a sensor to ask. The
+// depth to color mapping they give ignores the 5 cm between the cameras.
+static const float          cNominalDepthFocal = 365.0f;
+static const float          cNominalDepthCenterX = 256.0f;
+static const float          cNominalDepthCenterY = 212.0f;
+static const float          cNominalColorFocal = 1081.0f;
+static const float          cNominalColorCenterX = 960.0f;
+static const float          cNominalColorCenterY = 540.0f;
+
+// The reliable range the Kinect v2 reports for every frame
+static const uint16_t       cNominalMinReliableDepth = 500;
+static const uint16_t       cNominalMaxReliableDepth = 4500;
+
+/// <summary>
+/// The depth to color and color to depth maps of the nominal intrinsics, laid
+/// out as the coordinate mapper's ColorSpacePoint and DepthSpacePoint arrays.
+/// Both cameras sit on one axis, so the maps do not depend on the depth.
+/// </summary>
+/// <param name="pColorPoints">x, y in color pixels for every depth pixel</param>
+/// <param name="pDepthPoints">x, y in depth pixels for every color pixel</param>
+inline void GetNominalMaps(int nDepthWidth, int nDepthHeight, int nColorWidth, int nColorHeight,
+                           float* pColorPoints, float* pDepthPoints)
+{
+    const float fScale = cNominalColorFocal / cNominalDepthFocal;
+    for (int y = 0; y < nDepthHeight; ++y)
+    {
+        for (int x = 0; x < nDepthWidth; ++x, pColorPoints += 2)
+        {
+            pColorPoints[0] = (x - cNominalDepthCenterX) * fScale + cNominalColorCenterX;
+            pColorPoints[1] = (y - cNominalDepthCenterY) * fScale + cNominalColorCenterY;
+        }
+    }
+    for (int y = 0; y < nColorHeight; ++y)
+    {
+        for (int x = 0; x < nColorWidth; ++x, pDepthPoints += 2)
+        {
+            pDepthPoints[0] = (x - cNominalColorCenterX) / fScale + cNominalDepthCenterX;
+            pDepthPoints[1] = (y - cNominalColorCenterY) / fScale + cNominalDepthCenterY;
+        }
+    }
+}
+
+/// <summary>
+/// One depth frame and the color frame that came with it. The buffers
+/// belong to the source and stay valid until Release.
+/// </summary>
+typedef struct
+{
+    int64_t                 depthTime;          // RelativeTime, 100 ns units
+    const uint16_t*         pDepth;             // millimeters
+    int                     depthWidth;
+    int                     depthHeight;
+    uint16_t                minReliableDepth;
+    uint16_t                maxReliableDepth;
+    int64_t                 colorTime;
+    const uint32_t*         pColor;             // BGRA, NULL if no color frame arrived
+    int                     colorWidth;
+    int                     colorHeight;
+} SourceFrame;
+
+class FrameSource
+{
+public:
+    virtual ~FrameSource() {}
+
+    /// <summary>
+    /// Take the next frame if one is due; never waits
+    /// </summary>
+    /// <returns>false if there is no new frame yet</returns>
+    virtual bool Acquire(SourceFrame& frame) = 0;
+
+    /// <summary>
+    /// Done with the frame from the last successful Acquire
+    /// </summary>
+    virtual void Release() {}
+
+    /// <summary>
+    /// True once a finite source has delivered its last frame
+    /// </summary>
+    virtual bool IsFinished() const { return false; }
+};
+
+/// <summary>
+/// Hands out frames at the pace of their timestamps, or as fast as they are
+/// asked for. The first frame after a restart is always due.
+/// </summary>
+class FramePacer
+{
+public:
+    FramePacer(bool bRealTime) :
+        m_bRealTime(bRealTime),
+        m_bStarted(false),
+        m_nFirstTime(0)
+    {
+    }
+
+    /// <summary>
+    /// True when a frame stamped nTime (100 ns units) is due
+    /// </summary>
+    bool IsDue(int64_t nTime)
+    {
+        if (!m_bRealTime)
+        {
+            return true;
+        }
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (!m_bStarted)
+        {
+            m_bStarted = true;
+            m_start = now;
+            m_nFirstTime = nTime;
+            return true;
+        }
+        int64_t nElapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - m_start).count() * 10;
+        return nTime - m_nFirstTime <= nElapsed;
+    }
+
+    /// <summary>
+    /// Start timing again from the next frame
+    /// </summary>
+    void Restart()
+    {
+        m_bStarted = false;
+    }
+
+private:
+    bool                    m_bRealTime;
+    bool                    m_bStarted;
+    int64_t                 m_nFirstTime;
+    std::chrono::steady_clock::time_point m_start;
+};
@@ -0,0 +1,125 @@
+//------------------------------------------------------------------------------
+// HeadlessServer.cpp
+//------------------------------------------------------------------------------
+
+// Console entry point of the server for machines without the Kinect SDK:
+//
+// HeadlessServer [--source synthetic|playback] [--playback-file <file>]
+//                [server and encoder options]
+//
+// The options are the app's, see DepthImageServerX264.cpp and wWinMain;
+// --source kinect and --record need the sensor and are not available here.
+// Ctrl+C stops the server.
+
+#include <signal.h>
+#include <chrono>
+#include <thread>
+#include "HeadlessServer.h"
+
+static volatile bool g_bStop = false;
+
+static void OnStopSignal(int)
+{
+    g_bStop = true;
+}
+
+int main(int argc, char** argv)
+{
+    if (ParseEncoderArguments(argc, argv) < 0)
+    {
+        return 1;
+    }
+    if (SourceMode == SourceKinect)
+    {
+        std::cerr << "No Kinect without its SDK; serving the synthetic scene." << std::endl;
+        SourceMode = SourceSynthetic;
+    }
+    if (!RecordFile.empty())
+    {
+        std::cerr << "Recording needs the sensor; --record is ignored." << std::endl;
+        RecordFile.clear();
+    }
+
+    signal(SIGINT, OnStopSignal);
+    signal(SIGTERM, OnStopSignal);
+    CHeadlessServer server;
+    return server.Run(g_bStop);
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+CHeadlessServer::CHeadlessServer() :
+    m_pFrameSource(NULL),
+    m_pipeline(false, true)
+{
+}
+
+/// <summary>
+/// Destructor
+/// </summary>
+CHeadlessServer::~CHeadlessServer()
+{
+    delete m_pFrameSource;
+}
+
+/// <summary>
+/// Creates the frame source selected by SourceMode
+/// </summary>
+bool CHeadlessServer::InitializeFrameSource()
+{
+    if (SourceMode == SourcePlayback)
+    {
+        PlaybackFrameSource* pPlayback = new PlaybackFrameSource(SourceRealTime != 0, SourceFrames);
+        if (!pPlayback->Open(PlaybackFile))
+        {
+            delete pPlayback;
+            std::cerr << "Cannot play back the recording " << PlaybackFile << "." << std::endl;
+            return false;
+        }
+        m_pFrameSource = pPlayback;
+        return true;
+    }
+    m_pFrameSource = new SyntheticFrameSource(FramePipeline::cDepthWidth, FramePipeline::cDepthHeight,
+        FramePipeline::cColorWidth, FramePipeline::cColorHeight, SourceRealTime != 0, SourceFrames);
+    return true;
+}
+
+/// <summary>
+/// Feed the server until the source is finished or bStop is set
+/// </summary>
+int CHeadlessServer::Run(volatile bool& bStop)
+{
+    if (!InitializeFrameSource())
+    {
+        return 1;
+    }
+    while (!bStop && !m_pFrameSource->IsFinished())
+    {
+        if (!Update())
+        {
+            // the source paces itself and never blocks
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    if (m_pFrameSource->IsFinished())
+    {
+        std::cerr << "Frame source finished." << std::endl;
+    }
+    return 0;
+}
+
+/// <summary>
+/// Process and publish the next frame if one is due
+/// </summary>
+bool CHeadlessServer::Update()
+{
+    SourceFrame frame;
+    if (!m_pFrameSource->Acquire(frame))
+    {
+        return false;
+    }
+    m_pipeline.ProcessFrame(frame);
+    m_pFrameSource->Release();
+    return true;
+}
@@ -0,0 +1,59 @@
+//------------------------------------------------------------------------------
+// HeadlessServer.h
+//------------------------------------------------------------------------------
+
+// The server without the Kinect, a window or Direct2D: frames from the
+// synthetic scene or a recording go through the FramePipeline that
+// CDepthSecondVersion also drives, and ServerControl encodes and sends
+// them. Runs on Linux (see CMakeLists.txt) as well as on Windows, e.g. on
+// a machine that replays recordings to clients.
+
+#pragma once
+
+#include "PlaybackFrameSource.h"
+#include "SyntheticFrameSource.h"
+#include "FramePipeline.h"
+using namespace DepthImageServerX264;
+
+class CHeadlessServer
+{
+public:
+    /// <summary>
+    /// Constructor, starts the server
+    /// </summary>
+    CHeadlessServer();
+
+    /// <summary>
+    /// Destructor, stops the server
+    /// </summary>
+    ~CHeadlessServer();
+
+    /// <summary>
+    /// Feed the server until the source is finished or bStop is set
+    /// </summary>
+    /// <param name="bStop">set from elsewhere, e.g. a signal handler, to return</param>
+    /// <returns>0 on success, 1 if the source could not be opened</returns>
+    int                     Run(volatile bool& bStop);
+
+private:
+    CHeadlessServer(const CHeadlessServer&);
+    CHeadlessServer& operator=(const CHeadlessServer&);
+
+    // Depth and color frames: a recording or a synthetic scene
+    FrameSource*            m_pFrameSource;
+
+    // Slots, processing and the server, with the nominal coordinate maps
+    FramePipeline           m_pipeline;
+
+    /// <summary>
+    /// Creates the frame source selected by SourceMode
+    /// </summary>
+    /// <returns>false if the recording cannot be played back</returns>
+    bool                    InitializeFrameSource();
+
+    /// <summary>
+    /// Process and publish the next frame if one is due
+    /// </summary>
+    /// <returns>false if the source had no frame</returns>
+    bool                    Update();
+};
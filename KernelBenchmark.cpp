@@ -0,0 +1,845 @@
+//------------------------------------------------------------------------------
+// KernelBenchmark.cpp
+//------------------------------------------------------------------------------
+
+// Times every per-frame kernel of the capture, encode and send path on fixed
+// synthetic input: 30 frames of SyntheticFrameSource (512x424 depth, 1920x1080
+// BGRA), registered with the nominal intrinsics. Needs no sensor and no
+// window, so it runs on the build servers as well as on the capture machine.
+//
+// Each kernel is repeated until one batch of it has run for the minimum time.
+// The report gives ns per frame, pixels per second and heap allocations
+// (operator new) per frame; x264 and the igtl C library allocate with malloc,
+// which is not counted. It goes to the console and, with --benchmark-out, to
+// a JSON file for comparing releases. "DepthPacked compare" adds the
+// bitrate and depth error of the DepthPacked stream under each packing
+// scheme, from x264's reconstruction of the frames; "Depth16 compare" the
+// same for the Depth16 stream at --depth-bitdepth and --depth-qp, with its
+// encode time per frame.
+//
+// KernelBenchmark [--benchmark-filter <text>] [--benchmark-min-time <seconds>]
+//                 [--benchmark-out <file>] [server and encoder options]
+//
+// The server and encoder options are the app's, see DepthImageServerX264.cpp,
+// so a configuration is measured as it would run, e.g.
+//   KernelBenchmark --encoder-profile ultra-low-latency --color-format nv12
+//
+// Kernels named in older profiles have since been replaced: the scatter's
+// hole filling (CheckNeighbors) is part of RegistrationEngine::Scatter,
+// Bitmap2Yuv444p_calc2 is ColorConverter::Convert, and packing a
+// VideoMessage per frame became VideoFrameSender::Serialize. The old message
+// packing is kept here as the baseline.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "DepthQuantizer.h"
+#include "DepthPacking.h"
+#include "FrameArena.h"
+#include "RegistrationEngine.h"
+#include "ColorConversion.h"
+#include "PointCloudBuilder.h"
+#include "DepthDecimator.h"
+#include "DepthTemporalFilter.h"
+#include "DepthSpatialFilter.h"
+#include "SyntheticFrameSource.h"
+#include "DepthImageServerX264.cpp"
+using namespace DepthImageServerX264;
+
+// Every operator new of the process; the runner takes the difference
+static std::atomic<long long> g_nAllocations(0);
+
+void* operator new(size_t nBytes)
+{
+    g_nAllocations++;
+    void* p = malloc(nBytes ? nBytes : 1);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+static const int            cDepthWidth = 512;
+static const int            cDepthHeight = 424;
+static const int            cColorWidth = 1920;
+static const int            cColorHeight = 1080;
+static const int            cDepthPixels = cDepthWidth * cDepthHeight;
+static const int            cColorPixels = cColorWidth * cColorHeight;
+static const int            cInputFrames = 30;
+
+/// <summary>
+/// Timing of one kernel
+/// </summary>
+typedef struct
+{
+    std::string             name;
+    long long               iterations;
+    double                  nsPerFrame;
+    double                  pixelsPerSecond;
+    double                  allocationsPerFrame;
+} BenchmarkResult;
+
+class BenchmarkRunner
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    /// <param name="filter">only kernels whose name contains this run; empty for all</param>
+    /// <param name="fMinSeconds">time the measured batch of each kernel runs for at least</param>
+    BenchmarkRunner(const std::string& filter, double fMinSeconds) :
+        m_filter(filter),
+        m_fMinSeconds(fMinSeconds)
+    {
+    }
+
+    /// <summary>
+    /// True if the named kernel is to run
+    /// </summary>
+    bool IsSelected(const std::string& name) const
+    {
+        return m_filter.empty() || name.find(m_filter) != std::string::npos;
+    }
+
+    /// <summary>
+    /// Time kernel(nFrame) for nFrame = 0, 1, 2, ... and record it
+    /// </summary>
+    /// <param name="name">kernel name in the report</param>
+    /// <param name="nPixels">pixels one call processes</param>
+    /// <param name="kernel">processes one frame</param>
+    template <typename Kernel>
+    void Run(const std::string& name, long long nPixels, Kernel kernel)
+    {
+        if (!IsSelected(name))
+        {
+            return;
+        }
+
+        // the first call pays for lazily built tables and thread start-up
+        long long nFrame = 0;
+        kernel(nFrame++);
+
+        long long nIterations = 1;
+        for (;;)
+        {
+            long long nAllocationsBefore = g_nAllocations;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (long long i = 0; i < nIterations; ++i)
+            {
+                kernel(nFrame++);
+            }
+            double fSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            long long nAllocations = g_nAllocations - nAllocationsBefore;
+
+            if (fSeconds >= m_fMinSeconds || nIterations >= (1LL << 30))
+            {
+                BenchmarkResult result;
+                result.name = name;
+                result.iterations = nIterations;
+                result.nsPerFrame = fSeconds * 1e9 / nIterations;
+                result.pixelsPerSecond = fSeconds > 0 ? nPixels * nIterations / fSeconds : 0.0;
+                result.allocationsPerFrame = static_cast<double>(nAllocations) / nIterations;
+                m_results.push_back(result);
+                std::cout << std::left << std::setw(48) << name << std::right << std::fixed
+                          << std::setw(14) << std::setprecision(0) << result.nsPerFrame << " ns"
+                          << std::setw(11) << std::setprecision(1) << result.pixelsPerSecond / 1e6 << " Mpx/s"
+                          << std::setw(9) << std::setprecision(2) << result.allocationsPerFrame << " allocs"
+                          << std::endl;
+                return;
+            }
+
+            // aim a little past the minimum, growing at most tenfold per batch
+            long long nNext = fSeconds > 0 ? static_cast<long long>(nIterations * m_fMinSeconds * 1.4 / fSeconds) : nIterations * 10;
+            nIterations = nNext > nIterations * 10 ? nIterations * 10 : nNext > nIterations ? nNext : nIterations + 1;
+        }
+    }
+
+    /// <summary>
+    /// Write the results and the configuration they were taken with as JSON
+    /// </summary>
+    void WriteJson(std::ostream& out) const
+    {
+        char szDate[32] = "";
+        time_t now = time(NULL);
+        strftime(szDate, sizeof(szDate), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+        out << "{\n"
+            << "  \"context\": {\n"
+            << "    \"date\": \"" << szDate << "\",\n"
+            << "    \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n"
+            << "    \"registration_threads\": " << RegistrationThreads << ",\n"
+            << "    \"x264_build\": " << X264_BUILD << ",\n"
+            << "    \"depth_width\": " << cDepthWidth << ",\n"
+            << "    \"depth_height\": " << cDepthHeight << ",\n"
+            << "    \"color_width\": " << cColorWidth << ",\n"
+            << "    \"color_height\": " << cColorHeight << ",\n"
+            << "    \"min_time\": " << m_fMinSeconds << "\n"
+            << "  },\n"
+            << "  \"benchmarks\": [";
+        for (size_t i = 0; i < m_results.size(); ++i)
+        {
+            const BenchmarkResult& result = m_results[i];
+            out << (i ? "," : "") << "\n    {\n"
+                << "      \"name\": \"" << result.name << "\",\n"
+                << "      \"iterations\": " << result.iterations << ",\n"
+                << std::fixed << std::setprecision(1)
+                << "      \"ns_per_frame\": " << result.nsPerFrame << ",\n"
+                << std::setprecision(0)
+                << "      \"pixels_per_second\": " << result.pixelsPerSecond << ",\n"
+                << std::setprecision(3)
+                << "      \"allocations_per_frame\": " << result.allocationsPerFrame << "\n"
+                << "    }";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+private:
+    std::string             m_filter;
+    double                  m_fMinSeconds;
+    std::vector<BenchmarkResult> m_results;
+};
+
+/// <summary>
+/// One encoded stream: its pictures for every input frame and its encoder
+/// </summary>
+typedef struct
+{
+    std::string             name;
+    int                     width;
+    int                     height;
+    int                     bitDepth;
+    EncoderOptionList       options;
+    std::vector<std::vector<uint8_t> > planes;
+    std::vector<x264_picture_t> pictures;
+} BenchmarkStream;
+
+/// <summary>
+/// Describe nPlanes planes of one buffer to x264
+/// </summary>
+static void SetPicture(x264_picture_t& pic, int nCsp, uint8_t* pBuffer, int nPlanes, const int* pStrides, const int* pSizes)
+{
+    x264_picture_init(&pic);
+    pic.img.i_csp = nCsp;
+    pic.img.i_plane = nPlanes;
+    for (int i = 0; i < nPlanes; ++i)
+    {
+        pic.img.i_stride[i] = pStrides[i];
+        pic.img.plane[i] = pBuffer;
+        pBuffer += pSizes[i];
+    }
+}
+
+/// <summary>
+/// Build the stream's pictures from the depth and registered color frames,
+/// as ProcessDepth and ProcessColor would
+/// </summary>
+static void PrepareStream(BenchmarkStream& stream, const std::vector<std::vector<uint16_t> >& depth,
+                          const std::vector<std::vector<uint32_t> >& registered)
+{
+    DepthQuantizer quantizer;
+    quantizer.SetRange(cNominalMinReliableDepth, cNominalMaxReliableDepth);
+    ColorConverter converter;
+    converter.SetFormat(static_cast<ColorMatrix>(ColorStreamMatrix), static_cast<ColorRange>(ColorStreamRange));
+    DepthPacker* pPacker = DepthPacker::Create(static_cast<DepthPackingScheme>(DepthStreamPacking));
+    std::vector<uint16_t> code(cDepthPixels);
+    std::vector<uint8_t> discard(cDepthPixels);
+
+    stream.width = cDepthWidth;
+    stream.height = cDepthHeight;
+    stream.bitDepth = 8;
+    stream.planes.resize(depth.size());
+    stream.pictures.resize(depth.size());
+    for (size_t f = 0; f < depth.size(); ++f)
+    {
+        std::vector<uint8_t>& buffer = stream.planes[f];
+        x264_picture_t& pic = stream.pictures[f];
+        const int n = cDepthPixels;
+        if (stream.name == "DepthFrame" || stream.name == "DepthIndex")
+        {
+            buffer.assign(n * 3 / 2, 128);
+            bool bIndex = stream.name == "DepthIndex";
+            quantizer.Quantize(&depth[f][0], n, NULL, bIndex ? &discard[0] : &buffer[0], bIndex ? &buffer[0] : &discard[0]);
+            int strides[3] = { cDepthWidth, cDepthWidth / 2, cDepthWidth / 2 };
+            int sizes[3] = { n, n / 4, n / 4 };
+            SetPicture(pic, X264_CSP_I420, &buffer[0], 3, strides, sizes);
+        }
+        else if (stream.name == "Depth16")
+        {
+            // 8 bit samples at 8 bit, 16 bit ones at 10
+            int nSampleSize = DepthStreamBitDepth > 8 ? sizeof(uint16_t) : sizeof(uint8_t);
+            buffer.resize(n * nSampleSize);
+            if (nSampleSize > 1)
+            {
+                quantizer.QuantizeFitted(&depth[f][0], n, NULL, reinterpret_cast<uint16_t*>(&buffer[0]), DepthStreamBitDepth);
+            }
+            else
+            {
+                quantizer.QuantizeFitted(&depth[f][0], n, NULL, &buffer[0]);
+            }
+            int strides[1] = { cDepthWidth * nSampleSize };
+            int sizes[1] = { n * nSampleSize };
+#if X264_BUILD >= 153
+            SetPicture(pic, nSampleSize > 1 ? X264_CSP_I400 | X264_CSP_HIGH_DEPTH : X264_CSP_I400, &buffer[0], 1, strides, sizes);
+#endif
+            stream.bitDepth = DepthStreamBitDepth;
+        }
+        else if (stream.name == "DepthPacked")
+        {
+            buffer.resize(n * 3);
+            uint16_t nMaxCode = cNominalMaxReliableDepth - cNominalMinReliableDepth + 1;
+            quantizer.QuantizeFitted(&depth[f][0], n, NULL, &code[0], 16);
+            pPacker->Pack(&code[0], n, nMaxCode, &buffer[0], &buffer[n], &buffer[2 * n]);
+            int strides[3] = { cDepthWidth, cDepthWidth, cDepthWidth };
+            int sizes[3] = { n, n, n };
+            SetPicture(pic, X264_CSP_I444, &buffer[0], 3, strides, sizes);
+        }
+        else if (ColorStreamFormat == ColorFormatI444)
+        {
+            buffer.resize(n * 3);
+            converter.Convert(&registered[f][0], cDepthWidth, cDepthHeight, Chroma444, &buffer[0], &buffer[n], &buffer[2 * n]);
+            int strides[3] = { cDepthWidth, cDepthWidth, cDepthWidth };
+            int sizes[3] = { n, n, n };
+            SetPicture(pic, X264_CSP_I444, &buffer[0], 3, strides, sizes);
+        }
+        else if (ColorStreamFormat == ColorFormatNV12)
+        {
+            buffer.resize(n * 2);
+            converter.Convert(&registered[f][0], cDepthWidth, cDepthHeight, Chroma420, &buffer[0], &buffer[n * 3 / 2], &buffer[n * 7 / 4]);
+            ColorConverter::InterleaveChroma(&buffer[n * 3 / 2], &buffer[n * 7 / 4], n / 4, &buffer[n]);
+            int strides[2] = { cDepthWidth, cDepthWidth };
+            int sizes[2] = { n, n / 2 };
+            SetPicture(pic, X264_CSP_NV12, &buffer[0], 2, strides, sizes);
+        }
+        else
+        {
+            buffer.resize(n * 3 / 2);
+            converter.Convert(&registered[f][0], cDepthWidth, cDepthHeight, Chroma420, &buffer[0], &buffer[n], &buffer[n * 5 / 4]);
+            int strides[3] = { cDepthWidth, cDepthWidth / 2, cDepthWidth / 2 };
+            int sizes[3] = { n, n / 4, n / 4 };
+            SetPicture(pic, X264_CSP_I420, &buffer[0], 3, strides, sizes);
+        }
+    }
+    delete pPacker;
+}
+
+/// <summary>
+/// Bitrate and depth error of the DepthPacked stream under each packing
+/// scheme: every frame is packed and encoded as the server does it, and
+/// x264's reconstruction of it is unpacked and compared with the codes that
+/// went in. Errors are in mm over the pixels that were valid; "flipped"
+/// counts pixels that came back valid when they were not, or the reverse.
+/// </summary>
+static void CompareDepthPacking(const std::vector<std::vector<uint16_t> >& depth,
+                                const std::vector<std::vector<uint32_t> >& registered,
+                                const EncoderOptionList& baseOptions)
+{
+    static const DepthPackingScheme cSchemes[] = { DepthPackingSplit, DepthPackingGray, DepthPackingTriangle };
+    const int n = cDepthPixels;
+    const uint16_t nMaxCode = cNominalMaxReliableDepth - cNominalMinReliableDepth + 1;
+    DepthQuantizer quantizer;
+    quantizer.SetRange(cNominalMinReliableDepth, cNominalMaxReliableDepth);
+    std::vector<uint16_t> code(n);
+    std::vector<uint16_t> decoded(n);
+    std::vector<uint8_t> recon(3 * n);
+
+    int nConfiguredPacking = DepthStreamPacking;
+    for (size_t s = 0; s < sizeof(cSchemes) / sizeof(cSchemes[0]); ++s)
+    {
+        BenchmarkStream stream;
+        stream.name = "DepthPacked";
+        stream.options = baseOptions;
+        // full reconstruction of every frame, as for PSNR
+        stream.options.push_back(std::make_pair(std::string("psnr"), std::string()));
+        DepthStreamPacking = cSchemes[s];
+        PrepareStream(stream, depth, registered);
+        DepthPacker* pPacker = DepthPacker::Create(cSchemes[s]);
+
+        x264_param_t param;
+        cli_opt_t opt;
+        x264_t* pEncoder = OpenStreamEncoder(stream.name, stream.options, &stream.pictures[0],
+            stream.width, stream.height, stream.bitDepth, &param, &opt);
+        if (!pEncoder)
+        {
+            std::cerr << "Cannot open the " << stream.name << " encoder." << std::endl;
+            delete pPacker;
+            continue;
+        }
+
+        long long nBytes = 0;
+        long long nValid = 0;
+        long long nErrorSum = 0;
+        long long nFlipped = 0;
+        int nMaxError = 0;
+        int nFrames = 0;
+        x264_nal_t* nal = NULL;
+        int i_nal = 0;
+        x264_picture_t pic_out;
+        for (int f = 0; ; ++f)
+        {
+            // the input frames once, then whatever the encoder still holds
+            x264_picture_t* pPic = f < cInputFrames ? &stream.pictures[f] : NULL;
+            if (!pPic && x264_encoder_delayed_frames(pEncoder) <= 0)
+            {
+                break;
+            }
+            if (pPic)
+            {
+                pPic->i_pts = f;
+                pPic->i_type = X264_TYPE_AUTO;
+            }
+            int nFrameSize = x264_encoder_encode(pEncoder, &nal, &i_nal, pPic, &pic_out);
+            if (nFrameSize <= 0)
+            {
+                continue;
+            }
+            nBytes += nFrameSize;
+            ++nFrames;
+
+            // the reconstruction is what a decoder shows; its planes may be padded
+            for (int p = 0; p < 3; ++p)
+            {
+                for (int y = 0; y < cDepthHeight; ++y)
+                {
+                    memcpy(&recon[p * n + y * cDepthWidth], pic_out.img.plane[p] + y * pic_out.img.i_stride[p], cDepthWidth);
+                }
+            }
+            pPacker->Unpack(&recon[0], &recon[n], &recon[2 * n], n, nMaxCode, &decoded[0]);
+            quantizer.QuantizeFitted(&depth[pic_out.i_pts % cInputFrames][0], n, NULL, &code[0], 16);
+            for (int i = 0; i < n; ++i)
+            {
+                if ((code[i] != 0) != (decoded[i] != 0))
+                {
+                    ++nFlipped;
+                }
+                else if (code[i] != 0)
+                {
+                    int nError = abs(decoded[i] - code[i]);
+                    nMaxError = nError > nMaxError ? nError : nMaxError;
+                    nErrorSum += nError;
+                    ++nValid;
+                }
+            }
+        }
+        x264_encoder_close(pEncoder);
+
+        std::cout << std::left << std::setw(48) << std::string("DepthPacked ") + pPacker->GetName() << std::right << std::fixed
+                  << std::setw(10) << std::setprecision(0) << (nFrames ? nBytes * 8.0 * 30 / nFrames / 1000 : 0.0) << " kbit/s"
+                  << std::setw(7) << nMaxError << " mm max"
+                  << std::setw(9) << std::setprecision(2) << (nValid ? static_cast<double>(nErrorSum) / nValid : 0.0) << " mm mean"
+                  << std::setw(9) << nFlipped << " flipped" << std::endl;
+        delete pPacker;
+    }
+    DepthStreamPacking = nConfiguredPacking;
+}
+
+#if X264_BUILD >= 153
+/// <summary>
+/// Depth error and encode time of the Depth16 stream at the configured bit
+/// depth and QP: every frame is quantized and encoded as the server does it,
+/// and x264's reconstruction of it is decoded the way a receiver would,
+/// DepthMin + (code - 1) * DepthStep, and compared with the depth that went
+/// in. Errors are in mm over the pixels that were valid; "flipped" counts as
+/// in CompareDepthPacking. The time per frame includes the reconstruction.
+/// </summary>
+static void CompareDepth16(const std::vector<std::vector<uint16_t> >& depth,
+                           const std::vector<std::vector<uint32_t> >& registered,
+                           const EncoderOptionList& baseOptions)
+{
+    const bool bHighDepth = DepthStreamBitDepth > 8;
+    DepthQuantizer quantizer;
+    quantizer.SetRange(cNominalMinReliableDepth, cNominalMaxReliableDepth);
+    const double fStep = quantizer.GetFittedStep(DepthStreamBitDepth);
+
+    BenchmarkStream stream;
+    stream.name = "Depth16";
+    stream.options = baseOptions;
+    std::ostringstream qp;
+    qp << DepthStreamQP;
+    stream.options.push_back(std::make_pair(std::string("qp"), qp.str()));
+    // full reconstruction of every frame, as for PSNR
+    stream.options.push_back(std::make_pair(std::string("psnr"), std::string()));
+    PrepareStream(stream, depth, registered);
+
+    x264_param_t param;
+    cli_opt_t opt;
+    x264_t* pEncoder = OpenStreamEncoder(stream.name, stream.options, &stream.pictures[0],
+        stream.width, stream.height, stream.bitDepth, &param, &opt);
+    if (!pEncoder)
+    {
+        std::cerr << "Cannot open the " << stream.name << " encoder." << std::endl;
+        return;
+    }
+
+    long long nBytes = 0;
+    long long nValid = 0;
+    long long nFlipped = 0;
+    double fErrorSum = 0;
+    double fMaxError = 0;
+    double fEncodeSeconds = 0;
+    int nFrames = 0;
+    x264_nal_t* nal = NULL;
+    int i_nal = 0;
+    x264_picture_t pic_out;
+    for (int f = 0; ; ++f)
+    {
+        // the input frames once, then whatever the encoder still holds
+        x264_picture_t* pPic = f < cInputFrames ? &stream.pictures[f] : NULL;
+        if (!pPic && x264_encoder_delayed_frames(pEncoder) <= 0)
+        {
+            break;
+        }
+        if (pPic)
+        {
+            pPic->i_pts = f;
+            pPic->i_type = X264_TYPE_AUTO;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        int nFrameSize = x264_encoder_encode(pEncoder, &nal, &i_nal, pPic, &pic_out);
+        fEncodeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (nFrameSize <= 0)
+        {
+            continue;
+        }
+        nBytes += nFrameSize;
+        ++nFrames;
+
+        // the reconstruction is what a decoder shows: 8 or 16 bit samples, rows may be padded
+        const uint16_t* pDepth = &depth[pic_out.i_pts % cInputFrames][0];
+        for (int y = 0; y < cDepthHeight; ++y)
+        {
+            const uint8_t* pRow = pic_out.img.plane[0] + y * pic_out.img.i_stride[0];
+            for (int x = 0; x < cDepthWidth; ++x)
+            {
+                int nCode = bHighDepth ? reinterpret_cast<const uint16_t*>(pRow)[x] : pRow[x];
+                uint16_t nDepth = pDepth[y * cDepthWidth + x];
+                bool bValid = nDepth >= cNominalMinReliableDepth && nDepth <= cNominalMaxReliableDepth;
+                if (bValid != (nCode != 0))
+                {
+                    ++nFlipped;
+                }
+                else if (bValid)
+                {
+                    double fError = fabs(cNominalMinReliableDepth + (nCode - 1) * fStep - nDepth);
+                    fMaxError = fError > fMaxError ? fError : fMaxError;
+                    fErrorSum += fError;
+                    ++nValid;
+                }
+            }
+        }
+    }
+    x264_encoder_close(pEncoder);
+
+    std::ostringstream name;
+    name << "Depth16 " << DepthStreamBitDepth << " bit QP " << DepthStreamQP;
+    std::cout << std::left << std::setw(48) << name.str() << std::right << std::fixed
+              << std::setw(10) << std::setprecision(0) << (nFrames ? nBytes * 8.0 * 30 / nFrames / 1000 : 0.0) << " kbit/s"
+              << std::setw(9) << std::setprecision(2) << fMaxError << " mm max"
+              << std::setw(9) << (nValid ? fErrorSum / nValid : 0.0) << " mm mean"
+              << std::setw(9) << (nFrames ? fEncodeSeconds * 1000 / nFrames : 0.0) << " ms/frame"
+              << std::setw(9) << nFlipped << " flipped" << std::endl;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+    // the benchmark's own options; everything else configures the server
+    std::string filter;
+    std::string outFile;
+    double fMinSeconds = 0.5;
+    std::vector<char*> serverArgs;
+    serverArgs.push_back(argv[0]);
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string name = argv[i];
+        bool bValue = i + 1 < argc;
+        if (name == "--benchmark-filter" && bValue)
+        {
+            filter = argv[++i];
+        }
+        else if (name == "--benchmark-min-time" && bValue)
+        {
+            fMinSeconds = atof(argv[++i]);
+        }
+        else if (name == "--benchmark-out" && bValue)
+        {
+            outFile = argv[++i];
+        }
+        else
+        {
+            serverArgs.push_back(argv[i]);
+        }
+    }
+    if (ParseEncoderArguments(static_cast<int>(serverArgs.size()), &serverArgs[0]) < 0)
+    {
+        return 1;
+    }
+
+    // Input: depth and registered color of a second of the synthetic scene,
+    // the color frame of its first frame, and the nominal coordinate maps
+    FrameArena arena(64 * 1024 * 1024, FrameArenaHugePages != 0);
+    std::vector<float> colorPoints(2 * cDepthPixels);
+    std::vector<float> depthPoints(2 * cColorPixels);
+    GetNominalMaps(cDepthWidth, cDepthHeight, cColorWidth, cColorHeight, &colorPoints[0], &depthPoints[0]);
+
+    RegistrationEngine registration(arena, cDepthWidth, cDepthHeight, cColorWidth, cColorHeight);
+    registration.SetThreadCount(RegistrationThreads);
+    registration.SetColorStride(RegistrationColorStride);
+    PointCloudBuilder pointCloud(arena, cDepthWidth, cDepthHeight);
+    pointCloud.SetIntrinsics(cNominalDepthFocal, cNominalDepthFocal, cNominalDepthCenterX, cNominalDepthCenterY);
+    DepthDecimator decimator(arena, cDepthWidth, cDepthHeight);
+    decimator.SetThreadCount(RegistrationThreads);
+    DepthSpatialFilter spatialFilter(arena, cDepthWidth, cDepthHeight);
+    spatialFilter.SetThreadCount(RegistrationThreads);
+    spatialFilter.SetThreshold(SpatialFilterThreshold);
+    DepthTemporalFilter averageFilter(arena, cDepthWidth, cDepthHeight, TemporalFilterAverage, TemporalFilterHistory);
+    averageFilter.SetWeight(TemporalFilterWeight / 100.0f);
+    averageFilter.SetThreshold(TemporalFilterThreshold);
+    DepthTemporalFilter medianFilter(arena, cDepthWidth, cDepthHeight, TemporalFilterMedian, TemporalFilterHistory);
+    medianFilter.SetThreshold(TemporalFilterThreshold);
+    FrameArena::Mark frameMark = arena.GetMark();
+
+    std::vector<std::vector<uint16_t> > depth(cInputFrames);
+    std::vector<std::vector<uint32_t> > registered(cInputFrames);
+    std::vector<uint32_t> color(cColorPixels);
+    std::vector<uint32_t> preview(cDepthPixels);
+    SyntheticFrameSource source(cDepthWidth, cDepthHeight, cColorWidth, cColorHeight, false, cInputFrames);
+    SourceFrame frame;
+    for (int f = 0; f < cInputFrames && source.Acquire(frame); ++f)
+    {
+        depth[f].assign(frame.pDepth, frame.pDepth + cDepthPixels);
+        registered[f].resize(cDepthPixels);
+        registration.Gather(&colorPoints[0], frame.pColor, &registered[f][0], &preview[0]);
+        if (f == 0)
+        {
+            color.assign(frame.pColor, frame.pColor + cColorPixels);
+        }
+    }
+
+    BenchmarkRunner runner(filter, fMinSeconds);
+    std::vector<uint8_t> planes(cDepthPixels * 3);
+    std::vector<uint16_t> depthOut(cDepthPixels);
+    std::vector<uint32_t> colorOut(cDepthPixels);
+    uint8_t* pY = &planes[0];
+    uint8_t* pU = pY + cDepthPixels;
+    uint8_t* pV = pU + cDepthPixels;
+
+    // ProcessDepth
+    DepthQuantizer quantizer;
+    quantizer.SetRange(cNominalMinReliableDepth, cNominalMaxReliableDepth);
+    runner.Run("DepthQuantizer::Quantize", cDepthPixels, [&](long long n) {
+        quantizer.Quantize(&depth[n % cInputFrames][0], cDepthPixels, &preview[0], pY, pU);
+    });
+    runner.Run("DepthQuantizer::QuantizeFitted", cDepthPixels, [&](long long n) {
+        quantizer.QuantizeFitted(&depth[n % cInputFrames][0], cDepthPixels, &preview[0], &depthOut[0], DepthStreamBitDepth);
+    });
+    DepthPacker* pPacker = DepthPacker::Create(static_cast<DepthPackingScheme>(DepthStreamPacking));
+    std::vector<uint16_t> code(cDepthPixels);
+    quantizer.QuantizeFitted(&depth[0][0], cDepthPixels, NULL, &code[0], 16);
+    runner.Run(std::string("DepthPacker::Pack ") + pPacker->GetName(), cDepthPixels, [&](long long) {
+        pPacker->Pack(&code[0], cDepthPixels, cNominalMaxReliableDepth - cNominalMinReliableDepth + 1, pY, pU, pV);
+    });
+    delete pPacker;
+    runner.Run("DepthSpatialFilter::Filter speckle", cDepthPixels, [&](long long n) {
+        spatialFilter.Filter(SpatialFilterSpeckle, &depth[n % cInputFrames][0], &depthOut[0]);
+    });
+    runner.Run("DepthSpatialFilter::Filter bilateral", cDepthPixels, [&](long long n) {
+        spatialFilter.Filter(SpatialFilterBilateral, &depth[n % cInputFrames][0], &depthOut[0]);
+    });
+    runner.Run("DepthTemporalFilter::Filter average", cDepthPixels, [&](long long n) {
+        averageFilter.Filter(&depth[n % cInputFrames][0], &depthOut[0]);
+    });
+    runner.Run("DepthTemporalFilter::Filter median", cDepthPixels, [&](long long n) {
+        medianFilter.Filter(&depth[n % cInputFrames][0], &depthOut[0]);
+    });
+    runner.Run("DepthDecimator::Decimate median", cDepthPixels, [&](long long n) {
+        decimator.Decimate(DecimationMedian, DecimationFactor, &depth[n % cInputFrames][0], &depthOut[0]);
+    });
+
+    // ProcessColor
+    runner.Run("RegistrationEngine::Gather", cDepthPixels, [&](long long) {
+        registration.Gather(&colorPoints[0], &color[0], &colorOut[0], &preview[0]);
+    });
+    runner.Run("RegistrationEngine::Scatter", cColorPixels, [&](long long) {
+        arena.Rewind(frameMark);
+        registration.Scatter(&depthPoints[0], &depth[0][0], &color[0], &colorOut[0], &preview[0]);
+    });
+    ColorConverter converter;
+    converter.SetFormat(static_cast<ColorMatrix>(ColorStreamMatrix), static_cast<ColorRange>(ColorStreamRange));
+    runner.Run("ColorConverter::Convert 4:4:4", cDepthPixels, [&](long long n) {
+        converter.Convert(&registered[n % cInputFrames][0], cDepthWidth, cDepthHeight, Chroma444, pY, pU, pV);
+    });
+    runner.Run("ColorConverter::Convert 4:2:0", cDepthPixels, [&](long long n) {
+        converter.Convert(&registered[n % cInputFrames][0], cDepthWidth, cDepthHeight, Chroma420, pY, pU, pU + cDepthPixels / 4);
+    });
+    runner.Run("ColorConverter::InterleaveChroma", cDepthPixels, [&](long long) {
+        ColorConverter::InterleaveChroma(pU, pU + cDepthPixels / 4, cDepthPixels / 4, pV);
+    });
+
+    // BuildPointCloud
+    std::vector<uint8_t> positions(cDepthPixels * PointCloudBuilder::GetPositionSize(PointFormatFloat32));
+    std::vector<uint8_t> pointColors(cDepthPixels * 3);
+    std::vector<uint8_t> voxelPositions(positions.size());
+    std::vector<uint8_t> voxelColors(pointColors.size());
+    int nPoints = 0;
+    runner.Run("PointCloudBuilder::Build float32", cDepthPixels, [&](long long n) {
+        nPoints = pointCloud.Build(&depth[n % cInputFrames][0], &registered[n % cInputFrames][0],
+            cNominalMinReliableDepth, cNominalMaxReliableDepth, PointFormatFloat32, &positions[0], &pointColors[0]);
+    });
+    runner.Run("PointCloudBuilder::Build int16", cDepthPixels, [&](long long n) {
+        pointCloud.Build(&depth[n % cInputFrames][0], &registered[n % cInputFrames][0],
+            cNominalMinReliableDepth, cNominalMaxReliableDepth, PointFormatInt16, &positions[0], &pointColors[0]);
+    });
+    nPoints = pointCloud.Build(&depth[0][0], &registered[0][0], cNominalMinReliableDepth, cNominalMaxReliableDepth,
+        PointFormatFloat32, &positions[0], &pointColors[0]);
+    runner.Run("DepthDecimator::VoxelFilter", nPoints, [&](long long) {
+        arena.Rewind(frameMark);
+        decimator.VoxelFilter(&positions[0], &pointColors[0], nPoints, PointFormatFloat32, VoxelSize * 0.001f,
+            &voxelPositions[0], &voxelColors[0]);
+    });
+    std::vector<unsigned char> message;
+    runner.Run("PointCloudSender::Serialize", cDepthPixels, [&](long long) {
+        PointCloudSender::Serialize("PointCloud", PointFormatFloat32, nPoints, &positions[0], &pointColors[0], message);
+    });
+
+    // Encoders, opened as ThreadFunction opens them
+    EncoderOptionList baseOptions;
+    baseOptions.push_back(std::make_pair(std::string("tune"), std::string("zerolatency")));
+    baseOptions.push_back(std::make_pair(std::string("crf"), std::string("24")));
+    std::vector<BenchmarkStream> streams;
+    const char* streamNames[] = { "DepthFrame", "DepthIndex", "DepthPacked", "Depth16", "ColorFrame" };
+    for (int i = 0; i < 5; ++i)
+    {
+        BenchmarkStream stream;
+        stream.name = streamNames[i];
+        stream.options = baseOptions;
+#if X264_BUILD < 153
+        if (stream.name == "Depth16")
+        {
+            continue;
+        }
+#endif
+        if (stream.name == "Depth16")
+        {
+            std::ostringstream qp;
+            qp << DepthStreamQP;
+            stream.options.push_back(std::make_pair(std::string("qp"), qp.str()));
+        }
+        streams.push_back(stream);
+    }
+
+    std::vector<unsigned char> bitstream;
+    for (size_t i = 0; i < streams.size(); ++i)
+    {
+        BenchmarkStream& stream = streams[i];
+        std::string name = "x264_encoder_encode " + stream.name;
+        bool bPacking = stream.name == "ColorFrame" &&
+            (runner.IsSelected("VideoMessage::Pack") || runner.IsSelected("VideoFrameSender::Serialize"));
+        if (!runner.IsSelected(name) && !bPacking)
+        {
+            continue;
+        }
+        PrepareStream(stream, depth, registered);
+        x264_param_t param;
+        cli_opt_t opt;
+        x264_t* pEncoder = OpenStreamEncoder(stream.name, stream.options, &stream.pictures[0],
+            stream.width, stream.height, stream.bitDepth, &param, &opt);
+        if (!pEncoder)
+        {
+            std::cerr << "Cannot open the " << stream.name << " encoder." << std::endl;
+            continue;
+        }
+        x264_nal_t* nal = NULL;
+        int i_nal = 0;
+        x264_picture_t pic_out;
+        int nFrameSize = 0;
+        runner.Run(name, stream.width * stream.height, [&](long long n) {
+            x264_picture_t& pic = stream.pictures[n % cInputFrames];
+            pic.i_pts = n;
+            pic.i_type = X264_TYPE_AUTO;
+            nFrameSize = x264_encoder_encode(pEncoder, &nal, &i_nal, &pic, &pic_out);
+        });
+        if (stream.name == "ColorFrame")
+        {
+            // a typical inter frame for the packing benchmarks
+            x264_picture_t& pic = stream.pictures[0];
+            pic.i_pts = 1LL << 40;
+            nFrameSize = x264_encoder_encode(pEncoder, &nal, &i_nal, &pic, &pic_out);
+            while (nFrameSize == 0 && x264_encoder_delayed_frames(pEncoder) > 0)
+            {
+                nFrameSize = x264_encoder_encode(pEncoder, &nal, &i_nal, NULL, &pic_out);
+            }
+            if (nFrameSize > 0)
+            {
+                bitstream.assign(nal[0].p_payload, nal[0].p_payload + nFrameSize);
+            }
+        }
+        x264_encoder_close(pEncoder);
+    }
+
+    // Bitrate against depth error of the packing schemes at 30 fps
+    if (runner.IsSelected("DepthPacked compare"))
+    {
+        CompareDepthPacking(depth, registered, baseOptions);
+    }
+#if X264_BUILD >= 153
+    if (runner.IsSelected("Depth16 compare"))
+    {
+        CompareDepth16(depth, registered, baseOptions);
+    }
+#endif
+
+    // SendVideoData
+    if (!bitstream.empty())
+    {
+        igtl::VideoMessage::Pointer videoMsg = igtl::VideoMessage::New();
+        videoMsg->SetDefaultBodyType("ColoredDepth");
+        videoMsg->SetDeviceName("ColorFrame");
+        runner.Run("VideoMessage::Pack", cDepthPixels, [&](long long) {
+            // the message as it was built for every frame before VideoFrameSender
+            videoMsg->SetBitStreamSize(static_cast<int>(bitstream.size()));
+            videoMsg->AllocateScalars();
+            videoMsg->SetScalarType(videoMsg->TYPE_UINT32);
+            videoMsg->SetEndian(igtl_is_little_endian() == 1 ? 2 : 1);
+            videoMsg->SetWidth(cDepthWidth);
+            videoMsg->SetHeight(cDepthHeight);
+            memcpy(videoMsg->GetPackFragmentPointer(2), &bitstream[0], bitstream.size());
+            videoMsg->Pack();
+        });
+        VideoFrameSender sender;
+        sender.Initialize("ColorFrame", cDepthWidth, cDepthHeight);
+        VideoPayload payload = { &bitstream[0], static_cast<int>(bitstream.size()) };
+        runner.Run("VideoFrameSender::Serialize", cDepthPixels, [&](long long) {
+            sender.Serialize(&payload, 1, message);
+        });
+    }
+
+    if (!outFile.empty())
+    {
+        std::ofstream out(outFile.c_str());
+        if (!out)
+        {
+            std::cerr << "Cannot write " << outFile << "." << std::endl;
+            return 1;
+        }
+        runner.WriteJson(out);
+    }
+    return 0;
+}
@@ -0,0 +1,262 @@
+//------------------------------------------------------------------------------
+// KinectFrameSource.cpp
+//------------------------------------------------------------------------------
+
+#include "stdafx.h"
+#include "KinectFrameSource.h"
+
+/// <summary>
+/// Constructor
+/// </summary>
+KinectFrameSource::KinectFrameSource(int nColorWidth, int nColorHeight) :
+    m_nColorWidth(nColorWidth),
+    m_nColorHeight(nColorHeight),
+    m_pKinectSensor(NULL),
+    m_pCoordinateMapper(NULL),
+    m_pDepthFrameReader(NULL),
+    m_pColorFrameReader(NULL),
+    m_pDepthFrame(NULL),
+    m_pColorFrame(NULL)
+{
+}
+
+/// <summary>
+/// Destructor
+/// </summary>
+KinectFrameSource::~KinectFrameSource()
+{
+    Release();
+
+    SafeRelease(m_pDepthFrameReader);
+    SafeRelease(m_pColorFrameReader);
+    SafeRelease(m_pCoordinateMapper);
+
+    // close the Kinect Sensor
+    if (m_pKinectSensor)
+    {
+        m_pKinectSensor->Close();
+    }
+
+    SafeRelease(m_pKinectSensor);
+}
+
+/// <summary>
+/// Opens the default Kinect sensor and its depth and color readers
+/// </summary>
+/// <returns>indicates success or failure</returns>
+HRESULT KinectFrameSource::Initialize()
+{
+    HRESULT hr;
+
+    hr = GetDefaultKinectSensor(&m_pKinectSensor);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    if (m_pKinectSensor)
+    {
+        // Initialize the Kinect and get the depth and color readers
+        IDepthFrameSource* pDepthFrameSource = NULL;
+        IColorFrameSource* pColorFrameSource = NULL;
+        hr = m_pKinectSensor->Open();
+
+        if (SUCCEEDED(hr))
+        {
+            hr = m_pKinectSensor->get_DepthFrameSource(&pDepthFrameSource);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = m_pKinectSensor->get_ColorFrameSource(&pColorFrameSource);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = m_pKinectSensor->get_CoordinateMapper(&m_pCoordinateMapper);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = pDepthFrameSource->OpenReader(&m_pDepthFrameReader);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = pColorFrameSource->OpenReader(&m_pColorFrameReader);
+        }
+
+        SafeRelease(pDepthFrameSource);
+        SafeRelease(pColorFrameSource);
+    }
+
+    if (!m_pKinectSensor || FAILED(hr))
+    {
+        return E_FAIL;
+    }
+
+    return hr;
+}
+
+/// <summary>
+/// Take the latest depth frame and the color frame that came with it
+/// </summary>
+bool KinectFrameSource::Acquire(SourceFrame& frame)
+{
+    if (!m_pDepthFrameReader || !m_pColorFrameReader)
+    {
+        return false;
+    }
+    Release();
+
+    HRESULT hr = m_pDepthFrameReader->AcquireLatestFrame(&m_pDepthFrame);
+    if (FAILED(hr))
+    {
+        return false;
+    }
+
+    IFrameDescription* pFrameDescription = NULL;
+    INT64 nTime = 0;
+    int nWidth = 0;
+    int nHeight = 0;
+    USHORT nDepthMinReliableDistance = 0;
+    USHORT nDepthMaxDistance = 0;
+    UINT nBufferSize = 0;
+    UINT16* pBuffer = NULL;
+
+    hr = m_pDepthFrame->get_RelativeTime(&nTime);
+
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pDepthFrame->get_FrameDescription(&pFrameDescription);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = pFrameDescription->get_Width(&nWidth);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = pFrameDescription->get_Height(&nHeight);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pDepthFrame->get_DepthMinReliableDistance(&nDepthMinReliableDistance);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        // Only the reliable range is kept; USHRT_MAX here would show the far field too
+        hr = m_pDepthFrame->get_DepthMaxReliableDistance(&nDepthMaxDistance);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pDepthFrame->AccessUnderlyingBuffer(&nBufferSize, &pBuffer);
+    }
+    SafeRelease(pFrameDescription);
+
+    if (FAILED(hr))
+    {
+        Release();
+        return false;
+    }
+
+    frame.depthTime = nTime;
+    frame.pDepth = pBuffer;
+    frame.depthWidth = nWidth;
+    frame.depthHeight = nHeight;
+    frame.minReliableDepth = nDepthMinReliableDistance;
+    frame.maxReliableDepth = nDepthMaxDistance;
+    frame.colorTime = 0;
+    frame.pColor = NULL;
+    frame.colorWidth = 0;
+    frame.colorHeight = 0;
+
+    // depth goes ahead without color; it only misses the encoder
+    if (FAILED(AccessColor(frame)))
+    {
+        frame.pColor = NULL;
+    }
+    return true;
+}
+
+/// <summary>
+/// Done with the frames from the last successful Acquire
+/// </summary>
+void KinectFrameSource::Release()
+{
+    SafeRelease(m_pDepthFrame);
+    SafeRelease(m_pColorFrame);
+}
+
+/// <summary>
+/// Fill in the color part of frame from m_pColorFrame
+/// </summary>
+HRESULT KinectFrameSource::AccessColor(SourceFrame& frame)
+{
+    IFrameDescription* pFrameDescriptionColor = NULL;
+    INT64 nTimeColor = 0;
+    int nWidthColor = 0;
+    int nHeightColor = 0;
+    UINT nBufferSizeColor = 0;
+    uint32_t* pBufferColor = NULL;
+
+    HRESULT hr = m_pColorFrameReader->AcquireLatestFrame(&m_pColorFrame);
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pColorFrame->get_RelativeTime(&nTimeColor);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pColorFrame->get_FrameDescription(&pFrameDescriptionColor);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = pFrameDescriptionColor->get_Width(&nWidthColor);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = pFrameDescriptionColor->get_Height(&nHeightColor);
+    }
+    SafeRelease(pFrameDescriptionColor);
+
+    ColorImageFormat imageFormat = ColorImageFormat_None;
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pColorFrame->get_RawColorImageFormat(&imageFormat);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        if (imageFormat == ColorImageFormat_Bgra)
+        {
+            hr = m_pColorFrame->AccessRawUnderlyingBuffer(&nBufferSizeColor, reinterpret_cast<BYTE**>(&pBufferColor));
+        }
+        else if (nWidthColor == m_nColorWidth && nHeightColor == m_nColorHeight)
+        {
+            m_convertedColor.resize(m_nColorWidth * m_nColorHeight);
+            pBufferColor = &m_convertedColor[0];
+            nBufferSizeColor = static_cast<UINT>(m_convertedColor.size() * sizeof(uint32_t));
+            hr = m_pColorFrame->CopyConvertedFrameDataToArray(nBufferSizeColor, reinterpret_cast<BYTE*>(pBufferColor), ColorImageFormat_Bgra);
+        }
+        else
+        {
+            hr = E_FAIL;
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        frame.colorTime = nTimeColor;
+        frame.pColor = pBufferColor;
+        frame.colorWidth = nWidthColor;
+        frame.colorHeight = nHeightColor;
+    }
+    return hr;
+}
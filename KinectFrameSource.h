@@ -0,0 +1,74 @@
+//------------------------------------------------------------------------------
+// KinectFrameSource.h
+//------------------------------------------------------------------------------
+
+// Frames from the default Kinect v2. Depth comes straight from the sensor's
+// buffer; color too when the sensor delivers BGRA, otherwise it is
+// converted into a buffer of the source's own. Both frames are held until
+// Release, as the pipeline reads them in place.
+
+#pragma once
+
+#include <windows.h>
+#include <Kinect.h>
+#include <vector>
+#include "FrameSource.h"
+
+class KinectFrameSource : public FrameSource
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    /// <param name="nColorWidth">width of the color frames</param>
+    /// <param name="nColorHeight">height of the color frames</param>
+    KinectFrameSource(int nColorWidth, int nColorHeight);
+
+    /// <summary>
+    /// Destructor
+    /// </summary>
+    ~KinectFrameSource();
+
+    /// <summary>
+    /// Opens the default Kinect sensor and its depth and color readers
+    /// </summary>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    HRESULT Initialize();
+
+    /// <summary>
+    /// The sensor's coordinate mapper, NULL until Initialize succeeds
+    /// </summary>
+    ICoordinateMapper* GetCoordinateMapper() const { return m_pCoordinateMapper; }
+
+    virtual bool Acquire(SourceFrame& frame);
+    virtual void Release();
+
+private:
+    KinectFrameSource(const KinectFrameSource&);
+    KinectFrameSource& operator=(const KinectFrameSource&);
+
+    /// <summary>
+    /// Fill in the color part of frame from m_pColorFrame
+    /// </summary>
+    HRESULT                 AccessColor(SourceFrame& frame);
+
+    int                     m_nColorWidth;
+    int                     m_nColorHeight;
+
+    // Current Kinect
+    IKinectSensor*          m_pKinectSensor;
+
+    // Coordinate Mapper
+    ICoordinateMapper*      m_pCoordinateMapper;
+
+    // Depth and color readers
+    IDepthFrameReader*      m_pDepthFrameReader;
+    IColorFrameReader*      m_pColorFrameReader;
+
+    // Frames handed out by the last Acquire
+    IDepthFrame*            m_pDepthFrame;
+    IColorFrame*            m_pColorFrame;
+
+    // Color converted to BGRA when the sensor delivers another format
+    std::vector<uint32_t>   m_convertedColor;
+};
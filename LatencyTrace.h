@@ -0,0 +1,256 @@
+/*=========================================================================
+
+  Per-frame latency tracing from capture to the last byte on the wire.
+
+  Each frame carries a FrameTrace: steady clock stamps taken as it is
+  acquired, as ProcessDepth and ProcessColor finish, as each stream's
+  encoder takes and returns it, once its message is framed, and as each
+  client's sender finishes writing it. Stamps are microseconds; every
+  stage is measured from the acquire stamp, so the histograms show how
+  the latency builds up rather than how long each step took.
+
+  The histograms are log-linear with 32 buckets per octave, exact below
+  32 us and within about 3% above, so p50/p99/p99.9 stay cheap to keep
+  for every stream and stage at frame rate.
+
+  The wall clock time of the acquire is kept too, for clients: written
+  into the igtl header timestamp it lets a receiver with a synchronized
+  clock work out the glass-to-glass latency of every message.
+
+=========================================================================*/
+
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include "igtl_header.h"
+#include "igtlMutexLock.h"
+
+// Stages of a frame, in the order they happen
+enum {
+  TraceAcquire = 0,
+  TraceDepth,         // ProcessDepth done
+  TraceColor,         // ProcessColor done, the frame is complete
+  TraceEncodeStart,   // the stream's encoder took the picture
+  TraceEncodeEnd,     // its NALs came out
+  TracePack,          // the message is framed and queued for the clients
+  TraceSent,          // a client's sender wrote its last byte
+  TraceStageCount
+};
+
+typedef struct {
+  long long stamps[TraceStageCount];  // steady clock microseconds, 0 for stages not reached
+  long long captureTime;              // wall clock microseconds since 1970 at the acquire
+  int   frame;                        // the encoder's frame number, to match x264's delayed output
+} FrameTrace;
+
+class LatencyHistogram
+{
+public:
+  enum { SubBuckets = 32, Octaves = 24, BucketCount = SubBuckets * (Octaves + 1) };
+
+  LatencyHistogram() : m_Counts(BucketCount, 0), m_Count(0) {}
+
+  void Add(long long us)
+  {
+    m_Counts[GetBucket(us)]++;
+    m_Count++;
+  }
+
+  long long GetCount() const { return m_Count; }
+
+  /// Upper bound of the bucket the fraction p (0..1) of the values fall
+  /// into, in microseconds; 0 while empty
+  long long GetPercentile(double p) const
+  {
+    if (m_Count == 0)
+    {
+      return 0;
+    }
+    long long rank = static_cast<long long>(ceil(p * m_Count));
+    rank = rank < 1 ? 1 : (rank > m_Count ? m_Count : rank);
+    long long seen = 0;
+    for (int i = 0; i < BucketCount; i++)
+    {
+      seen += m_Counts[i];
+      if (seen >= rank)
+      {
+        return GetBucketTop(i);
+      }
+    }
+    return GetBucketTop(BucketCount - 1);
+  }
+
+  void Clear()
+  {
+    m_Counts.assign(BucketCount, 0);
+    m_Count = 0;
+  }
+
+private:
+  // values below SubBuckets get a bucket each; above, octave k holds
+  // [SubBuckets << k, SubBuckets << (k + 1)) in SubBuckets equal steps
+  static int GetBucket(long long us)
+  {
+    if (us < SubBuckets)
+    {
+      return us < 0 ? 0 : static_cast<int>(us);
+    }
+    int shift = 0;
+    while ((us >> shift) >= 2 * SubBuckets && shift < Octaves - 1)
+    {
+      shift++;
+    }
+    long long step = us >> shift;
+    if (step >= 2 * SubBuckets)
+    {
+      return BucketCount - 1;
+    }
+    return SubBuckets * (shift + 1) + static_cast<int>(step - SubBuckets);
+  }
+
+  static long long GetBucketTop(int bucket)
+  {
+    if (bucket < SubBuckets)
+    {
+      return bucket;
+    }
+    int shift = bucket / SubBuckets - 1;
+    long long step = bucket % SubBuckets + SubBuckets;
+    return ((step + 1) << shift) - 1;
+  }
+
+  std::vector<long long> m_Counts;
+  long long m_Count;
+};
+
+// Percentiles of one stage of one stream, in microseconds since the acquire
+typedef struct {
+  long long count;
+  long long p50;
+  long long p99;
+  long long p999;
+} LatencySummary;
+
+class LatencyRecorder
+{
+public:
+  /// Steady clock stamp in microseconds
+  static long long Now()
+  {
+    return ToStamp(std::chrono::steady_clock::now());
+  }
+
+  static long long ToStamp(std::chrono::steady_clock::time_point time)
+  {
+    return std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count();
+  }
+
+  /// Start a frame's trace at its acquire
+  static void Start(FrameTrace& trace)
+  {
+    for (int i = 0; i < TraceStageCount; i++)
+    {
+      trace.stamps[i] = 0;
+    }
+    trace.stamps[TraceAcquire] = Now();
+    trace.captureTime = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+    trace.frame = -1;
+  }
+
+  /// Write the capture time into a framed message's igtl header timestamp:
+  /// seconds since 1970 in the high 32 bits, the fraction in the low 32.
+  /// The header CRC only covers the body, so the message stays valid.
+  static void PutTimeStamp(const FrameTrace& trace, std::vector<unsigned char>& message)
+  {
+    if (message.size() < IGTL_HEADER_SIZE || trace.captureTime <= 0)
+    {
+      return;
+    }
+    igtl_uint64 seconds = static_cast<igtl_uint64>(trace.captureTime / 1000000);
+    igtl_uint64 fraction = static_cast<igtl_uint64>(trace.captureTime % 1000000) * 4294967296ULL / 1000000;
+    igtl_uint64 value = (seconds << 32) | fraction;
+    unsigned char* dst = &message[offsetof(igtl_header, timestamp)];
+    for (int i = 7; i >= 0; i--)
+    {
+      dst[i] = static_cast<unsigned char>(value & 0xFF);
+      value >>= 8;
+    }
+  }
+
+  /// Add every stage the trace reached, up to and including lastStage
+  void Record(const std::string& stream, const FrameTrace& trace, int lastStage)
+  {
+    long long acquire = trace.stamps[TraceAcquire];
+    if (acquire == 0)
+    {
+      return;
+    }
+    m_Lock.Lock();
+    Histograms& histograms = m_Streams[stream];
+    for (int i = TraceAcquire + 1; i <= lastStage && i < TraceStageCount; i++)
+    {
+      if (trace.stamps[i] != 0)
+      {
+        histograms.stages[i].Add(trace.stamps[i] - acquire);
+      }
+    }
+    m_Lock.Unlock();
+  }
+
+  /// Add one stage stamped after the trace was shared, i.e. a client's send
+  void RecordStage(const std::string& stream, const FrameTrace& trace, int stage, long long stamp)
+  {
+    if (trace.stamps[TraceAcquire] == 0)
+    {
+      return;
+    }
+    m_Lock.Lock();
+    m_Streams[stream].stages[stage].Add(stamp - trace.stamps[TraceAcquire]);
+    m_Lock.Unlock();
+  }
+
+  LatencySummary GetSummary(const std::string& stream, int stage)
+  {
+    m_Lock.Lock();
+    const LatencyHistogram& histogram = m_Streams[stream].stages[stage];
+    LatencySummary summary = { histogram.GetCount(), histogram.GetPercentile(0.5),
+                               histogram.GetPercentile(0.99), histogram.GetPercentile(0.999) };
+    m_Lock.Unlock();
+    return summary;
+  }
+
+  /// Start new histograms, e.g. after each report
+  void Clear()
+  {
+    m_Lock.Lock();
+    for (std::map<std::string, Histograms>::iterator it = m_Streams.begin(); it != m_Streams.end(); ++it)
+    {
+      for (int i = 0; i < TraceStageCount; i++)
+      {
+        it->second.stages[i].Clear();
+      }
+    }
+    m_Lock.Unlock();
+  }
+
+  static const char* GetStageName(int stage)
+  {
+    static const char* const names[TraceStageCount] =
+      { "acquire", "depth", "color", "encode start", "encode end", "pack", "sent" };
+    return stage >= 0 && stage < TraceStageCount ? names[stage] : "";
+  }
+
+private:
+  typedef struct {
+    LatencyHistogram stages[TraceStageCount];
+  } Histograms;
+
+  igtl::SimpleMutexLock m_Lock;
+  std::map<std::string, Histograms> m_Streams;
+};
@@ -0,0 +1,294 @@
+//------------------------------------------------------------------------------
+// PlaybackFrameSource.cpp
+//------------------------------------------------------------------------------
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <string.h>
+#include "PlaybackFrameSource.h"
+
+/// <summary>
+/// Constructor
+/// </summary>
+PlaybackFrameSource::PlaybackFrameSource(bool bRealTime, int nFrames) :
+    m_pacer(bRealTime),
+    m_nFrames(nFrames > 0 ? nFrames : 0),
+    m_nDelivered(0),
+    m_nNext(0),
+    m_nLoopOffset(0),
+    m_pFile(NULL),
+    m_nFileSize(0)
+#ifdef _WIN32
+    , m_hFile(INVALID_HANDLE_VALUE),
+    m_hMapping(NULL)
+#endif
+{
+    memset(&m_header, 0, sizeof(m_header));
+}
+
+/// <summary>
+/// Destructor
+/// </summary>
+PlaybackFrameSource::~PlaybackFrameSource()
+{
+    UnmapFile();
+}
+
+/// <summary>
+/// Map a recording and read its index
+/// </summary>
+bool PlaybackFrameSource::Open(const std::string& filename)
+{
+    UnmapFile();
+    m_index.clear();
+    if (!MapFile(filename) || m_nFileSize < sizeof(m_header))
+    {
+        return false;
+    }
+
+    memcpy(&m_header, m_pFile, sizeof(m_header));
+    if (m_header.magic != FrameRecorder::cMagic || m_header.version != FrameRecorder::cVersion ||
+        m_header.extentSize < FrameRecorder::cRecordAlignment)
+    {
+        return false;
+    }
+    if (!ReadIndex())
+    {
+        RebuildIndex();
+    }
+
+    m_nNext = 0;
+    m_nDelivered = 0;
+    m_nLoopOffset = 0;
+    m_pacer.Restart();
+    return !m_index.empty();
+}
+
+/// <summary>
+/// Take the next frame if one is due; never waits
+/// </summary>
+bool PlaybackFrameSource::Acquire(SourceFrame& frame)
+{
+    if (m_index.empty() || IsFinished())
+    {
+        return false;
+    }
+    if (m_nNext == m_index.size())
+    {
+        // loop, one frame period after the last frame
+        int64_t nSpan = m_index.back().depthTime - m_index.front().depthTime;
+        int64_t nPeriod = m_index.size() > 1 ? nSpan / static_cast<int64_t>(m_index.size() - 1) : 333333;
+        m_nLoopOffset += nSpan + nPeriod;
+        m_nNext = 0;
+        m_pacer.Restart();
+    }
+
+    const FrameRecorder::IndexEntry& entry = m_index[m_nNext];
+    if (!m_pacer.IsDue(entry.depthTime))
+    {
+        return false;
+    }
+
+    const FrameRecorder::FrameRecordHeader* pRecord = GetRecord(entry.offset);
+    const uint8_t* pBase = reinterpret_cast<const uint8_t*>(pRecord);
+    frame.depthTime = pRecord->depthTime + m_nLoopOffset;
+    frame.pDepth = (pRecord->flags & FrameRecorder::RecordDepth) ?
+        reinterpret_cast<const uint16_t*>(pBase + pRecord->depthOffset) : NULL;
+    frame.depthWidth = m_header.depthWidth;
+    frame.depthHeight = m_header.depthHeight;
+    frame.minReliableDepth = cNominalMinReliableDepth;
+    frame.maxReliableDepth = cNominalMaxReliableDepth;
+    frame.colorTime = pRecord->colorTime + m_nLoopOffset;
+    frame.pColor = (pRecord->flags & FrameRecorder::RecordColor) ?
+        reinterpret_cast<const uint32_t*>(pBase + pRecord->colorOffset) : NULL;
+    frame.colorWidth = m_header.colorWidth;
+    frame.colorHeight = m_header.colorHeight;
+    m_nNext++;
+    m_nDelivered++;
+    return true;
+}
+
+/// <summary>
+/// True once the requested frames, or the recording, have been played
+/// </summary>
+bool PlaybackFrameSource::IsFinished() const
+{
+    return m_nFrames > 0 ? m_nDelivered >= m_nFrames : m_nNext >= m_index.size();
+}
+
+/// <summary>
+/// Keep the index entries that point at whole records of the expected size
+/// </summary>
+bool PlaybackFrameSource::ReadIndex()
+{
+    uint64_t nCount = m_header.frameCount;
+    uint64_t nOffset = m_header.indexOffset;
+    if (nOffset == 0 || nOffset > m_nFileSize ||
+        nCount > (m_nFileSize - nOffset) / sizeof(FrameRecorder::IndexEntry))
+    {
+        return false;
+    }
+
+    const uint8_t* pEntries = m_pFile + nOffset;
+    for (uint64_t i = 0; i < nCount; ++i)
+    {
+        FrameRecorder::IndexEntry entry;
+        memcpy(&entry, pEntries + i * sizeof(entry), sizeof(entry));
+        if (GetRecord(entry.offset))
+        {
+            m_index.push_back(entry);
+        }
+    }
+    return true;
+}
+
+/// <summary>
+/// Find the records of a recording that was never closed
+/// </summary>
+void PlaybackFrameSource::RebuildIndex()
+{
+    uint64_t nOffset = FrameRecorder::cRecordAlignment;
+    while (nOffset + sizeof(FrameRecorder::FrameRecordHeader) <= m_nFileSize)
+    {
+        const FrameRecorder::FrameRecordHeader* pRecord = GetRecord(nOffset);
+        if (!pRecord)
+        {
+            // the zero tail of an extent, or where the recording stopped
+            uint64_t nNextExtent = (nOffset / m_header.extentSize + 1) * m_header.extentSize;
+            if (reinterpret_cast<const FrameRecorder::FrameRecordHeader*>(m_pFile + nOffset)->magic != 0)
+            {
+                break;
+            }
+            nOffset = nNextExtent;
+            continue;
+        }
+
+        FrameRecorder::IndexEntry entry = { nOffset, pRecord->depthTime };
+        m_index.push_back(entry);
+        uint64_t nEnd = pRecord->depthOffset + pRecord->depthSize;
+        if (pRecord->flags & FrameRecorder::RecordColor)
+        {
+            nEnd = pRecord->colorOffset + pRecord->colorSize;
+        }
+        uint64_t nAlignment = FrameRecorder::cRecordAlignment;
+        nOffset += (nEnd + nAlignment - 1) / nAlignment * nAlignment;
+    }
+}
+
+/// <summary>
+/// The record at nOffset, if it is one and fits in the file
+/// </summary>
+const FrameRecorder::FrameRecordHeader* PlaybackFrameSource::GetRecord(uint64_t nOffset) const
+{
+    if (nOffset % FrameRecorder::cRecordAlignment != 0 ||
+        nOffset + sizeof(FrameRecorder::FrameRecordHeader) > m_nFileSize)
+    {
+        return NULL;
+    }
+
+    const FrameRecorder::FrameRecordHeader* pRecord =
+        reinterpret_cast<const FrameRecorder::FrameRecordHeader*>(m_pFile + nOffset);
+    uint64_t nDepthSize = static_cast<uint64_t>(m_header.depthWidth) * m_header.depthHeight * sizeof(uint16_t);
+    uint64_t nColorSize = static_cast<uint64_t>(m_header.colorWidth) * m_header.colorHeight * sizeof(uint32_t);
+    if (pRecord->magic != FrameRecorder::cRecordMagic || !(pRecord->flags & FrameRecorder::RecordDepth) ||
+        pRecord->depthSize != nDepthSize || nOffset + pRecord->depthOffset + nDepthSize > m_nFileSize)
+    {
+        return NULL;
+    }
+    if ((pRecord->flags & FrameRecorder::RecordColor) &&
+        (pRecord->colorSize != nColorSize || nOffset + pRecord->colorOffset + nColorSize > m_nFileSize))
+    {
+        return NULL;
+    }
+    return pRecord;
+}
+
+#ifdef _WIN32
+
+bool PlaybackFrameSource::MapFile(const std::string& filename)
+{
+    m_hFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                          FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    LARGE_INTEGER size = {0};
+    if (m_hFile == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_hFile, &size) || size.QuadPart == 0)
+    {
+        return false;
+    }
+    m_hMapping = CreateFileMappingW(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!m_hMapping)
+    {
+        return false;
+    }
+    m_pFile = static_cast<const uint8_t*>(MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+    m_nFileSize = m_pFile ? static_cast<uint64_t>(size.QuadPart) : 0;
+    return m_pFile != NULL;
+}
+
+void PlaybackFrameSource::UnmapFile()
+{
+    if (m_pFile)
+    {
+        UnmapViewOfFile(m_pFile);
+        m_pFile = NULL;
+    }
+    if (m_hMapping)
+    {
+        CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+    }
+    if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+    m_nFileSize = 0;
+}
+
+#else
+
+bool PlaybackFrameSource::MapFile(const std::string& filename)
+{
+    int nFile = open(filename.c_str(), O_RDONLY);
+    if (nFile < 0)
+    {
+        return false;
+    }
+    struct stat status;
+    if (fstat(nFile, &status) != 0 || status.st_size == 0)
+    {
+        close(nFile);
+        return false;
+    }
+    // the mapping outlives the descriptor
+    void* pView = mmap(NULL, static_cast<size_t>(status.st_size), PROT_READ, MAP_SHARED, nFile, 0);
+    close(nFile);
+    if (pView == MAP_FAILED)
+    {
+        return false;
+    }
+    madvise(pView, static_cast<size_t>(status.st_size), MADV_SEQUENTIAL);
+    m_pFile = static_cast<const uint8_t*>(pView);
+    m_nFileSize = static_cast<uint64_t>(status.st_size);
+    return true;
+}
+
+void PlaybackFrameSource::UnmapFile()
+{
+    if (m_pFile)
+    {
+        munmap(const_cast<uint8_t*>(m_pFile), static_cast<size_t>(m_nFileSize));
+        m_pFile = NULL;
+    }
+    m_nFileSize = 0;
+}
+
+#endif
@@ -0,0 +1,86 @@
+//------------------------------------------------------------------------------
+// PlaybackFrameSource.h
+//------------------------------------------------------------------------------
+
+// Plays back a recording made by FrameRecorder. The whole file is mapped
+// read-only and frames are handed out straight from the mapping, so the
+// pipeline sees them with no copy, as it does the sensor's buffers. A
+// recording that was cut short has its index rebuilt by walking the
+// extents. Frames come at their recorded pace or as fast as they are
+// taken, and the recording loops until the requested frame count is
+// reached.
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "FrameRecorder.h"
+#include "FrameSource.h"
+
+class PlaybackFrameSource : public FrameSource
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    /// <param name="bRealTime">hand frames out at their recorded pace rather than as fast as possible</param>
+    /// <param name="nFrames">frames to deliver, looping the recording as needed; 0 plays it once</param>
+    PlaybackFrameSource(bool bRealTime, int nFrames);
+
+    /// <summary>
+    /// Destructor
+    /// </summary>
+    ~PlaybackFrameSource();
+
+    /// <summary>
+    /// Map a recording and read its index
+    /// </summary>
+    /// <returns>false if the file can't be read or holds no frames</returns>
+    bool Open(const std::string& filename);
+
+    /// <summary>
+    /// Frames in the recording
+    /// </summary>
+    int GetFrameCount() const { return static_cast<int>(m_index.size()); }
+
+    virtual bool Acquire(SourceFrame& frame);
+    virtual bool IsFinished() const;
+
+private:
+    PlaybackFrameSource(const PlaybackFrameSource&);
+    PlaybackFrameSource& operator=(const PlaybackFrameSource&);
+
+    /// <summary>
+    /// Keep the index entries that point at whole records of the expected size
+    /// </summary>
+    bool                    ReadIndex();
+
+    /// <summary>
+    /// Find the records of a recording that was never closed
+    /// </summary>
+    void                    RebuildIndex();
+
+    /// <summary>
+    /// The record at nOffset, if it is one and fits in the file
+    /// </summary>
+    const FrameRecorder::FrameRecordHeader* GetRecord(uint64_t nOffset) const;
+
+    // platform layer
+    bool                    MapFile(const std::string& filename);
+    void                    UnmapFile();
+
+    FrameRecorder::RecordingHeader m_header;
+    std::vector<FrameRecorder::IndexEntry> m_index;
+    FramePacer              m_pacer;
+    int                     m_nFrames;
+    int                     m_nDelivered;
+    size_t                  m_nNext;
+    int64_t                 m_nLoopOffset;      // added to the times so they keep rising across loops
+
+    const uint8_t*          m_pFile;
+    uint64_t                m_nFileSize;
+#ifdef _WIN32
+    void*                   m_hFile;
+    void*                   m_hMapping;
+#endif
+};
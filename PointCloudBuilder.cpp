@@ -0,0 +1,234 @@
+//------------------------------------------------------------------------------
+// PointCloudBuilder.cpp
+//------------------------------------------------------------------------------
+
+#include <math.h>
+#include "SimdSupport.h"
+#include "PointCloudBuilder.h"
+
+static const float cMetersPerMillimeter = 0.001f;
+
+static inline int16_t SaturateInt16(long nValue)
+{
+    return static_cast<int16_t>(nValue < -32768 ? -32768 : (nValue > 32767 ? 32767 : nValue));
+}
+
+static inline void StoreColor(uint32_t c, uint8_t* pColor)
+{
+    pColor[0] = static_cast<uint8_t>(c >> 16);
+    pColor[1] = static_cast<uint8_t>(c >> 8);
+    pColor[2] = static_cast<uint8_t>(c);
+}
+
+/// <summary>
+/// Constructor; the ray tables come from arena
+/// </summary>
+PointCloudBuilder::PointCloudBuilder(FrameArena& arena, int nWidth, int nHeight) :
+    m_nWidth(nWidth),
+    m_nHeight(nHeight),
+    m_bHasRays(false),
+    m_pRayX(NULL),
+    m_pRayY(NULL)
+{
+    m_pRayX = arena.Allocate<float>(nWidth * nHeight);
+    m_pRayY = arena.Allocate<float>(nWidth * nHeight);
+}
+
+/// <summary>
+/// Take the rays from a table of (x, y) pairs per pixel
+/// </summary>
+bool PointCloudBuilder::SetRayTable(const float* pRays, int nStride)
+{
+    if (!m_pRayX || !m_pRayY)
+    {
+        return false;
+    }
+
+    bool bAnyRay = false;
+    for (int y = 0; y < m_nHeight; ++y)
+    {
+        const float* pRow = pRays + 2 * y * nStride;
+        for (int x = 0; x < m_nWidth; ++x)
+        {
+            int i = y * m_nWidth + x;
+            m_pRayX[i] = pRow[2 * x];
+            m_pRayY[i] = pRow[2 * x + 1];
+            bAnyRay = bAnyRay || pRow[2 * x] != 0.0f || pRow[2 * x + 1] != 0.0f;
+        }
+    }
+    m_bHasRays = bAnyRay;
+    return bAnyRay;
+}
+
+/// <summary>
+/// Pinhole rays from the depth camera intrinsics
+/// </summary>
+void PointCloudBuilder::SetIntrinsics(float fFocalX, float fFocalY, float fCenterX, float fCenterY)
+{
+    if (!m_pRayX || !m_pRayY)
+    {
+        return;
+    }
+
+    for (int y = 0; y < m_nHeight; ++y)
+    {
+        for (int x = 0; x < m_nWidth; ++x)
+        {
+            m_pRayX[y * m_nWidth + x] = (x - fCenterX) / fFocalX;
+            m_pRayY[y * m_nWidth + x] = (fCenterY - y) / fFocalY;
+        }
+    }
+    m_bHasRays = true;
+}
+
+/// <summary>
+/// Back-project a depth frame, picking the AVX2 kernel when available
+/// </summary>
+int PointCloudBuilder::Build(const uint16_t* pDepth, const uint32_t* pColor, uint16_t nMinDepth, uint16_t nMaxDepth,
+                             PointFormat eFormat, void* pPositions, uint8_t* pColors) const
+{
+    if (!m_bHasRays)
+    {
+        return 0;
+    }
+
+    // depth 0 is "no reading", whatever the range says
+    uint16_t nLow = nMinDepth > 0 ? nMinDepth : 1;
+    int nPixels = m_nWidth * m_nHeight;
+    int nDone = 0;
+    int nPoints = 0;
+#if DEPTH_SIMD_X86
+    if (SimdSupport::HasAVX2())
+    {
+        nDone = nPixels & ~7;
+        nPoints = BuildAVX2(pDepth, pColor, nDone, nLow, nMaxDepth, eFormat, pPositions, pColors);
+    }
+#endif
+    return BuildRangeScalar(pDepth, pColor, nDone, nPixels, nLow, nMaxDepth, eFormat, pPositions, pColors, nPoints);
+}
+
+/// <summary>
+/// Reference implementation, one pixel at a time
+/// </summary>
+int PointCloudBuilder::BuildScalar(const uint16_t* pDepth, const uint32_t* pColor, uint16_t nMinDepth, uint16_t nMaxDepth,
+                                   PointFormat eFormat, void* pPositions, uint8_t* pColors) const
+{
+    if (!m_bHasRays)
+    {
+        return 0;
+    }
+
+    uint16_t nLow = nMinDepth > 0 ? nMinDepth : 1;
+    return BuildRangeScalar(pDepth, pColor, 0, m_nWidth * m_nHeight, nLow, nMaxDepth, eFormat, pPositions, pColors, 0);
+}
+
+int PointCloudBuilder::BuildRangeScalar(const uint16_t* pDepth, const uint32_t* pColor, int nBegin, int nEnd,
+                                        uint16_t nLow, uint16_t nHigh, PointFormat eFormat, void* pPositions, uint8_t* pColors, int nPoints) const
+{
+    for (int i = nBegin; i < nEnd; ++i)
+    {
+        uint16_t d = pDepth[i];
+        if (d < nLow || d > nHigh)
+        {
+            continue;
+        }
+
+        if (eFormat == PointFormatInt16)
+        {
+            // lrintf rounds to nearest even, as the AVX2 conversion does
+            float z = static_cast<float>(d);
+            int16_t* pPosition = static_cast<int16_t*>(pPositions) + 3 * nPoints;
+            pPosition[0] = SaturateInt16(lrintf(m_pRayX[i] * z));
+            pPosition[1] = SaturateInt16(lrintf(m_pRayY[i] * z));
+            pPosition[2] = SaturateInt16(d);
+        }
+        else
+        {
+            float z = static_cast<float>(d) * cMetersPerMillimeter;
+            float* pPosition = static_cast<float*>(pPositions) + 3 * nPoints;
+            pPosition[0] = m_pRayX[i] * z;
+            pPosition[1] = m_pRayY[i] * z;
+            pPosition[2] = z;
+        }
+        StoreColor(pColor[i], pColors + 3 * nPoints);
+        ++nPoints;
+    }
+    return nPoints;
+}
+
+#if DEPTH_SIMD_X86
+
+// Eight pixels at a time: the range test and the back-projection are
+// vectorized, then every lane is written at the next point and only valid
+// lanes advance it, so compaction has no branches. A lane written past the
+// last point lands at most on the current pixel's slot, which the output has.
+DEPTH_TARGET_AVX2
+int PointCloudBuilder::BuildAVX2(const uint16_t* pDepth, const uint32_t* pColor, int nPixels,
+                                 uint16_t nLow, uint16_t nHigh, PointFormat eFormat, void* pPositions, uint8_t* pColors) const
+{
+    const __m128i low = _mm_set1_epi16(static_cast<short>(nLow));
+    const __m128i high = _mm_set1_epi16(static_cast<short>(nHigh));
+    const __m256 meters = _mm256_set1_ps(cMetersPerMillimeter);
+    float* pFloat = static_cast<float*>(pPositions);
+    int16_t* pInt16 = static_cast<int16_t*>(pPositions);
+    int nPoints = 0;
+
+    for (int i = 0; i < nPixels; i += 8)
+    {
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pDepth + i));
+
+        // unsigned low <= d <= high
+        __m128i valid = _mm_and_si128(_mm_cmpeq_epi16(_mm_max_epu16(d, low), d),
+                                      _mm_cmpeq_epi16(_mm_min_epu16(d, high), d));
+        int nMask = _mm_movemask_epi8(_mm_packs_epi16(valid, _mm_setzero_si128()));
+        if (nMask == 0)
+        {
+            continue;
+        }
+
+        __m256i d32 = _mm256_cvtepu16_epi32(d);
+        __m256 rayX = _mm256_loadu_ps(m_pRayX + i);
+        __m256 rayY = _mm256_loadu_ps(m_pRayY + i);
+        if (eFormat == PointFormatInt16)
+        {
+            __m256 z = _mm256_cvtepi32_ps(d32);
+            __m256i x = _mm256_cvtps_epi32(_mm256_mul_ps(rayX, z));
+            __m256i y = _mm256_cvtps_epi32(_mm256_mul_ps(rayY, z));
+
+            // packs work within 128-bit lanes; the permute restores x0-7, y0-7
+            // and z0-7 order
+            int16_t xy[16], zz[16];
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(xy), _mm256_permute4x64_epi64(_mm256_packs_epi32(x, y), 0xD8));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(zz), _mm256_permute4x64_epi64(_mm256_packs_epi32(d32, d32), 0xD8));
+            for (int k = 0; k < 8; ++k)
+            {
+                int16_t* pPosition = pInt16 + 3 * nPoints;
+                pPosition[0] = xy[k];
+                pPosition[1] = xy[8 + k];
+                pPosition[2] = zz[k];
+                StoreColor(pColor[i + k], pColors + 3 * nPoints);
+                nPoints += (nMask >> k) & 1;
+            }
+        }
+        else
+        {
+            __m256 z = _mm256_mul_ps(_mm256_cvtepi32_ps(d32), meters);
+            float xs[8], ys[8], zs[8];
+            _mm256_storeu_ps(xs, _mm256_mul_ps(rayX, z));
+            _mm256_storeu_ps(ys, _mm256_mul_ps(rayY, z));
+            _mm256_storeu_ps(zs, z);
+            for (int k = 0; k < 8; ++k)
+            {
+                float* pPosition = pFloat + 3 * nPoints;
+                pPosition[0] = xs[k];
+                pPosition[1] = ys[k];
+                pPosition[2] = zs[k];
+                StoreColor(pColor[i + k], pColors + 3 * nPoints);
+                nPoints += (nMask >> k) & 1;
+            }
+        }
+    }
+    return nPoints;
+}
+
+#endif
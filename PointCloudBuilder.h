@@ -0,0 +1,91 @@
+//------------------------------------------------------------------------------
+// PointCloudBuilder.h
+//------------------------------------------------------------------------------
+
+// Back-projects the depth grid into a colored point cloud. Every depth pixel
+// has a precomputed ray (x/z, y/z in camera space, lens distortion included),
+// so a point is just the ray scaled by its depth. Pixels outside the reliable
+// depth range are skipped; the remaining points are written in pixel order.
+
+#pragma once
+
+#include <stdint.h>
+#include "FrameArena.h"
+
+enum PointFormat
+{
+    PointFormatFloat32 = 0,     // x, y, z as float meters
+    PointFormatInt16 = 1        // x, y, z as int16 millimeters, saturated
+};
+
+class PointCloudBuilder
+{
+public:
+    /// <summary>
+    /// Constructor; the ray tables come from arena
+    /// </summary>
+    PointCloudBuilder(FrameArena& arena, int nWidth, int nHeight);
+
+    /// <summary>
+    /// Take the rays from a table of (x, y) pairs per pixel, e.g. from
+    /// ICoordinateMapper::GetDepthFrameToCameraSpaceTable
+    /// </summary>
+    /// <param name="pRays">pair of the builder's first pixel</param>
+    /// <param name="nStride">pairs per table row, more than the width when the builder covers part of the frame</param>
+    /// <returns>false if the table is all zero, as before the sensor reports its intrinsics</returns>
+    bool SetRayTable(const float* pRays, int nStride);
+
+    /// <summary>
+    /// Pinhole rays from the depth camera intrinsics, without distortion;
+    /// Y points up as in Kinect camera space
+    /// </summary>
+    void SetIntrinsics(float fFocalX, float fFocalY, float fCenterX, float fCenterY);
+
+    bool HasRays() const { return m_bHasRays; }
+
+    /// <summary>
+    /// Bytes of one point's position in the given format
+    /// </summary>
+    static int GetPositionSize(PointFormat eFormat) { return eFormat == PointFormatInt16 ? 3 * sizeof(int16_t) : 3 * sizeof(float); }
+
+    /// <summary>
+    /// Back-project a depth frame, picking the AVX2 kernel when available
+    /// </summary>
+    /// <param name="pDepth">raw depth in millimeters, one per pixel</param>
+    /// <param name="pColor">registered BGRX color, one per pixel</param>
+    /// <param name="nMinDepth">minimum reliable depth</param>
+    /// <param name="nMaxDepth">maximum reliable depth</param>
+    /// <param name="eFormat">format of the positions</param>
+    /// <param name="pPositions">x, y, z per point, room for every pixel</param>
+    /// <param name="pColors">r, g, b per point, room for every pixel</param>
+    /// <returns>number of points written</returns>
+    int Build(const uint16_t* pDepth, const uint32_t* pColor, uint16_t nMinDepth, uint16_t nMaxDepth,
+              PointFormat eFormat, void* pPositions, uint8_t* pColors) const;
+
+    /// <summary>
+    /// Reference implementation, one pixel at a time
+    /// </summary>
+    int BuildScalar(const uint16_t* pDepth, const uint32_t* pColor, uint16_t nMinDepth, uint16_t nMaxDepth,
+                    PointFormat eFormat, void* pPositions, uint8_t* pColors) const;
+
+private:
+    PointCloudBuilder(const PointCloudBuilder&);
+    PointCloudBuilder& operator=(const PointCloudBuilder&);
+
+    // Back-project pixels [nBegin, nEnd) appending after nPoints points;
+    // returns the new number of points
+    int BuildRangeScalar(const uint16_t* pDepth, const uint32_t* pColor, int nBegin, int nEnd,
+                         uint16_t nLow, uint16_t nHigh, PointFormat eFormat, void* pPositions, uint8_t* pColors, int nPoints) const;
+
+    // As BuildRangeScalar from pixel 0, for a multiple of 8 pixels
+    int BuildAVX2(const uint16_t* pDepth, const uint32_t* pColor, int nPixels,
+                  uint16_t nLow, uint16_t nHigh, PointFormat eFormat, void* pPositions, uint8_t* pColors) const;
+
+    int                     m_nWidth;
+    int                     m_nHeight;
+    bool                    m_bHasRays;
+
+    // x/z and y/z of every pixel's ray
+    float*                  m_pRayX;
+    float*                  m_pRayY;
+};
@@ -0,0 +1,68 @@
+/*=========================================================================
+
+  Frames a colored point cloud as an OpenIGTLink message of type
+  POINTCLOUD.
+
+  POLYDATA would need big-endian float32 positions and a per-point color
+  attribute; this body is compact and copied straight from the capture
+  buffers. Positions and the point count are in the capture machine's byte
+  order, which the endian field gives as VideoMessage does:
+
+    uint8   version       1
+    uint8   format        0 float32 meters, 1 int16 millimeters
+    uint8   endian        1 big endian, 2 little endian
+    uint8   reserved      0
+    uint32  count         number of points N
+    N x 3   positions     x, y, z (Kinect camera space, Y up)
+    N x 3   uint8 colors  r, g, b
+
+=========================================================================*/
+
+#pragma once
+
+#include <string.h>
+#include <string>
+#include <vector>
+#include "igtl_header.h"
+#include "igtl_util.h"
+#include "PointCloudBuilder.h"
+
+class PointCloudSender
+{
+public:
+  enum { BodyHeaderSize = 8 };
+
+  /// Write the complete message for one cloud into out
+  static void Serialize(const std::string& deviceName, PointFormat format, int count,
+                        const void* positions, const unsigned char* colors, std::vector<unsigned char>& out)
+  {
+    size_t positionBytes = static_cast<size_t>(count) * PointCloudBuilder::GetPositionSize(format);
+    size_t colorBytes = static_cast<size_t>(count) * 3;
+    size_t bodySize = BodyHeaderSize + positionBytes + colorBytes;
+    out.resize(IGTL_HEADER_SIZE + bodySize);
+
+    unsigned char* body = &out[IGTL_HEADER_SIZE];
+    igtl_uint32 count32 = static_cast<igtl_uint32>(count);
+    body[0] = 1;
+    body[1] = static_cast<unsigned char>(format);
+    body[2] = igtl_is_little_endian() == 1 ? 2 : 1;
+    body[3] = 0;
+    memcpy(body + 4, &count32, sizeof(count32));
+    if (count > 0)
+    {
+      memcpy(body + BodyHeaderSize, positions, positionBytes);
+      memcpy(body + BodyHeaderSize + positionBytes, colors, colorBytes);
+    }
+
+    igtl_header header;
+    memset(&header, 0, sizeof(header));
+    header.header_version = IGTL_HEADER_VERSION_1;
+    strncpy(header.name, "POINTCLOUD", IGTL_HEADER_TYPE_SIZE);
+    strncpy(header.device_name, deviceName.c_str(), IGTL_HEADER_NAME_SIZE);
+    header.timestamp = 0;
+    header.body_size = bodySize;
+    header.crc = crc64(body, bodySize, crc64(0, 0, 0LL));
+    igtl_header_convert_byte_order(&header);
+    memcpy(&out[0], &header, IGTL_HEADER_SIZE);
+  }
+};
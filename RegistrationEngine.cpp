@@ -0,0 +1,154 @@
+//------------------------------------------------------------------------------
+// RegistrationEngine.cpp
+//------------------------------------------------------------------------------
+
+#include <new>
+#include "ColorRegistration.h"
+#include "RegistrationEngine.h"
+
+/// <summary>
+/// Constructor
+/// </summary>
+RegistrationEngine::RegistrationEngine(FrameArena& arena, int nDepthWidth, int nDepthHeight, int nColorWidth, int nColorHeight) :
+    m_arena(arena),
+    m_nDepthWidth(nDepthWidth),
+    m_nDepthHeight(nDepthHeight),
+    m_nColorWidth(nColorWidth),
+    m_nColorHeight(nColorHeight),
+    m_nThreads(1),
+    m_nColorStride(1),
+    m_pCells(NULL),
+    m_pSource(NULL),
+    m_pFilled(NULL),
+    m_ePass(PassGather),
+    m_pPoints(NULL),
+    m_pDepth(NULL),
+    m_pColor(NULL),
+    m_pRegistered(NULL),
+    m_pPreview(NULL)
+{
+    m_threader = igtl::MultiThreader::New();
+    SetThreadCount(0);
+
+    int nCells = nDepthWidth * nDepthHeight;
+    m_pCells = arena.Allocate<std::atomic<uint64_t> >(nCells);
+    for (int i = 0; m_pCells && i < nCells; ++i)
+    {
+        new (&m_pCells[i]) std::atomic<uint64_t>(ColorRegistration::cEmptyCell);
+    }
+}
+
+/// <summary>
+/// Number of worker threads; 0 uses one per core
+/// </summary>
+void RegistrationEngine::SetThreadCount(int nThreads)
+{
+    m_nThreads = nThreads > 0 ? nThreads : igtl::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    if (m_nThreads < 1)
+    {
+        m_nThreads = 1;
+    }
+}
+
+/// <summary>
+/// Use every nStride-th color pixel for Scatter()
+/// </summary>
+void RegistrationEngine::SetColorStride(int nStride)
+{
+    m_nColorStride = nStride > 1 ? nStride : 1;
+}
+
+/// <summary>
+/// Depth-driven registration
+/// </summary>
+void RegistrationEngine::Gather(const float* pColorPoints, const uint32_t* pColor,
+                                uint32_t* pRegistered, uint32_t* pPreview)
+{
+    m_pPoints = pColorPoints;
+    m_pColor = pColor;
+    m_pRegistered = pRegistered;
+    m_pPreview = pPreview;
+    Execute(PassGather);
+}
+
+/// <summary>
+/// Color-driven registration: splat in parallel over color tiles, then, each
+/// pass once the previous one is complete, resolve and fill along the rows and
+/// fill along the columns in parallel over depth tiles
+/// </summary>
+void RegistrationEngine::Scatter(const float* pDepthPoints, const uint16_t* pDepth, const uint32_t* pColor,
+                                 uint32_t* pRegistered, uint32_t* pPreview)
+{
+    m_pPoints = pDepthPoints;
+    m_pDepth = pDepth;
+    m_pColor = pColor;
+    m_pRegistered = pRegistered;
+    m_pPreview = pPreview;
+    m_pSource = m_arena.Allocate<uint32_t>(m_nDepthWidth * m_nDepthHeight);
+    m_pFilled = m_arena.Allocate<uint32_t>(m_nDepthWidth * m_nDepthHeight);
+    if (!m_pCells || !m_pSource || !m_pFilled)
+    {
+        return;
+    }
+    Execute(PassScatter);
+    Execute(PassResolve);
+    Execute(PassFill);
+}
+
+/// <summary>
+/// Run one pass on all threads and wait for it
+/// </summary>
+void RegistrationEngine::Execute(Pass ePass)
+{
+    m_ePass = ePass;
+    if (m_nThreads == 1)
+    {
+        igtl::MultiThreader::ThreadInfo info;
+        info.ThreadID = 0;
+        info.NumberOfThreads = 1;
+        info.UserData = this;
+        Worker(&info);
+        return;
+    }
+    m_threader->SetNumberOfThreads(m_nThreads);
+    m_threader->SetSingleMethod((igtl::ThreadFunctionType) &RegistrationEngine::Worker, this);
+    m_threader->SingleMethodExecute();
+}
+
+/// <summary>
+/// Worker entry point
+/// </summary>
+void* RegistrationEngine::Worker(void* ptr)
+{
+    igtl::MultiThreader::ThreadInfo* info = static_cast<igtl::MultiThreader::ThreadInfo*>(ptr);
+    RegistrationEngine* self = static_cast<RegistrationEngine*>(info->UserData);
+
+    int nRows = self->m_ePass == PassScatter ? self->m_nColorHeight : self->m_nDepthHeight;
+    int nTiles = (nRows + cTileRows - 1) / cTileRows;
+    for (int tile = info->ThreadID; tile < nTiles; tile += info->NumberOfThreads)
+    {
+        int nRowBegin = tile * cTileRows;
+        int nRowEnd = nRowBegin + cTileRows < nRows ? nRowBegin + cTileRows : nRows;
+        switch (self->m_ePass)
+        {
+        case PassGather:
+            ColorRegistration::GatherBilinear(self->m_pPoints, self->m_nDepthWidth, nRowBegin, nRowEnd,
+                self->m_pColor, self->m_nColorWidth, self->m_nColorHeight,
+                self->m_pRegistered, self->m_pPreview);
+            break;
+        case PassScatter:
+            ColorRegistration::ScatterZBuffered(self->m_pPoints, self->m_nColorWidth, self->m_nColorStride,
+                nRowBegin, nRowEnd, self->m_pDepth, self->m_nDepthWidth, self->m_nDepthHeight, self->m_pCells);
+            break;
+        case PassResolve:
+            ColorRegistration::ResolveRows(self->m_pCells, self->m_pDepth, self->m_nDepthWidth,
+                nRowBegin, nRowEnd, self->m_pSource, self->m_pFilled);
+            break;
+        case PassFill:
+            ColorRegistration::FillColumns(self->m_pFilled, self->m_pDepth, self->m_nDepthWidth, self->m_nDepthHeight,
+                nRowBegin, nRowEnd, self->m_pColor, self->m_pRegistered, self->m_pPreview);
+            break;
+        }
+    }
+    return NULL;
+}
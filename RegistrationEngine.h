@@ -0,0 +1,95 @@
+//------------------------------------------------------------------------------
+// RegistrationEngine.h
+//------------------------------------------------------------------------------
+
+// Runs color registration on all cores. A frame is cut into tiles of rows
+// that the worker threads take in turn; the kernels in ColorRegistration
+// make the output bit-identical for any number of threads.
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include "igtlMultiThreader.h"
+#include "FrameArena.h"
+
+class RegistrationEngine
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    /// <param name="arena">arena for the engine's buffers; Scatter() takes its per-frame
+    /// scratch from it too, so the caller rewinds it between frames</param>
+    /// <param name="nDepthWidth">width of the depth grid</param>
+    /// <param name="nDepthHeight">height of the depth grid</param>
+    /// <param name="nColorWidth">width of the color frame</param>
+    /// <param name="nColorHeight">height of the color frame</param>
+    RegistrationEngine(FrameArena& arena, int nDepthWidth, int nDepthHeight, int nColorWidth, int nColorHeight);
+
+    /// <summary>
+    /// Number of worker threads; 0 uses one per core
+    /// </summary>
+    void SetThreadCount(int nThreads);
+
+    /// <summary>
+    /// Use every nStride-th color pixel of every nStride-th row for Scatter();
+    /// the holes this leaves are filled from their neighbors
+    /// </summary>
+    void SetColorStride(int nStride);
+
+    /// <summary>
+    /// Depth-driven registration, see ColorRegistration::GatherBilinear
+    /// </summary>
+    void Gather(const float* pColorPoints, const uint32_t* pColor,
+                uint32_t* pRegistered, uint32_t* pPreview);
+
+    /// <summary>
+    /// Color-driven registration, see ColorRegistration::ScatterZBuffered
+    /// </summary>
+    void Scatter(const float* pDepthPoints, const uint16_t* pDepth, const uint32_t* pColor,
+                 uint32_t* pRegistered, uint32_t* pPreview);
+
+private:
+    RegistrationEngine(const RegistrationEngine&);
+    RegistrationEngine& operator=(const RegistrationEngine&);
+
+    enum Pass { PassGather, PassScatter, PassResolve, PassFill };
+
+    /// <summary>
+    /// Run one pass on all threads and wait for it
+    /// </summary>
+    void                    Execute(Pass ePass);
+
+    /// <summary>
+    /// Worker entry point; processes tiles ThreadID, ThreadID + NumberOfThreads, ...
+    /// </summary>
+    static void*            Worker(void* ptr);
+
+    static const int        cTileRows = 16;
+
+    FrameArena&             m_arena;
+    int                     m_nDepthWidth;
+    int                     m_nDepthHeight;
+    int                     m_nColorWidth;
+    int                     m_nColorHeight;
+    int                     m_nThreads;
+    int                     m_nColorStride;
+    igtl::MultiThreader::Pointer m_threader;
+
+    // scatter bids, one per depth pixel, kept empty between frames
+    std::atomic<uint64_t>*  m_pCells;
+
+    // winning color index per depth pixel, before and after the row fill;
+    // per-frame scratch
+    uint32_t*               m_pSource;
+    uint32_t*               m_pFilled;
+
+    // arguments of the pass being executed
+    Pass                    m_ePass;
+    const float*            m_pPoints;
+    const uint16_t*         m_pDepth;
+    const uint32_t*         m_pColor;
+    uint32_t*               m_pRegistered;
+    uint32_t*               m_pPreview;
+};
@@ -0,0 +1,104 @@
+//------------------------------------------------------------------------------
+// SimdSupport.h
+//------------------------------------------------------------------------------
+
+// Runtime CPU feature detection and per-function target attributes for the
+// SSE2/SSE4.1/AVX2 kernels, so they can live next to their scalar fallbacks
+
+#pragma once
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define DEPTH_SIMD_X86 1
+#else
+#define DEPTH_SIMD_X86 0
+#endif
+
+#if DEPTH_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define DEPTH_TARGET_SSE2
+#define DEPTH_TARGET_SSE41
+#define DEPTH_TARGET_AVX2
+#else
+#define DEPTH_TARGET_SSE2 __attribute__((target("sse2")))
+#define DEPTH_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define DEPTH_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace SimdSupport
+{
+#if DEPTH_SIMD_X86 && defined(_MSC_VER)
+    inline bool DetectSSE2()
+    {
+        int info[4];
+        __cpuid(info, 1);
+        return (info[3] & (1 << 26)) != 0;
+    }
+
+    inline bool DetectSSE41()
+    {
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 19)) != 0;
+    }
+
+    inline bool DetectAVX2()
+    {
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7)
+        {
+            return false;
+        }
+
+        // AVX needs OS support for saving the YMM registers (OSXSAVE + XCR0)
+        __cpuid(info, 1);
+        bool bOsxsave = (info[2] & (1 << 27)) != 0;
+        bool bAvx = (info[2] & (1 << 28)) != 0;
+        if (!bOsxsave || !bAvx || (_xgetbv(0) & 0x6) != 0x6)
+        {
+            return false;
+        }
+
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+    }
+#elif DEPTH_SIMD_X86
+    inline bool DetectSSE2()  { return __builtin_cpu_supports("sse2") != 0; }
+    inline bool DetectSSE41() { return __builtin_cpu_supports("sse4.1") != 0; }
+    inline bool DetectAVX2()  { return __builtin_cpu_supports("avx2") != 0; }
+#else
+    inline bool DetectSSE2()  { return false; }
+    inline bool DetectSSE41() { return false; }
+    inline bool DetectAVX2()  { return false; }
+#endif
+
+    /// <summary>
+    /// Whether SSE2 kernels may be used on this machine (detected once)
+    /// </summary>
+    inline bool HasSSE2()
+    {
+        static const bool bHas = DetectSSE2();
+        return bHas;
+    }
+
+    /// <summary>
+    /// Whether SSE4.1 kernels may be used on this machine (detected once)
+    /// </summary>
+    inline bool HasSSE41()
+    {
+        static const bool bHas = DetectSSE41();
+        return bHas;
+    }
+
+    /// <summary>
+    /// Whether AVX2 kernels may be used on this machine (detected once)
+    /// </summary>
+    inline bool HasAVX2()
+    {
+        static const bool bHas = DetectAVX2();
+        return bHas;
+    }
+}
@@ -0,0 +1,192 @@
+//------------------------------------------------------------------------------
+// SyntheticFrameSource.cpp
+//------------------------------------------------------------------------------
+
+#include <string.h>
+#include "SyntheticFrameSource.h"
+
+// intrinsics as integers, so every machine generates the same frames
+static const int cDepthFocal = static_cast<int>(cNominalDepthFocal);
+static const int cColorFocal = static_cast<int>(cNominalColorFocal);
+
+static const int cWallNear = 2500;      // mm at the left edge
+static const int cWallSlant = 400;      // mm further at the right edge
+static const int cBallFront = 1100;     // mm to the ball's nearest point
+static const int cBallDepth = 150;      // mm from its nearest point to its rim
+
+static inline uint32_t Hash(uint32_t x, uint32_t y, uint32_t nFrame)
+{
+    uint32_t h = x * 73856093u ^ y * 19349663u ^ nFrame * 83492791u;
+    h ^= h >> 13;
+    h *= 0x5bd1e995u;
+    h ^= h >> 15;
+    return h;
+}
+
+// -1024 .. 1024 and back over nPeriod frames
+static inline int Triangle(int nFrame, int nPeriod)
+{
+    int nPhase = nFrame % nPeriod;
+    int nHalf = nPeriod / 2;
+    return nPhase < nHalf ? -1024 + 2048 * nPhase / nHalf : 1024 - 2048 * (nPhase - nHalf) / (nPeriod - nHalf);
+}
+
+static inline uint32_t Bgra(int r, int g, int b)
+{
+    return 0xFF000000u | (static_cast<uint32_t>(r) << 16) | (static_cast<uint32_t>(g) << 8) | static_cast<uint32_t>(b);
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+SyntheticFrameSource::SyntheticFrameSource(int nDepthWidth, int nDepthHeight, int nColorWidth, int nColorHeight, bool bRealTime, int nFrames) :
+    m_nDepthWidth(nDepthWidth),
+    m_nDepthHeight(nDepthHeight),
+    m_nColorWidth(nColorWidth),
+    m_nColorHeight(nColorHeight),
+    m_pacer(bRealTime),
+    m_nFrames(nFrames > 0 ? nFrames : 0),
+    m_nNext(0),
+    m_wallDepth(nDepthWidth * nDepthHeight),
+    m_wallColor(nColorWidth * nColorHeight),
+    m_depth(nDepthWidth * nDepthHeight),
+    m_color(nColorWidth * nColorHeight),
+    m_colorToDepthX(nColorWidth),
+    m_colorToDepthY(nColorHeight)
+{
+    // color pixel to the depth pixel it shows, the inverse of the nominal mapping
+    int nDepthCenterX = m_nDepthWidth / 2;
+    int nDepthCenterY = m_nDepthHeight / 2;
+    for (int x = 0; x < m_nColorWidth; ++x)
+    {
+        m_colorToDepthX[x] = (x - m_nColorWidth / 2) * cDepthFocal / cColorFocal + nDepthCenterX;
+    }
+    for (int y = 0; y < m_nColorHeight; ++y)
+    {
+        m_colorToDepthY[y] = (y - m_nColorHeight / 2) * cDepthFocal / cColorFocal + nDepthCenterY;
+    }
+
+    for (int y = 0; y < m_nDepthHeight; ++y)
+    {
+        for (int x = 0; x < m_nDepthWidth; ++x)
+        {
+            m_wallDepth[y * m_nDepthWidth + x] = static_cast<uint16_t>(cWallNear + x * cWallSlant / m_nDepthWidth);
+        }
+    }
+    // a checkerboard on the wall, gray outside the depth camera's view
+    for (int y = 0; y < m_nColorHeight; ++y)
+    {
+        int dy = m_colorToDepthY[y];
+        for (int x = 0; x < m_nColorWidth; ++x)
+        {
+            int dx = m_colorToDepthX[x];
+            uint32_t c = Bgra(48, 48, 48);
+            if (dx >= 0 && dx < m_nDepthWidth && dy >= 0 && dy < m_nDepthHeight)
+            {
+                int nShade = 96 + dy * 96 / m_nDepthHeight;
+                c = ((dx >> 4) + (dy >> 4)) & 1 ? Bgra(nShade, nShade, nShade + 32) : Bgra(nShade / 2, nShade / 2 + 32, nShade / 2);
+            }
+            m_wallColor[y * m_nColorWidth + x] = c;
+        }
+    }
+}
+
+/// <summary>
+/// Take the next frame if one is due; never waits
+/// </summary>
+bool SyntheticFrameSource::Acquire(SourceFrame& frame)
+{
+    int64_t nTime = m_nNext * cFramePeriod;
+    if (IsFinished() || !m_pacer.IsDue(nTime))
+    {
+        return false;
+    }
+
+    Generate(m_nNext);
+    frame.depthTime = nTime;
+    frame.pDepth = &m_depth[0];
+    frame.depthWidth = m_nDepthWidth;
+    frame.depthHeight = m_nDepthHeight;
+    frame.minReliableDepth = cNominalMinReliableDepth;
+    frame.maxReliableDepth = cNominalMaxReliableDepth;
+    frame.colorTime = nTime;
+    frame.pColor = &m_color[0];
+    frame.colorWidth = m_nColorWidth;
+    frame.colorHeight = m_nColorHeight;
+    m_nNext++;
+    return true;
+}
+
+/// <summary>
+/// True once the requested frames have been delivered
+/// </summary>
+bool SyntheticFrameSource::IsFinished() const
+{
+    return m_nFrames > 0 && m_nNext >= m_nFrames;
+}
+
+/// <summary>
+/// Generate frame nFrame into the buffers
+/// </summary>
+void SyntheticFrameSource::Generate(int nFrame)
+{
+    int nBallX, nBallY, nRadius;
+    GetBall(nFrame, nBallX, nBallY, nRadius);
+    int nRadius2 = nRadius * nRadius;
+
+    for (int y = 0; y < m_nDepthHeight; ++y)
+    {
+        for (int x = 0; x < m_nDepthWidth; ++x)
+        {
+            int i = y * m_nDepthWidth + x;
+            uint32_t h = Hash(x, y, nFrame);
+            int d = m_wallDepth[i];
+            int dx = x - nBallX;
+            int dy = y - nBallY;
+            int nDistance2 = dx * dx + dy * dy;
+            if (nDistance2 < nRadius2)
+            {
+                int nBall = cBallFront + cBallDepth * nDistance2 / nRadius2;
+                // the outermost ring mixes ball and wall, as the sensor's flying pixels do
+                d = nDistance2 >= nRadius2 - 2 * nRadius && (h & 0x100) ? (nBall + d) / 2 : nBall;
+            }
+            // noise grows with distance; about one pixel in 128 has no reading
+            d += (static_cast<int>(h & 7) - 3) * d / 1000;
+            m_depth[i] = static_cast<uint16_t>((h >> 9) % 128 == 0 ? 0 : d);
+        }
+    }
+
+    memcpy(&m_color[0], &m_wallColor[0], m_color.size() * sizeof(uint32_t));
+    // the ball's box in color pixels, a pixel wider on each side
+    int nLeft = (nBallX - nRadius - 1 - m_nDepthWidth / 2) * cColorFocal / cDepthFocal + m_nColorWidth / 2;
+    int nRight = (nBallX + nRadius + 1 - m_nDepthWidth / 2) * cColorFocal / cDepthFocal + m_nColorWidth / 2;
+    int nTop = (nBallY - nRadius - 1 - m_nDepthHeight / 2) * cColorFocal / cDepthFocal + m_nColorHeight / 2;
+    int nBottom = (nBallY + nRadius + 1 - m_nDepthHeight / 2) * cColorFocal / cDepthFocal + m_nColorHeight / 2;
+    nLeft = nLeft < 0 ? 0 : nLeft;
+    nTop = nTop < 0 ? 0 : nTop;
+    nRight = nRight > m_nColorWidth ? m_nColorWidth : nRight;
+    nBottom = nBottom > m_nColorHeight ? m_nColorHeight : nBottom;
+    for (int y = nTop; y < nBottom; ++y)
+    {
+        int dy = m_colorToDepthY[y] - nBallY;
+        for (int x = nLeft; x < nRight; ++x)
+        {
+            int dx = m_colorToDepthX[x] - nBallX;
+            int nDistance2 = dx * dx + dy * dy;
+            if (nDistance2 < nRadius2)
+            {
+                // brightest where the ball is nearest
+                int nShade = 255 - 128 * nDistance2 / nRadius2;
+                m_color[y * m_nColorWidth + x] = Bgra(nShade, nShade * 5 / 8, nShade / 8);
+            }
+        }
+    }
+}
+
+// The ball traces a diamond around the middle of the frame
+void SyntheticFrameSource::GetBall(int nFrame, int& nX, int& nY, int& nRadius) const
+{
+    nX = m_nDepthWidth / 2 + Triangle(nFrame, cOrbitFrames) * (m_nDepthWidth / 4) / 1024;
+    nY = m_nDepthHeight / 2 + Triangle(nFrame + cOrbitFrames / 4, cOrbitFrames) * (m_nDepthHeight / 5) / 1024;
+    nRadius = m_nDepthHeight / 8;
+}
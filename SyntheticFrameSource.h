@@ -0,0 +1,58 @@
+//------------------------------------------------------------------------------
+// SyntheticFrameSource.h
+//------------------------------------------------------------------------------
+
+// A generated scene for running the pipeline without a sensor or a
+// recording: a slanted back wall with a ball moving in front of it, sensor
+// style noise and dropouts, and a color frame that lines up with the depth
+// under the nominal intrinsics. Frame n is the same on every run and every
+// machine; it uses integer arithmetic only.
+
+#pragma once
+
+#include <vector>
+#include "FrameSource.h"
+
+class SyntheticFrameSource : public FrameSource
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    /// <param name="nDepthWidth">width of the depth frames</param>
+    /// <param name="nDepthHeight">height of the depth frames</param>
+    /// <param name="nColorWidth">width of the BGRA color frames</param>
+    /// <param name="nColorHeight">height of the BGRA color frames</param>
+    /// <param name="bRealTime">hand frames out at 30 fps rather than as fast as possible</param>
+    /// <param name="nFrames">frames to deliver, 0 for no end</param>
+    SyntheticFrameSource(int nDepthWidth, int nDepthHeight, int nColorWidth, int nColorHeight, bool bRealTime, int nFrames);
+
+    virtual bool Acquire(SourceFrame& frame);
+    virtual bool IsFinished() const;
+
+    /// <summary>
+    /// Generate frame nFrame into the buffers
+    /// </summary>
+    void Generate(int nFrame);
+
+private:
+    static const int64_t    cFramePeriod = 333333;  // 30 fps in 100 ns units
+    static const int        cOrbitFrames = 240;     // frames the ball takes to go round
+
+    // where the ball is in frame nFrame, in depth pixels, and its radius
+    void                    GetBall(int nFrame, int& nX, int& nY, int& nRadius) const;
+
+    int                     m_nDepthWidth;
+    int                     m_nDepthHeight;
+    int                     m_nColorWidth;
+    int                     m_nColorHeight;
+    FramePacer              m_pacer;
+    int                     m_nFrames;
+    int                     m_nNext;
+    std::vector<uint16_t>   m_wallDepth;        // the static part of the scene, drawn once
+    std::vector<uint32_t>   m_wallColor;
+    std::vector<uint16_t>   m_depth;
+    std::vector<uint32_t>   m_color;
+    std::vector<int>        m_colorToDepthX;    // depth column each color column shows
+    std::vector<int>        m_colorToDepthY;
+};
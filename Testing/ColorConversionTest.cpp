@@ -0,0 +1,108 @@
+//------------------------------------------------------------------------------
+// ColorConversionTest.cpp
+//------------------------------------------------------------------------------
+
+// ColorConverter::Convert (the widest SIMD kernel of this CPU) against
+// ConvertScalar, byte for byte, for every matrix, range and chroma format on
+// random BGRX with black and white mixed in. The widths leave every kind of
+// remainder after the 16 and 32 pixel kernels, and the planes are followed
+// by guard bytes that neither may touch.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "ColorConversion.h"
+
+static const int cGuardBytes = 64;
+
+/// <summary>
+/// Deterministic pixels: mostly random, some black and white for the clamps
+/// </summary>
+static void FillPixels(std::vector<uint32_t>& pixels, uint32_t nSeed)
+{
+    for (size_t i = 0; i < pixels.size(); ++i)
+    {
+        nSeed = nSeed * 1664525u + 1013904223u;
+        uint32_t nValue = nSeed >> 8;
+        int nKind = (nSeed >> 4) & 15;
+        pixels[i] = nKind == 0 ? 0xFF000000u : nKind == 1 ? 0xFFFFFFFFu : (nValue | (nSeed << 24));
+    }
+}
+
+/// <summary>
+/// Convert one image with both kernels and compare the planes and their guards
+/// </summary>
+/// <returns>1 on a mismatch, 0 otherwise</returns>
+static int RunComparison(const ColorConverter& converter, const std::vector<uint32_t>& pixels,
+                         int nWidth, int nHeight, ChromaFormat eChroma)
+{
+    int nChromaWidth = eChroma == Chroma444 ? nWidth : nWidth / 2;
+    int nChromaHeight = eChroma == Chroma420 ? nHeight / 2 : nHeight;
+    int nLuma = nWidth * nHeight;
+    int nChroma = nChromaWidth * nChromaHeight;
+
+    std::vector<uint8_t> expected(nLuma + 2 * nChroma + 3 * cGuardBytes, 0xA5);
+    std::vector<uint8_t> actual(expected);
+    uint8_t* pPlanes[2] = { &expected[0], &actual[0] };
+    for (int k = 0; k < 2; ++k)
+    {
+        uint8_t* pY = pPlanes[k];
+        uint8_t* pU = pY + nLuma + cGuardBytes;
+        uint8_t* pV = pU + nChroma + cGuardBytes;
+        if (k == 0)
+        {
+            converter.ConvertScalar(&pixels[0], nWidth, nHeight, eChroma, pY, pU, pV);
+        }
+        else
+        {
+            converter.Convert(&pixels[0], nWidth, nHeight, eChroma, pY, pU, pV);
+        }
+    }
+
+    for (size_t i = 0; i < expected.size(); ++i)
+    {
+        if (expected[i] != actual[i])
+        {
+            printf("matrix %d, range %d, chroma %d, %dx%d: byte %d is %u, the reference gives %u\n",
+                   converter.GetMatrix(), converter.GetRange(), eChroma, nWidth, nHeight,
+                   static_cast<int>(i), actual[i], expected[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main()
+{
+    static const int cWidths[] = { 2, 6, 14, 16, 18, 30, 32, 34, 46, 62, 64, 66, 510, 512, 514 };
+    static const int cHeights[] = { 2, 6 };
+    static const ColorMatrix cMatrices[] = { ColorMatrixBT601, ColorMatrixBT709 };
+    static const ColorRange cRanges[] = { ColorRangeLimited, ColorRangeFull };
+    static const ChromaFormat cChromas[] = { Chroma444, Chroma422, Chroma420 };
+
+    int nFailures = 0;
+    int nRuns = 0;
+    for (size_t m = 0; m < sizeof(cMatrices) / sizeof(cMatrices[0]); ++m)
+    {
+        for (size_t r = 0; r < sizeof(cRanges) / sizeof(cRanges[0]); ++r)
+        {
+            ColorConverter converter;
+            converter.SetFormat(cMatrices[m], cRanges[r]);
+            for (size_t c = 0; c < sizeof(cChromas) / sizeof(cChromas[0]); ++c)
+            {
+                for (size_t w = 0; w < sizeof(cWidths) / sizeof(cWidths[0]); ++w)
+                {
+                    for (size_t h = 0; h < sizeof(cHeights) / sizeof(cHeights[0]); ++h)
+                    {
+                        std::vector<uint32_t> pixels(cWidths[w] * cHeights[h]);
+                        FillPixels(pixels, static_cast<uint32_t>(nRuns * 7919 + 1));
+                        nFailures += RunComparison(converter, pixels, cWidths[w], cHeights[h], cChromas[c]);
+                        ++nRuns;
+                    }
+                }
+            }
+        }
+    }
+    printf("%d of %d conversions match the reference\n", nRuns - nFailures, nRuns);
+    return nFailures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,91 @@
+//------------------------------------------------------------------------------
+// DepthPackingTest.cpp
+//------------------------------------------------------------------------------
+
+// Pack/Unpack round trip of every DepthPacker scheme over every code of a
+// range, for ranges from a few hundred codes to the 16 bit maximum: invalid
+// 0 has to come back as 0 and every valid code as a valid one. Gray is
+// lossless; Split is lossless up to 65280 and saturates the codes above;
+// Triangle is lossless below 4096 codes and above drops a low bit for each
+// doubling of its period.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "DepthPacking.h"
+
+/// <summary>
+/// Largest error Triangle may make at nMaxCode: its step less one
+/// </summary>
+static int GetTriangleTolerance(int nMaxCode)
+{
+    int nShift = 0;
+    while (nMaxCode >= (4096 << nShift))
+    {
+        ++nShift;
+    }
+    return (1 << nShift) - 1;
+}
+
+/// <summary>
+/// Pack and unpack codes 0 to nMaxCode with one scheme
+/// </summary>
+/// <returns>number of failures</returns>
+static int RunRoundTrip(DepthPackingScheme eScheme, int nMaxCode)
+{
+    DepthPacker* pPacker = DepthPacker::Create(eScheme);
+    int nTolerance = eScheme == DepthPackingTriangle ? GetTriangleTolerance(nMaxCode) : 0;
+
+    // every code, padded to an odd count past a multiple of 32 for the SIMD tails
+    int nPixels = (nMaxCode + 1 + 31) / 32 * 32 + 7;
+    std::vector<uint16_t> code(nPixels);
+    for (int i = 0; i < nPixels; ++i)
+    {
+        code[i] = static_cast<uint16_t>(i <= nMaxCode ? i : i % (nMaxCode + 1));
+    }
+    std::vector<uint8_t> planes(3 * nPixels);
+    std::vector<uint16_t> decoded(nPixels);
+    uint8_t* pY = &planes[0];
+    pPacker->Pack(&code[0], nPixels, static_cast<uint16_t>(nMaxCode), pY, pY + nPixels, pY + 2 * nPixels);
+    pPacker->Unpack(pY, pY + nPixels, pY + 2 * nPixels, nPixels, static_cast<uint16_t>(nMaxCode), &decoded[0]);
+
+    int nFailures = 0;
+    int nMaxError = 0;
+    long long nErrorSum = 0;
+    for (int i = 0; i < nPixels; ++i)
+    {
+        int nExpected = eScheme == DepthPackingSplit && code[i] > 65280 ? 65280 : code[i];
+        int nError = abs(decoded[i] - code[i]);
+        bool bValidity = (decoded[i] != 0) == (code[i] != 0);
+        if (!bValidity || abs(decoded[i] - nExpected) > nTolerance || decoded[i] > nMaxCode)
+        {
+            if (nFailures++ < 5)
+            {
+                printf("  code %u decoded as %u\n", code[i], decoded[i]);
+            }
+        }
+        nMaxError = nError > nMaxError ? nError : nMaxError;
+        nErrorSum += nError;
+    }
+    printf("%-8s %5d codes: max error %3d, mean %7.3f%s\n", pPacker->GetName(), nMaxCode,
+           nMaxError, static_cast<double>(nErrorSum) / nPixels, nFailures ? "  FAILED" : "");
+    delete pPacker;
+    return nFailures;
+}
+
+int main()
+{
+    // the sensor's 500-4500 mm range is 4001 codes; the rest straddle Triangle's period doublings
+    static const int cRanges[] = { 255, 1000, 4001, 4095, 4096, 8191, 8192, 16384, 40000, 65280, 65281, 65535 };
+    static const DepthPackingScheme cSchemes[] = { DepthPackingSplit, DepthPackingGray, DepthPackingTriangle };
+
+    int nFailures = 0;
+    for (size_t s = 0; s < sizeof(cSchemes) / sizeof(cSchemes[0]); ++s)
+    {
+        for (size_t r = 0; r < sizeof(cRanges) / sizeof(cRanges[0]); ++r)
+        {
+            nFailures += RunRoundTrip(cSchemes[s], cRanges[r]);
+        }
+    }
+    return nFailures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
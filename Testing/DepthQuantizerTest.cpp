@@ -0,0 +1,186 @@
+//------------------------------------------------------------------------------
+// DepthQuantizerTest.cpp
+//------------------------------------------------------------------------------
+
+// DepthQuantizer::Quantize (the widest SIMD kernel of this CPU) against
+// QuantizeScalar, byte for byte, on the preview, intensity and index planes
+// for several ranges, at pixel counts leaving every kind of SIMD tail and
+// with guard bytes behind each plane that neither may touch.
+//
+// Round trip of DepthQuantizer::QuantizeFitted, the Depth16 stream's samples:
+// a client gets depth back as min + (code - 1) * step. For a range that fits
+// the bit depth that has to be exact for every depth and every bit depth 8 to
+// 16, with 0 for everything outside it. Wider ranges, like the sensor's
+// 500-4500 mm at the stream's 8 or 10 bit, are spread over every code and
+// may be off by half a step; their max and mean error are reported. The 8 bit
+// samples have to match the 16 bit ones.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "DepthQuantizer.h"
+
+static const int cGuardBytes = 64;
+
+/// <summary>
+/// Every depth value once, in an odd count so the SIMD kernels run their tails
+/// </summary>
+static std::vector<uint16_t> GetAllDepths()
+{
+    std::vector<uint16_t> depth(65536 + 7);
+    for (size_t i = 0; i < depth.size(); ++i)
+    {
+        depth[i] = static_cast<uint16_t>(i * 40503u);
+    }
+    return depth;
+}
+
+/// <summary>
+/// Quantize nPixels depth samples with both kernels and compare the planes and their guards
+/// </summary>
+/// <returns>1 on a mismatch, 0 otherwise</returns>
+static int RunComparison(const uint16_t* pDepth, int nPixels, uint16_t nMinDepth, uint16_t nMaxDepth)
+{
+    DepthQuantizer quantizer;
+    quantizer.SetRange(nMinDepth, nMaxDepth);
+
+    // preview, intensity and index, each followed by its guard
+    int nBytes = 4 * nPixels + cGuardBytes + 2 * (nPixels + cGuardBytes);
+    std::vector<uint8_t> expected(nBytes, 0xA5);
+    std::vector<uint8_t> actual(expected);
+    uint8_t* pPlanes[2] = { &expected[0], &actual[0] };
+    for (int k = 0; k < 2; ++k)
+    {
+        uint32_t* pPreview = reinterpret_cast<uint32_t*>(pPlanes[k]);
+        uint8_t* pIntensity = pPlanes[k] + 4 * nPixels + cGuardBytes;
+        uint8_t* pIndex = pIntensity + nPixels + cGuardBytes;
+        if (k == 0)
+        {
+            quantizer.QuantizeScalar(pDepth, nPixels, pPreview, pIntensity, pIndex);
+        }
+        else
+        {
+            quantizer.Quantize(pDepth, nPixels, pPreview, pIntensity, pIndex);
+        }
+    }
+
+    for (int i = 0; i < nBytes; ++i)
+    {
+        if (expected[i] != actual[i])
+        {
+            printf("%u-%u mm, %d pixels: byte %d is %u, the reference gives %u\n",
+                   nMinDepth, nMaxDepth, nPixels, i, actual[i], expected[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/// <summary>
+/// Quantize and decode depth over [nMinDepth, nMaxDepth] at nBitDepth
+/// </summary>
+/// <param name="bExact">fail on any decoding error, not only on those beyond half a step</param>
+/// <returns>number of failures</returns>
+static int RunRoundTrip(const std::vector<uint16_t>& depth, uint16_t nMinDepth, uint16_t nMaxDepth, int nBitDepth, bool bExact)
+{
+    DepthQuantizer quantizer;
+    quantizer.SetRange(nMinDepth, nMaxDepth);
+    std::vector<uint16_t> code(depth.size());
+    quantizer.QuantizeFitted(&depth[0], static_cast<int>(depth.size()), NULL, &code[0], nBitDepth);
+    double fStep = quantizer.GetFittedStep(nBitDepth);
+
+    int nMaxCode = (1 << nBitDepth) - 1;
+    int nFailures = 0;
+    if (nBitDepth == 8)
+    {
+        std::vector<uint8_t> narrow(depth.size());
+        quantizer.QuantizeFitted(&depth[0], static_cast<int>(depth.size()), NULL, &narrow[0]);
+        for (size_t i = 0; i < depth.size(); ++i)
+        {
+            if (narrow[i] != code[i] && nFailures++ < 5)
+            {
+                printf("  depth %u gave 8 bit sample %u, 16 bit sample %u\n", depth[i], narrow[i], code[i]);
+            }
+        }
+    }
+
+    double fMaxError = 0;
+    double fErrorSum = 0;
+    long long nValid = 0;
+    for (size_t i = 0; i < depth.size(); ++i)
+    {
+        bool bValid = depth[i] >= nMinDepth && depth[i] <= nMaxDepth;
+        if (!bValid)
+        {
+            if (code[i] != 0 && nFailures++ < 5)
+            {
+                printf("  depth %u outside the range gave code %u\n", depth[i], code[i]);
+            }
+            continue;
+        }
+        double fDecoded = nMinDepth + (code[i] - 1) * fStep;
+        double fError = fabs(fDecoded - depth[i]);
+        if (code[i] == 0 || code[i] > nMaxCode || fError > (bExact ? 0 : fStep / 2 + 1e-9))
+        {
+            if (nFailures++ < 5)
+            {
+                printf("  depth %u gave code %u, decoded %.3f\n", depth[i], code[i], fDecoded);
+            }
+        }
+        fMaxError = fError > fMaxError ? fError : fMaxError;
+        fErrorSum += fError;
+        ++nValid;
+    }
+    printf("%2d bit, %5u-%5u mm, step %7.3f: max error %7.3f mm, mean %7.3f mm%s\n", nBitDepth, nMinDepth, nMaxDepth,
+           fStep, fMaxError, nValid ? fErrorSum / nValid : 0.0, nFailures ? "  FAILED" : "");
+    return nFailures;
+}
+
+int main()
+{
+    std::vector<uint16_t> depth = GetAllDepths();
+    int nFailures = 0;
+
+    // slices of every depth at odd offsets; the counts leave every remainder
+    // after the 16 and 32 pixel kernels, the last one is every depth
+    static const uint16_t cRanges[][2] = { { 500, 4500 }, { 0, 65535 }, { 1, 255 }, { 500, 500 },
+                                           { 300, 8000 }, { 65280, 65535 }, { 4500, 500 } };
+    static const int cCounts[] = { 1, 7, 15, 16, 17, 31, 32, 33, 47, 63, 64, 65, 511, 4099 };
+    int nRuns = 0;
+    int nMismatches = 0;
+    for (size_t r = 0; r < sizeof(cRanges) / sizeof(cRanges[0]); ++r)
+    {
+        for (size_t c = 0; c < sizeof(cCounts) / sizeof(cCounts[0]); ++c)
+        {
+            nMismatches += RunComparison(&depth[2 * c + 1], cCounts[c], cRanges[r][0], cRanges[r][1]);
+            ++nRuns;
+        }
+        nMismatches += RunComparison(&depth[0], static_cast<int>(depth.size()), cRanges[r][0], cRanges[r][1]);
+        ++nRuns;
+    }
+    printf("%d of %d quantizations match the reference\n", nRuns - nMismatches, nRuns);
+    nFailures += nMismatches;
+
+    // the widest range each bit depth holds: codes 1 to 2^n - 1
+    for (int nBitDepth = 8; nBitDepth <= 16; ++nBitDepth)
+    {
+        uint16_t nMinDepth = nBitDepth == 16 ? 1 : 500;
+        uint16_t nMaxDepth = static_cast<uint16_t>(nMinDepth + (1 << nBitDepth) - 2);
+        nFailures += RunRoundTrip(depth, nMinDepth, nMaxDepth, nBitDepth, true);
+    }
+
+    // the sensor's reliable range, spread over the codes below 12 bit
+    for (int nBitDepth = 8; nBitDepth <= 16; ++nBitDepth)
+    {
+        bool bFits = 4500 - 500 + 1 <= (1 << nBitDepth) - 1;
+        nFailures += RunRoundTrip(depth, 500, 4500, nBitDepth, bFits);
+    }
+
+    // one code short of fitting, and every depth at the stream's bit depths
+    nFailures += RunRoundTrip(depth, 500, 1523, 10, false);
+    nFailures += RunRoundTrip(depth, 0, 65535, 8, false);
+    nFailures += RunRoundTrip(depth, 0, 65535, 10, false);
+
+    return nFailures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+/*=========================================================================
+
+  Sends encoded frames of one stream as OpenIGTLink VIDEO messages.
+
+  The VideoMessage for the stream is created once and reused for every
+  frame. It is packed only when its fields change (device name, size,
+  metadata) to capture the message framing; per frame only the body size
+  and CRC in the cached header are patched, and the encoder's bitstream
+  buffers are sent straight to the socket without being copied into the
+  message.
+
+  This relies on the VideoMessage layout: fragment 0 is the igtl header,
+  fragment 2 is the bitstream, and no other fragment depends on the
+  bitstream size (the body size lives only in the igtl header).
+
+=========================================================================*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "igtl_header.h"
+#include "igtl_util.h"
+#include "igtlSocket.h"
+#include "igtlVideoMessage.h"
+
+// One contiguous piece of encoded bitstream, e.g. x264's NAL payload block
+// or one OpenH264 layer
+typedef struct {
+  const unsigned char* data;
+  int   size;
+} VideoPayload;
+
+class VideoFrameSender
+{
+public:
+  VideoFrameSender() : m_Dirty(true), m_BodyPrefixSize(0) {}
+
+  /// Create the reusable message; call once before the first frame
+  void Initialize(const std::string& deviceName, int width, int height)
+  {
+    m_Message = igtl::VideoMessage::New();
+    m_Message->SetDefaultBodyType("ColoredDepth");
+    m_Message->SetDeviceName(deviceName);
+    m_Message->SetScalarType(m_Message->TYPE_UINT32);
+    m_Message->SetEndian(igtl_is_little_endian() == 1 ? 2 : 1); //little endian is 2 big endian is 1
+    m_Message->SetWidth(width);
+    m_Message->SetHeight(height);
+    m_Dirty = true;
+  }
+
+  /// The reusable message; call Invalidate() after changing any of its fields
+  igtl::VideoMessage* GetMessage() { return m_Message.GetPointer(); }
+
+  /// Rebuild the cached framing before the next frame
+  void Invalidate() { m_Dirty = true; }
+
+  /// Send one frame made of nPayloads bitstream pieces. Returns 0 if the socket failed.
+  int Send(igtl::Socket* socket, const VideoPayload* payloads, int nPayloads)
+  {
+    FinishHeader(payloads, nPayloads);
+
+    int r = socket->Send(&m_Prefix[0], m_Prefix.size());
+    for (int i = 0; r && i < nPayloads; i++)
+    {
+      r = socket->Send(payloads[i].data, payloads[i].size);
+    }
+    if (r && !m_Suffix.empty())
+    {
+      r = socket->Send(&m_Suffix[0], m_Suffix.size());
+    }
+    return r;
+  }
+
+  /// Write the complete message for one frame into out, for senders that
+  /// outlive the encoder's buffers
+  void Serialize(const VideoPayload* payloads, int nPayloads, std::vector<unsigned char>& out)
+  {
+    FinishHeader(payloads, nPayloads);
+
+    out.assign(m_Prefix.begin(), m_Prefix.end());
+    for (int i = 0; i < nPayloads; i++)
+    {
+      out.insert(out.end(), payloads[i].data, payloads[i].data + payloads[i].size);
+    }
+    out.insert(out.end(), m_Suffix.begin(), m_Suffix.end());
+  }
+
+private:
+  void FinishHeader(const VideoPayload* payloads, int nPayloads)
+  {
+    if (m_Dirty)
+    {
+      RebuildFraming();
+    }
+
+    igtl_uint64 bodySize = m_BodyPrefixSize + m_Suffix.size();
+    igtl_uint64 crc = crc64(0, 0, 0LL);
+    crc = crc64(&m_Prefix[IGTL_HEADER_SIZE], m_BodyPrefixSize, crc);
+    for (int i = 0; i < nPayloads; i++)
+    {
+      crc = crc64(const_cast<unsigned char*>(payloads[i].data), payloads[i].size, crc);
+      bodySize += payloads[i].size;
+    }
+    if (!m_Suffix.empty())
+    {
+      crc = crc64(&m_Suffix[0], m_Suffix.size(), crc);
+    }
+
+    // body_size and crc are the last two 64-bit big-endian fields of the header
+    PutBigEndian64(&m_Prefix[IGTL_HEADER_SIZE - 16], bodySize);
+    PutBigEndian64(&m_Prefix[IGTL_HEADER_SIZE - 8], crc);
+  }
+
+  void RebuildFraming()
+  {
+    // A one-byte bitstream is enough to make Pack() lay out every other fragment
+    m_Message->SetBitStreamSize(1);
+    m_Message->AllocateScalars();
+    m_Message->Pack();
+
+    m_Prefix.clear();
+    m_Suffix.clear();
+    for (int i = 0; i < m_Message->GetNumberOfPackFragments(); i++)
+    {
+      if (i == 2)
+      {
+        continue;
+      }
+      unsigned char* fragment = static_cast<unsigned char*>(m_Message->GetPackFragmentPointer(i));
+      std::vector<unsigned char>& target = i < 2 ? m_Prefix : m_Suffix;
+      target.insert(target.end(), fragment, fragment + m_Message->GetPackFragmentSize(i));
+    }
+    m_BodyPrefixSize = m_Prefix.size() - IGTL_HEADER_SIZE;
+    m_Dirty = false;
+  }
+
+  static void PutBigEndian64(unsigned char* dst, igtl_uint64 value)
+  {
+    for (int i = 7; i >= 0; i--)
+    {
+      dst[i] = static_cast<unsigned char>(value & 0xFF);
+      value >>= 8;
+    }
+  }
+
+  igtl::VideoMessage::Pointer m_Message;
+  bool  m_Dirty;
+
+  // igtl header + body fragments before the bitstream, and after it
+  std::vector<unsigned char> m_Prefix;
+  std::vector<unsigned char> m_Suffix;
+  size_t m_BodyPrefixSize;
+};